@@ -0,0 +1,104 @@
+#include <stdalign.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+#define ARENA_MIN_CHUNK (64 * 1024)
+#define ARENA_MAX_CHUNK (4 * 1024 * 1024)
+
+struct ArenaChunk {
+	struct ArenaChunk *next;
+	size_t size;
+	alignas(max_align_t) char data[];
+};
+
+struct ListArena {
+	struct ArenaChunk *chunks; /// The one being filled comes first.
+	char *ptr;
+	char *end;
+};
+
+struct ListArena *list_arena_new(void)
+{
+	return calloc(1, sizeof(struct ListArena));
+}
+
+static void free_chunks(struct ArenaChunk *chunk)
+{
+	while (chunk) {
+		struct ArenaChunk *next = chunk->next;
+		free(chunk);
+		chunk = next;
+	}
+}
+
+void list_arena_free(struct ListArena *arena)
+{
+	if (!arena)
+		return;
+	free_chunks(arena->chunks);
+	free(arena);
+}
+
+void list_arena_reset(struct ListArena *arena)
+{
+	struct ArenaChunk *chunk = arena->chunks;
+	if (!chunk)
+		return;
+	// Chunks grow, so the newest one is the largest.
+	free_chunks(chunk->next);
+	chunk->next = NULL;
+	arena->ptr = chunk->data;
+	arena->end = chunk->data + chunk->size;
+}
+
+/**
+ *  \return -1 on failure.
+ */
+static int add_chunk(struct ListArena *arena, size_t min_size)
+{
+	size_t size = arena->chunks ? arena->chunks->size * 2 : ARENA_MIN_CHUNK;
+	if (size > ARENA_MAX_CHUNK)
+		size = ARENA_MAX_CHUNK;
+	if (size < min_size)
+		size = min_size;
+	struct ArenaChunk *chunk = malloc(sizeof(*chunk) + size);
+	if (!chunk)
+		return -1;
+	chunk->size = size;
+	chunk->next = arena->chunks;
+	arena->chunks = chunk;
+	arena->ptr = chunk->data;
+	arena->end = chunk->data + size;
+	return 0;
+}
+
+static void *bump(struct ListArena *arena, size_t size, size_t align)
+{
+	uintptr_t ptr = ((uintptr_t)arena->ptr + align - 1) & ~(align - 1);
+	uintptr_t end = (uintptr_t)arena->end;
+	if (!arena->ptr || ptr > end || size > end - ptr) {
+		if (add_chunk(arena, size) < 0)
+			return NULL;
+		ptr = (uintptr_t)arena->ptr;
+	}
+	arena->ptr = (char *)ptr + size;
+	return (void *)ptr;
+}
+
+void *list_arena_alloc(struct ListArena *arena, size_t size)
+{
+	return bump(arena, size, alignof(max_align_t));
+}
+
+char *list_arena_strndup(struct ListArena *arena, const char *s, size_t n)
+{
+	char *copy = bump(arena, n + 1, 1);
+	if (!copy)
+		return NULL;
+	memcpy(copy, s, n);
+	copy[n] = '\0';
+	return copy;
+}
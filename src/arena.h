@@ -0,0 +1,36 @@
+#ifndef _ARENA_H
+#define _ARENA_H
+
+#include <stddef.h>
+
+/// A bump allocator for the names and facts of a listing.
+/**
+ *  Everything allocated from an arena is released at once by
+ *  list_arena_reset() or list_arena_free(). An arena isn't thread safe,
+ *  give each thread its own.
+ */
+struct ListArena;
+
+/**
+ *  \return NULL on failure.
+ */
+struct ListArena *list_arena_new(void);
+
+void list_arena_free(struct ListArena *arena);
+
+/// Release everything allocated from \a arena, but keep its memory.
+void list_arena_reset(struct ListArena *arena);
+
+/// Allocate \a size bytes, aligned for any type.
+/**
+ *  \return NULL on failure.
+ */
+void *list_arena_alloc(struct ListArena *arena, size_t size);
+
+/// Copy \a n bytes of \a s into \a arena and terminate them.
+/**
+ *  \return NULL on failure.
+ */
+char *list_arena_strndup(struct ListArena *arena, const char *s, size_t n);
+
+#endif
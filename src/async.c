@@ -0,0 +1,1340 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "config.h"
+
+#include "debug.h"
+
+#include "async.h"
+#include "cmd.h"
+#include "error.h"
+#include "ftp.h"
+#include "parse.h"
+#include "trace.h"
+#ifdef HAVE_IO_URING
+#include "uring.h"
+#endif
+
+#define ERR_PRINTF_REPLY(reply, fmt, ...)                                      \
+	ERR_PRINTF(fmt " (%s)", ##__VA_ARGS__, reply)
+
+#define ASYNC_DATA_BUF_LEN (16 * 1024)
+/// Receive at most this many buffers per step, so that one fast transfer
+/// doesn't starve the other sessions of the loop.
+#define ASYNC_RECV_ROUNDS 16
+
+enum AsyncState {
+	STATE_CONNECTING,
+	STATE_GREETING,
+	STATE_USER,
+	STATE_PASS,
+	STATE_ACCT,
+	STATE_IDLE,
+	STATE_TYPE,
+	STATE_EPSV,
+	STATE_PASV,
+	STATE_START, /// Waiting for the first reply to the transfer command.
+	STATE_TRANSFER, /// Waiting for the transfer to complete.
+	STATE_FAILED,
+};
+
+enum DataState { DATA_NONE, DATA_CONNECTING, DATA_OPEN, DATA_DONE };
+
+struct UserPIAsync {
+	struct Connection ctrl;
+	struct addrinfo *ai_next; /// The address to try if this one fails.
+	/// The host of the control connection, 0 until known.
+	struct sockaddr_storage peer;
+	socklen_t peer_len;
+	const struct LoginInfo *login;
+	enum AsyncState state;
+
+	char out[PIPELINE_BUF_LEN];
+	size_t out_len;
+	size_t out_sent;
+	struct RecvBuf rb;
+	struct Reply reply;
+
+	int data_fd;
+	enum DataState data_state;
+	char *data_buf;
+	AsyncDataFunc on_data;
+	void *ctx;
+	char *path;
+	bool is_list;
+	enum ListFormat list_format;
+	int out_fd; /// Download into this file instead of on_data, or -1.
+	off_t out_offset;
+	bool ctrl_done; /// The completion reply of the transfer arrived.
+	bool op_failed;
+	struct ErrMsg op_err;
+
+	/// The io_uring loop driving the session, or NULL for user_pi_step().
+	struct AsyncLoop *loop;
+	unsigned int n_ctrl_ops; /// In flight on the control connection.
+	unsigned int n_data_ops; /// In flight on the data connection.
+	unsigned int n_writes; /// In flight to out_fd.
+	bool ctrl_recv_armed;
+	bool ctrl_poll_armed;
+	bool data_recv_armed;
+	bool data_poll_armed;
+	bool data_closing; /// Close data_fd once n_data_ops drops to 0.
+	bool data_starved; /// The receive ran out of buffers.
+	bool reported; /// The current result went out of async_loop_wait().
+	bool queued;
+	struct UserPIAsync *next_queued;
+	struct UserPIAsync *next_session;
+};
+
+#ifdef HAVE_IO_URING
+static void loop_cancel(struct UserPIAsync *a, int fd);
+#endif
+
+static int set_nonblocking(int fd)
+{
+	int flags = fcntl(fd, F_GETFL);
+	if (flags < 0)
+		return -1;
+	return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+/// Start a non-blocking connect().
+/**
+ *  \return a socket descriptor, or -1 and sets errno.
+ */
+static int connect_start(const struct sockaddr *addr, socklen_t len)
+{
+	int fd = socket(addr->sa_family, SOCK_STREAM, 0);
+	if (fd < 0)
+		return -1;
+	trace_event(TRACE_CONNECT_BEGIN, fd, 1, NULL, 0);
+	if (set_nonblocking(fd) < 0 ||
+	    (connect(fd, addr, len) < 0 && errno != EINPROGRESS)) {
+		int saved = errno;
+		close(fd);
+		errno = saved;
+		return -1;
+	}
+	return fd;
+}
+
+/// Check on a connect() started by connect_start().
+/**
+ *  \return 1 if connected, 0 if still in progress, or -1 and sets errno.
+ */
+static int connect_finish(int fd)
+{
+	struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+	if (poll(&pfd, 1, 0) == 0)
+		return 0;
+	int so_error;
+	socklen_t len = sizeof(so_error);
+	if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &so_error, &len) < 0)
+		so_error = errno;
+	trace_event(TRACE_CONNECT_END, fd, so_error, NULL, 0);
+	if (so_error) {
+		errno = so_error;
+		return -1;
+	}
+	return 1;
+}
+
+static void fail_session(struct UserPIAsync *a)
+{
+	debug("[WARNING] Async session failed: [%s] %s\n", a->op_err.where,
+	      a->op_err.msg);
+	a->state = STATE_FAILED;
+}
+
+static int ctrl_connect_next(struct UserPIAsync *a)
+{
+	struct ErrMsg *err = &a->op_err;
+	for (; a->ai_next; a->ai_next = a->ai_next->ai_next) {
+		a->ctrl.fd = connect_start(a->ai_next->ai_addr,
+		                           a->ai_next->ai_addrlen);
+		if (a->ctrl.fd >= 0) {
+			a->ai_next = a->ai_next->ai_next;
+			return 0;
+		}
+	}
+	ERR_PRINTF("Cannot connect to %s, %s", a->ctrl.name, a->ctrl.service);
+	ERR_WHERE_PRINTF("Control Connection");
+	return -1;
+}
+
+static void queue_command(struct UserPIAsync *a, const char *fmt, ...)
+{
+	struct ErrMsg *err = &a->op_err;
+	if (a->out_sent == a->out_len)
+		a->out_sent = a->out_len = 0;
+	size_t room = sizeof(a->out) - a->out_len;
+	va_list args;
+	va_start(args, fmt);
+	size_t len = vsnprintf(&a->out[a->out_len], room, fmt, args);
+	va_end(args);
+	if (len + 2 >= room) {
+		ERR_PRINTF("Command too long.");
+		ERR_WHERE();
+		fail_session(a);
+		return;
+	}
+	memcpy(&a->out[a->out_len + len], "\r\n", 2);
+	trace_event(TRACE_COMMAND, a->ctrl.fd, 0, &a->out[a->out_len], len);
+	a->out_len += len + 2;
+}
+
+static int flush_commands(struct UserPIAsync *a)
+{
+	struct ErrMsg *err = &a->op_err;
+	while (a->out_sent < a->out_len) {
+		ssize_t n = send(a->ctrl.fd, &a->out[a->out_sent],
+		                 a->out_len - a->out_sent, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+			strerror_r(errno, err->msg, ERR_MSG_MAX_LEN);
+			ERR_WHERE();
+			return -1;
+		}
+		a->out_sent += n;
+	}
+	return 0;
+}
+
+static void close_data(struct UserPIAsync *a)
+{
+	if (a->data_state == DATA_CONNECTING || a->data_state == DATA_OPEN) {
+#ifdef HAVE_IO_URING
+		if (a->n_data_ops) {
+			// The ring still holds the socket.
+			loop_cancel(a, a->data_fd);
+			a->data_closing = true;
+		} else {
+			close(a->data_fd);
+		}
+#else
+		close(a->data_fd);
+#endif
+	}
+	a->data_state = a->data_state == DATA_NONE ? DATA_NONE : DATA_DONE;
+}
+
+static bool data_is_idle(const struct UserPIAsync *a)
+{
+	bool closed = a->data_state == DATA_NONE || a->data_state == DATA_DONE;
+	return closed && !a->n_data_ops && !a->n_writes;
+}
+
+/// The current operation failed, but the session may carry on.
+static void fail_op(struct UserPIAsync *a, struct Reply *reply,
+                    const char *what)
+{
+	struct ErrMsg *err = &a->op_err;
+	if (a->op_failed)
+		return;
+	a->op_failed = true;
+	if (reply) {
+		ERR_PRINTF_REPLY(reply->short_reply, "%s", what);
+	} else {
+		ERR_PRINTF("%s", what);
+	}
+	ERR_WHERE();
+}
+
+static void data_connect(struct UserPIAsync *a, const char *name,
+                         const char *service)
+{
+	struct ErrMsg *err = &a->op_err;
+	struct sockaddr_storage addr;
+	socklen_t len;
+	if (!*name && !a->peer_len) {
+		// EPSV means the host of the control connection.
+		a->peer_len = sizeof(a->peer);
+		if (getpeername(a->ctrl.fd, (struct sockaddr *)&a->peer,
+		                &a->peer_len) < 0) {
+			a->peer_len = 0;
+			goto fail;
+		}
+	}
+	if (data_sockaddr(name, service, &a->peer, a->peer_len, &addr,
+	                  &len) < 0) {
+		errno = EINVAL;
+		goto fail;
+	}
+	a->data_fd = connect_start((struct sockaddr *)&addr, len);
+	if (a->data_fd < 0)
+		goto fail;
+	a->data_state = DATA_CONNECTING;
+	return;
+fail:
+	strerror_r(errno, err->msg, ERR_MSG_MAX_LEN);
+	fail_op(a, NULL, "Cannot open the data connection.");
+	a->data_state = DATA_DONE;
+}
+
+static void handle_login_reply(struct UserPIAsync *a, struct Reply *reply)
+{
+	struct ErrMsg *err = &a->op_err;
+	enum ReplyCode1 first = reply->first;
+	const struct LoginInfo *l = a->login;
+	if (a->state == STATE_GREETING) {
+		if (first == POS_PRE)
+			return;
+		if (first != POS_COM) {
+			ERR_PRINTF_REPLY(reply->short_reply,
+			                 "The server says it's unavailable.");
+			goto fail;
+		}
+		if (!l->username) {
+			ERR_PRINTF("A username is needed to log in.");
+			goto fail;
+		}
+		queue_command(a, "USER %s", l->username);
+		a->state = STATE_USER;
+		return;
+	}
+	if (first == POS_COM) {
+		debug("[INFO] Login succeeded.\n");
+		a->state = STATE_IDLE;
+		return;
+	}
+	if (first != POS_INT || a->state == STATE_ACCT) {
+		ERR_PRINTF_REPLY(reply->short_reply, "Login failed.");
+		goto fail;
+	}
+	if (a->state == STATE_USER) {
+		if (!l->password) {
+			ERR_PRINTF("A password is needed to log in.");
+			goto fail;
+		}
+		queue_command(a, "PASS %s", l->password);
+		a->state = STATE_PASS;
+		return;
+	}
+	if (!l->account_info) {
+		ERR_PRINTF("Account information is needed to log in.");
+		goto fail;
+	}
+	queue_command(a, "ACCT %s", l->account_info);
+	a->state = STATE_ACCT;
+	return;
+fail:
+	ERR_WHERE();
+	fail_session(a);
+}
+
+static void queue_transfer(struct UserPIAsync *a)
+{
+	if (a->is_list && a->list_format == FORMAT_MLSD)
+		queue_command(a, "MLSD %s", a->path);
+	else if (a->is_list)
+		queue_command(a, "LIST %s", a->path);
+	else
+		queue_command(a, "RETR %s", a->path);
+	a->state = STATE_START;
+}
+
+static void handle_transfer_reply(struct UserPIAsync *a, struct Reply *reply)
+{
+	char name[3 * 4 + 3 + 1];
+	char service[7];
+	enum ReplyCode1 first = reply->first;
+	switch (a->state) {
+	case STATE_TYPE:
+		if (first != POS_COM)
+			fail_op(a, reply, "Cannot set Representation Type.");
+		a->state = STATE_EPSV;
+		return;
+	case STATE_EPSV:
+		if (a->op_failed) {
+			a->ctrl_done = true;
+			return;
+		}
+		if (reply->first == POS_COM && reply->second == CONNECTIONS &&
+		    reply->third == 9 &&
+		    parse_epsv_reply(reply->short_reply,
+		                     reply->short_reply_len, service) == 0) {
+			data_connect(a, "", service);
+			if (a->op_failed) {
+				a->ctrl_done = true;
+				return;
+			}
+			queue_transfer(a);
+			return;
+		}
+		debug("[WARNING] EPSV failed. Falling back to PASV\n");
+		queue_command(a, "PASV");
+		a->state = STATE_PASV;
+		return;
+	case STATE_PASV:
+		if (first != POS_COM ||
+		    parse_pasv_reply(reply->short_reply, reply->short_reply_len,
+		                     name, service) < 0) {
+			fail_op(a, reply, "Cannot enter passive mode.");
+			a->ctrl_done = true;
+			return;
+		}
+		data_connect(a, name, service);
+		if (a->op_failed) {
+			a->ctrl_done = true;
+			return;
+		}
+		queue_transfer(a);
+		return;
+	case STATE_START:
+		if (first == POS_PRE) {
+			a->state = STATE_TRANSFER;
+			return;
+		}
+		if (first == POS_COM) {
+			a->state = STATE_TRANSFER;
+			a->ctrl_done = true;
+			return;
+		}
+		if (a->is_list && a->list_format == FORMAT_MLSD) {
+			debug("[WARNING] Fall back to LIST.\n");
+			a->list_format = FORMAT_LIST;
+			queue_transfer(a);
+			return;
+		}
+		fail_op(a, reply, "Cannot initiate transfer.");
+		close_data(a);
+		a->ctrl_done = true;
+		return;
+	case STATE_TRANSFER:
+		if (first != POS_COM)
+			fail_op(a, reply, "Failed to complete.");
+		a->ctrl_done = true;
+		return;
+	default:
+		__builtin_unreachable();
+	}
+}
+
+static void handle_reply(struct UserPIAsync *a, struct Reply *reply)
+{
+	struct ErrMsg *err = &a->op_err;
+	switch (a->state) {
+	case STATE_GREETING:
+	case STATE_USER:
+	case STATE_PASS:
+	case STATE_ACCT:
+		handle_login_reply(a, reply);
+		return;
+	case STATE_TYPE:
+	case STATE_EPSV:
+	case STATE_PASV:
+	case STATE_START:
+	case STATE_TRANSFER:
+		handle_transfer_reply(a, reply);
+		return;
+	default:
+		// Most likely 421 before the server hangs up.
+		ERR_PRINTF_REPLY(reply->short_reply, "Unexpected reply.");
+		ERR_WHERE();
+		fail_session(a);
+	}
+}
+
+static void feed_line(struct UserPIAsync *a, const char *line, size_t len)
+{
+	bool done = false;
+	enum GetReplyResult result =
+		reply_feed_line(a->ctrl.fd, (const unsigned char *)line, len,
+		                &a->reply, &done);
+	if (result != GET_REPLY_OK) {
+		get_reply_result_to_err_msg(result, a->op_err.msg,
+		                            ERR_MSG_MAX_LEN);
+		fail_session(a);
+		return;
+	}
+	if (!done)
+		return;
+	a->reply.len = 0;
+	handle_reply(a, &a->reply);
+}
+
+/// Feed the complete lines in the input buffer to the reply parser.
+static void parse_replies(struct UserPIAsync *a)
+{
+	const char *line;
+	size_t len;
+	while (a->state != STATE_FAILED &&
+	       (len = recv_buf_next_line(&a->rb, &line)))
+		feed_line(a, line, len);
+}
+
+static void ctrl_closed(struct UserPIAsync *a)
+{
+	struct ErrMsg *err = &a->op_err;
+	get_reply_result_to_err_msg(GET_REPLY_CLOSED, err->msg,
+	                            ERR_MSG_MAX_LEN);
+	ERR_WHERE();
+	fail_session(a);
+}
+
+static void read_replies(struct UserPIAsync *a)
+{
+	struct ErrMsg *err = &a->op_err;
+	while (a->state != STATE_FAILED) {
+		char *space;
+		size_t size = recv_buf_space(&a->rb, &space);
+		ssize_t n = recv(a->ctrl.fd, space, size, 0);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return;
+			strerror_r(errno, err->msg, ERR_MSG_MAX_LEN);
+			ERR_WHERE();
+			fail_session(a);
+			return;
+		}
+		if (n == 0) {
+			ctrl_closed(a);
+			return;
+		}
+		recv_buf_commit(&a->rb, n);
+		parse_replies(a);
+	}
+}
+
+static void ctrl_connect_step(struct UserPIAsync *a)
+{
+	int ret = connect_finish(a->ctrl.fd);
+	if (ret == 0)
+		return;
+	if (ret < 0) {
+		close(a->ctrl.fd);
+		if (ctrl_connect_next(a) < 0)
+			fail_session(a);
+		return;
+	}
+	debug("[INFO] Control Connection established.\n");
+	a->state = STATE_GREETING;
+}
+
+static void data_connect_step(struct UserPIAsync *a)
+{
+	struct ErrMsg *err = &a->op_err;
+	int ret = connect_finish(a->data_fd);
+	if (ret == 0)
+		return;
+	if (ret < 0) {
+		strerror_r(errno, err->msg, ERR_MSG_MAX_LEN);
+		fail_op(a, NULL, "Cannot open the data connection.");
+		close_data(a);
+		return;
+	}
+	debug("[INFO] Data connection established.\n");
+	a->data_state = DATA_OPEN;
+}
+
+/// Hand \a len bytes received on the data connection to the user.
+static void data_input(struct UserPIAsync *a, const char *buf, size_t len)
+{
+	struct ErrMsg *err = &a->op_err;
+	trace_event(TRACE_DATA_RECV, a->data_fd, len, NULL, 0);
+	if (a->out_fd < 0) {
+		if (a->on_data(a->ctx, buf, len) < 0) {
+			fail_op(a, NULL, "Aborted by the callback.");
+			close_data(a);
+		}
+		return;
+	}
+	while (len) {
+		ssize_t n = pwrite(a->out_fd, buf, len, a->out_offset);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			strerror_r(errno, err->msg, ERR_MSG_MAX_LEN);
+			fail_op(a, NULL, "Cannot write the file.");
+			close_data(a);
+			return;
+		}
+		buf += n;
+		len -= n;
+		a->out_offset += n;
+	}
+}
+
+static void step_data(struct UserPIAsync *a)
+{
+	struct ErrMsg *err = &a->op_err;
+	if (a->data_state == DATA_CONNECTING)
+		data_connect_step(a);
+	for (size_t i = 0; i < ASYNC_RECV_ROUNDS && a->data_state == DATA_OPEN;
+	     i++) {
+		ssize_t n = recv(a->data_fd, a->data_buf, ASYNC_DATA_BUF_LEN, 0);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return;
+			strerror_r(errno, err->msg, ERR_MSG_MAX_LEN);
+			fail_op(a, NULL, "Error on the data connection.");
+			close_data(a);
+			return;
+		}
+		if (n == 0) {
+			close_data(a);
+			return;
+		}
+		data_input(a, a->data_buf, n);
+	}
+}
+
+static enum AsyncResult finish_op(struct UserPIAsync *a, struct ErrMsg *err)
+{
+	free(a->path);
+	a->path = NULL;
+	free(a->data_buf);
+	a->data_buf = NULL;
+	a->data_state = DATA_NONE;
+	a->state = STATE_IDLE;
+	if (a->op_failed) {
+		*err = a->op_err;
+		return ASYNC_ERROR;
+	}
+	return ASYNC_READY;
+}
+
+/// Finish the operation if everything about it is done.
+static enum AsyncResult settle(struct UserPIAsync *a, struct ErrMsg *err)
+{
+	bool transferring = a->state >= STATE_TYPE && a->state <= STATE_TRANSFER;
+	if (transferring && a->ctrl_done && data_is_idle(a))
+		return finish_op(a, err);
+	if (a->state == STATE_FAILED) {
+		*err = a->op_err;
+		return ASYNC_FAILED;
+	}
+	return a->state == STATE_IDLE ? ASYNC_READY : ASYNC_PENDING;
+}
+
+enum AsyncResult user_pi_step(struct UserPIAsync *a, struct ErrMsg *err)
+{
+	if (a->loop) {
+		ERR_PRINTF("The session is driven by an AsyncLoop.");
+		ERR_WHERE();
+		return ASYNC_FAILED;
+	}
+	if (a->state == STATE_CONNECTING)
+		ctrl_connect_step(a);
+	if (a->state == STATE_CONNECTING || a->state == STATE_FAILED)
+		goto out;
+
+	if (flush_commands(a) < 0) {
+		fail_session(a);
+		goto out;
+	}
+	read_replies(a);
+	if (a->state == STATE_FAILED)
+		goto out;
+	step_data(a);
+	if (flush_commands(a) < 0)
+		fail_session(a);
+out:
+	return settle(a, err);
+}
+
+int user_pi_async_fds(const struct UserPIAsync *a,
+                      struct pollfd fds[ASYNC_MAX_FDS])
+{
+	int n = 0;
+	if (a->state == STATE_FAILED)
+		return 0;
+	short events = POLLIN;
+	if (a->state == STATE_CONNECTING)
+		events = POLLOUT;
+	else if (a->out_sent < a->out_len)
+		events |= POLLOUT;
+	fds[n++] = (struct pollfd){ .fd = a->ctrl.fd, .events = events };
+	if (a->data_state == DATA_CONNECTING)
+		fds[n++] = (struct pollfd){ .fd = a->data_fd, .events = POLLOUT };
+	else if (a->data_state == DATA_OPEN)
+		fds[n++] = (struct pollfd){ .fd = a->data_fd, .events = POLLIN };
+	return n;
+}
+
+#ifdef HAVE_IO_URING
+static void loop_queue(struct UserPIAsync *a);
+#endif
+
+static int start_op(struct UserPIAsync *a, const char *path, bool is_list,
+                    AsyncDataFunc on_data, void *ctx, int out_fd,
+                    off_t out_offset, struct ErrMsg *err)
+{
+	if (a->state != STATE_IDLE) {
+		ERR_PRINTF("The session is busy.");
+		goto fail;
+	}
+	a->path = strdup(path);
+	// The ring has buffers of its own.
+	a->data_buf = a->loop ? NULL : malloc(ASYNC_DATA_BUF_LEN);
+	if (!a->path || (!a->loop && !a->data_buf)) {
+		free(a->path);
+		free(a->data_buf);
+		a->path = a->data_buf = NULL;
+		ERR_PRINTF("Out of memory.");
+		goto fail;
+	}
+	a->on_data = on_data;
+	a->ctx = ctx;
+	a->out_fd = out_fd;
+	a->out_offset = out_offset;
+	a->is_list = is_list;
+	a->list_format = FORMAT_MLSD;
+	a->ctrl_done = false;
+	a->op_failed = false;
+	a->data_state = DATA_NONE;
+	a->reported = false;
+	queue_command(a, "TYPE I");
+	queue_command(a, "EPSV");
+	a->state = STATE_TYPE;
+#ifdef HAVE_IO_URING
+	if (a->loop) {
+		// Sent along with the next batch.
+		loop_queue(a);
+		return 0;
+	}
+#endif
+	if (flush_commands(a) < 0) {
+		fail_session(a);
+		*err = a->op_err;
+		return -1;
+	}
+	return 0;
+fail:
+	ERR_WHERE();
+	return -1;
+}
+
+int user_pi_async_download(struct UserPIAsync *a, const char *path,
+                           AsyncDataFunc on_data, void *ctx,
+                           struct ErrMsg *err)
+{
+	return start_op(a, path, false, on_data, ctx, -1, 0, err);
+}
+
+int user_pi_async_download_to_fd(struct UserPIAsync *a, const char *path,
+                                 int fd, off_t out_offset,
+                                 struct ErrMsg *err)
+{
+	return start_op(a, path, false, NULL, NULL, fd, out_offset, err);
+}
+
+int user_pi_async_list(struct UserPIAsync *a, const char *path,
+                       AsyncDataFunc on_data, void *ctx, struct ErrMsg *err)
+{
+	return start_op(a, path, true, on_data, ctx, -1, 0, err);
+}
+
+enum ListFormat user_pi_async_list_format(const struct UserPIAsync *a)
+{
+	return a->list_format;
+}
+
+struct UserPIAsync *user_pi_async_new(const char *name, const char *service,
+                                      const struct LoginInfo *login,
+                                      struct ErrMsg *err)
+{
+	struct UserPIAsync *a = calloc(1, sizeof(*a));
+	if (!a) {
+		ERR_PRINTF("Out of memory.");
+		goto fail;
+	}
+	a->ctrl.name = name;
+	a->ctrl.service = service;
+	a->login = login;
+	a->data_state = DATA_NONE;
+	a->out_fd = -1;
+	recv_buf_init(&a->rb);
+	const struct addrinfo hint = { .ai_family = AF_UNSPEC,
+		                       .ai_socktype = SOCK_STREAM };
+	int n;
+	if ((n = getaddrinfo(name, service, &hint, &a->ctrl.addr_info)) != 0) {
+		ERR_PRINTF("getaddrinfo: %s", gai_strerror(n));
+		free(a);
+		goto fail;
+	}
+	a->ai_next = a->ctrl.addr_info;
+	if (ctrl_connect_next(a) < 0) {
+		*err = a->op_err;
+		freeaddrinfo(a->ctrl.addr_info);
+		free(a);
+		return NULL;
+	}
+	a->state = STATE_CONNECTING;
+	return a;
+fail:
+	ERR_WHERE();
+	return NULL;
+}
+
+#ifdef HAVE_IO_URING
+static void loop_detach(struct UserPIAsync *a);
+#endif
+
+void user_pi_async_free(struct UserPIAsync *a)
+{
+	if (a->state != STATE_FAILED && a->state != STATE_CONNECTING) {
+		// Say goodbye if it fits in the socket buffer.
+		queue_command(a, "QUIT");
+		flush_commands(a);
+	}
+	a->state = STATE_FAILED;
+	close_data(a);
+#ifdef HAVE_IO_URING
+	if (a->loop)
+		loop_detach(a);
+#endif
+	if (a->data_closing)
+		close(a->data_fd);
+	close(a->ctrl.fd);
+	freeaddrinfo(a->ctrl.addr_info);
+	free(a->path);
+	free(a->data_buf);
+	free(a);
+}
+
+#ifdef HAVE_IO_URING
+
+#define LOOP_CTRL_BGID 0
+#define LOOP_CTRL_BUFS 64
+#define LOOP_DATA_BGID 1
+#define LOOP_DATA_BUFS 128
+#define LOOP_DATA_BUF_LEN (64 * 1024)
+
+/// What a CQE completes, in the low bits of its user_data.
+enum LoopOp {
+	OP_CTRL_RECV = 1,
+	OP_CTRL_POLL,
+	OP_DATA_RECV,
+	OP_DATA_POLL,
+	OP_WRITE,
+};
+#define LOOP_OP_MASK 7
+
+/// A received buffer on its way to out_fd.
+struct LoopWrite {
+	struct UserPIAsync *a;
+	unsigned short bid;
+	const char *buf;
+	size_t len;
+	off_t offset;
+};
+
+struct AsyncLoop {
+	struct Uring ring;
+	struct UringBufRing ctrl_bufs;
+	struct UringBufRing data_bufs;
+	unsigned int n_data_bufs_held; /// By writes in flight.
+	unsigned int n_starved;
+	struct UserPIAsync *sessions;
+	/// Sessions with something new, to be armed and settled.
+	struct UserPIAsync *queue;
+};
+
+static uint64_t op_data(void *p, enum LoopOp op)
+{
+	return (uintptr_t)p | op;
+}
+
+static void loop_queue(struct UserPIAsync *a)
+{
+	if (a->queued)
+		return;
+	a->queued = true;
+	a->next_queued = a->loop->queue;
+	a->loop->queue = a;
+}
+
+static struct io_uring_sqe *loop_sqe(struct UserPIAsync *a)
+{
+	struct ErrMsg *err = &a->op_err;
+	struct io_uring_sqe *sqe = uring_get_sqe(&a->loop->ring);
+	if (!sqe) {
+		strerror_r(errno, err->msg, ERR_MSG_MAX_LEN);
+		ERR_WHERE();
+		fail_session(a);
+	}
+	return sqe;
+}
+
+/// Cancel everything in flight on \a fd.
+static void loop_cancel(struct UserPIAsync *a, int fd)
+{
+	struct io_uring_sqe *sqe = uring_get_sqe(&a->loop->ring);
+	if (!sqe) {
+		// Make the receive end on its own.
+		shutdown(fd, SHUT_RDWR);
+		return;
+	}
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = fd;
+	sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+	sqe->user_data = 0;
+}
+
+static bool loop_poll(struct UserPIAsync *a, int fd, enum LoopOp op)
+{
+	struct io_uring_sqe *sqe = loop_sqe(a);
+	if (!sqe)
+		return false;
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = fd;
+	sqe->poll32_events = POLLOUT;
+	sqe->user_data = op_data(a, op);
+	return true;
+}
+
+/// Receive on \a fd into buffers picked from group \a bgid until the
+/// connection ends or the buffers run out.
+static bool loop_recv(struct UserPIAsync *a, int fd, unsigned short bgid,
+                      enum LoopOp op)
+{
+	struct io_uring_sqe *sqe = loop_sqe(a);
+	if (!sqe)
+		return false;
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = fd;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = bgid;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->user_data = op_data(a, op);
+	return true;
+}
+
+/// Queue whatever \a a waits for next.
+static void loop_arm(struct UserPIAsync *a)
+{
+	if (a->state == STATE_FAILED)
+		return;
+	bool connecting = a->state == STATE_CONNECTING;
+	if (!connecting && flush_commands(a) < 0) {
+		fail_session(a);
+		return;
+	}
+	bool want_out = connecting || a->out_sent < a->out_len;
+	if (want_out && !a->ctrl_poll_armed &&
+	    loop_poll(a, a->ctrl.fd, OP_CTRL_POLL)) {
+		a->ctrl_poll_armed = true;
+		a->n_ctrl_ops++;
+	}
+	if (!connecting && !a->ctrl_recv_armed &&
+	    loop_recv(a, a->ctrl.fd, LOOP_CTRL_BGID, OP_CTRL_RECV)) {
+		a->ctrl_recv_armed = true;
+		a->n_ctrl_ops++;
+	}
+	if (a->data_state == DATA_CONNECTING && !a->data_poll_armed &&
+	    loop_poll(a, a->data_fd, OP_DATA_POLL)) {
+		a->data_poll_armed = true;
+		a->n_data_ops++;
+	}
+	if (a->data_state == DATA_OPEN && !a->data_recv_armed &&
+	    !a->data_starved &&
+	    loop_recv(a, a->data_fd, LOOP_DATA_BGID, OP_DATA_RECV)) {
+		a->data_recv_armed = true;
+		a->n_data_ops++;
+	}
+}
+
+static void loop_data_buf_put(struct AsyncLoop *loop, unsigned short bid)
+{
+	uring_buf_ring_put(&loop->data_bufs, bid);
+	if (!loop->n_starved)
+		return;
+	for (struct UserPIAsync *a = loop->sessions; a; a = a->next_session) {
+		if (a->data_starved) {
+			a->data_starved = false;
+			loop_queue(a);
+		}
+	}
+	loop->n_starved = 0;
+}
+
+static bool loop_submit_write(struct UserPIAsync *a, struct LoopWrite *w)
+{
+	struct io_uring_sqe *sqe = loop_sqe(a);
+	if (!sqe)
+		return false;
+	sqe->opcode = IORING_OP_WRITE;
+	sqe->fd = a->out_fd;
+	sqe->addr = (uintptr_t)w->buf;
+	sqe->len = w->len;
+	sqe->off = w->offset;
+	sqe->user_data = op_data(w, OP_WRITE);
+	return true;
+}
+
+/// Write received buffer \a bid straight from the ring into out_fd.
+static void loop_write(struct UserPIAsync *a, unsigned short bid, size_t len)
+{
+	struct AsyncLoop *loop = a->loop;
+	struct ErrMsg *err = &a->op_err;
+	struct LoopWrite *w = malloc(sizeof(*w));
+	if (!w) {
+		ERR_PRINTF("Out of memory.");
+		goto fail;
+	}
+	*w = (struct LoopWrite){ .a = a,
+		                 .bid = bid,
+		                 .buf = uring_buf(&loop->data_bufs, bid),
+		                 .len = len,
+		                 .offset = a->out_offset };
+	if (!loop_submit_write(a, w)) {
+		free(w);
+		goto fail;
+	}
+	a->out_offset += len;
+	a->n_writes++;
+	loop->n_data_bufs_held++;
+	return;
+fail:
+	fail_op(a, NULL, "Cannot write the file.");
+	close_data(a);
+	loop_data_buf_put(loop, bid);
+}
+
+static void loop_write_done(struct AsyncLoop *loop, struct LoopWrite *w,
+                            int res)
+{
+	struct UserPIAsync *a = w->a;
+	struct ErrMsg *err = &a->op_err;
+	loop_queue(a);
+	if (res < 0 && a->state != STATE_FAILED && !a->op_failed) {
+		strerror_r(-res, err->msg, ERR_MSG_MAX_LEN);
+		fail_op(a, NULL, "Cannot write the file.");
+		close_data(a);
+	} else if (res >= 0 && (size_t)res < w->len && a->state != STATE_FAILED) {
+		w->buf += res;
+		w->len -= res;
+		w->offset += res;
+		if (loop_submit_write(a, w))
+			return;
+	}
+	a->n_writes--;
+	loop->n_data_bufs_held--;
+	loop_data_buf_put(loop, w->bid);
+	free(w);
+}
+
+static void loop_ctrl_recv_done(struct UserPIAsync *a, int res,
+                                unsigned short bid)
+{
+	struct ErrMsg *err = &a->op_err;
+	if (res == 0) {
+		ctrl_closed(a);
+		return;
+	}
+	if (res < 0) {
+		if (res == -ENOBUFS)
+			return; // Armed again with the next batch.
+		strerror_r(-res, err->msg, ERR_MSG_MAX_LEN);
+		ERR_WHERE();
+		fail_session(a);
+		return;
+	}
+	// Replies are short, copying them is cheap.
+	const char *buf = uring_buf(&a->loop->ctrl_bufs, bid);
+	while (res > 0 && a->state != STATE_FAILED) {
+		char *space;
+		size_t n = recv_buf_space(&a->rb, &space);
+		if (n > (size_t)res)
+			n = res;
+		memcpy(space, buf, n);
+		recv_buf_commit(&a->rb, n);
+		buf += n;
+		res -= n;
+		parse_replies(a);
+	}
+}
+
+/**
+ *  \return whether the buffer was taken.
+ */
+static bool loop_data_recv_done(struct UserPIAsync *a, int res,
+                                unsigned short bid)
+{
+	struct AsyncLoop *loop = a->loop;
+	struct ErrMsg *err = &a->op_err;
+	if (res == 0) {
+		close_data(a);
+		return false;
+	}
+	if (res == -ENOBUFS) {
+		// Wait for a write to give a buffer back.
+		if (loop->n_data_bufs_held) {
+			a->data_starved = true;
+			loop->n_starved++;
+		}
+		return false;
+	}
+	if (res < 0) {
+		strerror_r(-res, err->msg, ERR_MSG_MAX_LEN);
+		fail_op(a, NULL, "Error on the data connection.");
+		close_data(a);
+		return false;
+	}
+	if (a->out_fd >= 0) {
+		loop_write(a, bid, res);
+		return true;
+	}
+	data_input(a, uring_buf(&loop->data_bufs, bid), res);
+	return false;
+}
+
+static void loop_complete(struct AsyncLoop *loop,
+                          const struct io_uring_cqe *cqe)
+{
+	if (!cqe->user_data)
+		return; // A cancellation.
+	enum LoopOp op = cqe->user_data & LOOP_OP_MASK;
+	void *p = (void *)(uintptr_t)(cqe->user_data & ~(uint64_t)LOOP_OP_MASK);
+	if (op == OP_WRITE) {
+		loop_write_done(loop, p, cqe->res);
+		return;
+	}
+	struct UserPIAsync *a = p;
+	bool more = cqe->flags & IORING_CQE_F_MORE;
+	bool has_buf = cqe->flags & IORING_CQE_F_BUFFER;
+	unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+	// Completions keep coming for a session being freed.
+	bool alive = a->state != STATE_FAILED;
+	loop_queue(a);
+
+	switch (op) {
+	case OP_CTRL_POLL:
+		a->ctrl_poll_armed = false;
+		a->n_ctrl_ops--;
+		if (alive && a->state == STATE_CONNECTING)
+			ctrl_connect_step(a);
+		break;
+	case OP_CTRL_RECV:
+		if (!more) {
+			a->ctrl_recv_armed = false;
+			a->n_ctrl_ops--;
+		}
+		if (alive)
+			loop_ctrl_recv_done(a, cqe->res, bid);
+		if (has_buf)
+			uring_buf_ring_put(&loop->ctrl_bufs, bid);
+		break;
+	case OP_DATA_POLL:
+		a->data_poll_armed = false;
+		a->n_data_ops--;
+		if (a->data_state == DATA_CONNECTING)
+			data_connect_step(a);
+		break;
+	case OP_DATA_RECV:
+		if (!more) {
+			a->data_recv_armed = false;
+			a->n_data_ops--;
+		}
+		if (alive && a->data_state == DATA_OPEN &&
+		    loop_data_recv_done(a, cqe->res, bid))
+			has_buf = false;
+		if (has_buf)
+			loop_data_buf_put(loop, bid);
+		break;
+	default:
+		__builtin_unreachable();
+	}
+	if (a->data_closing && !a->n_data_ops) {
+		close(a->data_fd);
+		a->data_closing = false;
+	}
+}
+
+/// Process every CQE there is.
+static void loop_reap(struct AsyncLoop *loop)
+{
+	struct io_uring_cqe *cqe;
+	while ((cqe = uring_peek_cqe(&loop->ring))) {
+		struct io_uring_cqe copy = *cqe;
+		uring_cqe_seen(&loop->ring);
+		loop_complete(loop, &copy);
+	}
+}
+
+int async_loop_wait(struct AsyncLoop *loop, struct AsyncEvent *events,
+                    size_t max, int timeout_ms, struct ErrMsg *err)
+{
+	size_t n = 0;
+	for (bool waited = false;; waited = true) {
+		while (loop->queue && n < max) {
+			struct UserPIAsync *a = loop->queue;
+			loop->queue = a->next_queued;
+			a->queued = false;
+			loop_arm(a);
+			enum AsyncResult result = settle(a, &events[n].err);
+			if (result == ASYNC_PENDING) {
+				a->reported = false;
+				continue;
+			}
+			if (a->reported)
+				continue;
+			a->reported = true;
+			events[n].session = a;
+			events[n].result = result;
+			n++;
+		}
+		if (n || waited) {
+			// Send what the sessions queued, without waiting.
+			if (uring_submit(&loop->ring, 0, 0) < 0)
+				goto fail;
+			return n;
+		}
+		if (uring_submit(&loop->ring, 1, timeout_ms) < 0) {
+			if (errno == ETIME)
+				return 0;
+			goto fail;
+		}
+		loop_reap(loop);
+	}
+fail:
+	strerror_r(errno, err->msg, ERR_MSG_MAX_LEN);
+	ERR_WHERE();
+	return -1;
+}
+
+int async_loop_add(struct AsyncLoop *loop, struct UserPIAsync *a,
+                   struct ErrMsg *err)
+{
+	if (a->loop || (a->state != STATE_CONNECTING && a->state != STATE_IDLE)) {
+		ERR_PRINTF("The session is busy.");
+		ERR_WHERE();
+		return -1;
+	}
+	a->loop = loop;
+	a->reported = false;
+	a->next_session = loop->sessions;
+	loop->sessions = a;
+	loop_queue(a);
+	return 0;
+}
+
+/// Take \a a out of its loop, once the ring is done with it.
+static void loop_detach(struct UserPIAsync *a)
+{
+	struct AsyncLoop *loop = a->loop;
+	if (a->n_ctrl_ops)
+		loop_cancel(a, a->ctrl.fd);
+	if (a->n_data_ops)
+		loop_cancel(a, a->data_fd);
+	while (a->n_ctrl_ops || a->n_data_ops || a->n_writes) {
+		if (uring_submit(&loop->ring, 1, -1) < 0)
+			break;
+		loop_reap(loop);
+	}
+	for (struct UserPIAsync **p = &loop->sessions; *p;
+	     p = &(*p)->next_session) {
+		if (*p == a) {
+			*p = a->next_session;
+			break;
+		}
+	}
+	for (struct UserPIAsync **p = &loop->queue; *p;
+	     p = &(*p)->next_queued) {
+		if (*p == a) {
+			*p = a->next_queued;
+			break;
+		}
+	}
+	if (a->data_starved)
+		loop->n_starved--;
+}
+
+struct AsyncLoop *async_loop_new(unsigned int entries, struct ErrMsg *err)
+{
+	struct AsyncLoop *loop = calloc(1, sizeof(*loop));
+	if (!loop) {
+		ERR_PRINTF("Out of memory.");
+		goto fail;
+	}
+	if (uring_init(&loop->ring, entries) < 0) {
+		free(loop);
+		goto fail_errno;
+	}
+	if (uring_buf_ring_init(&loop->ring, &loop->ctrl_bufs, LOOP_CTRL_BGID,
+	                        LOOP_CTRL_BUFS, LINE_MAX_LEN) < 0)
+		goto fail_ring;
+	if (uring_buf_ring_init(&loop->ring, &loop->data_bufs, LOOP_DATA_BGID,
+	                        LOOP_DATA_BUFS, LOOP_DATA_BUF_LEN) < 0) {
+		int saved = errno;
+		uring_buf_ring_free(&loop->ring, &loop->ctrl_bufs);
+		errno = saved;
+		goto fail_ring;
+	}
+	return loop;
+fail_ring:
+	strerror_r(errno, err->msg, ERR_MSG_MAX_LEN);
+	uring_exit(&loop->ring);
+	free(loop);
+	goto fail;
+fail_errno:
+	strerror_r(errno, err->msg, ERR_MSG_MAX_LEN);
+fail:
+	ERR_WHERE();
+	return NULL;
+}
+
+void async_loop_free(struct AsyncLoop *loop)
+{
+	uring_buf_ring_free(&loop->ring, &loop->data_bufs);
+	uring_buf_ring_free(&loop->ring, &loop->ctrl_bufs);
+	uring_exit(&loop->ring);
+	free(loop);
+}
+
+#else
+
+struct AsyncLoop *async_loop_new(unsigned int entries, struct ErrMsg *err)
+{
+	(void)entries;
+	ERR_PRINTF("Built without io_uring.");
+	ERR_WHERE();
+	return NULL;
+}
+
+void async_loop_free(struct AsyncLoop *loop)
+{
+	(void)loop;
+}
+
+int async_loop_add(struct AsyncLoop *loop, struct UserPIAsync *a,
+                   struct ErrMsg *err)
+{
+	(void)loop;
+	(void)a;
+	ERR_PRINTF("Built without io_uring.");
+	ERR_WHERE();
+	return -1;
+}
+
+int async_loop_wait(struct AsyncLoop *loop, struct AsyncEvent *events,
+                    size_t max, int timeout_ms, struct ErrMsg *err)
+{
+	(void)loop;
+	(void)events;
+	(void)max;
+	(void)timeout_ms;
+	ERR_PRINTF("Built without io_uring.");
+	ERR_WHERE();
+	return -1;
+}
+
+#endif
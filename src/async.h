@@ -0,0 +1,136 @@
+#ifndef _ASYNC_H
+#define _ASYNC_H
+
+#include <poll.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "cmd.h"
+#include "error.h"
+
+struct UserPIAsync;
+struct ErrMsg;
+
+/// Called with every piece of data received on the data connection.
+/**
+ *  \return -1 to abort the transfer.
+ */
+typedef int (*AsyncDataFunc)(void *ctx, const char *data, size_t len);
+
+enum AsyncResult {
+	/// The session is broken and must be freed.
+	ASYNC_FAILED = -2,
+	/// The current operation failed. The session is idle again.
+	ASYNC_ERROR = -1,
+	/// Call user_pi_step() again once an fd is ready.
+	ASYNC_PENDING = 0,
+	/// The session is logged in and idle, ready for the next operation.
+	ASYNC_READY = 1,
+};
+
+#define ASYNC_MAX_FDS 2
+
+/// Start a non-blocking session to \a name, \a service.
+/**
+ *  Only name resolution blocks, so pass numeric addresses from an event
+ *  loop. The greeting and login are carried out by user_pi_step().
+ *  \a login must outlive the session.
+ *  \return NULL on failure.
+ */
+struct UserPIAsync *user_pi_async_new(const char *name, const char *service,
+                                      const struct LoginInfo *login,
+                                      struct ErrMsg *err);
+
+/// Close every connection of \a a and free it.
+void user_pi_async_free(struct UserPIAsync *a);
+
+/// The fds of \a a and the events it waits for.
+/**
+ *  The set changes as \a a advances, so query it again after every
+ *  user_pi_step().
+ *  \return the number of entries filled in \a fds.
+ */
+int user_pi_async_fds(const struct UserPIAsync *a,
+                      struct pollfd fds[ASYNC_MAX_FDS]);
+
+/// Advance \a a as far as possible without blocking.
+/**
+ *  Call it whenever one of the fds of \a a is ready. Spurious calls are
+ *  harmless.
+ */
+enum AsyncResult user_pi_step(struct UserPIAsync *a, struct ErrMsg *err);
+
+/// Start downloading \a path into \a on_data.
+/**
+ *  The session must be idle. user_pi_step() returns ASYNC_READY when the
+ *  transfer is complete.
+ *  \return -1 on error.
+ */
+int user_pi_async_download(struct UserPIAsync *a, const char *path,
+                           AsyncDataFunc on_data, void *ctx,
+                           struct ErrMsg *err);
+
+/// Start downloading \a path into \a fd.
+/**
+ *  The file is downloaded from its byte 0, and written at \a out_offset
+ *  of \a fd on.
+ *  \return -1 on error.
+ */
+int user_pi_async_download_to_fd(struct UserPIAsync *a, const char *path,
+                                 int fd, off_t out_offset,
+                                 struct ErrMsg *err);
+
+/// Start listing \a path into \a on_data, in the format of
+/// user_pi_async_list_format().
+/**
+ *  \return -1 on error.
+ */
+int user_pi_async_list(struct UserPIAsync *a, const char *path,
+                       AsyncDataFunc on_data, void *ctx, struct ErrMsg *err);
+
+enum ListFormat user_pi_async_list_format(const struct UserPIAsync *a);
+
+/// Drives many sessions from one thread through io_uring.
+/**
+ *  The control and data connections are read with multishot receives into
+ *  buffer rings registered with the kernel, and downloads to an fd are
+ *  written straight from those buffers. Every SQE queued by the sessions
+ *  goes out in one io_uring_enter() per async_loop_wait().
+ */
+struct AsyncLoop;
+
+struct AsyncEvent {
+	struct UserPIAsync *session;
+	/// Never ASYNC_PENDING.
+	enum AsyncResult result;
+	struct ErrMsg err;
+};
+
+/// Create a loop with an SQ of \a entries.
+/**
+ *  \return NULL if io_uring isn't built in, or the kernel lacks it (Linux
+ *  6.0 is needed for multishot receives). Use user_pi_step() then.
+ */
+struct AsyncLoop *async_loop_new(unsigned int entries, struct ErrMsg *err);
+
+/// Free \a loop. Free its sessions first.
+void async_loop_free(struct AsyncLoop *loop);
+
+/// Let \a loop drive \a a from now on, instead of user_pi_step().
+/**
+ *  \a a must be connecting or idle. It leaves the loop when freed.
+ *  \return -1 on error.
+ */
+int async_loop_add(struct AsyncLoop *loop, struct UserPIAsync *a,
+                   struct ErrMsg *err);
+
+/// Wait for sessions of \a loop to become idle or fail.
+/**
+ *  Each login, operation or failure is reported once. It may return 0
+ *  before \a timeout_ms runs out. A negative \a timeout_ms waits forever.
+ *  \return the number of \a events filled, or -1 on error.
+ */
+int async_loop_wait(struct AsyncLoop *loop, struct AsyncEvent *events,
+                    size_t max, int timeout_ms, struct ErrMsg *err);
+
+#endif
@@ -1,31 +1,32 @@
-#include <assert.h>
+#include <arpa/inet.h>
 #include <ctype.h>
 #include <errno.h>
+#include <poll.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <unistd.h>
 
+#include "arena.h"
 #include "cmd.h"
 #include "debug.h"
 #include "error.h"
+#include "feat.h"
 #include "ftp.h"
+#include "metrics.h"
+#include "list_cache.h"
+#include "mode_b.h"
+#include "mode_z.h"
 #include "parse.h"
 #include "telnet.h"
+#include "trace.h"
 
 #define ERR_PRINTF_REPLY(reply, fmt, ...)                                      \
 	ERR_PRINTF(fmt " (%s)", ##__VA_ARGS__, reply)
 
-enum GetReplyResult {
-	GET_REPLY_NETWORK_ERROR, // errno
-	GET_REPLY_TELNET_ERROR, // errno
-	GET_REPLY_CLOSED,
-	GET_REPLY_SYNTAX_ERROR,
-	GET_REPLY_OK
-};
-
 const char *get_reply_err_msg[] = {
 	[GET_REPLY_SYNTAX_ERROR] = "get_reply: Syntax error.",
 	[GET_REPLY_CLOSED] = "get_reply: Connection is closed.",
@@ -36,9 +37,6 @@ const char *get_reply_err_msg[] = {
 static enum GetReplyResult get_reply(int fd, struct RecvBuf *rb,
                                      struct Reply *reply);
 
-void get_reply_result_to_err_msg(enum GetReplyResult result, char *err_msg,
-                                 size_t len);
-
 static bool is_reply_eq(struct Reply *reply, unsigned int reply_code[3])
 {
 	for (size_t i = 0; i < 3; i++) {
@@ -48,47 +46,203 @@ static bool is_reply_eq(struct Reply *reply, unsigned int reply_code[3])
 	return true;
 }
 
-int send_command(int fd, struct Reply *reply, struct ErrMsg *err,
-                 const char *fmt, ...)
+void pipeline_init(struct Pipeline *pipeline)
 {
-	int ret = 0;
-	va_list args;
-	va_start(args, fmt);
-	// First try a fixed-size array to avoid malloc.
-	char cmd_buf_small[CMD_BUF_LEN];
-	const size_t _CMD_BUF_LEN = CMD_BUF_LEN - 2;
-	char *cmd_buf_bigger = NULL;
-	char *cmd_buf = cmd_buf_small;
-	size_t len = vsnprintf(cmd_buf, _CMD_BUF_LEN, fmt, args);
-	if (len >= _CMD_BUF_LEN) {
-		cmd_buf_bigger = malloc(len + 3); // CR LF \0
-		len = vsnprintf(cmd_buf_bigger, len + 1, fmt, args);
-		cmd_buf = cmd_buf_bigger;
-	}
-	strcpy(&cmd_buf[len], "\r\n");
-	va_end(args);
+	pipeline->len = 0;
+	pipeline->n_queued = 0;
+	pipeline->n_pending = 0;
+	pipeline->timed_begin = 0;
+	pipeline->n_timed = 0;
+	pipeline->n_untimed = 0;
+}
+
+/// Time a command pushed into \a p, \a sent_ns is 0 if it's only queued.
+static void pipeline_time(struct Pipeline *p, const char *cmd, size_t len,
+                          uint64_t sent_ns)
+{
+	if (p->n_untimed || p->n_timed == PIPELINE_MAX_TIMED) {
+		p->n_untimed++;
+		return;
+	}
+	p->timed[(p->timed_begin + p->n_timed++) % PIPELINE_MAX_TIMED] =
+		(struct PendingCommand){ .sent_ns = sent_ns,
+			                 .command = metric_command(cmd, len) };
+}
 
-	if (sendn(fd, cmd_buf, len + 2) != len + 2) {
+static bool is_transfer_command(enum MetricCommand command)
+{
+	return command == METRIC_CMD_RETR || command == METRIC_CMD_STOR ||
+	       command == METRIC_CMD_APPE || command == METRIC_CMD_LIST ||
+	       command == METRIC_CMD_MLSD;
+}
+
+/// Record \a reply against the oldest command in flight.
+static void pipeline_time_reply(struct UserPI *user_pi,
+                                const struct Reply *reply)
+{
+	struct Pipeline *p = &user_pi->pipeline;
+	struct Metrics *metrics = &user_pi->metrics;
+	bool final = reply->first != POS_PRE;
+	if (reply->first == NEG_TRAN_COM || reply->first == NEG_PERM_COM)
+		metrics_add(metrics, METRIC_NEGATIVE_REPLIES, 1);
+	if (!p->n_timed) {
+		if (final && p->n_untimed)
+			p->n_untimed--;
+		return;
+	}
+	struct PendingCommand *head = &p->timed[p->timed_begin];
+	if (!head->answered) {
+		head->answered = true;
+		metrics_observe(metrics, METRIC_COMMAND + head->command,
+		                head->sent_ns);
+		if (!final && (head->command == METRIC_CMD_RETR ||
+		               head->command == METRIC_CMD_LIST ||
+		               head->command == METRIC_CMD_MLSD))
+			metrics->first_byte_from_ns = head->sent_ns;
+	}
+	if (!final)
+		return;
+	if (is_transfer_command(head->command))
+		metrics_observe(metrics, METRIC_TRANSFER, head->sent_ns);
+	p->timed_begin = (p->timed_begin + 1) % PIPELINE_MAX_TIMED;
+	p->n_timed--;
+}
+
+int pipeline_flush(struct UserPI *user_pi, struct ErrMsg *err)
+{
+	struct Pipeline *p = &user_pi->pipeline;
+	if (!p->len)
+		return 0;
+	if (sendn(user_pi->ctrl.fd, p->buf, p->len) != p->len) {
+		metrics_add(&user_pi->metrics, METRIC_ERRORS, 1);
 		strerror_r(errno, err->msg, ERR_MSG_MAX_LEN);
-		goto fail;
+		ERR_WHERE();
+		return -1;
 	}
-	debug("[O] %s", cmd_buf);
-	struct RecvBuf rb;
-	recv_buf_init(&rb);
-	enum GetReplyResult result = get_reply(fd, &rb, reply);
-	if (result != GET_REPLY_OK) {
-		get_reply_result_to_err_msg(result, err->msg, LINE_MAX_LEN);
-		goto fail;
+	uint64_t now_ns = metrics_now_ns();
+	for (unsigned int i = 0; i < p->n_timed; i++) {
+		struct PendingCommand *cmd =
+			&p->timed[(p->timed_begin + i) % PIPELINE_MAX_TIMED];
+		if (!cmd->sent_ns)
+			cmd->sent_ns = now_ns;
+	}
+	p->n_pending += p->n_queued;
+	p->n_queued = 0;
+	p->len = 0;
+	return 0;
+}
+
+static int pipeline_vpush(struct UserPI *user_pi, struct ErrMsg *err,
+                          const char *fmt, va_list args)
+{
+	struct Pipeline *p = &user_pi->pipeline;
+	va_list args_retry;
+	va_copy(args_retry, args);
+	int ret = 0;
+	char *cmd_buf_bigger = NULL;
+
+	size_t room = PIPELINE_BUF_LEN - p->len;
+	size_t len = vsnprintf(&p->buf[p->len], room, fmt, args);
+	if (len + 2 >= room) {
+		// It doesn't fit behind the queued ones.
+		if (pipeline_flush(user_pi, err) < 0)
+			goto fail;
+		if (len + 2 < PIPELINE_BUF_LEN) {
+			vsnprintf(p->buf, PIPELINE_BUF_LEN, fmt, args_retry);
+		} else {
+			// Too long to be queued at all, send it right away.
+			cmd_buf_bigger = malloc(len + 3); // CR LF \0
+			if (!cmd_buf_bigger) {
+				strerror_r(errno, err->msg, ERR_MSG_MAX_LEN);
+				goto fail;
+			}
+			vsnprintf(cmd_buf_bigger, len + 1, fmt, args_retry);
+			strcpy(&cmd_buf_bigger[len], "\r\n");
+			trace_event(TRACE_COMMAND, user_pi->ctrl.fd, 0,
+			            cmd_buf_bigger, len);
+			if (sendn(user_pi->ctrl.fd, cmd_buf_bigger, len + 2) !=
+			    len + 2) {
+				metrics_add(&user_pi->metrics, METRIC_ERRORS, 1);
+				strerror_r(errno, err->msg, ERR_MSG_MAX_LEN);
+				goto fail;
+			}
+			pipeline_time(p, cmd_buf_bigger, len, metrics_now_ns());
+			p->n_pending++;
+			goto clean_up;
+		}
 	}
+	memcpy(&p->buf[p->len + len], "\r\n", 2);
+	trace_event(TRACE_COMMAND, user_pi->ctrl.fd, 0, &p->buf[p->len], len);
+	pipeline_time(p, &p->buf[p->len], len, 0);
+	p->len += len + 2;
+	p->n_queued++;
 clean_up:
+	va_end(args_retry);
 	free(cmd_buf_bigger);
 	return ret;
 fail:
-	ERR_WHERE_PRINTF("%s(%s)", __func__, cmd_buf);
+	ERR_WHERE();
 	ret = -1;
 	goto clean_up;
 }
 
+int pipeline_push(struct UserPI *user_pi, struct ErrMsg *err,
+                  const char *fmt, ...)
+{
+	va_list args;
+	va_start(args, fmt);
+	int ret = pipeline_vpush(user_pi, err, fmt, args);
+	va_end(args);
+	return ret;
+}
+
+int pipeline_get_reply(struct UserPI *user_pi, struct Reply *reply,
+                       struct ErrMsg *err)
+{
+	struct Pipeline *p = &user_pi->pipeline;
+	if (p->n_queued && pipeline_flush(user_pi, err) < 0)
+		return -1;
+	enum GetReplyResult result =
+		get_reply(user_pi->ctrl.fd, &user_pi->rb, reply);
+	if (result != GET_REPLY_OK) {
+		metrics_add(&user_pi->metrics, METRIC_ERRORS, 1);
+		get_reply_result_to_err_msg(result, err->msg, ERR_MSG_MAX_LEN);
+		ERR_WHERE();
+		return -1;
+	}
+	if (p->n_pending)
+		pipeline_time_reply(user_pi, reply);
+	if (reply->first != POS_PRE && p->n_pending)
+		p->n_pending--;
+	return 0;
+}
+
+void pipeline_drain(struct UserPI *user_pi)
+{
+	struct ErrMsg err;
+	struct Reply reply;
+	// Including the reply to the EPSV or PASV of a prefetch.
+	user_pi->prefetch.pending = false;
+	while (user_pi->pipeline.n_pending || user_pi->pipeline.n_queued) {
+		if (pipeline_get_reply(user_pi, &reply, &err) < 0) {
+			pipeline_init(&user_pi->pipeline);
+			return;
+		}
+	}
+}
+
+int send_command(struct UserPI *user_pi, struct Reply *reply,
+                 struct ErrMsg *err, const char *fmt, ...)
+{
+	va_list args;
+	va_start(args, fmt);
+	int ret = pipeline_vpush(user_pi, err, fmt, args);
+	va_end(args);
+	if (ret < 0)
+		return -1;
+	return pipeline_get_reply(user_pi, reply, err);
+}
+
 /// Look for xyz-, where x, y, z are digits.
 static bool is_reply_multi_line(char short_reply[4], size_t len)
 {
@@ -105,45 +259,55 @@ static bool is_reply_multi_line_last(char short_reply[4], size_t len)
 	return short_reply[3] == ' ';
 }
 
+enum GetReplyResult reply_feed_line(int fd, const unsigned char *line,
+                                    size_t len, struct Reply *reply,
+                                    bool *done)
+{
+	bool first_line = reply->len == 0;
+	trace_event(TRACE_LINE, fd, 0, (const char *)line, len);
+	if (copy_from_telnet_line(fd, line, len, reply) < 0)
+		return GET_REPLY_TELNET_ERROR;
+	if (first_line) {
+		for (size_t i = 0; i < 3; i++) {
+			if (i + 1 > reply->len)
+				return GET_REPLY_SYNTAX_ERROR;
+			reply->reply_codes[i] = reply->reply[i] - '0';
+		}
+		*done = !is_reply_multi_line(reply->short_reply,
+		                             reply->short_reply_len);
+	} else {
+		// Oh, we have a multi-line reply!
+		*done = is_reply_multi_line_last(reply->short_reply,
+		                                 reply->short_reply_len);
+	}
+	if (*done)
+		trace_event(TRACE_REPLY, fd,
+		            reply->first * 100 + reply->second * 10 +
+		                    reply->third,
+		            NULL, 0);
+	return GET_REPLY_OK;
+}
+
 static enum GetReplyResult get_reply(int fd, struct RecvBuf *rb,
                                      struct Reply *reply)
 {
 	reply->len = 0;
-	unsigned char line[LINE_MAX_LEN];
-	ssize_t len;
-
-#define GET_LINE()                                                             \
-	len = recv_buf_get_line(rb, fd, line);                                 \
-	if (len < 0)                                                           \
-		return GET_REPLY_NETWORK_ERROR;                                \
-	if (len == 0)                                                          \
-		return GET_REPLY_CLOSED;                                       \
-	debug("[I] %s", line);                                                 \
-	assert(line[len - 1] ==                                                \
-	       '\n'); /* TODO: Not sure about this. Let's just crash first.*/  \
-	if (copy_from_telnet_line(fd, line, len, reply) < 0)                   \
-		return GET_REPLY_TELNET_ERROR;
+	bool done = false;
 
-	GET_LINE();
-	for (size_t i = 0; i < 3; i++) {
-		if (i + 1 > reply->len)
-			return GET_REPLY_SYNTAX_ERROR;
-		reply->reply_codes[i] = reply->reply[i] - '0';
-	}
-	if (!is_reply_multi_line(reply->short_reply, reply->short_reply_len))
-		return GET_REPLY_OK;
-
-	// Oh, we have a multi-line reply!
-	for (;;) {
-		GET_LINE();
-		if (is_reply_multi_line_last(reply->short_reply,
-		                             reply->short_reply_len))
-			break;
+	while (!done) {
+		const char *line;
+		ssize_t len = recv_buf_get_line(rb, fd, &line);
+		if (len < 0)
+			return GET_REPLY_NETWORK_ERROR;
+		if (len == 0)
+			return GET_REPLY_CLOSED;
+		enum GetReplyResult result =
+			reply_feed_line(fd, (const unsigned char *)line, len,
+		                        reply, &done);
+		if (result != GET_REPLY_OK)
+			return result;
 	}
-
 	return GET_REPLY_OK;
-
-#undef GET_LINE
 }
 
 void get_reply_result_to_err_msg(enum GetReplyResult result, char *err_msg,
@@ -156,15 +320,17 @@ void get_reply_result_to_err_msg(enum GetReplyResult result, char *err_msg,
 	bool errno_involved = result == GET_REPLY_TELNET_ERROR ||
 	                      result == GET_REPLY_NETWORK_ERROR;
 	if (errno_involved)
-		strerror_r(errno, err_msg + len, len - first_part_len);
+		strerror_r(errno, err_msg + first_part_len,
+		           len - first_part_len);
 	err_msg[len - 1] = 0;
 }
 
-int get_connection_greetings(int fd, struct RecvBuf *rb, struct ErrMsg *err)
+int get_connection_greetings(struct UserPI *user_pi, struct ErrMsg *err)
 {
 	for (;;) {
 		struct Reply reply;
-		enum GetReplyResult result = get_reply(fd, rb, &reply);
+		enum GetReplyResult result =
+			get_reply(user_pi->ctrl.fd, &user_pi->rb, &reply);
 		if (result != GET_REPLY_OK) {
 			get_reply_result_to_err_msg(result, err->msg,
 			                            ERR_MSG_MAX_LEN);
@@ -188,8 +354,8 @@ fail:
 	return -1;
 }
 
-int perform_login_sequence(const struct LoginInfo *l, int fd,
-                           struct RecvBuf *rb, struct ErrMsg *err)
+int perform_login_sequence(const struct LoginInfo *l, struct UserPI *user_pi,
+                           struct ErrMsg *err)
 {
 	/*
 	RFC 959 Page 57:
@@ -230,7 +396,8 @@ int perform_login_sequence(const struct LoginInfo *l, int fd,
 		info = "A username";
 		goto info_needed;
 	}
-	if (send_command(fd, &reply, err, "USER %s", l->username) < 0)
+	user_pi->username = l->username;
+	if (send_command(user_pi, &reply, err, "USER %s", l->username) < 0)
 		return -1;
 	cmd = "USER";
 	if (*first == POS_COM)
@@ -239,7 +406,7 @@ int perform_login_sequence(const struct LoginInfo *l, int fd,
 		goto error;
 	if (*first == NEG_TRAN_COM || *first == NEG_PERM_COM) {
 		ERR_PRINTF_REPLY(
-			reply,
+			reply.short_reply,
 			"Failure: Login failed after sending the username \"%s\".",
 			l->username);
 		// TODO: Extract more information from the reply.
@@ -247,7 +414,7 @@ int perform_login_sequence(const struct LoginInfo *l, int fd,
 	}
 	if (*first != POS_INT) {
 		ERR_PRINTF_REPLY(
-			reply,
+			reply.short_reply,
 			"Unexpected reply after sending the username \"%s\".",
 			l->username);
 		goto fail;
@@ -259,7 +426,7 @@ int perform_login_sequence(const struct LoginInfo *l, int fd,
 		info = "Your password";
 		goto info_needed;
 	}
-	if (send_command(fd, &reply, err, "PASS %s", l->password) < 0)
+	if (send_command(user_pi, &reply, err, "PASS %s", l->password) < 0)
 		return -1;
 	cmd = "PASS";
 	if (*first == POS_COM)
@@ -268,14 +435,15 @@ int perform_login_sequence(const struct LoginInfo *l, int fd,
 		goto error;
 	if (*first == NEG_TRAN_COM || *first == NEG_PERM_COM) {
 		ERR_PRINTF_REPLY(
-			reply,
+			reply.short_reply,
 			"Failure: Login failed after sending the password.");
 		// TODO: Extract more information from the reply.
 		goto fail;
 	}
 	if (*first != POS_INT) {
 		ERR_PRINTF_REPLY(
-			reply, "Unexpected reply after sending the password.");
+			reply.short_reply,
+			"Unexpected reply after sending the password.");
 		goto fail;
 	}
 
@@ -285,7 +453,7 @@ int perform_login_sequence(const struct LoginInfo *l, int fd,
 		info = "Your account information";
 		goto info_needed;
 	}
-	if (send_command(fd, &reply, err, "ACCT %s", l->account_info) < 0)
+	if (send_command(user_pi, &reply, err, "ACCT %s", l->account_info) < 0)
 		return -1;
 	cmd = "ACCT";
 	if (*first == POS_COM)
@@ -358,14 +526,29 @@ static int generic_reply_validate(struct Reply *reply, struct ErrMsg *err,
 	__builtin_unreachable();
 }
 
+/// 500 to 504 but 503, the server doesn't have the command or argument.
+static bool is_reply_not_implemented(const struct Reply *reply)
+{
+	return reply->first == NEG_PERM_COM && reply->second == SYNTAX &&
+	       reply->third != 3;
+}
+
+/// Fail without a round trip if the server is known to lack \a feature.
+static int require_feature(struct UserPI *user_pi, enum Feature feature,
+                           const char *cmd, struct ErrMsg *err)
+{
+	if (features_use(&user_pi->features, feature))
+		return 0;
+	ERR_PRINTF("The server doesn't support %s.", cmd);
+	ERR_WHERE_PRINTF("%s", cmd);
+	return -1;
+}
+
 static int get_reply_and_validate(struct UserPI *user_pi, struct ErrMsg *err,
                                   const char *cmd, const char *desc)
 {
 	struct Reply reply;
-	enum GetReplyResult result =
-		get_reply(user_pi->ctrl.fd, &user_pi->rb, &reply);
-	if (result != GET_REPLY_OK) {
-		get_reply_result_to_err_msg(result, err->msg, LINE_MAX_LEN);
+	if (pipeline_get_reply(user_pi, &reply, err) < 0) {
 		ERR_WHERE_PRINTF("%s", cmd);
 		return -1;
 	}
@@ -374,127 +557,749 @@ static int get_reply_and_validate(struct UserPI *user_pi, struct ErrMsg *err,
 	return 0;
 }
 
-static int enter_passive_mode(int fd, struct RecvBuf *rb, char *name,
-                              char *service, struct ErrMsg *err)
+/// Handle the reply to EPSV if \a epsv, falling back to PASV if needed, or
+/// else the reply to PASV.
+static int enter_passive_mode(struct UserPI *user_pi, struct Reply *reply,
+                              bool epsv, char *name, char *service,
+                              struct ErrMsg *err)
 {
-	struct Reply reply;
-	const char *cmd;
-	cmd = "EPSV";
-	if (send_command(fd, &reply, err, cmd) < 0)
-		return -1;
-	if (is_reply_eq(&reply, (unsigned int[]){ 2, 2, 9 })) {
-		if (parse_epsv_reply(reply.short_reply, reply.short_reply_len,
-		                     service) < 0) {
-			ERR_PRINTF("Cannot parse the reply: %s",
-			           reply.short_reply);
-			ERR_WHERE_PRINTF("EPSV");
-			return -1;
+	const char *cmd = "PASV";
+	if (epsv) {
+		if (is_reply_eq(reply, (unsigned int[]){ 2, 2, 9 })) {
+			if (parse_epsv_reply(reply->short_reply,
+			                     reply->short_reply_len,
+			                     service) < 0) {
+				ERR_PRINTF("Cannot parse the reply: %s",
+				           reply->short_reply);
+				ERR_WHERE_PRINTF("EPSV");
+				return -1;
+			}
+			*name = '\0';
+			return 0;
 		}
-		*name = '\0';
-		return 0;
+		if (is_reply_not_implemented(reply))
+			features_learn_lack(user_pi, FEAT_EPSV);
+		debug("[WARNING] EPSV failed. Falling back to PASV\n");
+		if (send_command(user_pi, reply, err, cmd) < 0)
+			return -1;
 	}
-	debug("[WARNING] EPSV failed. Falling back to PASV");
-	cmd = "PASV";
-	if (send_command(fd, &reply, err, cmd) < 0)
-		return -1;
-	if (generic_reply_validate(&reply, err, cmd,
+	if (generic_reply_validate(reply, err, cmd,
 	                           "Cannot enter passive mode.") < 0)
 		return -1;
-	if (parse_pasv_reply(reply.short_reply, reply.short_reply_len, name,
+	if (parse_pasv_reply(reply->short_reply, reply->short_reply_len, name,
 	                     service) < 0) {
-		ERR_PRINTF("Cannot parse the reply: %s", reply.short_reply);
+		ERR_PRINTF("Cannot parse the reply: %s", reply->short_reply);
 		ERR_WHERE_PRINTF("PASV");
 		return -1;
 	}
 	return 0;
 }
 
-int set_transfer_parameters(int fd, struct RecvBuf *rb, char *name,
-                            char *service, struct ErrMsg *err)
+/// Close the data connection opened ahead, if any.
+static void prefetch_drop(struct UserPI *user_pi)
 {
-	if (enter_passive_mode(fd, rb, name, service, err) < 0)
-		return -1;
+	if (user_pi->prefetch.fd < 0)
+		return;
+	close(user_pi->prefetch.fd);
+	user_pi->prefetch.fd = -1;
+}
+
+void set_data_prefetch(struct UserPI *user_pi, bool on)
+{
+	user_pi->prefetch.enabled = on;
+	if (!on)
+		prefetch_drop(user_pi);
+}
+
+/// Move the data connection opened ahead to `user_pi->data`, if still good.
+static bool prefetch_take(struct UserPI *user_pi)
+{
+	struct DataPrefetch *prefetch = &user_pi->prefetch;
+	if (prefetch->fd < 0)
+		return false;
+	// Nothing is sent before the transfer command, so anything to read
+	// means it was closed.
+	struct pollfd pfd = { .fd = prefetch->fd, .events = POLLIN };
+	if (metrics_now_ns() - prefetch->since_ns >
+	            DATA_PREFETCH_MAX_IDLE_MS * 1000000ull ||
+	    poll(&pfd, 1, 0) != 0) {
+		debug("[INFO] The data connection opened ahead is stale.\n");
+		prefetch_drop(user_pi);
+		return false;
+	}
+	user_pi->data.fd = prefetch->fd;
+	prefetch->fd = -1;
+	return true;
+}
+
+/// Close the data connection left open in block mode, if any.
+static void data_drop_kept(struct UserPI *user_pi)
+{
+	if (!user_pi->mode_b)
+		return;
+	int fd = mode_b_kept(user_pi->mode_b);
+	if (fd >= 0)
+		close(fd);
+	mode_b_forget(user_pi->mode_b);
+}
+
+/// Move the data connection left open in block mode to `user_pi->data`, if
+/// still good.
+static bool data_take_kept(struct UserPI *user_pi)
+{
+	if (!user_pi->mode_b)
+		return false;
+	int fd = mode_b_kept(user_pi->mode_b);
+	if (fd < 0)
+		return false;
+	// Nothing is sent between transfers either.
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+	if (poll(&pfd, 1, 0) != 0) {
+		debug("[INFO] The data connection left open is gone.\n");
+		data_drop_kept(user_pi);
+		return false;
+	}
+	user_pi->data.fd = fd;
+	return true;
+}
+
+/// Close the data connection, which won't carry another transfer.
+static void data_close(struct UserPI *user_pi)
+{
+	close(user_pi->data.fd);
+	if (user_pi->mode_b)
+		mode_b_forget(user_pi->mode_b);
+}
+
+/// Done with the data connection, left open if block mode allows.
+/**
+ *  That's when its transfer ended with the EOF block, or when it was kept
+ *  for one the server turned down.
+ */
+static void data_end(struct UserPI *user_pi)
+{
+	if (!user_pi->mode_b ||
+	    mode_b_kept(user_pi->mode_b) != user_pi->data.fd)
+		close(user_pi->data.fd);
+}
 
+int set_transfer_parameters(struct UserPI *user_pi, char *name, char *service,
+                            struct ErrMsg *err)
+{
 	const char *cmd;
 	struct Reply reply;
 
+	// The server stops listening for it, and closes the one left open.
+	prefetch_drop(user_pi);
+	data_drop_kept(user_pi);
+
 	// Representation Type: Image
 	cmd = "TYPE I";
-	if (send_command(fd, &reply, err, cmd) < 0)
+	if (pipeline_push(user_pi, err, cmd) < 0)
+		return -1;
+	bool epsv = features_use(&user_pi->features, FEAT_EPSV);
+	if (pipeline_push(user_pi, err, epsv ? "EPSV" : "PASV") < 0)
+		return -1;
+
+	if (pipeline_get_reply(user_pi, &reply, err) < 0)
 		return -1;
 	if (generic_reply_validate(
 		    &reply, err, cmd,
-		    "Cannot set Representation Type to \"Image\".") < 0)
+		    "Cannot set Representation Type to \"Image\".") < 0) {
+		pipeline_drain(user_pi);
+		return -1;
+	}
+
+	if (pipeline_get_reply(user_pi, &reply, err) < 0)
+		return -1;
+	if (enter_passive_mode(user_pi, &reply, epsv, name, service, err) < 0)
 		return -1;
 
 	// File Structure: File
 	// Do nothing since File is the default structure.
 
-	// Transfer Mode: Block
-	// Do nothing since Stream is the default transfer mode.
+	// Transfer Mode
+	// Set once for the session by set_mode_z() or set_mode_b(), Stream by
+	// default.
 	return 0;
 }
 
-ssize_t list_directory(struct UserPI *user_pi, char *path, char **list,
-                       enum ListFormat *format, struct ErrMsg *err)
+int set_mode_z(struct UserPI *user_pi, int level, struct ErrMsg *err)
 {
-	if (create_data_connection(user_pi, err) < 0)
+	struct Reply reply;
+	if (level == 0) {
+		if (!user_pi->mode_z)
+			return 0;
+		if (send_command(user_pi, &reply, err, "MODE S") < 0 ||
+		    generic_reply_validate(&reply, err, "MODE S",
+		                           "Cannot go back to Stream mode.") < 0)
+			return -1;
+		mode_z_free(user_pi->mode_z);
+		user_pi->mode_z = NULL;
+		return 0;
+	}
+	if (level < 1 || level > 9) {
+		ERR_PRINTF("Invalid compression level %d.", level);
+		ERR_WHERE();
+		return -1;
+	}
+	if (require_feature(user_pi, FEAT_MODE_Z, "MODE Z", err) < 0)
+		return -1;
+	struct ModeZ *mode_z = mode_z_new(level);
+	if (!mode_z) {
+		if (errno == ENOTSUP) {
+			ERR_PRINTF("Built without zlib.");
+		} else {
+			strerror_r(errno, err->msg, ERR_MSG_MAX_LEN);
+		}
+		ERR_WHERE();
 		return -1;
+	}
+	if (pipeline_push(user_pi, err, "MODE Z") < 0 ||
+	    pipeline_push(user_pi, err, "OPTS MODE Z LEVEL %d", level) < 0 ||
+	    pipeline_get_reply(user_pi, &reply, err) < 0)
+		goto fail;
+	if (generic_reply_validate(&reply, err, "MODE Z",
+	                           "Cannot set Transfer Mode to Deflate.") < 0) {
+		if (is_reply_not_implemented(&reply))
+			features_learn_lack(user_pi, FEAT_MODE_Z);
+		pipeline_drain(user_pi);
+		goto fail;
+	}
+	if (pipeline_get_reply(user_pi, &reply, err) < 0)
+		goto fail;
+	// The server may keep a level of its own.
+	if (reply.first != POS_COM)
+		debug("[WARNING] OPTS MODE Z LEVEL failed: %s\n",
+		      reply.short_reply);
+	mode_z_free(user_pi->mode_z);
+	user_pi->mode_z = mode_z;
+	// Which replaces block mode.
+	data_drop_kept(user_pi);
+	mode_b_free(user_pi->mode_b);
+	user_pi->mode_b = NULL;
+	return 0;
+fail:
+	mode_z_free(mode_z);
+	return -1;
+}
 
+int set_mode_b(struct UserPI *user_pi, bool on, struct ErrMsg *err)
+{
 	struct Reply reply;
-	enum ReplyCode1 *first = &reply.first;
-	if (send_command(user_pi->ctrl.fd, &reply, err, "MLSD %s", path) < 0)
+	if (!on) {
+		if (!user_pi->mode_b)
+			return 0;
+		if (send_command(user_pi, &reply, err, "MODE S") < 0 ||
+		    generic_reply_validate(&reply, err, "MODE S",
+		                           "Cannot go back to Stream mode.") < 0)
+			return -1;
+		data_drop_kept(user_pi);
+		mode_b_free(user_pi->mode_b);
+		user_pi->mode_b = NULL;
+		return 0;
+	}
+	if (user_pi->mode_b)
+		return 0;
+	// FEAT doesn't list MODE B, so it's tried until turned down.
+	if (user_pi->features.lacks & FEAT_MODE_B) {
+		ERR_PRINTF("The server doesn't support MODE B.");
+		ERR_WHERE_PRINTF("MODE B");
+		return -1;
+	}
+	struct ModeB *mode_b = mode_b_new();
+	if (!mode_b) {
+		strerror_r(errno, err->msg, ERR_MSG_MAX_LEN);
+		ERR_WHERE();
 		return -1;
+	}
+	if (send_command(user_pi, &reply, err, "MODE B") < 0)
+		goto fail;
+	if (generic_reply_validate(&reply, err, "MODE B",
+	                           "Cannot set Transfer Mode to Block.") < 0) {
+		if (is_reply_not_implemented(&reply))
+			features_learn_lack(user_pi, FEAT_MODE_B);
+		goto fail;
+	}
+	// Which replaces MODE Z.
+	mode_z_free(user_pi->mode_z);
+	user_pi->mode_z = NULL;
+	user_pi->mode_b = mode_b;
+	return 0;
+fail:
+	mode_b_free(mode_b);
+	return -1;
+}
 
-	*format = FORMAT_MLSD;
-	if (*first != POS_PRE) {
+/// Count \a n bytes received, or an error if negative.
+static void data_received(struct UserPI *user_pi, ssize_t n)
+{
+	struct Metrics *metrics = &user_pi->metrics;
+	trace_event(TRACE_DATA_RECV, user_pi->data.fd, n < 0 ? -errno : n,
+	            NULL, 0);
+	if (n < 0) {
+		metrics_add(metrics, METRIC_ERRORS, 1);
+		return;
+	}
+	metrics_add(metrics, METRIC_BYTES_RECEIVED, n);
+	if (n && metrics->first_byte_from_ns) {
+		metrics_observe(metrics, METRIC_FIRST_BYTE,
+		                metrics->first_byte_from_ns);
+		metrics->first_byte_from_ns = 0;
+	}
+}
+
+/// Wait for the first byte, for the metrics, before a receive that only
+/// returns once everything has come.
+static void data_wait_first_byte(struct UserPI *user_pi)
+{
+	struct Metrics *metrics = &user_pi->metrics;
+	if (!metrics->first_byte_from_ns)
+		return;
+	struct pollfd pfd = { .fd = user_pi->data.fd, .events = POLLIN };
+	if (poll(&pfd, 1, -1) == 1 && pfd.revents & POLLIN)
+		metrics_observe(metrics, METRIC_FIRST_BYTE,
+		                metrics->first_byte_from_ns);
+	metrics->first_byte_from_ns = 0;
+}
+
+ssize_t data_recv(struct UserPI *user_pi, char *buf, size_t size)
+{
+	ssize_t n;
+	if (user_pi->mode_z)
+		n = mode_z_recv(user_pi->mode_z, buf, size);
+	else if (user_pi->mode_b)
+		n = mode_b_recv(user_pi->mode_b, buf, size);
+	else
+		n = try_recv(user_pi->data.fd, buf, size);
+	data_received(user_pi, n);
+	return n;
+}
+
+/// Like recv_all(), undoing the transfer mode.
+static ssize_t data_recv_all(struct UserPI *user_pi, char **data)
+{
+	if (!user_pi->mode_z && !user_pi->mode_b) {
+		data_wait_first_byte(user_pi);
+		ssize_t n = recv_all(user_pi->data.fd, data);
+		data_received(user_pi, n);
+		return n;
+	}
+	size_t len = 0;
+	size_t capacity = 0;
+	char *buf = NULL;
+	for (;;) {
+		if (capacity - len < LINE_MAX_LEN) {
+			capacity = capacity ? capacity * 2 : 4 * LINE_MAX_LEN;
+			char *new_buf = realloc(buf, capacity);
+			if (!new_buf) {
+				free(buf);
+				return -1;
+			}
+			buf = new_buf;
+		}
+		// Leave room for the '\0'.
+		ssize_t n = data_recv(user_pi, buf + len, capacity - len - 1);
+		if (n < 0) {
+			free(buf);
+			return -1;
+		}
+		if (n == 0) {
+			buf[len] = '\0';
+			*data = buf;
+			return len;
+		}
+		len += n;
+	}
+}
+
+/// Queue EPSV or PASV for the next transfer, behind the command of this one.
+/**
+ *  The server only gets to it once the transfer is over, and answers
+ *  right after the final reply to the transfer command.
+ */
+static int prefetch_push(struct UserPI *user_pi, struct ErrMsg *err)
+{
+	struct DataPrefetch *prefetch = &user_pi->prefetch;
+	// In block mode, the connection stays open for the next transfer,
+	// and EPSV or PASV would have the server close it.
+	if (!prefetch->enabled || user_pi->mode_b)
+		return 0;
+	prefetch->epsv = features_use(&user_pi->features, FEAT_EPSV);
+	if (pipeline_push(user_pi, err, prefetch->epsv ? "EPSV" : "PASV") < 0)
+		return -1;
+	prefetch->pending = true;
+	return 0;
+}
+
+/// Read the reply to prefetch_push(), if any, and start connecting to the
+/// endpoint it gives.
+static void prefetch_open(struct UserPI *user_pi)
+{
+	struct DataPrefetch *prefetch = &user_pi->prefetch;
+	if (!prefetch->pending)
+		return;
+	prefetch->pending = false;
+	struct ErrMsg err;
+	struct Reply reply;
+	char name[3 * 4 + 3 + 1];
+	char service[7];
+	if (pipeline_get_reply(user_pi, &reply, &err) < 0 ||
+	    enter_passive_mode(user_pi, &reply, prefetch->epsv, name, service,
+	                       &err) < 0 ||
+	    open_data_connection_ahead(user_pi, name, service, &err) < 0)
+		debug("[WARNING] Cannot open a data connection ahead: %s\n",
+		      err.msg);
+}
+
+/// Read the final reply to the transfer command \a cmd.
+/**
+ *  When prefetching, the data connection of the next transfer is on its
+ *  way by the time this returns.
+ *  \return -1 on error.
+ */
+static int transfer_finish(struct UserPI *user_pi, struct ErrMsg *err,
+                           const char *cmd)
+{
+	if (get_reply_and_validate(user_pi, err, cmd, "Failed to complete.") <
+	    0) {
+		if (user_pi->prefetch.pending)
+			pipeline_drain(user_pi);
+		return -1;
+	}
+	prefetch_open(user_pi);
+	return 0;
+}
+
+/// Open a data connection and start a transfer command on it.
+/**
+ *  The command is sent before connecting, so that it travels while the TCP
+ *  handshake is in progress. A non-zero \a offset is sent as REST in the
+ *  same batch. In block mode, the connection left open by the last transfer
+ *  is used instead if there's one, and \a offset is a restart marker.
+ *  \return -1 on error, otherwise \a reply holds the first reply to the
+ *  command.
+ */
+static int start_transfer(struct UserPI *user_pi, struct Reply *reply,
+                          off_t offset, struct ErrMsg *err, const char *fmt,
+                          ...)
+{
+	char name_data[3 * 4 + 3 + 1];
+	char service_data[7];
+	if (offset && !user_pi->mode_b &&
+	    require_feature(user_pi, FEAT_REST_STREAM, "REST STREAM", err) < 0)
+		return -1;
+	bool kept = data_take_kept(user_pi);
+	bool ahead = !kept && prefetch_take(user_pi);
+	if (!kept && !ahead &&
+	    set_transfer_parameters(user_pi, name_data, service_data, err) < 0)
+		return -1;
+
+	if (offset &&
+	    pipeline_push(user_pi, err, "REST %lld", (long long)offset) < 0)
+		return -1;
+	va_list args;
+	va_start(args, fmt);
+	int ret = pipeline_vpush(user_pi, err, fmt, args);
+	va_end(args);
+	if (ret < 0 || prefetch_push(user_pi, err) < 0 ||
+	    pipeline_flush(user_pi, err) < 0)
+		return -1;
+
+	int connected = 0;
+	if (ahead)
+		connected = wait_data_connection(user_pi, err);
+	else if (!kept)
+		connected = open_data_connection(user_pi, name_data,
+		                                 service_data, err);
+	// With a prefetch, a server turning the command down goes on to the
+	// next EPSV or PASV at once, and drops the connection. Its reply tells
+	// more then.
+	if (connected < 0 && !user_pi->prefetch.pending) {
+		pipeline_drain(user_pi);
+		return -1;
+	}
+	if (connected == 0 && user_pi->mode_z)
+		mode_z_start(user_pi->mode_z, user_pi->data.fd);
+	if (offset) {
+		if (pipeline_get_reply(user_pi, reply, err) < 0)
+			return -1;
+		if (reply->first != POS_INT) {
+			if (is_reply_not_implemented(reply))
+				features_learn_lack(user_pi, FEAT_REST_STREAM);
+			ERR_PRINTF_REPLY(reply->short_reply,
+			                 "Cannot restart at %lld.",
+			                 (long long)offset);
+			ERR_WHERE_PRINTF("REST");
+			data_close(user_pi);
+			pipeline_drain(user_pi);
+			return -1;
+		}
+	}
+	if (pipeline_get_reply(user_pi, reply, err) < 0)
+		return -1;
+	// No transfer, the next one can have the connection right away.
+	if (reply->first != POS_PRE) {
+		prefetch_open(user_pi);
+		return 0;
+	}
+	if (connected < 0) {
+		pipeline_drain(user_pi);
+		return -1;
+	}
+	if (user_pi->mode_b)
+		mode_b_start(user_pi->mode_b, user_pi->data.fd);
+	return 0;
+}
+
+/// Start listing \a path with MLSD, or with LIST if the server lacks MLSD or
+/// it fails.
+static int start_listing(struct UserPI *user_pi, char *path,
+                         enum ListFormat *format, struct ErrMsg *err)
+{
+	struct Reply reply;
+	enum ReplyCode1 *first = &reply.first;
+	char mlsd_err[ERR_MSG_MAX_LEN] = "not tried";
+	if (features_use(&user_pi->features, FEAT_MLST)) {
+		if (start_transfer(user_pi, &reply, 0, err, "MLSD %s", path) < 0)
+			return -1;
+		*format = FORMAT_MLSD;
+		if (*first == POS_PRE)
+			return 0;
 		ERR_PRINTF_REPLY(reply.short_reply,
 		                 "Expected a Positive Preliminary Reply.");
-		*format = FORMAT_LIST;
-		char mlsd_err[ERR_MSG_MAX_LEN];
-		strncpy(err->msg, mlsd_err, ERR_MSG_MAX_LEN);
+		strncpy(mlsd_err, err->msg, ERR_MSG_MAX_LEN);
+		if (is_reply_not_implemented(&reply))
+			features_learn_lack(user_pi, FEAT_MLST);
 		debug("[WARNING] Fall back to LIST.\n");
-		if (send_command(user_pi->ctrl.fd, &reply, err, "LIST %s",
-		                 path) < 0)
+		if (user_pi->prefetch.enabled && !user_pi->mode_b) {
+			// The server now listens for the one opened ahead.
+			close(user_pi->data.fd);
+			if (start_transfer(user_pi, &reply, 0, err, "LIST %s",
+			                   path) < 0)
+				return -1;
+		} else if (send_command(user_pi, &reply, err, "LIST %s",
+		                        path) < 0) {
 			return -1;
-		if (*first != POS_PRE) {
-			ERR_PRINTF_REPLY(
-				reply.short_reply,
-				"Failed to retreive directory listing even using LIST. \n(MLSD: %s)",
-				mlsd_err);
-			goto fail;
 		}
+	} else {
+		if (start_transfer(user_pi, &reply, 0, err, "LIST %s", path) < 0)
+			return -1;
 	}
+	*format = FORMAT_LIST;
+	if (*first != POS_PRE) {
+		ERR_PRINTF_REPLY(
+			reply.short_reply,
+			"Failed to retreive directory listing even using LIST. \n(MLSD: %s)",
+			mlsd_err);
+		data_end(user_pi);
+		ERR_WHERE();
+		return -1;
+	}
+	return 0;
+}
 
-	ssize_t len = recv_all(user_pi->data.fd, list) < 0;
-	debug("[D begin]\n%s[D end]\n", *list);
+ssize_t list_directory(struct UserPI *user_pi, char *path, char **list,
+                       enum ListFormat *format, struct ErrMsg *err)
+{
+	if (start_listing(user_pi, path, format, err) < 0)
+		return -1;
+
+	ssize_t len = data_recv_all(user_pi, list);
+	data_end(user_pi);
 	if (len < 0) {
 		strerror_r(errno, err->msg, ERR_MSG_MAX_LEN);
-		goto fail;
+		ERR_WHERE();
+		pipeline_drain(user_pi);
+		return -1;
 	}
+	debug("[D begin]\n%s[D end]\n", *list);
 
-	if (get_reply_and_validate(user_pi, err, "MLSD",
-	                           "Failed to complete.") < 0)
+	if (transfer_finish(user_pi, err, "MLSD") < 0)
 		return -1;
 	return len;
-fail:
+}
+
+#define LIST_BUF_LEN (64 * 1024)
+
+/// Call \a on_fact for each complete line in \a buf.
+/**
+ *  The names are put in \a arena.
+ *  \return the number of bytes consumed, or -1 if \a on_fact said stop.
+ */
+static ssize_t foreach_line(char *buf, size_t len,
+                            ParseLineListArenaFunc parse,
+                            struct ListArena *arena, FactFunc on_fact,
+                            void *ctx, ssize_t *n_facts)
+{
+	char *line = buf;
+	char *lf;
+	while ((lf = memchr(line, '\n', buf + len - line))) {
+		bool ignore;
+		const char *end;
+		struct Fact fact = { 0 };
+		if (parse(line, &ignore, &end, &fact, arena) < 0) {
+			debug("[WARNING] Cannot parse: %.*s\n", (int)(lf - line),
+			      line);
+		} else if (!ignore) {
+			if (on_fact(ctx, &fact) < 0)
+				return -1;
+			(*n_facts)++;
+		}
+		line = lf + 1;
+	}
+	return line - buf;
+}
+
+/// Parse the listing of \a path into \a arena as it arrives.
+/**
+ *  With \a keep unset, \a arena is reset after each buffer of entries.
+ *  \return the number of entries, or -1 on error.
+ */
+static ssize_t foreach_listing(struct UserPI *user_pi, char *path,
+                               struct ListArena *arena, bool keep,
+                               FactFunc on_fact, void *ctx,
+                               struct ErrMsg *err)
+{
+	enum ListFormat format;
+	if (start_listing(user_pi, path, &format, err) < 0)
+		return -1;
+	ParseLineListArenaFunc parse = format == FORMAT_MLSD ?
+	                                       parse_line_mlsd_arena :
+	                                       parse_line_list_gnu_arena;
+
+	ssize_t n_facts = 0;
+	size_t len = 0;
+	char *buf = malloc(LIST_BUF_LEN);
+	if (!buf) {
+		ERR_PRINTF("Out of memory.");
+		goto abort;
+	}
+	for (;;) {
+		// Leave room to terminate a last line that lacks its "\n".
+		ssize_t n = data_recv(user_pi, buf + len, LIST_BUF_LEN - 2 - len);
+		if (n < 0) {
+			strerror_r(errno, err->msg, ERR_MSG_MAX_LEN);
+			goto abort;
+		}
+		if (n == 0 && len)
+			buf[len++] = '\n';
+		len += n;
+		// The parsers stop at '\0' as well as '\n'.
+		buf[len] = '\0';
+		ssize_t consumed = foreach_line(buf, len, parse, arena, on_fact,
+		                                ctx, &n_facts);
+		if (consumed < 0) {
+			ERR_PRINTF("Stopped by the callback.");
+			goto abort;
+		}
+		if (!keep)
+			list_arena_reset(arena);
+		if (n == 0)
+			break;
+		if (consumed == 0 && len == LIST_BUF_LEN - 2) {
+			ERR_PRINTF("A line of the listing is too long.");
+			goto abort;
+		}
+		len -= consumed;
+		memmove(buf, buf + consumed, len);
+	}
+	free(buf);
+	data_end(user_pi);
+	if (transfer_finish(user_pi, err,
+	                    format == FORMAT_MLSD ? "MLSD" : "LIST") < 0)
+		return -1;
+	return n_facts;
+abort:
+	free(buf);
 	ERR_WHERE();
+	struct ErrMsg abort_err;
+	download_abort(user_pi, &abort_err);
 	return -1;
 }
 
-int download_init(struct UserPI *user_pi, char *path, struct ErrMsg *err)
+ssize_t list_directory_foreach(struct UserPI *user_pi, char *path,
+                               FactFunc on_fact, void *ctx,
+                               struct ErrMsg *err)
+{
+	struct ListArena *arena = list_arena_new();
+	if (!arena) {
+		ERR_PRINTF("Out of memory.");
+		ERR_WHERE();
+		return -1;
+	}
+	ssize_t n = foreach_listing(user_pi, path, arena, false, on_fact, ctx,
+	                            err);
+	list_arena_free(arena);
+	return n;
+}
+
+struct FactArray {
+	struct ListArena *arena;
+	struct Fact *facts;
+	size_t len;
+	size_t capacity;
+};
+
+static int append_fact(void *ctx, const struct Fact *fact)
+{
+	struct FactArray *array = ctx;
+	if (array->len == array->capacity) {
+		// The old array stays in the arena, at most doubling its use.
+		size_t capacity = array->capacity ? array->capacity * 2 : 64;
+		struct Fact *facts = list_arena_alloc(
+			array->arena, capacity * sizeof(struct Fact));
+		if (!facts)
+			return -1;
+		if (array->len)
+			memcpy(facts, array->facts,
+			       array->len * sizeof(struct Fact));
+		array->facts = facts;
+		array->capacity = capacity;
+	}
+	array->facts[array->len++] = *fact;
+	return 0;
+}
+
+ssize_t list_directory_facts(struct UserPI *user_pi, char *path,
+                             struct ListArena *arena, struct Fact **facts,
+                             struct ErrMsg *err)
 {
-	if (create_data_connection(user_pi, err))
+	struct ListCache *cache = user_pi->list_cache;
+	struct ListCacheMiss miss;
+	if (cache) {
+		ssize_t cached = list_cache_lookup(cache, user_pi, path, arena,
+		                                   facts, &miss);
+		if (cached >= 0)
+			return cached;
+	}
+	struct FactArray array = { .arena = arena };
+	ssize_t n = foreach_listing(user_pi, path, arena, true, append_fact,
+	                            &array, err);
+	if (n < 0)
 		return -1;
+	*facts = array.facts;
+	if (cache)
+		list_cache_store(cache, user_pi, path, &miss, array.facts, n);
+	return n;
+}
+
+int download_init(struct UserPI *user_pi, char *path, struct ErrMsg *err)
+{
+	return download_init_at(user_pi, path, 0, err);
+}
 
+int download_init_at(struct UserPI *user_pi, char *path, off_t offset,
+                     struct ErrMsg *err)
+{
 	struct Reply reply;
-	enum ReplyCode1 *first = &reply.first;
-	if (send_command(user_pi->ctrl.fd, &reply, err, "RETR %s", path) < 0)
+	if (start_transfer(user_pi, &reply, offset, err, "RETR %s", path) < 0)
 		return -1;
 	if (reply.first != POS_PRE) {
 		ERR_PRINTF_REPLY(reply.short_reply,
 		                 "Cannot initiate transfer.");
 		ERR_WHERE()
+		data_end(user_pi);
 		return -1;
 	}
 	return 0;
@@ -503,17 +1308,14 @@ int download_init(struct UserPI *user_pi, char *path, struct ErrMsg *err)
 ssize_t download_chunk(struct UserPI *user_pi, char *data, size_t size,
                        struct ErrMsg *err)
 {
-	ssize_t received = try_recv(user_pi->data.fd, data, size);
+	ssize_t received = data_recv(user_pi, data, size);
 	if (received < 0) {
 		strerror_r(errno, err->msg, ERR_MSG_MAX_LEN);
 		goto fail;
 	}
 	bool ended = received == 0;
-	if (ended) {
-		if (get_reply_and_validate(user_pi, err, "RETR",
-		                           "Failed to complete.") < 0)
-			return -1;
-	}
+	if (ended && download_finish(user_pi, err) < 0)
+		return -1;
 	debug("[INFO] Received %d.\n", received);
 	return received;
 fail:
@@ -521,10 +1323,409 @@ fail:
 	return -1;
 }
 
-void user_pi_quit(struct UserPI *user_pi)
+int download_finish(struct UserPI *user_pi, struct ErrMsg *err)
+{
+	data_end(user_pi);
+	return transfer_finish(user_pi, err, "RETR");
+}
+
+int download_abort(struct UserPI *user_pi, struct ErrMsg *err)
+{
+	// Closing the data connection makes the server give up the transfer.
+	// It then answers RETR with either 426, or 226 if everything had
+	// already been sent, so there's no need for ABOR and its ambiguous
+	// extra reply.
+	data_close(user_pi);
+	struct Reply reply;
+	if (pipeline_get_reply(user_pi, &reply, err) < 0)
+		return -1;
+	prefetch_open(user_pi);
+	if (reply.first == POS_COM || reply.first == NEG_TRAN_COM)
+		return 0;
+	ERR_PRINTF_REPLY(reply.short_reply, "Cannot abort the transfer.");
+	ERR_WHERE();
+	return -1;
+}
+
+off_t get_file_size(struct UserPI *user_pi, char *path, struct ErrMsg *err)
+{
+	struct Reply reply;
+	if (require_feature(user_pi, FEAT_SIZE, "SIZE", err) < 0)
+		return -1;
+	if (send_command(user_pi, &reply, err, "SIZE %s", path) < 0)
+		return -1;
+	if (!is_reply_eq(&reply, (unsigned int[]){ 2, 1, 3 })) {
+		if (is_reply_not_implemented(&reply))
+			features_learn_lack(user_pi, FEAT_SIZE);
+		ERR_PRINTF_REPLY(reply.short_reply, "Cannot get the size.");
+		goto fail;
+	}
+	char *end;
+	long long size = strtoll(reply.short_reply + 4, &end, 10);
+	if (end == reply.short_reply + 4 || size < 0) {
+		ERR_PRINTF("Cannot parse the reply: %s", reply.short_reply);
+		goto fail;
+	}
+	return size;
+fail:
+	ERR_WHERE();
+	return -1;
+}
+
+int get_modification_time(struct UserPI *user_pi, char *path, time_t *mtime,
+                          struct ErrMsg *err)
 {
 	struct Reply reply;
+	if (require_feature(user_pi, FEAT_MDTM, "MDTM", err) < 0)
+		return -1;
+	if (send_command(user_pi, &reply, err, "MDTM %s", path) < 0)
+		return -1;
+	if (!is_reply_eq(&reply, (unsigned int[]){ 2, 1, 3 })) {
+		if (is_reply_not_implemented(&reply))
+			features_learn_lack(user_pi, FEAT_MDTM);
+		ERR_PRINTF_REPLY(reply.short_reply,
+		                 "Cannot get the modification time.");
+		goto fail;
+	}
+	const char *begin = reply.short_reply + 4;
+	if (parse_time_val(begin, begin + strcspn(begin, " \r\n"), mtime) <
+	    0) {
+		ERR_PRINTF("Cannot parse the reply: %s", reply.short_reply);
+		goto fail;
+	}
+	return 0;
+fail:
+	ERR_WHERE();
+	return -1;
+}
+
+int delete_file(struct UserPI *user_pi, char *path, struct ErrMsg *err)
+{
+	struct Reply reply;
+	if (send_command(user_pi, &reply, err, "DELE %s", path) < 0)
+		return -1;
+	if (generic_reply_validate(&reply, err, "DELE",
+	                           "Cannot delete the file.") < 0)
+		return -1;
+	list_cache_invalidate(user_pi, path);
+	return 0;
+}
+
+int rename_file(struct UserPI *user_pi, char *from, char *to,
+                struct ErrMsg *err)
+{
+	struct Reply reply;
+	// RNTO is turned down on its own if RNFR fails.
+	if (pipeline_push(user_pi, err, "RNFR %s", from) < 0 ||
+	    pipeline_push(user_pi, err, "RNTO %s", to) < 0 ||
+	    pipeline_get_reply(user_pi, &reply, err) < 0)
+		return -1;
+	if (reply.first != POS_INT) {
+		ERR_PRINTF_REPLY(reply.short_reply, "Cannot rename %s.", from);
+		ERR_WHERE_PRINTF("RNFR");
+		pipeline_drain(user_pi);
+		return -1;
+	}
+	if (get_reply_and_validate(user_pi, err, "RNTO",
+	                           "Cannot rename the file.") < 0)
+		return -1;
+	list_cache_invalidate(user_pi, from);
+	list_cache_invalidate(user_pi, to);
+	return 0;
+}
+
+bool session_is_alive(struct UserPI *user_pi)
+{
+	struct Reply reply;
+	struct ErrMsg err;
+	if (send_command(user_pi, &reply, &err, "NOOP") < 0)
+		return false;
+	return reply.first == POS_COM;
+}
+
+int upload_init(struct UserPI *user_pi, char *path, bool append,
+                struct ErrMsg *err)
+{
+	struct Reply reply;
+	if (start_transfer(user_pi, &reply, 0, err,
+	                   append ? "APPE %s" : "STOR %s", path) < 0)
+		return -1;
+	// The file may be there even if the transfer fails.
+	list_cache_invalidate(user_pi, path);
+	if (reply.first != POS_PRE) {
+		ERR_PRINTF_REPLY(reply.short_reply,
+		                 "Cannot initiate transfer.");
+		ERR_WHERE();
+		data_end(user_pi);
+		return -1;
+	}
+	zerocopy_init(&user_pi->upload, user_pi->data.fd);
+	return 0;
+}
+
+/// Give up an upload after the data connection failed.
+static void upload_fail(struct UserPI *user_pi)
+{
+	// Reset the connection, or the server would take what it got for
+	// the whole file. That also lets go of the chunks sent without a
+	// copy.
+	struct linger linger = { .l_onoff = 1, .l_linger = 0 };
+	setsockopt(user_pi->data.fd, SOL_SOCKET, SO_LINGER, &linger,
+	           sizeof(linger));
+	data_close(user_pi);
+	pipeline_drain(user_pi);
+}
+
+ssize_t upload_chunk(struct UserPI *user_pi, const char *data, size_t size,
+                     struct ErrMsg *err)
+{
+	ssize_t sent;
+	if (user_pi->mode_z)
+		sent = mode_z_send(user_pi->mode_z, data, size);
+	else if (user_pi->mode_b)
+		sent = mode_b_send(user_pi->mode_b, data, size);
+	else
+		sent = zerocopy_sendn(&user_pi->upload, data, size);
+	if (sent < 0) {
+		strerror_r(errno, err->msg, ERR_MSG_MAX_LEN);
+		ERR_WHERE();
+		trace_event(TRACE_DATA_SEND, user_pi->data.fd, -errno, NULL, 0);
+		metrics_add(&user_pi->metrics, METRIC_ERRORS, 1);
+		upload_fail(user_pi);
+		return -1;
+	}
+	trace_event(TRACE_DATA_SEND, user_pi->data.fd, size, NULL, 0);
+	metrics_add(&user_pi->metrics, METRIC_BYTES_SENT, size);
+	debug("[INFO] Sent %zu.\n", size);
+	return size;
+}
+
+int upload_finish(struct UserPI *user_pi, struct ErrMsg *err)
+{
+	// The chunks sent without a copy are let go once the server got them.
+	if ((user_pi->mode_z && mode_z_send_end(user_pi->mode_z) < 0) ||
+	    (user_pi->mode_b && mode_b_send_end(user_pi->mode_b) < 0) ||
+	    zerocopy_flush(&user_pi->upload) < 0) {
+		strerror_r(errno, err->msg, ERR_MSG_MAX_LEN);
+		ERR_WHERE();
+		upload_fail(user_pi);
+		return -1;
+	}
+	// The end of the data connection is the end of the file, unless it
+	// was the EOF block.
+	data_end(user_pi);
+	return transfer_finish(user_pi, err, "STOR");
+}
+
+off_t upload_from_fd(struct UserPI *user_pi, char *path, int in_fd,
+                     bool append, struct ErrMsg *err)
+{
+	if (upload_init(user_pi, path, append, err) < 0)
+		return -1;
+	ssize_t total;
+	if (user_pi->mode_z)
+		total = mode_z_send_from_fd(user_pi->mode_z, in_fd);
+	else if (user_pi->mode_b)
+		total = mode_b_send_from_fd(user_pi->mode_b, in_fd);
+	else
+		total = send_from_fd(user_pi->data.fd, in_fd);
+	if (total < 0) {
+		strerror_r(errno, err->msg, ERR_MSG_MAX_LEN);
+		ERR_WHERE();
+		trace_event(TRACE_DATA_SEND, user_pi->data.fd, -errno, NULL, 0);
+		metrics_add(&user_pi->metrics, METRIC_ERRORS, 1);
+		upload_fail(user_pi);
+		return -1;
+	}
+	trace_event(TRACE_DATA_SEND, user_pi->data.fd, total, NULL, 0);
+	metrics_add(&user_pi->metrics, METRIC_BYTES_SENT, total);
+	if (upload_finish(user_pi, err) < 0)
+		return -1;
+	debug("[INFO] Sent %zd from fd %d.\n", total, in_fd);
+	return total;
+}
+
+ssize_t download_to_fd(struct UserPI *user_pi, char *path, int out_fd,
+                       struct ErrMsg *err)
+{
+	if (download_init(user_pi, path, err) < 0)
+		return -1;
+	data_wait_first_byte(user_pi);
+	ssize_t total;
+	if (user_pi->mode_z)
+		total = mode_z_recv_to_fd(user_pi->mode_z, out_fd);
+	else if (user_pi->mode_b)
+		total = mode_b_recv_to_fd(user_pi->mode_b, out_fd);
+	else
+		total = recv_to_fd(user_pi->data.fd, out_fd);
+	data_received(user_pi, total);
+	data_end(user_pi);
+	if (total < 0) {
+		strerror_r(errno, err->msg, ERR_MSG_MAX_LEN);
+		ERR_WHERE();
+		pipeline_drain(user_pi);
+		return -1;
+	}
+	if (transfer_finish(user_pi, err, "RETR") < 0)
+		return -1;
+	debug("[INFO] Received %zd into fd %d.\n", total, out_fd);
+	return total;
+}
+
+/// Give up the STOR of a server-to-server copy whose source failed.
+static void fxp_abort(struct UserPI *dest)
+{
+	// There's no data connection of ours to close, only ABOR is left.
 	struct ErrMsg err;
-	send_command(user_pi->ctrl.fd, &reply, &err, "QUIT");
+	if (pipeline_push(dest, &err, "ABOR") == 0)
+		pipeline_drain(dest);
+}
+
+int fxp_copy(struct UserPI *src, char *src_path, struct UserPI *dest,
+             char *dest_path, struct ErrMsg *err)
+{
+	struct Reply reply;
+	if (src == dest || !src->mode_z != !dest->mode_z ||
+	    !src->mode_b != !dest->mode_b) {
+		ERR_PRINTF("Both sessions must differ and be in the same mode.");
+		ERR_WHERE();
+		return -1;
+	}
+	struct sockaddr_storage peer;
+	socklen_t peer_len = sizeof(peer);
+	if (getpeername(src->ctrl.fd, (struct sockaddr *)&peer, &peer_len) <
+	    0) {
+		strerror_r(errno, err->msg, ERR_MSG_MAX_LEN);
+		ERR_WHERE();
+		return -1;
+	}
+	// Their data connections are about to be set up otherwise.
+	prefetch_drop(src);
+	prefetch_drop(dest);
+	data_drop_kept(src);
+	data_drop_kept(dest);
+	// PASV only has room for IPv4, EPSV is needed for the others.
+	bool ipv6 = peer.ss_family == AF_INET6 &&
+	            !IN6_IS_ADDR_V4MAPPED(
+			    &((struct sockaddr_in6 *)&peer)->sin6_addr);
+	if (ipv6 && require_feature(src, FEAT_EPSV, "EPSV", err) < 0)
+		return -1;
+
+	const char *cmd = "TYPE I";
+	if (pipeline_push(src, err, cmd) < 0 ||
+	    pipeline_push(src, err, ipv6 ? "EPSV" : "PASV") < 0)
+		return -1;
+	if (pipeline_get_reply(src, &reply, err) < 0)
+		return -1;
+	if (generic_reply_validate(
+		    &reply, err, cmd,
+		    "Cannot set Representation Type to \"Image\".") < 0) {
+		pipeline_drain(src);
+		return -1;
+	}
+	char name[INET6_ADDRSTRLEN];
+	char service[7];
+	if (pipeline_get_reply(src, &reply, err) < 0)
+		return -1;
+	// Falling back to PASV would give an IPv4 address for EPRT.
+	if (ipv6 && !is_reply_eq(&reply, (unsigned int[]){ 2, 2, 9 })) {
+		if (is_reply_not_implemented(&reply))
+			features_learn_lack(src, FEAT_EPSV);
+		ERR_PRINTF_REPLY(reply.short_reply,
+		                 "Cannot enter extended passive mode.");
+		ERR_WHERE_PRINTF("EPSV");
+		return -1;
+	}
+	if (enter_passive_mode(src, &reply, ipv6, name, service, err) < 0)
+		return -1;
+	// EPSV leaves the host out, it's the one we're connected to.
+	if (!*name)
+		inet_ntop(AF_INET6, &((struct sockaddr_in6 *)&peer)->sin6_addr,
+		          name, sizeof(name));
+
+	// The destination connects to the source, and gets the file from it.
+	int port = atoi(service);
+	if (pipeline_push(dest, err, cmd) < 0)
+		return -1;
+	if (ipv6) {
+		if (pipeline_push(dest, err, "EPRT |2|%s|%d|", name, port) < 0)
+			return -1;
+	} else {
+		for (char *c = name; *c; c++)
+			if (*c == '.')
+				*c = ',';
+		if (pipeline_push(dest, err, "PORT %s,%d,%d", name, port >> 8,
+		                  port & 0xff) < 0)
+			return -1;
+	}
+	if (pipeline_push(dest, err, "STOR %s", dest_path) < 0)
+		return -1;
+	if (pipeline_get_reply(dest, &reply, err) < 0)
+		return -1;
+	if (generic_reply_validate(
+		    &reply, err, cmd,
+		    "Cannot set Representation Type to \"Image\".") < 0) {
+		pipeline_drain(dest);
+		return -1;
+	}
+	if (pipeline_get_reply(dest, &reply, err) < 0)
+		return -1;
+	if (generic_reply_validate(&reply, err, ipv6 ? "EPRT" : "PORT",
+	                           "Cannot set the data address.") < 0) {
+		pipeline_drain(dest);
+		return -1;
+	}
+	if (pipeline_get_reply(dest, &reply, err) < 0)
+		return -1;
+	if (reply.first != POS_PRE) {
+		ERR_PRINTF_REPLY(reply.short_reply,
+		                 "Cannot initiate transfer.");
+		ERR_WHERE_PRINTF("STOR");
+		return -1;
+	}
+	list_cache_invalidate(dest, dest_path);
+
+	if (send_command(src, &reply, err, "RETR %s", src_path) < 0) {
+		fxp_abort(dest);
+		return -1;
+	}
+	if (reply.first != POS_PRE) {
+		ERR_PRINTF_REPLY(reply.short_reply,
+		                 "Cannot initiate transfer.");
+		ERR_WHERE_PRINTF("RETR");
+		fxp_abort(dest);
+		return -1;
+	}
+	// The source ends the data connection, then the destination sees it.
+	if (get_reply_and_validate(src, err, "RETR", "Failed to complete.") <
+	    0) {
+		pipeline_drain(dest);
+		return -1;
+	}
+	if (get_reply_and_validate(dest, err, "STOR", "Failed to complete.") <
+	    0)
+		return -1;
+	debug("[INFO] Copied %s to %s between servers.\n", src_path,
+	      dest_path);
+	return 0;
+}
+
+void user_pi_release(struct UserPI *user_pi)
+{
+	prefetch_drop(user_pi);
+	data_drop_kept(user_pi);
 	shutdown(user_pi->ctrl.fd, SHUT_RDWR);
+	close(user_pi->ctrl.fd);
+	mode_z_free(user_pi->mode_z);
+	user_pi->mode_z = NULL;
+	mode_b_free(user_pi->mode_b);
+	user_pi->mode_b = NULL;
+}
+
+void user_pi_quit(struct UserPI *user_pi)
+{
+	struct Reply reply;
+	struct ErrMsg err;
+	send_command(user_pi, &reply, &err, "QUIT");
+	user_pi_release(user_pi);
 }
@@ -1,6 +1,8 @@
 #ifndef _CMD_H
 #define _CMD_H
 
+#include <stdint.h>
+
 #include "telnet.h"
 
 enum ReplyCode1 {
@@ -34,6 +36,26 @@ struct Reply {
 	size_t short_reply_len;
 };
 
+enum GetReplyResult {
+	GET_REPLY_NETWORK_ERROR, // errno
+	GET_REPLY_TELNET_ERROR, // errno
+	GET_REPLY_CLOSED,
+	GET_REPLY_SYNTAX_ERROR,
+	GET_REPLY_OK
+};
+
+/// Parse one received \a line into \a reply.
+/**
+ *  `reply->len` must be 0 before the first line of a reply. \a done is set
+ *  once the last line of the reply has been fed.
+ */
+enum GetReplyResult reply_feed_line(int fd, const unsigned char *line,
+                                    size_t len, struct Reply *reply,
+                                    bool *done);
+
+void get_reply_result_to_err_msg(enum GetReplyResult result, char *err_msg,
+                                 size_t len);
+
 struct LoginInfo {
 	const char *username;
 	const char *password;
@@ -45,36 +67,275 @@ enum ListFormat { FORMAT_LIST, FORMAT_MLSD };
 struct UserPI;
 struct ErrMsg;
 struct RecvBuf;
+struct Fact;
+struct ListArena;
 
 #define CMD_BUF_LEN 64
 
+#define PIPELINE_BUF_LEN 512
+#define PIPELINE_MAX_TIMED 16
+
+/// A command queued or in flight, for the metrics.
+struct PendingCommand {
+	uint64_t sent_ns; /// 0 while queued.
+	uint8_t command; /// enum MetricCommand
+	bool answered; /// Its first reply has been read.
+};
+
+/// Commands queued on the control connection.
+/**
+ *  Queued commands are sent together by one sendn(). Their replies are
+ *  read back in order from `user_pi->rb`.
+ *
+ *  The oldest PIPELINE_MAX_TIMED commands are timed, in a ring starting at
+ *  \a timed_begin. The ones pushed while it's full are only counted in
+ *  \a n_untimed, and so are any pushed after them until the pipeline
+ *  empties, to keep the replies matched with their commands.
+ */
+struct Pipeline {
+	char buf[PIPELINE_BUF_LEN];
+	size_t len;
+	unsigned int n_queued; /// Commands in \a buf, not sent yet.
+	unsigned int n_pending; /// Commands sent, final reply not read yet.
+	struct PendingCommand timed[PIPELINE_MAX_TIMED];
+	unsigned int timed_begin;
+	unsigned int n_timed;
+	unsigned int n_untimed;
+};
+
+void pipeline_init(struct Pipeline *pipeline);
+
+/// Queue a command without sending it.
+/**
+ *  The queue is flushed first if the command doesn't fit.
+ *  \return -1 on error.
+ */
+int pipeline_push(struct UserPI *user_pi, struct ErrMsg *err,
+                  const char *fmt, ...);
+
+/// Send every queued command at once.
+/**
+ *  \return -1 on error.
+ */
+int pipeline_flush(struct UserPI *user_pi, struct ErrMsg *err);
+
+/// Get the next reply of the oldest command in flight.
+/**
+ *  Flushes the queue first. A Positive Preliminary Reply leaves the command
+ *  in flight, since its completion reply is still to come.
+ *  \return -1 on error.
+ */
+int pipeline_get_reply(struct UserPI *user_pi, struct Reply *reply,
+                       struct ErrMsg *err);
+
+/// Read and discard the replies of every command still in flight.
+void pipeline_drain(struct UserPI *user_pi);
+
 /// Send a command and get its primary reply.
 /**
  *  /return -1 on error.
  */
-int send_command(int fd, struct Reply *reply, struct ErrMsg *err,
-                 const char *fmt, ...);
+int send_command(struct UserPI *user_pi, struct Reply *reply,
+                 struct ErrMsg *err, const char *fmt, ...);
 
 /// Wait for the server to send a bunch of welcome messages and let us send command.
 /**
  *  /return -1 on error.
  */
-int get_connection_greetings(int fd, struct RecvBuf *rb, struct ErrMsg *err);
+int get_connection_greetings(struct UserPI *user_pi, struct ErrMsg *err);
+
+int perform_login_sequence(const struct LoginInfo *l, struct UserPI *user_pi,
+                           struct ErrMsg *err);
+
+/// Enter passive mode and set the representation type.
+/**
+ *  TYPE and EPSV are pipelined, so this costs a single round trip unless
+ *  the server makes us fall back to PASV.
+ */
+int set_transfer_parameters(struct UserPI *user_pi, char *name, char *service,
+                            struct ErrMsg *err);
 
-int perform_login_sequence(const struct LoginInfo *l, int fd,
-                           struct RecvBuf *rb, struct ErrMsg *err);
+/// Compress the transfers with MODE Z at \a level, from 1 to 9.
+/**
+ *  The level is asked of the server with OPTS MODE Z LEVEL, which it may
+ *  ignore, and used for uploads. Level 0 goes back to MODE S. Clones of
+ *  \a user_pi get the same mode.
+ *  \return -1 on error, or if the library was built without zlib.
+ */
+int set_mode_z(struct UserPI *user_pi, int level, struct ErrMsg *err);
 
-int set_transfer_parameters(int fd, struct RecvBuf *rb, char *name,
-                            char *service, struct ErrMsg *err);
+/// Send the transfers in blocks with MODE B, or go back to MODE S.
+/**
+ *  A transfer then ends with an EOF block rather than by closing the data
+ *  connection, which stays open for the next one: back-to-back transfers
+ *  skip EPSV and the TCP handshake, and data prefetching isn't needed.
+ *  REST takes the restart markers of the server instead of offsets, see
+ *  download_resumable(), so download_segmented() and remote_file_open(),
+ *  which need byte offsets, refuse sessions in MODE B. MODE B replaces
+ *  MODE Z and the other way around.
+ *  Clones of \a user_pi get the same mode.
+ *  \return -1 on error.
+ */
+int set_mode_b(struct UserPI *user_pi, bool on, struct ErrMsg *err);
+
+/// Open the data connection of the next transfer as each one ends.
+/**
+ *  EPSV or PASV is pipelined behind every transfer command, for the server
+ *  to answer once the transfer is over. The next transfer command then goes
+ *  out at once, over the connection opened meanwhile, which saves it a
+ *  round trip. The server has to leave commands sent during a transfer for
+ *  after it, as RFC 959 has it. Clones of \a user_pi prefetch too.
+ */
+void set_data_prefetch(struct UserPI *user_pi, bool on);
+
+/// Receive from the data connection, undoing the transfer mode.
+/**
+ *  \return 0 at the end of the data, or -1 on error and sets errno.
+ */
+ssize_t data_recv(struct UserPI *user_pi, char *buf, size_t size);
 
 ssize_t list_directory(struct UserPI *user_pi, char *path, char **list,
                        enum ListFormat *format, struct ErrMsg *err);
 
+/// Called with every entry of a listing.
+/**
+ *  \a fact, including its name, is only valid during the call.
+ *  \return -1 to stop the listing.
+ */
+typedef int (*FactFunc)(void *ctx, const struct Fact *fact);
+
+/// List \a path, calling \a on_fact for each entry as it arrives.
+/**
+ *  Entries are parsed while the rest of the listing is still on the way,
+ *  and memory use is bounded by a fixed buffer, however long the listing.
+ *  Lines that can't be parsed are skipped.
+ *  \return the number of entries, or -1 on error.
+ */
+ssize_t list_directory_foreach(struct UserPI *user_pi, char *path,
+                               FactFunc on_fact, void *ctx,
+                               struct ErrMsg *err);
+
+/// List \a path into an array of entries.
+/**
+ *  The array and the names are allocated from \a arena, and are released
+ *  with it instead of one by one.
+ *  \return the number of entries, or -1 on error.
+ */
+ssize_t list_directory_facts(struct UserPI *user_pi, char *path,
+                             struct ListArena *arena, struct Fact **facts,
+                             struct ErrMsg *err);
+
 int download_init(struct UserPI *user_pi, char *path, struct ErrMsg *err);
 
+/// Like download_init(), but start at byte \a offset of the file.
+/**
+ *  In MODE B, \a offset is a restart marker of the server instead.
+ */
+int download_init_at(struct UserPI *user_pi, char *path, off_t offset,
+                     struct ErrMsg *err);
+
 ssize_t download_chunk(struct UserPI *user_pi, char *data, size_t size,
                        struct ErrMsg *err);
 
+/// Download \a path straight into \a out_fd, a file or a pipe.
+/**
+ *  The data is moved with splice() where possible, so it's never copied
+ *  through user space.
+ *  \return the number of bytes downloaded, or -1 on error.
+ */
+ssize_t download_to_fd(struct UserPI *user_pi, char *path, int out_fd,
+                       struct ErrMsg *err);
+
+/// Start uploading to \a path, with APPE if \a append, or STOR.
+/**
+ *  \return -1 on error.
+ */
+int upload_init(struct UserPI *user_pi, char *path, bool append,
+                struct ErrMsg *err);
+
+/// Send the next \a size bytes of the file.
+/**
+ *  Big chunks are sent with MSG_ZEROCOPY where the kernel has it, so
+ *  \a data must stay as it is until upload_finish() returns, or the upload
+ *  failed. On error, the upload is given up.
+ *  \return \a size, or -1 on error.
+ */
+ssize_t upload_chunk(struct UserPI *user_pi, const char *data, size_t size,
+                     struct ErrMsg *err);
+
+/// End the upload and wait for the server to confirm it.
+/**
+ *  \return -1 on error.
+ */
+int upload_finish(struct UserPI *user_pi, struct ErrMsg *err);
+
+/// Upload what's left of \a in_fd, from its current offset, to \a path.
+/**
+ *  Files are sent with sendfile(), so the data never enters user space.
+ *  \return the number of bytes uploaded, or -1 on error.
+ */
+off_t upload_from_fd(struct UserPI *user_pi, char *path, int in_fd,
+                     bool append, struct ErrMsg *err);
+
+/// Copy \a src_path from the server of \a src to \a dest_path on the server
+/// of \a dest, with the data going straight from one to the other.
+/**
+ *  The source is put in passive mode, and its address is given to the
+ *  destination with PORT, or EPRT over IPv6. Both servers have to allow
+ *  it, and the sessions have to be in the same transfer mode.
+ *  \return -1 on error.
+ */
+int fxp_copy(struct UserPI *src, char *src_path, struct UserPI *dest,
+             char *dest_path, struct ErrMsg *err);
+
+/// Complete a download whose data connection has reached its end.
+/**
+ *  download_chunk() does this itself when it gets to the end.
+ *  \return -1 on error.
+ */
+int download_finish(struct UserPI *user_pi, struct ErrMsg *err);
+
+/// Stop a download before the end of the file.
+/**
+ *  \return -1 on error.
+ */
+int download_abort(struct UserPI *user_pi, struct ErrMsg *err);
+
+/// Get the size of \a path with SIZE.
+/**
+ *  \return -1 on error.
+ */
+off_t get_file_size(struct UserPI *user_pi, char *path, struct ErrMsg *err);
+
+/// Get the modification time of \a path with MDTM.
+/**
+ *  \return -1 on error.
+ */
+int get_modification_time(struct UserPI *user_pi, char *path, time_t *mtime,
+                          struct ErrMsg *err);
+
+/// Delete the file \a path with DELE.
+/**
+ *  \return -1 on error.
+ */
+int delete_file(struct UserPI *user_pi, char *path, struct ErrMsg *err);
+
+/// Rename \a from to \a to with RNFR and RNTO, sent together.
+/**
+ *  \return -1 on error.
+ */
+int rename_file(struct UserPI *user_pi, char *from, char *to,
+                struct ErrMsg *err);
+
+/// Whether the control connection still answers NOOP.
+bool session_is_alive(struct UserPI *user_pi);
+
+/// Close the connections of \a user_pi and free what it owns, without QUIT.
+/**
+ *  For a session whose control connection is lost. The address stays.
+ */
+void user_pi_release(struct UserPI *user_pi);
+
 void user_pi_quit(struct UserPI *user_pi);
 
 #endif
@@ -0,0 +1,488 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "debug.h"
+
+#include "cmd.h"
+#include "crawl.h"
+#include "error.h"
+#include "ftp.h"
+#include "parse.h"
+
+#define DEQUE_MIN_CAPACITY 64
+
+/// Directories waiting to be listed by a worker.
+/**
+ *  The owner pushes and pops at the tail, so it goes depth first and its
+ *  deque stays short. Thieves take from the head, where the directories
+ *  closest to the root, and so the biggest subtrees, are.
+ */
+struct Deque {
+	pthread_mutex_t lock;
+	char **dirs; /// A ring, \a capacity is a power of 2.
+	size_t capacity;
+	size_t head;
+	size_t tail;
+};
+
+struct Crawl;
+
+struct CrawlWorker {
+	struct Crawl *crawl;
+	unsigned int id;
+	struct Deque deque;
+	unsigned int seed; /// For picking victims.
+
+	pthread_t thread;
+	bool started;
+	struct UserPI *user_pi;
+	struct UserPI clone;
+	bool cloned;
+	ssize_t n_facts;
+	struct ErrMsg err;
+};
+
+struct Crawl {
+	struct CrawlWorker *workers;
+	unsigned int n_workers;
+	CrawlFunc on_fact;
+	void *ctx;
+
+	/// Directories in some deque.
+	size_t n_queued;
+	/// Directories in some deque or being listed. The crawl is over at 0.
+	size_t n_pending;
+	bool stop;
+
+	/// Idle workers wait here for directories, or the end of the crawl.
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	unsigned int n_sleeping;
+
+	/// Set by the first worker that failed the crawl.
+	bool failed;
+	struct ErrMsg err;
+
+	/// Directories that couldn't be listed, and why the first couldn't.
+	size_t n_unlisted;
+	struct ErrMsg unlisted_err;
+};
+
+static void deque_init(struct Deque *deque)
+{
+	pthread_mutex_init(&deque->lock, NULL);
+	deque->dirs = NULL;
+	deque->capacity = 0;
+	deque->head = 0;
+	deque->tail = 0;
+}
+
+static void deque_destroy(struct Deque *deque)
+{
+	for (size_t i = deque->head; i != deque->tail; i++)
+		free(deque->dirs[i & (deque->capacity - 1)]);
+	free(deque->dirs);
+	pthread_mutex_destroy(&deque->lock);
+}
+
+/// Called with the lock held.
+/**
+ *  \return -1 on failure.
+ */
+static int deque_grow(struct Deque *deque)
+{
+	size_t capacity = deque->capacity ? deque->capacity * 2 :
+	                                    DEQUE_MIN_CAPACITY;
+	char **dirs = malloc(capacity * sizeof(*dirs));
+	if (!dirs)
+		return -1;
+	size_t len = deque->tail - deque->head;
+	for (size_t i = 0; i < len; i++)
+		dirs[i] = deque->dirs[(deque->head + i) & (deque->capacity - 1)];
+	free(deque->dirs);
+	deque->dirs = dirs;
+	deque->capacity = capacity;
+	deque->head = 0;
+	deque->tail = len;
+	return 0;
+}
+
+/**
+ *  \return -1 on failure.
+ */
+static int deque_push(struct Deque *deque, char *dir)
+{
+	pthread_mutex_lock(&deque->lock);
+	if (deque->tail - deque->head == deque->capacity &&
+	    deque_grow(deque) < 0) {
+		pthread_mutex_unlock(&deque->lock);
+		return -1;
+	}
+	deque->dirs[deque->tail++ & (deque->capacity - 1)] = dir;
+	pthread_mutex_unlock(&deque->lock);
+	return 0;
+}
+
+/// Take the newest directory, by the owner.
+static char *deque_pop(struct Deque *deque)
+{
+	char *dir = NULL;
+	pthread_mutex_lock(&deque->lock);
+	if (deque->tail != deque->head)
+		dir = deque->dirs[--deque->tail & (deque->capacity - 1)];
+	pthread_mutex_unlock(&deque->lock);
+	return dir;
+}
+
+/// Take the oldest directory, by a thief.
+static char *deque_steal(struct Deque *deque)
+{
+	char *dir = NULL;
+	// Don't queue up behind the owner or another thief.
+	if (pthread_mutex_trylock(&deque->lock))
+		return NULL;
+	if (deque->tail != deque->head)
+		dir = deque->dirs[deque->head++ & (deque->capacity - 1)];
+	pthread_mutex_unlock(&deque->lock);
+	return dir;
+}
+
+static void wake_all(struct Crawl *crawl)
+{
+	pthread_mutex_lock(&crawl->lock);
+	pthread_cond_broadcast(&crawl->cond);
+	pthread_mutex_unlock(&crawl->lock);
+}
+
+/// Fail the crawl with \a err, unless it has failed already.
+static void crawl_fail(struct Crawl *crawl, const struct ErrMsg *err)
+{
+	pthread_mutex_lock(&crawl->lock);
+	if (!crawl->failed) {
+		crawl->failed = true;
+		crawl->err = *err;
+	}
+	__atomic_store_n(&crawl->stop, true, __ATOMIC_SEQ_CST);
+	pthread_cond_broadcast(&crawl->cond);
+	pthread_mutex_unlock(&crawl->lock);
+}
+
+/**
+ *  \return -1 on failure, and frees \a dir.
+ */
+static int crawl_push(struct CrawlWorker *worker, char *dir)
+{
+	struct Crawl *crawl = worker->crawl;
+	// Counted first, so that the crawl can't look over meanwhile.
+	__atomic_add_fetch(&crawl->n_pending, 1, __ATOMIC_SEQ_CST);
+	if (deque_push(&worker->deque, dir) < 0) {
+		free(dir);
+		__atomic_sub_fetch(&crawl->n_pending, 1, __ATOMIC_SEQ_CST);
+		return -1;
+	}
+	__atomic_add_fetch(&crawl->n_queued, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&crawl->n_sleeping, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock(&crawl->lock);
+		pthread_cond_signal(&crawl->cond);
+		pthread_mutex_unlock(&crawl->lock);
+	}
+	return 0;
+}
+
+/// Put back \a dir, taken by a worker whose session died.
+/**
+ *  It stays pending, for the other workers to steal.
+ *  \return -1 on failure, and frees \a dir.
+ */
+static int crawl_requeue(struct CrawlWorker *worker, char *dir)
+{
+	struct Crawl *crawl = worker->crawl;
+	if (deque_push(&worker->deque, dir) < 0) {
+		free(dir);
+		return -1;
+	}
+	__atomic_add_fetch(&crawl->n_queued, 1, __ATOMIC_SEQ_CST);
+	wake_all(crawl);
+	return 0;
+}
+
+/// Count \a dir as not listed, keeping \a err if it's the first.
+static void crawl_unlisted(struct Crawl *crawl, const char *dir,
+                           const struct ErrMsg *err)
+{
+	pthread_mutex_lock(&crawl->lock);
+	if (!crawl->n_unlisted++) {
+		struct ErrMsg *first = &crawl->unlisted_err;
+		snprintf(first->msg, ERR_MSG_MAX_LEN,
+		         "Cannot list %.100s: %.140s", dir, err->msg);
+		snprintf(first->where, sizeof(first->where), "%s",
+		         err->where);
+	}
+	pthread_mutex_unlock(&crawl->lock);
+}
+
+/// A directory taken from a deque has been listed, or given up on.
+static void crawl_done(struct Crawl *crawl)
+{
+	if (__atomic_sub_fetch(&crawl->n_pending, 1, __ATOMIC_SEQ_CST) == 0)
+		wake_all(crawl);
+}
+
+static char *take_own(struct CrawlWorker *worker)
+{
+	char *dir = deque_pop(&worker->deque);
+	if (dir)
+		__atomic_sub_fetch(&worker->crawl->n_queued, 1,
+		                   __ATOMIC_SEQ_CST);
+	return dir;
+}
+
+static char *steal(struct CrawlWorker *worker)
+{
+	struct Crawl *crawl = worker->crawl;
+	unsigned int n = crawl->n_workers;
+	unsigned int first = rand_r(&worker->seed) % n;
+	for (unsigned int i = 0; i < n; i++) {
+		struct CrawlWorker *victim = &crawl->workers[(first + i) % n];
+		if (victim == worker)
+			continue;
+		char *dir = deque_steal(&victim->deque);
+		if (dir) {
+			__atomic_sub_fetch(&crawl->n_queued, 1,
+			                   __ATOMIC_SEQ_CST);
+			return dir;
+		}
+	}
+	return NULL;
+}
+
+/// Get the next directory to list, waiting for one if there's none yet.
+/**
+ *  \return NULL once the crawl is over.
+ */
+static char *next_dir(struct CrawlWorker *worker)
+{
+	struct Crawl *crawl = worker->crawl;
+	for (;;) {
+		if (__atomic_load_n(&crawl->stop, __ATOMIC_SEQ_CST))
+			return NULL;
+		char *dir = take_own(worker);
+		if (!dir)
+			dir = steal(worker);
+		if (dir)
+			return dir;
+
+		pthread_mutex_lock(&crawl->lock);
+		__atomic_add_fetch(&crawl->n_sleeping, 1, __ATOMIC_SEQ_CST);
+		while (!__atomic_load_n(&crawl->n_queued, __ATOMIC_SEQ_CST) &&
+		       __atomic_load_n(&crawl->n_pending, __ATOMIC_SEQ_CST) &&
+		       !__atomic_load_n(&crawl->stop, __ATOMIC_SEQ_CST))
+			pthread_cond_wait(&crawl->cond, &crawl->lock);
+		__atomic_sub_fetch(&crawl->n_sleeping, 1, __ATOMIC_SEQ_CST);
+		bool over = !__atomic_load_n(&crawl->n_pending,
+		                             __ATOMIC_SEQ_CST);
+		pthread_mutex_unlock(&crawl->lock);
+		if (over)
+			return NULL;
+	}
+}
+
+/// Join \a dir and \a name into a new path.
+static char *join_path(const char *dir, const char *name)
+{
+	size_t dir_len = strlen(dir);
+	bool slash = dir_len && dir[dir_len - 1] != '/';
+	size_t len = dir_len + slash + strlen(name);
+	char *path = malloc(len + 1);
+	if (!path)
+		return NULL;
+	snprintf(path, len + 1, "%s%s%s", dir, slash ? "/" : "", name);
+	return path;
+}
+
+struct ListContext {
+	struct CrawlWorker *worker;
+	const char *dir;
+	bool stopped; /// By the callback, rather than the listing failing.
+};
+
+static int on_crawl_fact(void *ctx, const struct Fact *fact)
+{
+	struct ListContext *list = ctx;
+	struct CrawlWorker *worker = list->worker;
+	struct Crawl *crawl = worker->crawl;
+	if (!strcmp(fact->name, ".") || !strcmp(fact->name, ".."))
+		return 0;
+	if (crawl->on_fact(crawl->ctx, list->dir, fact) < 0 ||
+	    __atomic_load_n(&crawl->stop, __ATOMIC_SEQ_CST)) {
+		list->stopped = true;
+		return -1;
+	}
+	worker->n_facts++;
+	if (!fact->is_dir)
+		return 0;
+	char *path = join_path(list->dir, fact->name);
+	if (!path || crawl_push(worker, path) < 0) {
+		struct ErrMsg *err = &worker->err;
+		ERR_PRINTF("Out of memory.");
+		ERR_WHERE();
+		crawl_fail(crawl, err);
+		list->stopped = true;
+		return -1;
+	}
+	return 0;
+}
+
+static void *crawl_main(void *arg)
+{
+	struct CrawlWorker *worker = arg;
+	struct Crawl *crawl = worker->crawl;
+	struct ErrMsg *err = &worker->err;
+	debug("[INFO] Crawler %u started.\n", worker->id);
+	char *dir;
+	while ((dir = next_dir(worker))) {
+		struct ListContext list = { .worker = worker, .dir = dir };
+		ssize_t n = list_directory_foreach(worker->user_pi, dir,
+		                                   on_crawl_fact, &list, err);
+		if (n < 0 && !list.stopped) {
+			debug("[WARNING] Cannot list %s: [%s] %s\n", dir,
+			      err->where, err->msg);
+			if (!session_is_alive(worker->user_pi)) {
+				// The others can still steal it, and what's
+				// left here.
+				if (crawl_requeue(worker, dir) < 0) {
+					ERR_PRINTF("Out of memory.");
+					ERR_WHERE();
+					crawl_fail(crawl, err);
+					crawl_done(crawl);
+				}
+				return NULL;
+			}
+			crawl_unlisted(crawl, dir, err);
+		}
+		if (list.stopped) {
+			__atomic_store_n(&crawl->stop, true, __ATOMIC_SEQ_CST);
+			wake_all(crawl);
+		}
+		free(dir);
+		crawl_done(crawl);
+	}
+	return NULL;
+}
+
+ssize_t crawl(struct UserPI *user_pi, const struct LoginInfo *login,
+              const char *root, unsigned int n_sessions, CrawlFunc on_fact,
+              void *ctx, struct ErrMsg *err)
+{
+	if (n_sessions < 1)
+		n_sessions = 1;
+	struct Crawl crawl = {
+		.n_workers = n_sessions,
+		.on_fact = on_fact,
+		.ctx = ctx,
+	};
+	crawl.workers = calloc(n_sessions, sizeof(*crawl.workers));
+	char *root_copy = strdup(root);
+	if (!crawl.workers || !root_copy) {
+		free(crawl.workers);
+		free(root_copy);
+		ERR_PRINTF("Out of memory.");
+		ERR_WHERE();
+		return -1;
+	}
+	pthread_mutex_init(&crawl.lock, NULL);
+	pthread_cond_init(&crawl.cond, NULL);
+
+	for (unsigned int i = 0; i < n_sessions; i++) {
+		struct CrawlWorker *worker = &crawl.workers[i];
+		worker->crawl = &crawl;
+		worker->id = i;
+		worker->seed = i;
+		deque_init(&worker->deque);
+		// Worker 0 runs on user_pi itself, the others on clones, all
+		// made before any worker starts changing user_pi.
+		worker->user_pi = user_pi;
+		if (!i)
+			continue;
+		if (user_pi_clone(user_pi, &worker->clone, login, err) < 0) {
+			debug("[WARNING] Cannot clone a session: [%s] %s\n",
+			      err->where, err->msg);
+			continue;
+		}
+		worker->cloned = true;
+		worker->user_pi = &worker->clone;
+	}
+
+	ssize_t ret = -1;
+	if (crawl_push(&crawl.workers[0], root_copy) < 0) {
+		ERR_PRINTF("Out of memory.");
+		ERR_WHERE();
+		goto clean_up;
+	}
+	for (unsigned int i = 0; i < n_sessions; i++) {
+		struct CrawlWorker *worker = &crawl.workers[i];
+		if (i && !worker->cloned)
+			continue;
+		int create_ret = pthread_create(&worker->thread, NULL,
+		                                crawl_main, worker);
+		if (create_ret) {
+			if (i == 0) {
+				strerror_r(create_ret, err->msg,
+				           ERR_MSG_MAX_LEN);
+				ERR_WHERE();
+				goto clean_up;
+			}
+			debug("[WARNING] Cannot start a worker: %s\n",
+			      strerror(create_ret));
+			continue;
+		}
+		worker->started = true;
+	}
+
+	ret = 0;
+	for (unsigned int i = 0; i < n_sessions; i++) {
+		struct CrawlWorker *worker = &crawl.workers[i];
+		if (!worker->started)
+			continue;
+		pthread_join(worker->thread, NULL);
+		ret += worker->n_facts;
+	}
+	if (crawl.failed) {
+		*err = crawl.err;
+		ret = -1;
+	} else if (crawl.stop) {
+		ERR_PRINTF("Stopped by the callback.");
+		ERR_WHERE();
+		ret = -1;
+	} else if (crawl.n_pending) {
+		// Every session died with directories left.
+		ERR_PRINTF("Lost every session, %zu directories left.",
+		           crawl.n_pending);
+		ERR_WHERE();
+		ret = -1;
+	} else if (crawl.n_unlisted) {
+		*err = crawl.unlisted_err;
+		if (crawl.n_unlisted > 1) {
+			size_t len = strlen(err->msg);
+			snprintf(err->msg + len, ERR_MSG_MAX_LEN - len,
+			         " (%zu directories not listed)",
+			         crawl.n_unlisted);
+		}
+		ret = -1;
+	}
+clean_up:
+	for (unsigned int i = 0; i < n_sessions; i++) {
+		struct CrawlWorker *worker = &crawl.workers[i];
+		if (worker->cloned)
+			user_pi_quit(&worker->clone);
+		deque_destroy(&worker->deque);
+	}
+	free(crawl.workers);
+	pthread_cond_destroy(&crawl.cond);
+	pthread_mutex_destroy(&crawl.lock);
+	return ret;
+}
@@ -0,0 +1,34 @@
+#ifndef _CRAWL_H
+#define _CRAWL_H
+
+#include <sys/types.h>
+
+struct UserPI;
+struct LoginInfo;
+struct ErrMsg;
+struct Fact;
+
+/// Called with every entry found by crawl(), in the directory \a dir.
+/**
+ *  It's called from several threads at once, and \a fact, including its
+ *  name, is only valid during the call.
+ *  \return -1 to stop the crawl.
+ */
+typedef int (*CrawlFunc)(void *ctx, const char *dir, const struct Fact *fact);
+
+/// Walk the tree under \a root over \a n_sessions sessions at once.
+/**
+ *  \a user_pi lists directories too, alongside sessions cloned from it
+ *  with \a login. Every session has its own deque of directories to list;
+ *  it takes the newest one of its own, and when it runs out, it steals
+ *  the oldest one of another session. Symbolic links aren't followed.
+ *  Directories that can't be listed are skipped, but the crawl then fails
+ *  with the first of them in \a err. Those taken by a session that died
+ *  are left to the others.
+ *  \return the number of entries, or -1 on error.
+ */
+ssize_t crawl(struct UserPI *user_pi, const struct LoginInfo *login,
+              const char *root, unsigned int n_sessions, CrawlFunc on_fact,
+              void *ctx, struct ErrMsg *err);
+
+#endif
@@ -0,0 +1,182 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include "debug.h"
+
+#include "cmd.h"
+#include "error.h"
+#include "feat.h"
+#include "ftp.h"
+
+static const struct {
+	const char *name;
+	const char *arg; /// NULL matches any.
+	enum Feature feature;
+} feature_names[] = {
+	{ "EPSV", NULL, FEAT_EPSV },
+	{ "MLST", NULL, FEAT_MLST },
+	{ "REST", "STREAM", FEAT_REST_STREAM },
+	{ "SIZE", NULL, FEAT_SIZE },
+	{ "MDTM", NULL, FEAT_MDTM },
+	{ "MODE", "Z", FEAT_MODE_Z },
+	{ "UTF8", NULL, FEAT_UTF8 },
+};
+
+#define HOST_KEY_LEN 128
+/// The features of one host and service.
+struct CachedFeatures {
+	char key[HOST_KEY_LEN]; /// Empty if unused.
+	time_t since;
+	struct Features features;
+};
+
+static struct CachedFeatures cache[FEATURE_CACHE_LEN];
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+bool features_use(const struct Features *features, enum Feature feature)
+{
+	if (features->lacks & feature)
+		return false;
+	return !features->known || features->has & feature;
+}
+
+static bool is_word(const char *s, size_t len, const char *word)
+{
+	return len == strlen(word) && !strncasecmp(s, word, len);
+}
+
+void features_parse(struct Features *features, const char *reply,
+                    size_t len)
+{
+	// A list cut short by the reply buffer isn't the whole list.
+	*features = (struct Features){ .known = len < MAX_TELNET_BUF_LEN };
+	const char *end = reply + len;
+	for (const char *line = reply; line < end;) {
+		const char *lf = memchr(line, '\n', end - line);
+		const char *line_end = lf ? lf : end;
+		const char *next = lf ? lf + 1 : end;
+		if (line_end > line && line_end[-1] == '\r')
+			line_end--;
+		// Features are the lines indented by a space.
+		if (*line != ' ') {
+			line = next;
+			continue;
+		}
+		const char *name = line + 1;
+		const char *name_end = name;
+		while (name_end < line_end && *name_end != ' ')
+			name_end++;
+		const char *arg = name_end < line_end ? name_end + 1 : line_end;
+		for (size_t i = 0;
+		     i < sizeof(feature_names) / sizeof(*feature_names); i++) {
+			if (!is_word(name, name_end - name,
+			             feature_names[i].name) ||
+			    (feature_names[i].arg &&
+			     !is_word(arg, line_end - arg,
+			              feature_names[i].arg)))
+				continue;
+			features->has |= feature_names[i].feature;
+			if (feature_names[i].feature == FEAT_MLST)
+				snprintf(features->mlst_facts,
+				         FEAT_MLST_FACTS_LEN, "%.*s",
+				         (int)(line_end - arg), arg);
+		}
+		line = next;
+	}
+}
+
+static time_t now_s(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+/// \return false if \a user_pi can't be told from other hosts.
+static bool cache_key(const struct UserPI *user_pi, char key[HOST_KEY_LEN])
+{
+	if (!user_pi->ctrl.name || !user_pi->ctrl.service)
+		return false;
+	int len = snprintf(key, HOST_KEY_LEN, "%s %s", user_pi->ctrl.name,
+	                   user_pi->ctrl.service);
+	return len < HOST_KEY_LEN;
+}
+
+/// Call with cache_lock held.
+static struct CachedFeatures *cache_find(const char *key)
+{
+	for (size_t i = 0; i < FEATURE_CACHE_LEN; i++)
+		if (!strcmp(cache[i].key, key))
+			return &cache[i];
+	return NULL;
+}
+
+static bool cache_get(const char *key, struct Features *features)
+{
+	pthread_mutex_lock(&cache_lock);
+	struct CachedFeatures *entry = cache_find(key);
+	bool fresh = entry && now_s() - entry->since < FEATURE_CACHE_TTL_S;
+	if (fresh)
+		*features = entry->features;
+	pthread_mutex_unlock(&cache_lock);
+	return fresh;
+}
+
+static void cache_put(const char *key, const struct Features *features)
+{
+	pthread_mutex_lock(&cache_lock);
+	struct CachedFeatures *entry = cache_find(key);
+	// Or else an unused one, or else the oldest.
+	for (size_t i = 0; !entry && i < FEATURE_CACHE_LEN; i++)
+		if (!*cache[i].key)
+			entry = &cache[i];
+	if (!entry) {
+		struct CachedFeatures *oldest = &cache[0];
+		for (size_t i = 1; i < FEATURE_CACHE_LEN; i++)
+			if (cache[i].since < oldest->since)
+				oldest = &cache[i];
+		entry = oldest;
+	}
+	strcpy(entry->key, key);
+	entry->since = now_s();
+	entry->features = *features;
+	pthread_mutex_unlock(&cache_lock);
+}
+
+int negotiate_features(struct UserPI *user_pi, struct ErrMsg *err)
+{
+	char key[HOST_KEY_LEN];
+	bool cacheable = cache_key(user_pi, key);
+	if (cacheable && cache_get(key, &user_pi->features))
+		return 0;
+	struct Reply reply;
+	if (send_command(user_pi, &reply, err, "FEAT") < 0)
+		return -1;
+	if (reply.first == POS_COM) {
+		features_parse(&user_pi->features, reply.reply, reply.len);
+	} else {
+		debug("[INFO] No FEAT, every extension will be tried.\n");
+		user_pi->features = (struct Features){ 0 };
+	}
+	if (cacheable)
+		cache_put(key, &user_pi->features);
+	return 0;
+}
+
+void features_learn_lack(struct UserPI *user_pi, enum Feature feature)
+{
+	debug("[INFO] The server turned down feature %#x, not trying again.\n",
+	      feature);
+	user_pi->features.lacks |= feature;
+	char key[HOST_KEY_LEN];
+	if (!cache_key(user_pi, key))
+		return;
+	pthread_mutex_lock(&cache_lock);
+	struct CachedFeatures *entry = cache_find(key);
+	if (entry)
+		entry->features.lacks |= feature;
+	pthread_mutex_unlock(&cache_lock);
+}
@@ -0,0 +1,61 @@
+#ifndef _FEAT_H
+#define _FEAT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+struct UserPI;
+struct ErrMsg;
+
+/// Extensions a session may use, as listed by FEAT.
+enum Feature {
+	FEAT_EPSV = 1 << 0,
+	FEAT_MLST = 1 << 1, /// MLST and MLSD
+	FEAT_REST_STREAM = 1 << 2,
+	FEAT_SIZE = 1 << 3,
+	FEAT_MDTM = 1 << 4,
+	FEAT_MODE_Z = 1 << 5,
+	FEAT_UTF8 = 1 << 6,
+	FEAT_MODE_B = 1 << 7, /// Not listed by FEAT, only ever lacked.
+};
+
+#define FEAT_MLST_FACTS_LEN 64
+struct Features {
+	/// The server answered FEAT, so \a has is the whole list.
+	bool known;
+	unsigned int has; /// enum Feature
+	/// Turned down by the server, learned from its replies.
+	unsigned int lacks; /// enum Feature
+	/// As listed after MLST, the ones sent by default end with '*'.
+	char mlst_facts[FEAT_MLST_FACTS_LEN];
+};
+
+/// Features of a host are shared by its sessions for this long.
+#define FEATURE_CACHE_TTL_S 600
+#define FEATURE_CACHE_LEN 32
+
+/// Whether \a feature is worth a try.
+/**
+ *  Without a FEAT list, everything is tried until the server turns it down.
+ */
+bool features_use(const struct Features *features, enum Feature feature);
+
+/// Fill \a features from the text of a FEAT reply.
+void features_parse(struct Features *features, const char *reply,
+                    size_t len);
+
+/// Get the features of the server of \a user_pi, once logged in.
+/**
+ *  They are taken from sessions to the same host and service when possible,
+ *  or else asked with FEAT. A server without FEAT isn't an error.
+ *  \return -1 on error.
+ */
+int negotiate_features(struct UserPI *user_pi, struct ErrMsg *err);
+
+/// Remember that the server of \a user_pi turned down \a feature.
+/**
+ *  Other sessions to the same host won't try it either.
+ */
+void features_learn_lack(struct UserPI *user_pi, enum Feature feature);
+
+#endif
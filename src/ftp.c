@@ -2,6 +2,8 @@
 #include <errno.h>
 #include <netdb.h>
 #include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -12,6 +14,7 @@
 #include "cmd.h"
 #include "error.h"
 #include "ftp.h"
+#include "mode_z.h"
 
 static int getaddrinfo_ftp(const char *name, const char *service,
                            struct addrinfo **ret)
@@ -22,66 +25,158 @@ static int getaddrinfo_ftp(const char *name, const char *service,
 	return getaddrinfo(name, service, &hint, ret);
 }
 
-/// Iterate \a addr_info and try to connect.
-/**
- *  \return a socket descriptor on success, 0 on faliure.
- */
-static int addrinfo_connect(struct addrinfo *addr_info)
-{
-	for (; addr_info; addr_info = addr_info->ai_next) {
-		int s = socket(addr_info->ai_family, addr_info->ai_socktype,
-		               addr_info->ai_protocol);
-		if (s < 0)
-			continue;
-		if (connect(s, addr_info->ai_addr, addr_info->ai_addrlen) == 0)
-			return s;
-		close(s);
-	}
-	return 0;
-}
-
-static int try_connect(const char *name, const char *service, int *fd,
-                       struct addrinfo **ai, struct ErrMsg *err)
+static int try_connect(const char *name, const char *service,
+                       unsigned int timeout_ms, int *fd, struct addrinfo **ai,
+                       struct ErrMsg *err)
 {
 	int n;
 	if ((n = getaddrinfo_ftp(name, service, ai)) != 0) {
 		ERR_PRINTF("getaddrinfo: %s", gai_strerror(n));
 		return -1;
 	}
-	*fd = addrinfo_connect(*ai);
-	if (*fd <= 0) {
-		ERR_PRINTF("Cannot connect to %s, %s", name, service);
+	*fd = connect_happy(*ai, timeout_ms);
+	if (*fd < 0) {
+		ERR_PRINTF("Cannot connect to %s, %s: %s", name, service,
+		           strerror(errno));
 		freeaddrinfo(*ai);
 		return -1;
 	}
 	return 0;
 }
 
-static int data_connection_connect(struct Connection *data_con,
-                                   const char *ctrl_name, const char *name,
-                                   const char *service, struct ErrMsg *err)
+/// Where to connect the data connection to \a name, \a service.
+static int data_connection_addr(struct UserPI *user_pi, const char *name,
+                                const char *service,
+                                struct sockaddr_storage *addr, socklen_t *len,
+                                struct ErrMsg *err)
 {
-	if (!*name)
-		name = ctrl_name;
-	if (try_connect(name, service, &data_con->fd, &data_con->addr_info,
-	                err) < 0) {
+	struct AddrCache *cache = &user_pi->addr_cache;
+	if (!*name) {
+		if (!cache->peer_len) {
+			// The same for every transfer of the session.
+			socklen_t peer_len = sizeof(cache->peer);
+			if (getpeername(user_pi->ctrl.fd,
+			                (struct sockaddr *)&cache->peer,
+			                &peer_len) < 0) {
+				strerror_r(errno, err->msg, ERR_MSG_MAX_LEN);
+				return -1;
+			}
+			cache->peer_len = peer_len;
+		}
+		if (data_sockaddr("", service, &cache->peer, cache->peer_len,
+		                  addr, len) < 0)
+			goto bad_port;
+		return 0;
+	}
+	if (data_sockaddr(name, service, NULL, 0, addr, len) == 0)
+		return 0;
+
+	// Not a numeric address, look it up unless it's the last one.
+	if (!cache->addr_len || strcmp(name, cache->name)) {
+		struct addrinfo *ai;
+		int n;
+		if ((n = getaddrinfo_ftp(name, NULL, &ai)) != 0) {
+			ERR_PRINTF("getaddrinfo: %s", gai_strerror(n));
+			return -1;
+		}
+		memcpy(&cache->addr, ai->ai_addr, ai->ai_addrlen);
+		cache->addr_len = ai->ai_addrlen;
+		freeaddrinfo(ai);
+		snprintf(cache->name, sizeof(cache->name), "%s", name);
+	}
+	// An empty name takes the address as it is, with the port set.
+	if (data_sockaddr("", service, &cache->addr, cache->addr_len, addr,
+	                  len) < 0)
+		goto bad_port;
+	return 0;
+bad_port:
+	ERR_PRINTF("Bad data connection port %s", service);
+	return -1;
+}
+
+int open_data_connection(struct UserPI *user_pi, const char *name,
+                         const char *service, struct ErrMsg *err)
+{
+	struct Connection *data_con = &user_pi->data;
+	struct sockaddr_storage addr;
+	socklen_t len;
+	if (data_connection_addr(user_pi, name, service, &addr, &len, err) <
+	    0) {
+		ERR_WHERE_PRINTF("Data Connection");
+		return -1;
+	}
+	struct addrinfo ai = { .ai_family = addr.ss_family,
+		               .ai_socktype = SOCK_STREAM,
+		               .ai_addrlen = len,
+		               .ai_addr = (struct sockaddr *)&addr };
+	data_con->addr_info = NULL;
+	uint64_t begin_ns = metrics_now_ns();
+	data_con->fd = connect_happy(&ai, user_pi->connect_timeout_ms);
+	if (data_con->fd < 0) {
+		metrics_add(&user_pi->metrics, METRIC_ERRORS, 1);
+		ERR_PRINTF("Cannot connect to %s, %s: %s",
+		           *name ? name : user_pi->ctrl.name, service,
+		           strerror(errno));
 		ERR_WHERE_PRINTF("Data Connection");
 		return -1;
 	}
-	freeaddrinfo(data_con->addr_info);
+	metrics_observe(&user_pi->metrics, METRIC_DATA_CONNECT, begin_ns);
 	debug("[INFO] Data connection established.\n");
 	return 0;
 }
 
+int open_data_connection_ahead(struct UserPI *user_pi, const char *name,
+                               const char *service, struct ErrMsg *err)
+{
+	struct sockaddr_storage addr;
+	socklen_t len;
+	if (data_connection_addr(user_pi, name, service, &addr, &len, err) <
+	    0) {
+		ERR_WHERE_PRINTF("Data Connection");
+		return -1;
+	}
+	struct addrinfo ai = { .ai_family = addr.ss_family,
+		               .ai_socktype = SOCK_STREAM,
+		               .ai_addrlen = len,
+		               .ai_addr = (struct sockaddr *)&addr };
+	int fd = connect_nowait(&ai);
+	if (fd < 0) {
+		metrics_add(&user_pi->metrics, METRIC_ERRORS, 1);
+		ERR_PRINTF("Cannot connect to %s, %s: %s",
+		           *name ? name : user_pi->ctrl.name, service,
+		           strerror(errno));
+		ERR_WHERE_PRINTF("Data Connection");
+		return -1;
+	}
+	user_pi->prefetch.fd = fd;
+	user_pi->prefetch.since_ns = metrics_now_ns();
+	return 0;
+}
+
+int wait_data_connection(struct UserPI *user_pi, struct ErrMsg *err)
+{
+	struct Connection *data_con = &user_pi->data;
+	uint64_t begin_ns = metrics_now_ns();
+	data_con->fd = connect_wait(data_con->fd, user_pi->connect_timeout_ms);
+	if (data_con->fd < 0) {
+		metrics_add(&user_pi->metrics, METRIC_ERRORS, 1);
+		ERR_PRINTF("Cannot connect ahead to %s: %s", user_pi->ctrl.name,
+		           strerror(errno));
+		ERR_WHERE_PRINTF("Data Connection");
+		return -1;
+	}
+	// Only what the transfer itself had to wait for.
+	metrics_observe(&user_pi->metrics, METRIC_DATA_CONNECT, begin_ns);
+	return 0;
+}
+
 int create_data_connection(struct UserPI *user_pi, struct ErrMsg *err)
 {
 	char name_data[3 * 4 + 3 + 1];
 	char service_data[7];
-	if (set_transfer_parameters(user_pi->ctrl.fd, &user_pi->rb, name_data,
-	                            service_data, err) != 0)
+	if (set_transfer_parameters(user_pi, name_data, service_data, err) != 0)
 		return -1;
-	if (data_connection_connect(&user_pi->data, user_pi->ctrl.name,
-	                            name_data, service_data, err) < 0)
+	if (open_data_connection(user_pi, name_data, service_data, err) < 0)
 		return -1;
 	return 0;
 }
@@ -89,10 +184,21 @@ int create_data_connection(struct UserPI *user_pi, struct ErrMsg *err)
 struct UserPI *user_pi_init(const char *name, const char *service,
                             const struct LoginInfo *login,
                             struct UserPI *user_pi, struct ErrMsg *err)
+{
+	return user_pi_init_timeout(name, service, login,
+	                            DEFAULT_CONNECT_TIMEOUT_MS, user_pi, err);
+}
+
+struct UserPI *user_pi_init_timeout(const char *name, const char *service,
+                                    const struct LoginInfo *login,
+                                    unsigned int connect_timeout_ms,
+                                    struct UserPI *user_pi,
+                                    struct ErrMsg *err)
 {
 	int ctrl_fd;
 	struct addrinfo *ctrl_ai;
-	if (try_connect(name, service, &ctrl_fd, &ctrl_ai, err) < 0) {
+	if (try_connect(name, service, connect_timeout_ms, &ctrl_fd, &ctrl_ai,
+	                err) < 0) {
 		ERR_WHERE_PRINTF("Control Connection");
 		return NULL;
 	}
@@ -101,11 +207,22 @@ struct UserPI *user_pi_init(const char *name, const char *service,
 		                             .name = name,
 		                             .service = service,
 		                             .fd = ctrl_fd };
+	user_pi->connect_timeout_ms = connect_timeout_ms;
 	recv_buf_init(&user_pi->rb);
-	if (get_connection_greetings(user_pi->ctrl.fd, &user_pi->rb, err) != 0)
+	pipeline_init(&user_pi->pipeline);
+	user_pi->addr_cache.peer_len = 0;
+	user_pi->addr_cache.addr_len = 0;
+	user_pi->mode_z = NULL;
+	user_pi->mode_b = NULL;
+	user_pi->metrics = (struct Metrics){ 0 };
+	user_pi->features = (struct Features){ 0 };
+	user_pi->prefetch = (struct DataPrefetch){ .fd = -1 };
+	user_pi->list_cache = NULL;
+	if (get_connection_greetings(user_pi, err) != 0)
+		return NULL;
+	if (perform_login_sequence(login, user_pi, err) != 0)
 		return NULL;
-	if (perform_login_sequence(login, user_pi->ctrl.fd, &user_pi->rb,
-	                           err) != 0)
+	if (negotiate_features(user_pi, err) < 0)
 		return NULL;
 
 	return user_pi;
@@ -116,19 +233,37 @@ int user_pi_clone(const struct UserPI *src, struct UserPI *dest,
                   const struct LoginInfo *login, struct ErrMsg *err)
 {
 	*dest = (struct UserPI){ .ctrl.addr_info = src->ctrl.addr_info,
-		                 .ctrl.name = src->ctrl.name };
-	int fd = addrinfo_connect(dest->ctrl.addr_info);
-	if (fd <= 0) {
-		ERR_PRINTF("Cannot connect to the server.");
+		                 .ctrl.name = src->ctrl.name,
+		                 .ctrl.service = src->ctrl.service,
+		                 .connect_timeout_ms = src->connect_timeout_ms,
+		                 .prefetch.enabled = src->prefetch.enabled,
+		                 .prefetch.fd = -1,
+		                 .list_cache = src->list_cache };
+	int fd = connect_happy(dest->ctrl.addr_info, dest->connect_timeout_ms);
+	if (fd < 0) {
+		ERR_PRINTF("Cannot connect to the server: %s", strerror(errno));
 		ERR_WHERE();
+		return -1;
 	}
 	dest->ctrl.fd = fd;
 	recv_buf_init(&dest->rb);
-	if (get_connection_greetings(dest->ctrl.fd, &dest->rb, err) != 0)
-		return -1;
-	if (perform_login_sequence(login, dest->ctrl.fd, &dest->rb, err) != 0)
-		return -1;
+	pipeline_init(&dest->pipeline);
+	if (get_connection_greetings(dest, err) != 0 ||
+	    perform_login_sequence(login, dest, err) != 0 ||
+	    negotiate_features(dest, err) < 0)
+		goto fail;
+	// In case the shared ones have expired meanwhile.
+	dest->features.lacks |= src->features.lacks;
+	if (src->mode_z &&
+	    set_mode_z(dest, mode_z_level(src->mode_z), err) < 0)
+		goto fail;
+	if (src->mode_b && set_mode_b(dest, true, err) < 0)
+		goto fail;
 	return 0;
+fail:
+	// Callers only quit the clones that worked.
+	user_pi_release(dest);
+	return -1;
 }
 
 void user_pi_drop(struct UserPI *user_pi)
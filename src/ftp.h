@@ -2,8 +2,14 @@
 #define _FTP_H
 
 #include "cmd.h"
+#include "feat.h"
+#include "metrics.h"
 #include "socket_util.h"
 
+struct ListCache;
+struct ModeB;
+struct ModeZ;
+
 struct Connection {
 	const char *name;
 	const char *service;
@@ -11,11 +17,55 @@ struct Connection {
 	int fd;
 };
 
+#define ADDR_CACHE_NAME_LEN 64
+/// Addresses a session connects its data connections to.
+struct AddrCache {
+	/// The host of the control connection, \a peer_len is 0 until known.
+	struct sockaddr_storage peer;
+	socklen_t peer_len;
+	/// The last non-numeric data host that had to be resolved.
+	char name[ADDR_CACHE_NAME_LEN];
+	struct sockaddr_storage addr;
+	socklen_t addr_len;
+};
+
+/// A data connection opened ahead of the next transfer.
+struct DataPrefetch {
+	bool enabled;
+	/// EPSV if \a epsv or else PASV was sent, its reply is still to come.
+	bool pending;
+	bool epsv;
+	/// Maybe still connecting, -1 if there's none.
+	int fd;
+	uint64_t since_ns; /// metrics_now_ns()
+};
+
+/// A server may stop listening for a data connection left unused that long.
+#define DATA_PREFETCH_MAX_IDLE_MS 5000
+
 struct UserPI {
 	struct Connection ctrl;
+	/// Borrowed from the LoginInfo, like the name of the host.
+	const char *username;
 	struct RecvBuf rb;
+	struct Pipeline pipeline;
 
 	struct Connection data;
+	struct AddrCache addr_cache;
+	/// For every connection of the session, 0 means no deadline.
+	unsigned int connect_timeout_ms;
+	/// The upload in progress on the data connection.
+	struct ZeroCopy upload;
+	/// NULL unless in MODE Z.
+	struct ModeZ *mode_z;
+	/// NULL unless in MODE B.
+	struct ModeB *mode_b;
+	struct Metrics metrics;
+	/// What the server supports, or is thought to.
+	struct Features features;
+	struct DataPrefetch prefetch;
+	/// Shared, NULL if none.
+	struct ListCache *list_cache;
 };
 
 struct ErrMsg;
@@ -28,9 +78,45 @@ struct UserPI *user_pi_init(const char *name, const char *service,
                             const struct LoginInfo *login,
                             struct UserPI *user_pi, struct ErrMsg *err);
 
+#define DEFAULT_CONNECT_TIMEOUT_MS 30000
+
+/// Like user_pi_init(), but give up connecting after \a connect_timeout_ms.
+/**
+ *  The deadline applies to each connection of the session, including the
+ *  data connections and those of its clones. 0 means no deadline.
+ */
+struct UserPI *user_pi_init_timeout(const char *name, const char *service,
+                                    const struct LoginInfo *login,
+                                    unsigned int connect_timeout_ms,
+                                    struct UserPI *user_pi,
+                                    struct ErrMsg *err);
+
 int create_data_connection(struct UserPI *user_pi, struct ErrMsg *err);
 
-// addr_info still belongs to \a src
+/// Connect to the passive endpoint \a name, \a service.
+/**
+ *  An empty \a name means the host of the control connection. Numeric
+ *  addresses are used as they are, only other names are resolved, and the
+ *  last one is kept in `user_pi->addr_cache`.
+ */
+int open_data_connection(struct UserPI *user_pi, const char *name,
+                         const char *service, struct ErrMsg *err);
+
+/// Start connecting to \a name, \a service, into `user_pi->prefetch`.
+/**
+ *  Like open_data_connection(), but the connection is only waited for by
+ *  wait_data_connection(), once the transfer command is on its way.
+ */
+int open_data_connection_ahead(struct UserPI *user_pi, const char *name,
+                               const char *service, struct ErrMsg *err);
+
+/// Wait for `user_pi->data`, taken from `user_pi->prefetch`, to connect.
+int wait_data_connection(struct UserPI *user_pi, struct ErrMsg *err);
+
+/// user_pi_quit(), and free what belongs to \a user_pi unlike its clones.
+void user_pi_drop(struct UserPI *user_pi);
+
+// addr_info still belongs to \a src, nothing is left open on failure
 int user_pi_clone(const struct UserPI *src, struct UserPI *dest,
                   const struct LoginInfo *login, struct ErrMsg *err);
 
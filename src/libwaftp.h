@@ -2,15 +2,40 @@
 #ifndef _LIBWAFTP_H
 #define _LIBWAFTP_H
 
+#include <poll.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
 
+#include <sys/socket.h>
 #include <sys/types.h>
 
 #define LINE_MAX_LEN 1024
+#define RECV_BUF_LEN (4 * LINE_MAX_LEN)
 struct RecvBuf {
-	char buf[LINE_MAX_LEN];
-	char *read_ptr;
-	int remain_count;
+	char buf[RECV_BUF_LEN];
+	size_t begin;
+	size_t end;
+};
+
+#define PIPELINE_BUF_LEN 512
+#define PIPELINE_MAX_TIMED 16
+
+struct PendingCommand {
+	uint64_t sent_ns;
+	uint8_t command;
+	bool answered;
+};
+
+struct Pipeline {
+	char buf[PIPELINE_BUF_LEN];
+	size_t len;
+	unsigned int n_queued;
+	unsigned int n_pending;
+	struct PendingCommand timed[PIPELINE_MAX_TIMED];
+	unsigned int timed_begin;
+	unsigned int n_timed;
+	unsigned int n_untimed;
 };
 
 struct Connection {
@@ -20,11 +45,157 @@ struct Connection {
 	int fd;
 };
 
+#define ADDR_CACHE_NAME_LEN 64
+/// Addresses a session connects its data connections to.
+struct AddrCache {
+	/// The host of the control connection, \a peer_len is 0 until known.
+	struct sockaddr_storage peer;
+	socklen_t peer_len;
+	/// The last non-numeric data host that had to be resolved.
+	char name[ADDR_CACHE_NAME_LEN];
+	struct sockaddr_storage addr;
+	socklen_t addr_len;
+};
+
+/// Commands timed separately, the others count as METRIC_CMD_OTHER.
+enum MetricCommand {
+	METRIC_CMD_USER,
+	METRIC_CMD_PASS,
+	METRIC_CMD_TYPE,
+	METRIC_CMD_EPSV,
+	METRIC_CMD_PASV,
+	METRIC_CMD_REST,
+	METRIC_CMD_RETR,
+	METRIC_CMD_STOR,
+	METRIC_CMD_APPE,
+	METRIC_CMD_LIST,
+	METRIC_CMD_MLSD,
+	METRIC_CMD_SIZE,
+	METRIC_CMD_MDTM,
+	METRIC_CMD_MODE,
+	METRIC_CMD_NOOP,
+	METRIC_CMD_OTHER,
+	N_METRIC_COMMANDS
+};
+
+enum MetricHistogram {
+	/// From sending a command to its first reply, one per MetricCommand.
+	METRIC_COMMAND,
+	/// Connecting the data connection.
+	METRIC_DATA_CONNECT = METRIC_COMMAND + N_METRIC_COMMANDS,
+	/// From sending a RETR, LIST or MLSD to the first byte of data.
+	METRIC_FIRST_BYTE,
+	/// From sending a transfer command to its final reply.
+	METRIC_TRANSFER,
+	N_METRIC_HISTOGRAMS
+};
+
+enum MetricCounter {
+	METRIC_BYTES_RECEIVED,
+	METRIC_BYTES_SENT,
+	/// 4xx and 5xx replies.
+	METRIC_NEGATIVE_REPLIES,
+	/// Failures on our side or of the network.
+	METRIC_ERRORS,
+	/// Listings taken from a ListCache as they were, after checking the
+	/// directory with the server, or listed again.
+	METRIC_LIST_CACHE_HITS,
+	METRIC_LIST_CACHE_REVALIDATIONS,
+	METRIC_LIST_CACHE_MISSES,
+	N_METRIC_COUNTERS
+};
+
+/// Bucket i counts values up to 2^i us, except the last, which counts the
+/// rest.
+#define HISTOGRAM_N_BUCKETS 25
+
+struct Histogram {
+	uint64_t count;
+	uint64_t sum_us;
+	uint64_t buckets[HISTOGRAM_N_BUCKETS];
+};
+
+/// What a session, or the whole process, has been up to.
+struct Metrics {
+	struct Histogram histograms[N_METRIC_HISTOGRAMS];
+	uint64_t counters[N_METRIC_COUNTERS];
+	/// When the transfer in progress was sent, while its first byte hasn't
+	/// come, or 0.
+	uint64_t first_byte_from_ns;
+};
+
+/// Extensions a session may use, as listed by FEAT.
+enum Feature {
+	FEAT_EPSV = 1 << 0,
+	FEAT_MLST = 1 << 1, /// MLST and MLSD
+	FEAT_REST_STREAM = 1 << 2,
+	FEAT_SIZE = 1 << 3,
+	FEAT_MDTM = 1 << 4,
+	FEAT_MODE_Z = 1 << 5,
+	FEAT_UTF8 = 1 << 6,
+	FEAT_MODE_B = 1 << 7, /// Not listed by FEAT, only ever lacked.
+};
+
+#define FEAT_MLST_FACTS_LEN 64
+struct Features {
+	/// The server answered FEAT, so \a has is the whole list.
+	bool known;
+	unsigned int has; /// enum Feature
+	/// Turned down by the server, learned from its replies.
+	unsigned int lacks; /// enum Feature
+	/// As listed after MLST, the ones sent by default end with '*'.
+	char mlst_facts[FEAT_MLST_FACTS_LEN];
+};
+
+struct ListCache;
+struct ModeB;
+struct ModeZ;
+
+/// Sends on a socket with MSG_ZEROCOPY.
+struct ZeroCopy {
+	int fd;
+	bool enabled;
+	uint32_t n_sent; /// Zero-copy sends so far, the kernel numbers them.
+	uint32_t n_done; /// Zero-copy sends the kernel is done with.
+};
+
+/// A data connection opened ahead of the next transfer.
+struct DataPrefetch {
+	bool enabled;
+	/// EPSV if \a epsv or else PASV was sent, its reply is still to come.
+	bool pending;
+	bool epsv;
+	/// Maybe still connecting, -1 if there's none.
+	int fd;
+	uint64_t since_ns; /// metrics_now_ns()
+};
+
+/// A server may stop listening for a data connection left unused that long.
+#define DATA_PREFETCH_MAX_IDLE_MS 5000
+
 struct UserPI {
 	struct Connection ctrl;
+	/// Borrowed from the LoginInfo, like the name of the host.
+	const char *username;
 	struct RecvBuf rb;
+	struct Pipeline pipeline;
 
 	struct Connection data;
+	struct AddrCache addr_cache;
+	/// For every connection of the session, 0 means no deadline.
+	unsigned int connect_timeout_ms;
+	/// The upload in progress on the data connection.
+	struct ZeroCopy upload;
+	/// NULL unless in MODE Z.
+	struct ModeZ *mode_z;
+	/// NULL unless in MODE B.
+	struct ModeB *mode_b;
+	struct Metrics metrics;
+	/// What the server supports, or is thought to.
+	struct Features features;
+	struct DataPrefetch prefetch;
+	/// Shared, NULL if none.
+	struct ListCache *list_cache;
 };
 
 struct ErrMsg {
@@ -48,6 +219,19 @@ struct UserPI *user_pi_init(const char *name, const char *service,
                             const struct LoginInfo *login,
                             struct UserPI *user_pi, struct ErrMsg *err);
 
+#define DEFAULT_CONNECT_TIMEOUT_MS 30000
+
+/// Like user_pi_init(), but give up connecting after \a connect_timeout_ms.
+/**
+ *  The deadline applies to each connection of the session, including the
+ *  data connections and those of its clones. 0 means no deadline.
+ */
+struct UserPI *user_pi_init_timeout(const char *name, const char *service,
+                                    const struct LoginInfo *login,
+                                    unsigned int connect_timeout_ms,
+                                    struct UserPI *user_pi,
+                                    struct ErrMsg *err);
+
 enum ListFormat { FORMAT_LIST, FORMAT_MLSD };
 
 ssize_t list_directory(struct UserPI *user_pi, char *path, char **list,
@@ -56,29 +240,589 @@ ssize_t list_directory(struct UserPI *user_pi, char *path, char **list,
 struct Fact {
 	char *name;
 	bool is_dir;
-	ssize_t size;
+	ssize_t size; /// -1 if unknown.
 #define FACT_PERM_MAX_LEN 64
 	char perm[FACT_PERM_MAX_LEN];
-	time_t modify;
+	time_t modify; /// -1 if unknown.
+#define FACT_UNIQUE_MAX_LEN 64
+	char unique[FACT_UNIQUE_MAX_LEN]; /// Empty if unknown.
 };
 
+/// A bump allocator for the names and facts of a listing.
+/**
+ *  Everything allocated from an arena is released at once by
+ *  list_arena_reset() or list_arena_free(). An arena isn't thread safe,
+ *  give each thread its own.
+ */
+struct ListArena;
+
+/**
+ *  \return NULL on failure.
+ */
+struct ListArena *list_arena_new(void);
+
+void list_arena_free(struct ListArena *arena);
+
+/// Release everything allocated from \a arena, but keep its memory.
+void list_arena_reset(struct ListArena *arena);
+
+/// Allocate \a size bytes, aligned for any type.
+/**
+ *  \return NULL on failure.
+ */
+void *list_arena_alloc(struct ListArena *arena, size_t size);
+
+/// Copy \a n bytes of \a s into \a arena and terminate them.
+/**
+ *  \return NULL on failure.
+ */
+char *list_arena_strndup(struct ListArena *arena, const char *s, size_t n);
+
 typedef int (*ParseLineListFunc)(const char *list, bool *ignore,
                                  const char **end, struct Fact *fact);
 
+/// Like ParseLineListFunc, but the name is put in \a arena if it's not NULL.
+typedef int (*ParseLineListArenaFunc)(const char *list, bool *ignore,
+                                      const char **end, struct Fact *fact,
+                                      struct ListArena *arena);
+
 int parse_line_list_gnu(const char *list, bool *ignore, const char **end,
                         struct Fact *fact);
 
+int parse_line_list_gnu_arena(const char *list, bool *ignore,
+                              const char **end, struct Fact *fact,
+                              struct ListArena *arena);
+
+int parse_line_mlsd(const char *list, bool *ignore, const char **end,
+                    struct Fact *fact);
+
+int parse_line_mlsd_arena(const char *list, bool *ignore, const char **end,
+                          struct Fact *fact, struct ListArena *arena);
+
+/// Called with every entry of a listing.
+/**
+ *  \a fact, including its name, is only valid during the call.
+ *  \return -1 to stop the listing.
+ */
+typedef int (*FactFunc)(void *ctx, const struct Fact *fact);
+
+/// List \a path, calling \a on_fact for each entry as it arrives.
+/**
+ *  Memory use is bounded by a fixed buffer, however long the listing.
+ *  \return the number of entries, or -1 on error.
+ */
+ssize_t list_directory_foreach(struct UserPI *user_pi, char *path,
+                               FactFunc on_fact, void *ctx,
+                               struct ErrMsg *err);
+
+/// List \a path into an array of entries.
+/**
+ *  The array and the names are allocated from \a arena, and are released
+ *  with it instead of one by one.
+ *  \return the number of entries, or -1 on error.
+ */
+ssize_t list_directory_facts(struct UserPI *user_pi, char *path,
+                             struct ListArena *arena, struct Fact **facts,
+                             struct ErrMsg *err);
+
+/// Compress the transfers with MODE Z at \a level, from 1 to 9.
+/**
+ *  The level is asked of the server with OPTS MODE Z LEVEL, which it may
+ *  ignore, and used for uploads. Level 0 goes back to MODE S. Clones of
+ *  \a user_pi get the same mode.
+ *  \return -1 on error, or if the library was built without zlib.
+ */
+int set_mode_z(struct UserPI *user_pi, int level, struct ErrMsg *err);
+
+/// Send the transfers in blocks with MODE B, or go back to MODE S.
+/**
+ *  A transfer then ends with an EOF block rather than by closing the data
+ *  connection, which stays open for the next one: back-to-back transfers
+ *  skip EPSV and the TCP handshake, and data prefetching isn't needed.
+ *  REST takes the restart markers of the server instead of offsets, see
+ *  download_resumable(), so download_segmented() and remote_file_open(),
+ *  which need byte offsets, refuse sessions in MODE B. MODE B replaces
+ *  MODE Z and the other way around.
+ *  Clones of \a user_pi get the same mode.
+ *  \return -1 on error.
+ */
+int set_mode_b(struct UserPI *user_pi, bool on, struct ErrMsg *err);
+
+/// Open the data connection of the next transfer as each one ends.
+/**
+ *  EPSV or PASV is pipelined behind every transfer command, for the server
+ *  to answer once the transfer is over. The next transfer command then goes
+ *  out at once, over the connection opened meanwhile, which saves it a
+ *  round trip. The server has to leave commands sent during a transfer for
+ *  after it, as RFC 959 has it. Clones of \a user_pi prefetch too.
+ */
+void set_data_prefetch(struct UserPI *user_pi, bool on);
+
+/// Receive from the data connection, undoing the transfer mode.
+/**
+ *  \return 0 at the end of the data, or -1 on error and sets errno.
+ */
+ssize_t data_recv(struct UserPI *user_pi, char *buf, size_t size);
+
 int download_init(struct UserPI *user_pi, char *path, struct ErrMsg *err);
 
+/// Like download_init(), but start at byte \a offset of the file.
+/**
+ *  In MODE B, \a offset is a restart marker of the server instead.
+ */
+int download_init_at(struct UserPI *user_pi, char *path, off_t offset,
+                     struct ErrMsg *err);
+
 ssize_t download_chunk(struct UserPI *user_pi, char *data, size_t size,
                        struct ErrMsg *err);
 
+/// Download \a path straight into \a out_fd, a file or a pipe.
+/**
+ *  The data is moved with splice() where possible, so it's never copied
+ *  through user space.
+ *  \return the number of bytes downloaded, or -1 on error.
+ */
+ssize_t download_to_fd(struct UserPI *user_pi, char *path, int out_fd,
+                       struct ErrMsg *err);
+
+/// Start uploading to \a path, with APPE if \a append, or STOR.
+/**
+ *  \return -1 on error.
+ */
+int upload_init(struct UserPI *user_pi, char *path, bool append,
+                struct ErrMsg *err);
+
+/// Send the next \a size bytes of the file.
+/**
+ *  Big chunks are sent with MSG_ZEROCOPY where the kernel has it, so
+ *  \a data must stay as it is until upload_finish() returns, or the upload
+ *  failed. On error, the upload is given up.
+ *  \return \a size, or -1 on error.
+ */
+ssize_t upload_chunk(struct UserPI *user_pi, const char *data, size_t size,
+                     struct ErrMsg *err);
+
+/// End the upload and wait for the server to confirm it.
+/**
+ *  \return -1 on error.
+ */
+int upload_finish(struct UserPI *user_pi, struct ErrMsg *err);
+
+/// Upload what's left of \a in_fd, from its current offset, to \a path.
+/**
+ *  Files are sent with sendfile(), so the data never enters user space.
+ *  \return the number of bytes uploaded, or -1 on error.
+ */
+off_t upload_from_fd(struct UserPI *user_pi, char *path, int in_fd,
+                     bool append, struct ErrMsg *err);
+
+/// Copy \a src_path from the server of \a src to \a dest_path on the server
+/// of \a dest, with the data going straight from one to the other.
+/**
+ *  The source is put in passive mode, and its address is given to the
+ *  destination with PORT, or EPRT over IPv6. Both servers have to allow
+ *  it, and the sessions have to be in the same transfer mode.
+ *  \return -1 on error.
+ */
+int fxp_copy(struct UserPI *src, char *src_path, struct UserPI *dest,
+             char *dest_path, struct ErrMsg *err);
+
+/// Complete a download whose data connection has reached its end.
+/**
+ *  download_chunk() does this itself when it gets to the end.
+ *  \return -1 on error.
+ */
+int download_finish(struct UserPI *user_pi, struct ErrMsg *err);
+
+/// Stop a download before the end of the file.
+/**
+ *  \return -1 on error.
+ */
+int download_abort(struct UserPI *user_pi, struct ErrMsg *err);
+
+/// Get the size of \a path with SIZE.
+/**
+ *  \return -1 on error.
+ */
+off_t get_file_size(struct UserPI *user_pi, char *path, struct ErrMsg *err);
+
+/// Get the modification time of \a path with MDTM.
+/**
+ *  \return -1 on error.
+ */
+int get_modification_time(struct UserPI *user_pi, char *path, time_t *mtime,
+                          struct ErrMsg *err);
+
+/// Delete the file \a path with DELE.
+/**
+ *  \return -1 on error.
+ */
+int delete_file(struct UserPI *user_pi, char *path, struct ErrMsg *err);
+
+/// Rename \a from to \a to with RNFR and RNTO, sent together.
+/**
+ *  \return -1 on error.
+ */
+int rename_file(struct UserPI *user_pi, char *from, char *to,
+                struct ErrMsg *err);
+
+/// Whether the control connection still answers NOOP.
+bool session_is_alive(struct UserPI *user_pi);
+
+/// Download \a path into \a out_fd over \a n_segments sessions at once.
+/**
+ *  \a user_pi fetches the first range of the file, and sessions cloned from
+ *  it with \a login fetch the others. Not in MODE B, where REST doesn't
+ *  take byte offsets.
+ *  \return the size of the file, or -1 on error.
+ */
+off_t download_segmented(struct UserPI *user_pi,
+                         const struct LoginInfo *login, char *path,
+                         int out_fd, unsigned int n_segments,
+                         struct ErrMsg *err);
+
+/// How download_resumable() retries a broken transfer.
+struct RetryOptions {
+	/// Give up after this many failures in a row without any progress.
+	unsigned int max_retries;
+	/// The delay before the first retry, doubled for every next one.
+	unsigned int backoff_ms;
+	unsigned int max_backoff_ms;
+};
+
+#define RETRY_DEFAULT_MAX_RETRIES 5
+#define RETRY_DEFAULT_BACKOFF_MS 500
+#define RETRY_DEFAULT_MAX_BACKOFF_MS 30000
+
+/// Download \a path into \a out_fd from \a offset on, surviving failures.
+/**
+ *  Byte n of the file is written at n in \a out_fd. A broken transfer is
+ *  restarted with REST after a backoff, on a new session logged in with
+ *  \a login if the control connection is gone too, as long as SIZE and
+ *  MDTM show the file hasn't changed. \a options may be NULL. In block
+ *  mode, REST takes the last restart marker of the server instead, so
+ *  \a offset has to be 0 or one of them.
+ *  \return the size of the file, or -1 on error.
+ */
+off_t download_resumable(struct UserPI *user_pi, const struct LoginInfo *login,
+                         char *path, int out_fd, off_t offset,
+                         const struct RetryOptions *options,
+                         struct ErrMsg *err);
+
+/// How a RemoteFile caches and reads ahead.
+struct RemoteFileOptions {
+	/// Reads are done in blocks of this many bytes.
+	size_t block_len;
+	/// The most blocks kept, the least recently used go first.
+	unsigned int max_blocks;
+	/// Sequential reads fetch up to this many blocks ahead.
+	unsigned int max_read_ahead;
+};
+
+#define REMOTE_FILE_DEFAULT_BLOCK_LEN (64 * 1024)
+#define REMOTE_FILE_DEFAULT_MAX_BLOCKS 256
+#define REMOTE_FILE_DEFAULT_MAX_READ_AHEAD 64
+
+struct RemoteFileStats {
+	uint64_t hits; /// Blocks read from the cache.
+	uint64_t misses; /// Blocks that started a fetch.
+	uint64_t transfers; /// RETR sent.
+	uint64_t bytes_received;
+};
+
+/// A file on the server read at random offsets.
+struct RemoteFile;
+
+/// Open \a path for remote_file_pread().
+/**
+ *  \a user_pi belongs to the file until it's closed, since a transfer may
+ *  be left open between reads. \a options may be NULL for the defaults,
+ *  and so may any of its fields be 0. Not in MODE B, where REST doesn't
+ *  take byte offsets.
+ *  \return NULL on error.
+ */
+struct RemoteFile *remote_file_open(struct UserPI *user_pi, char *path,
+                                    const struct RemoteFileOptions *options,
+                                    struct ErrMsg *err);
+
+/// Abort any transfer left open, and free \a file.
+void remote_file_close(struct RemoteFile *file);
+
+/// The size of the file, as given by SIZE when it was opened.
+off_t remote_file_size(const struct RemoteFile *file);
+
+/// Read up to \a len bytes at \a offset, like pread().
+/**
+ *  Missing blocks are fetched with REST and RETR, and the transfer is
+ *  aborted once they're in, unless the reads look sequential. Then blocks
+ *  are read ahead, twice as many every time up to `max_read_ahead`, and
+ *  the transfer stays open for the next read to carry on with.
+ *  \return the number of bytes read, less than \a len only at the end of
+ *  the file, or -1 on error.
+ */
+ssize_t remote_file_pread(struct RemoteFile *file, void *buf, size_t len,
+                          off_t offset, struct ErrMsg *err);
+
+void remote_file_stats(const struct RemoteFile *file,
+                       struct RemoteFileStats *stats);
+
+/// How long a ListCache keeps listings, and how many.
+struct ListCacheOptions {
+	/// A listing is used as is for this long.
+	unsigned int ttl_s;
+	/// After that, it's revalidated with MLST or MDTM on the directory
+	/// instead of listed again, until it's this old. The time of a
+	/// directory only moves when entries come and go, so a file changed
+	/// in place may take that long to show.
+	unsigned int max_age_s;
+	/// The most listings kept, the least recently used go first.
+	unsigned int max_entries;
+};
+
+#define LIST_CACHE_DEFAULT_TTL_S 60
+#define LIST_CACHE_DEFAULT_MAX_AGE_S 3600
+#define LIST_CACHE_DEFAULT_MAX_ENTRIES 1024
+
+/// The listings of list_directory_facts(), by host, user and path.
+/**
+ *  A cache may be shared by sessions to any hosts, from any threads.
+ */
+struct ListCache;
+
+/// Create an empty cache.
+/**
+ *  \a options may be NULL for the defaults, and so may any of its fields
+ *  be 0.
+ *  \return NULL on error and sets errno.
+ */
+struct ListCache *list_cache_new(const struct ListCacheOptions *options);
+
+/// Free \a cache, once no session uses it.
+void list_cache_free(struct ListCache *cache);
+
+/// Have list_directory_facts() on \a user_pi go through \a cache.
+/**
+ *  NULL stops it. Clones of \a user_pi use the same cache. Uploads,
+ *  deletes and renames done by the session drop the listings they change.
+ */
+void set_list_cache(struct UserPI *user_pi, struct ListCache *cache);
+
+/// Drop the listings \a path, changed on the server, may be part of.
+/**
+ *  That's the listing of its directory, and its own if it's one. For a
+ *  relative path, that's every listing of an absolute path on the host
+ *  too, since the directory it's relative to isn't known.
+ */
+void list_cache_invalidate(struct UserPI *user_pi, const char *path);
+
+/// Called with every entry found by crawl(), in the directory \a dir.
+/**
+ *  It's called from several threads at once, and \a fact, including its
+ *  name, is only valid during the call.
+ *  \return -1 to stop the crawl.
+ */
+typedef int (*CrawlFunc)(void *ctx, const char *dir, const struct Fact *fact);
+
+/// Walk the tree under \a root over \a n_sessions sessions at once.
+/**
+ *  \a user_pi lists directories too, alongside sessions cloned from it
+ *  with \a login. Symbolic links aren't followed. Directories that can't
+ *  be listed are skipped, but the crawl then fails with the first of them
+ *  in \a err.
+ *  \return the number of entries, or -1 on error.
+ */
+ssize_t crawl(struct UserPI *user_pi, const struct LoginInfo *login,
+              const char *root, unsigned int n_sessions, CrawlFunc on_fact,
+              void *ctx, struct ErrMsg *err);
+
+struct PoolOptions {
+	/// Sessions per (host, service, login), 0 means unbounded.
+	unsigned int max_sessions;
+	/// Send NOOP to sessions idle for this long, 0 disables keepalive.
+	unsigned int keepalive_ms;
+	/// Close sessions idle for this long, 0 keeps them forever.
+	unsigned int idle_timeout_ms;
+};
+
+struct SessionPool;
+
+/// Create a pool of logged-in sessions.
+/**
+ *  \return NULL on failure.
+ */
+struct SessionPool *session_pool_create(const struct PoolOptions *options);
+
+void session_pool_destroy(struct SessionPool *pool);
+
+/// Get a logged-in session to \a name, \a service, reusing idle ones.
+/**
+ *  \return NULL on failure.
+ */
+struct UserPI *session_pool_checkout(struct SessionPool *pool,
+                                     const char *name, const char *service,
+                                     const struct LoginInfo *login,
+                                     struct ErrMsg *err);
+
+void session_pool_checkin(struct SessionPool *pool, struct UserPI *user_pi);
+
+void session_pool_discard(struct SessionPool *pool, struct UserPI *user_pi);
+
+void session_pool_maintain(struct SessionPool *pool);
+
+struct UserPIAsync;
+
+/// Called with every piece of data received on the data connection.
+/**
+ *  \return -1 to abort the transfer.
+ */
+typedef int (*AsyncDataFunc)(void *ctx, const char *data, size_t len);
+
+enum AsyncResult {
+	/// The session is broken and must be freed.
+	ASYNC_FAILED = -2,
+	/// The current operation failed. The session is idle again.
+	ASYNC_ERROR = -1,
+	/// Call user_pi_step() again once an fd is ready.
+	ASYNC_PENDING = 0,
+	/// The session is logged in and idle, ready for the next operation.
+	ASYNC_READY = 1,
+};
+
+#define ASYNC_MAX_FDS 2
+
+/// Start a non-blocking session to \a name, \a service.
+/**
+ *  \a login must outlive the session.
+ *  \return NULL on failure.
+ */
+struct UserPIAsync *user_pi_async_new(const char *name, const char *service,
+                                      const struct LoginInfo *login,
+                                      struct ErrMsg *err);
+
+void user_pi_async_free(struct UserPIAsync *a);
+
+/// The fds of \a a and the events it waits for.
+/**
+ *  \return the number of entries filled in \a fds.
+ */
+int user_pi_async_fds(const struct UserPIAsync *a,
+                      struct pollfd fds[ASYNC_MAX_FDS]);
+
+/// Advance \a a as far as possible without blocking.
+enum AsyncResult user_pi_step(struct UserPIAsync *a, struct ErrMsg *err);
+
+int user_pi_async_download(struct UserPIAsync *a, const char *path,
+                           AsyncDataFunc on_data, void *ctx,
+                           struct ErrMsg *err);
+
+int user_pi_async_list(struct UserPIAsync *a, const char *path,
+                       AsyncDataFunc on_data, void *ctx, struct ErrMsg *err);
+
+/// Start downloading \a path into \a fd.
+/**
+ *  The file is downloaded from its byte 0, and written at \a out_offset
+ *  of \a fd on.
+ *  \return -1 on error.
+ */
+int user_pi_async_download_to_fd(struct UserPIAsync *a, const char *path,
+                                 int fd, off_t out_offset,
+                                 struct ErrMsg *err);
+
+enum ListFormat user_pi_async_list_format(const struct UserPIAsync *a);
+
+/// Drives many sessions from one thread through io_uring.
+struct AsyncLoop;
+
+struct AsyncEvent {
+	struct UserPIAsync *session;
+	enum AsyncResult result;
+	struct ErrMsg err;
+};
+
+/**
+ *  \return NULL if io_uring isn't available. Use user_pi_step() then.
+ */
+struct AsyncLoop *async_loop_new(unsigned int entries, struct ErrMsg *err);
+
+void async_loop_free(struct AsyncLoop *loop);
+
+int async_loop_add(struct AsyncLoop *loop, struct UserPIAsync *a,
+                   struct ErrMsg *err);
+
+int async_loop_wait(struct AsyncLoop *loop, struct AsyncEvent *events,
+                    size_t max, int timeout_ms, struct ErrMsg *err);
+
 void user_pi_drop(struct UserPI *user_pi);
 
 void user_pi_quit(struct UserPI *user_pi);
 
-// addr_info still belongs to \a src
+// addr_info still belongs to \a src, nothing is left open on failure
 int user_pi_clone(const struct UserPI *src, struct UserPI *dest,
                   const struct LoginInfo *login, struct ErrMsg *err);
 
+/// Copy the metrics of \a user_pi, or the process-wide aggregate if NULL.
+/**
+ *  A session has to be copied by the thread using it.
+ */
+void metrics_snapshot(const struct UserPI *user_pi, struct Metrics *metrics);
+
+/// Write \a metrics in the Prometheus text format.
+/**
+ *  \return the length of the whole text, like snprintf(), which may be more
+ *  than \a size.
+ */
+size_t metrics_export(const struct Metrics *metrics, char *buf, size_t size);
+
+enum TraceType {
+	/// A command sent, in data.
+	TRACE_COMMAND,
+	/// The last line of a reply, value is its code.
+	TRACE_REPLY,
+	/// A line received on a control connection, in data.
+	TRACE_LINE,
+	/// A telnet negotiation received, value is its command << 8 | option.
+	TRACE_TELNET,
+	/// value is the number of addresses to try.
+	TRACE_CONNECT_BEGIN,
+	/// fd is the connection or -1, value is 0 or errno.
+	TRACE_CONNECT_END,
+	/// value is the size of the chunk, or -errno.
+	TRACE_DATA_RECV,
+	/// value is the size of the chunk, or -errno.
+	TRACE_DATA_SEND,
+	N_TRACE_TYPES
+};
+
+#define TRACE_DATA_LEN 36
+/// One event, as recorded and dumped.
+struct TraceRecord {
+	uint64_t ns; /// CLOCK_MONOTONIC
+	int64_t value;
+	int32_t tid;
+	int32_t fd;
+	uint16_t type; /// enum TraceType
+	uint16_t len; /// Of data, which is truncated to TRACE_DATA_LEN.
+	char data[TRACE_DATA_LEN];
+};
+
+/// Records kept for each thread, the older ones are overwritten.
+#define TRACE_RING_LEN 1024
+
+/// Turn tracing on or off for every thread, it starts on.
+void trace_set_enabled(bool enabled);
+
+/// Write the rings of every thread, past and present, to \a fd.
+/**
+ *  Events recorded while dumping may be left out.
+ *  \return the number of events written, or -1 and sets errno.
+ */
+ssize_t trace_dump(int fd);
+
+/// Print a dump read from \a fd as a timeline, oldest first.
+/**
+ *  \return the number of events printed, or -1 and sets errno, EINVAL if
+ *  \a fd doesn't hold a dump.
+ */
+ssize_t trace_decode(int fd, FILE *out);
+
 #endif
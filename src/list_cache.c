@@ -0,0 +1,389 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "debug.h"
+
+#include "arena.h"
+#include "cmd.h"
+#include "error.h"
+#include "feat.h"
+#include "ftp.h"
+#include "list_cache.h"
+#include "metrics.h"
+#include "parse.h"
+
+struct CacheEntry {
+	/// "name service username" of the session, followed by the path, NULL
+	/// if unused.
+	char *host;
+	char *path;
+	uint64_t hash;
+	/// The last use, for the LRU.
+	uint64_t used;
+	time_t listed;
+	/// Listed or revalidated.
+	time_t checked;
+	bool has_modify;
+	time_t modify;
+	/// Followed by their names, in the same allocation.
+	struct Fact *facts;
+	size_t n_facts;
+};
+
+struct ListCache {
+	struct ListCacheOptions options;
+	pthread_mutex_t lock;
+	struct CacheEntry *entries;
+	uint64_t clock;
+	/// Moved by every invalidation.
+	uint64_t generation;
+	/// now_s(), unless list_cache_set_clock() says otherwise.
+	ListCacheClock now;
+};
+
+static time_t now_s(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+struct ListCache *list_cache_new(const struct ListCacheOptions *options)
+{
+	struct ListCache *cache = calloc(1, sizeof(*cache));
+	if (!cache)
+		return NULL;
+	if (options)
+		cache->options = *options;
+	struct ListCacheOptions *o = &cache->options;
+	if (!o->ttl_s)
+		o->ttl_s = LIST_CACHE_DEFAULT_TTL_S;
+	if (!o->max_age_s)
+		o->max_age_s = LIST_CACHE_DEFAULT_MAX_AGE_S;
+	if (!o->max_entries)
+		o->max_entries = LIST_CACHE_DEFAULT_MAX_ENTRIES;
+	cache->now = now_s;
+	cache->entries = calloc(o->max_entries, sizeof(*cache->entries));
+	if (!cache->entries) {
+		free(cache);
+		return NULL;
+	}
+	pthread_mutex_init(&cache->lock, NULL);
+	return cache;
+}
+
+static void entry_clear(struct CacheEntry *entry)
+{
+	free(entry->host);
+	free(entry->facts);
+	*entry = (struct CacheEntry){ 0 };
+}
+
+void list_cache_free(struct ListCache *cache)
+{
+	if (!cache)
+		return;
+	for (unsigned int i = 0; i < cache->options.max_entries; i++)
+		entry_clear(&cache->entries[i]);
+	free(cache->entries);
+	pthread_mutex_destroy(&cache->lock);
+	free(cache);
+}
+
+void list_cache_set_clock(struct ListCache *cache, ListCacheClock clock_s)
+{
+	cache->now = clock_s;
+}
+
+void set_list_cache(struct UserPI *user_pi, struct ListCache *cache)
+{
+	user_pi->list_cache = cache;
+}
+
+/// The host, the user and the path of a listing, as they're kept.
+/**
+ *  Users may see different trees on the same host.
+ */
+struct Key {
+	char *host; /// Followed by the path.
+	char *path;
+	uint64_t hash;
+};
+
+/// Copy \a path without repeated or trailing slashes, nor a leading "./".
+/**
+ *  So "", "." and "./" are all the current directory.
+ */
+static void normalize(const char *path, char *out)
+{
+	while (path[0] == '.' && (path[1] == '/' || !path[1])) {
+		path++;
+		while (*path == '/')
+			path++;
+	}
+	char *o = out;
+	for (; *path; path++) {
+		if (*path == '/' && o > out && o[-1] == '/')
+			continue;
+		*o++ = *path;
+	}
+	if (o - out > 1 && o[-1] == '/')
+		o--;
+	*o = '\0';
+}
+
+/// \return -1 if \a user_pi can't be told from other hosts, or on error.
+static int key_init(struct Key *key, const struct UserPI *user_pi,
+                    const char *path)
+{
+	if (!user_pi->ctrl.name || !user_pi->ctrl.service)
+		return -1;
+	const char *username = user_pi->username ? user_pi->username : "";
+	size_t host_len = strlen(user_pi->ctrl.name) + 1 +
+	                  strlen(user_pi->ctrl.service) + 1 + strlen(username);
+	key->host = malloc(host_len + 1 + strlen(path) + 1);
+	if (!key->host)
+		return -1;
+	sprintf(key->host, "%s %s %s", user_pi->ctrl.name,
+	        user_pi->ctrl.service, username);
+	key->path = key->host + host_len + 1;
+	normalize(path, key->path);
+	// FNV-1a
+	key->hash = 14695981039346656037ull;
+	const char *end = key->path + strlen(key->path);
+	for (const char *s = key->host; s < end; s++)
+		key->hash = (key->hash ^ (unsigned char)*s) * 1099511628211ull;
+	return 0;
+}
+
+/// Call with the lock held.
+static struct CacheEntry *entry_find(struct ListCache *cache,
+                                     const struct Key *key)
+{
+	for (unsigned int i = 0; i < cache->options.max_entries; i++) {
+		struct CacheEntry *entry = &cache->entries[i];
+		if (entry->host && entry->hash == key->hash &&
+		    !strcmp(entry->host, key->host) &&
+		    !strcmp(entry->path, key->path))
+			return entry;
+	}
+	return NULL;
+}
+
+/// An unused entry, or else the least recently used. Call with the lock held.
+static struct CacheEntry *entry_victim(struct ListCache *cache)
+{
+	struct CacheEntry *victim = &cache->entries[0];
+	for (unsigned int i = 0; i < cache->options.max_entries; i++) {
+		struct CacheEntry *entry = &cache->entries[i];
+		if (!entry->host)
+			return entry;
+		if (entry->used < victim->used)
+			victim = entry;
+	}
+	return victim;
+}
+
+/// Copy the listing of \a entry into \a arena.
+/**
+ *  \return the number of entries, or -1 on error.
+ */
+static ssize_t entry_copy(struct ListCache *cache, struct CacheEntry *entry,
+                          struct ListArena *arena, struct Fact **facts)
+{
+	entry->used = ++cache->clock;
+	*facts = NULL;
+	if (!entry->n_facts)
+		return 0;
+	struct Fact *copy =
+		list_arena_alloc(arena, entry->n_facts * sizeof(*copy));
+	if (!copy)
+		return -1;
+	for (size_t i = 0; i < entry->n_facts; i++) {
+		copy[i] = entry->facts[i];
+		copy[i].name = list_arena_strndup(arena, entry->facts[i].name,
+		                                  strlen(entry->facts[i].name));
+		if (!copy[i].name)
+			return -1;
+	}
+	*facts = copy;
+	return entry->n_facts;
+}
+
+/// When the server says \a path was last modified, with MLST or else MDTM.
+/**
+ *  \return false if it can't tell.
+ */
+static bool dir_modify(struct UserPI *user_pi, char *path, time_t *modify)
+{
+	struct ErrMsg err;
+	struct Reply reply;
+	// MLST fails on some servers where MLSD works, that's no reason to
+	// stop using MLSD.
+	if (features_use(&user_pi->features, FEAT_MLST) &&
+	    send_command(user_pi, &reply, &err, "MLST %s", path) == 0 &&
+	    reply.first == POS_COM) {
+		// The facts are on the line indented by a space.
+		reply.reply[reply.len < MAX_TELNET_BUF_LEN ?
+		                    reply.len :
+		                    MAX_TELNET_BUF_LEN - 1] = '\0';
+		const char *line = strstr(reply.reply, "\n ");
+		struct Fact fact;
+		bool ignore;
+		const char *end;
+		if (line &&
+		    parse_line_mlsd(line + 2, &ignore, &end, &fact) == 0) {
+			free(fact.name);
+			if (fact.modify >= 0) {
+				*modify = fact.modify;
+				return true;
+			}
+		}
+	}
+	if (!features_use(&user_pi->features, FEAT_MDTM))
+		return false;
+	return get_modification_time(user_pi, path, modify, &err) == 0;
+}
+
+ssize_t list_cache_lookup(struct ListCache *cache, struct UserPI *user_pi,
+                          char *path, struct ListArena *arena,
+                          struct Fact **facts, struct ListCacheMiss *miss)
+{
+	const struct ListCacheOptions *o = &cache->options;
+	*miss = (struct ListCacheMiss){ 0 };
+	struct Key key;
+	if (key_init(&key, user_pi, path) < 0)
+		return -1;
+	time_t now = cache->now();
+	ssize_t n = -1;
+	pthread_mutex_lock(&cache->lock);
+	miss->generation = cache->generation;
+	struct CacheEntry *entry = entry_find(cache, &key);
+	if (entry && now - entry->checked < o->ttl_s) {
+		n = entry_copy(cache, entry, arena, facts);
+		pthread_mutex_unlock(&cache->lock);
+		if (n >= 0)
+			metrics_add(&user_pi->metrics, METRIC_LIST_CACHE_HITS,
+			            1);
+		goto done;
+	}
+	bool revalidate = entry && entry->has_modify &&
+	                  now - entry->listed < o->max_age_s;
+	time_t cached_modify = revalidate ? entry->modify : 0;
+	pthread_mutex_unlock(&cache->lock);
+
+	// The time is asked before listing, so a change made meanwhile isn't
+	// missed, only seen the next time.
+	miss->has_modify = dir_modify(user_pi, path, &miss->modify);
+	if (revalidate && miss->has_modify && miss->modify == cached_modify) {
+		pthread_mutex_lock(&cache->lock);
+		entry = entry_find(cache, &key);
+		if (entry && entry->has_modify &&
+		    entry->modify == cached_modify &&
+		    cache->generation == miss->generation) {
+			entry->checked = now;
+			n = entry_copy(cache, entry, arena, facts);
+		}
+		pthread_mutex_unlock(&cache->lock);
+		if (n >= 0) {
+			metrics_add(&user_pi->metrics,
+			            METRIC_LIST_CACHE_REVALIDATIONS, 1);
+			goto done;
+		}
+	}
+	metrics_add(&user_pi->metrics, METRIC_LIST_CACHE_MISSES, 1);
+done:
+	debug("[INFO] Listing of %s %s.\n", key.path,
+	      n >= 0 ? "taken from the cache" : "not cached");
+	free(key.host);
+	return n;
+}
+
+void list_cache_store(struct ListCache *cache, struct UserPI *user_pi,
+                      char *path, const struct ListCacheMiss *miss,
+                      const struct Fact *facts, size_t n_facts)
+{
+	struct Key key;
+	if (key_init(&key, user_pi, path) < 0)
+		return;
+	size_t names_len = 0;
+	for (size_t i = 0; i < n_facts; i++)
+		names_len += strlen(facts[i].name) + 1;
+	struct Fact *copy = malloc(n_facts * sizeof(*copy) + names_len);
+	if (!copy) {
+		free(key.host);
+		return;
+	}
+	char *name = (char *)(copy + n_facts);
+	for (size_t i = 0; i < n_facts; i++) {
+		copy[i] = facts[i];
+		copy[i].name = strcpy(name, facts[i].name);
+		name += strlen(name) + 1;
+	}
+
+	pthread_mutex_lock(&cache->lock);
+	if (cache->generation != miss->generation) {
+		pthread_mutex_unlock(&cache->lock);
+		free(key.host);
+		free(copy);
+		return;
+	}
+	struct CacheEntry *entry = entry_find(cache, &key);
+	if (!entry)
+		entry = entry_victim(cache);
+	entry_clear(entry);
+	time_t now = cache->now();
+	*entry = (struct CacheEntry){ .host = key.host,
+		                      .path = key.path,
+		                      .hash = key.hash,
+		                      .used = ++cache->clock,
+		                      .listed = now,
+		                      .checked = now,
+		                      .has_modify = miss->has_modify,
+		                      .modify = miss->modify,
+		                      .facts = copy,
+		                      .n_facts = n_facts };
+	pthread_mutex_unlock(&cache->lock);
+}
+
+void list_cache_invalidate(struct UserPI *user_pi, const char *path)
+{
+	struct ListCache *cache = user_pi->list_cache;
+	struct Key key;
+	if (!cache || key_init(&key, user_pi, path) < 0)
+		return;
+	char *dir = strdup(key.path);
+	if (!dir) {
+		free(key.host);
+		return;
+	}
+	char *slash = strrchr(dir, '/');
+	if (!slash)
+		*dir = '\0';
+	else if (slash == dir)
+		dir[1] = '\0';
+	else
+		*slash = '\0';
+	bool relative = *key.path != '/';
+
+	pthread_mutex_lock(&cache->lock);
+	cache->generation++;
+	for (unsigned int i = 0; i < cache->options.max_entries; i++) {
+		struct CacheEntry *entry = &cache->entries[i];
+		if (!entry->host || strcmp(entry->host, key.host))
+			continue;
+		if ((*entry->path != '/') != relative ||
+		    !strcmp(entry->path, dir) ||
+		    !strcmp(entry->path, key.path)) {
+			debug("[INFO] Dropped the listing of %s.\n",
+			      entry->path);
+			entry_clear(entry);
+		}
+	}
+	pthread_mutex_unlock(&cache->lock);
+	free(dir);
+	free(key.host);
+}
@@ -0,0 +1,92 @@
+#ifndef _LIST_CACHE_H
+#define _LIST_CACHE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+
+struct UserPI;
+struct Fact;
+struct ListArena;
+
+/// How long a ListCache keeps listings, and how many.
+struct ListCacheOptions {
+	/// A listing is used as is for this long.
+	unsigned int ttl_s;
+	/// After that, it's revalidated with MLST or MDTM on the directory
+	/// instead of listed again, until it's this old. The time of a
+	/// directory only moves when entries come and go, so a file changed
+	/// in place may take that long to show.
+	unsigned int max_age_s;
+	/// The most listings kept, the least recently used go first.
+	unsigned int max_entries;
+};
+
+#define LIST_CACHE_DEFAULT_TTL_S 60
+#define LIST_CACHE_DEFAULT_MAX_AGE_S 3600
+#define LIST_CACHE_DEFAULT_MAX_ENTRIES 1024
+
+/// The listings of list_directory_facts(), by host, user and path.
+/**
+ *  A cache may be shared by sessions to any hosts, from any threads.
+ */
+struct ListCache;
+
+/// Create an empty cache.
+/**
+ *  \a options may be NULL for the defaults, and so may any of its fields
+ *  be 0.
+ *  \return NULL on error and sets errno.
+ */
+struct ListCache *list_cache_new(const struct ListCacheOptions *options);
+
+/// Free \a cache, once no session uses it.
+void list_cache_free(struct ListCache *cache);
+
+/// Have list_directory_facts() on \a user_pi go through \a cache.
+/**
+ *  NULL stops it. Clones of \a user_pi use the same cache. Uploads,
+ *  deletes and renames done by the session drop the listings they change.
+ */
+void set_list_cache(struct UserPI *user_pi, struct ListCache *cache);
+
+/// Drop the listings \a path, changed on the server, may be part of.
+/**
+ *  That's the listing of its directory, and its own if it's one. For a
+ *  relative path, that's every listing of an absolute path on the host
+ *  too, since the directory it's relative to isn't known.
+ */
+void list_cache_invalidate(struct UserPI *user_pi, const char *path);
+
+/// Seconds from any fixed point, for TTLs.
+typedef time_t (*ListCacheClock)(void);
+
+/// Have \a cache tell time with \a clock_s instead of CLOCK_MONOTONIC.
+void list_cache_set_clock(struct ListCache *cache, ListCacheClock clock_s);
+
+/// What list_cache_store() needs to know from a lookup that missed.
+struct ListCacheMiss {
+	/// The time of the directory, asked before it's listed.
+	bool has_modify;
+	time_t modify;
+	/// Listings invalidated meanwhile aren't stored.
+	uint64_t generation;
+};
+
+/// Copy the listing of \a path into \a arena, if cached and still good.
+/**
+ *  A listing past its TTL costs a round trip to revalidate it. On a miss,
+ *  so does getting the time of the directory, when the server can tell.
+ *  \return the number of entries, or -1 on a miss, with \a miss filled.
+ */
+ssize_t list_cache_lookup(struct ListCache *cache, struct UserPI *user_pi,
+                          char *path, struct ListArena *arena,
+                          struct Fact **facts, struct ListCacheMiss *miss);
+
+/// Keep a copy of the listing of \a path, after list_cache_lookup() missed.
+void list_cache_store(struct ListCache *cache, struct UserPI *user_pi,
+                      char *path, const struct ListCacheMiss *miss,
+                      const struct Fact *facts, size_t n_facts);
+
+#endif
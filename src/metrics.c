@@ -0,0 +1,204 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include "ftp.h"
+#include "metrics.h"
+
+/// Every session adds to it as well, with atomics.
+static struct Metrics global;
+
+static const char *const command_names[N_METRIC_COMMANDS] = {
+	[METRIC_CMD_USER] = "USER", [METRIC_CMD_PASS] = "PASS",
+	[METRIC_CMD_TYPE] = "TYPE", [METRIC_CMD_EPSV] = "EPSV",
+	[METRIC_CMD_PASV] = "PASV", [METRIC_CMD_REST] = "REST",
+	[METRIC_CMD_RETR] = "RETR", [METRIC_CMD_STOR] = "STOR",
+	[METRIC_CMD_APPE] = "APPE", [METRIC_CMD_LIST] = "LIST",
+	[METRIC_CMD_MLSD] = "MLSD", [METRIC_CMD_SIZE] = "SIZE",
+	[METRIC_CMD_MDTM] = "MDTM", [METRIC_CMD_MODE] = "MODE",
+	[METRIC_CMD_NOOP] = "NOOP", [METRIC_CMD_OTHER] = "other",
+};
+
+uint64_t metrics_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+enum MetricCommand metric_command(const char *cmd, size_t len)
+{
+	if (len < 4 || (len > 4 && cmd[4] != ' ' && cmd[4] != '\r'))
+		return METRIC_CMD_OTHER;
+	for (unsigned int i = 0; i < METRIC_CMD_OTHER; i++)
+		if (!strncasecmp(cmd, command_names[i], 4))
+			return i;
+	return METRIC_CMD_OTHER;
+}
+
+static unsigned int bucket_of(uint64_t us)
+{
+	if (us <= 1)
+		return 0;
+	unsigned int i = 64 - __builtin_clzll(us - 1);
+	return i < HISTOGRAM_N_BUCKETS ? i : HISTOGRAM_N_BUCKETS - 1;
+}
+
+void metrics_observe(struct Metrics *metrics, enum MetricHistogram which,
+                     uint64_t begin_ns)
+{
+	uint64_t us = (metrics_now_ns() - begin_ns) / 1000;
+	unsigned int bucket = bucket_of(us);
+	struct Histogram *h = &metrics->histograms[which];
+	h->count++;
+	h->sum_us += us;
+	h->buckets[bucket]++;
+	h = &global.histograms[which];
+	__atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&h->sum_us, us, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&h->buckets[bucket], 1, __ATOMIC_RELAXED);
+}
+
+void metrics_add(struct Metrics *metrics, enum MetricCounter which,
+                 uint64_t n)
+{
+	metrics->counters[which] += n;
+	__atomic_fetch_add(&global.counters[which], n, __ATOMIC_RELAXED);
+}
+
+void metrics_snapshot(const struct UserPI *user_pi, struct Metrics *metrics)
+{
+	if (user_pi) {
+		*metrics = user_pi->metrics;
+		return;
+	}
+	*metrics = (struct Metrics){ 0 };
+	for (unsigned int i = 0; i < N_METRIC_HISTOGRAMS; i++) {
+		const struct Histogram *from = &global.histograms[i];
+		struct Histogram *to = &metrics->histograms[i];
+		to->count = __atomic_load_n(&from->count, __ATOMIC_RELAXED);
+		to->sum_us = __atomic_load_n(&from->sum_us, __ATOMIC_RELAXED);
+		for (unsigned int j = 0; j < HISTOGRAM_N_BUCKETS; j++)
+			to->buckets[j] = __atomic_load_n(&from->buckets[j],
+			                                 __ATOMIC_RELAXED);
+	}
+	for (unsigned int i = 0; i < N_METRIC_COUNTERS; i++)
+		metrics->counters[i] =
+			__atomic_load_n(&global.counters[i], __ATOMIC_RELAXED);
+}
+
+struct Text {
+	char *buf;
+	size_t size;
+	size_t len;
+};
+
+static void text_printf(struct Text *text, const char *fmt, ...)
+{
+	size_t room = text->len < text->size ? text->size - text->len : 0;
+	va_list args;
+	va_start(args, fmt);
+	int n = vsnprintf(room ? text->buf + text->len : NULL, room, fmt, args);
+	va_end(args);
+	if (n > 0)
+		text->len += n;
+}
+
+/// \a label is put inside the braces, with its trailing comma.
+static void export_histogram(struct Text *text, const char *name,
+                             const char *label, const struct Histogram *h)
+{
+	uint64_t cumulative = 0;
+	for (unsigned int i = 0; i < HISTOGRAM_N_BUCKETS - 1; i++) {
+		cumulative += h->buckets[i];
+		text_printf(text, "%s_bucket{%sle=\"%.9g\"} %llu\n", name, label,
+		            (double)(1ull << i) / 1e6,
+		            (unsigned long long)cumulative);
+	}
+	text_printf(text, "%s_bucket{%sle=\"+Inf\"} %llu\n", name, label,
+	            (unsigned long long)h->count);
+	// The label without its comma, if any.
+	int label_len = strlen(label) ? (int)strlen(label) - 1 : 0;
+	const char *braces = label_len ? "{" : "";
+	const char *end = label_len ? "}" : "";
+	text_printf(text, "%s_sum%s%.*s%s %.6f\n", name, braces, label_len,
+	            label, end, h->sum_us / 1e6);
+	text_printf(text, "%s_count%s%.*s%s %llu\n", name, braces, label_len,
+	            label, end, (unsigned long long)h->count);
+}
+
+size_t metrics_export(const struct Metrics *metrics, char *buf, size_t size)
+{
+	struct Text text = { .buf = buf, .size = size };
+	if (size)
+		*buf = '\0';
+
+	const char *name = "waftp_command_seconds";
+	text_printf(&text,
+	            "# HELP %s Time from sending a command to its first reply.\n"
+	            "# TYPE %s histogram\n",
+	            name, name);
+	for (unsigned int i = 0; i < N_METRIC_COMMANDS; i++) {
+		const struct Histogram *h =
+			&metrics->histograms[METRIC_COMMAND + i];
+		if (!h->count)
+			continue;
+		char label[32];
+		snprintf(label, sizeof(label), "command=\"%s\",",
+		         command_names[i]);
+		export_histogram(&text, name, label, h);
+	}
+
+	static const struct {
+		enum MetricHistogram which;
+		const char *name;
+		const char *help;
+	} histograms[] = {
+		{ METRIC_DATA_CONNECT, "waftp_data_connect_seconds",
+		  "Time to connect a data connection." },
+		{ METRIC_FIRST_BYTE, "waftp_first_byte_seconds",
+		  "Time from sending a download to its first byte of data." },
+		{ METRIC_TRANSFER, "waftp_transfer_seconds",
+		  "Time from sending a transfer to its final reply." },
+	};
+	for (size_t i = 0; i < sizeof(histograms) / sizeof(*histograms);
+	     i++) {
+		name = histograms[i].name;
+		text_printf(&text, "# HELP %s %s\n# TYPE %s histogram\n", name,
+		            histograms[i].help, name);
+		export_histogram(&text, name, "",
+		                 &metrics->histograms[histograms[i].which]);
+	}
+
+	static const struct {
+		enum MetricCounter which;
+		const char *name;
+		const char *help;
+	} counters[] = {
+		{ METRIC_BYTES_RECEIVED, "waftp_received_bytes_total",
+		  "Bytes of data received, after decompression." },
+		{ METRIC_BYTES_SENT, "waftp_sent_bytes_total",
+		  "Bytes of data sent, before compression." },
+		{ METRIC_NEGATIVE_REPLIES, "waftp_negative_replies_total",
+		  "Replies from 400 to 599." },
+		{ METRIC_ERRORS, "waftp_errors_total",
+		  "Failed connections, sends and receives." },
+		{ METRIC_LIST_CACHE_HITS, "waftp_list_cache_hits_total",
+		  "Listings taken from the cache." },
+		{ METRIC_LIST_CACHE_REVALIDATIONS,
+		  "waftp_list_cache_revalidations_total",
+		  "Listings revalidated against the directory time." },
+		{ METRIC_LIST_CACHE_MISSES, "waftp_list_cache_misses_total",
+		  "Listings not in the cache, or changed." },
+	};
+	for (size_t i = 0; i < sizeof(counters) / sizeof(*counters); i++) {
+		name = counters[i].name;
+		text_printf(&text, "# HELP %s %s\n# TYPE %s counter\n%s %llu\n",
+		            name, counters[i].help, name, name,
+		            (unsigned long long)
+		                    metrics->counters[counters[i].which]);
+	}
+	return text.len;
+}
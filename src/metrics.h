@@ -0,0 +1,101 @@
+#ifndef _METRICS_H
+#define _METRICS_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+struct UserPI;
+
+/// Commands timed separately, the others count as METRIC_CMD_OTHER.
+enum MetricCommand {
+	METRIC_CMD_USER,
+	METRIC_CMD_PASS,
+	METRIC_CMD_TYPE,
+	METRIC_CMD_EPSV,
+	METRIC_CMD_PASV,
+	METRIC_CMD_REST,
+	METRIC_CMD_RETR,
+	METRIC_CMD_STOR,
+	METRIC_CMD_APPE,
+	METRIC_CMD_LIST,
+	METRIC_CMD_MLSD,
+	METRIC_CMD_SIZE,
+	METRIC_CMD_MDTM,
+	METRIC_CMD_MODE,
+	METRIC_CMD_NOOP,
+	METRIC_CMD_OTHER,
+	N_METRIC_COMMANDS
+};
+
+enum MetricHistogram {
+	/// From sending a command to its first reply, one per MetricCommand.
+	METRIC_COMMAND,
+	/// Connecting the data connection.
+	METRIC_DATA_CONNECT = METRIC_COMMAND + N_METRIC_COMMANDS,
+	/// From sending a RETR, LIST or MLSD to the first byte of data.
+	METRIC_FIRST_BYTE,
+	/// From sending a transfer command to its final reply.
+	METRIC_TRANSFER,
+	N_METRIC_HISTOGRAMS
+};
+
+enum MetricCounter {
+	METRIC_BYTES_RECEIVED,
+	METRIC_BYTES_SENT,
+	/// 4xx and 5xx replies.
+	METRIC_NEGATIVE_REPLIES,
+	/// Failures on our side or of the network.
+	METRIC_ERRORS,
+	/// Listings taken from a ListCache as they were, after checking the
+	/// directory with the server, or listed again.
+	METRIC_LIST_CACHE_HITS,
+	METRIC_LIST_CACHE_REVALIDATIONS,
+	METRIC_LIST_CACHE_MISSES,
+	N_METRIC_COUNTERS
+};
+
+/// Bucket i counts values up to 2^i us, except the last, which counts the
+/// rest.
+#define HISTOGRAM_N_BUCKETS 25
+
+struct Histogram {
+	uint64_t count;
+	uint64_t sum_us;
+	uint64_t buckets[HISTOGRAM_N_BUCKETS];
+};
+
+/// What a session, or the whole process, has been up to.
+struct Metrics {
+	struct Histogram histograms[N_METRIC_HISTOGRAMS];
+	uint64_t counters[N_METRIC_COUNTERS];
+	/// When the transfer in progress was sent, while its first byte hasn't
+	/// come, or 0.
+	uint64_t first_byte_from_ns;
+};
+
+uint64_t metrics_now_ns(void);
+
+enum MetricCommand metric_command(const char *cmd, size_t len);
+
+/// Record the time from \a begin_ns until now, in \a metrics and the
+/// process-wide aggregate.
+void metrics_observe(struct Metrics *metrics, enum MetricHistogram which,
+                     uint64_t begin_ns);
+
+void metrics_add(struct Metrics *metrics, enum MetricCounter which,
+                 uint64_t n);
+
+/// Copy the metrics of \a user_pi, or the process-wide aggregate if NULL.
+/**
+ *  A session has to be copied by the thread using it.
+ */
+void metrics_snapshot(const struct UserPI *user_pi, struct Metrics *metrics);
+
+/// Write \a metrics in the Prometheus text format.
+/**
+ *  \return the length of the whole text, like snprintf(), which may be more
+ *  than \a size.
+ */
+size_t metrics_export(const struct Metrics *metrics, char *buf, size_t size);
+
+#endif
@@ -0,0 +1,209 @@
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "mode_b.h"
+#include "socket_util.h"
+
+#define MODE_B_HEADER_LEN 3
+#define MODE_B_BLOCK_MAX 0xffff
+/// Longer markers would overflow an off_t.
+#define MODE_B_MARKER_MAX_DIGITS 18
+
+/// Flags of the descriptor, RFC 959 3.4.2.
+enum Descriptor {
+	DESC_EOR = 128,
+	DESC_EOF = 64,
+	DESC_ERRORS = 32, /// The data is still passed on.
+	DESC_RESTART = 16,
+};
+
+struct ModeB {
+	int fd;
+	/// The EOF block went through.
+	bool ended;
+	/// The block being received is flagged EOF.
+	bool last;
+	/// Data left in the block being received.
+	size_t remaining;
+	off_t marker;
+	/// A block about to be sent, or a marker received.
+	unsigned char buf[MODE_B_HEADER_LEN + MODE_B_BLOCK_MAX];
+};
+
+struct ModeB *mode_b_new(void)
+{
+	struct ModeB *mode_b = malloc(sizeof(*mode_b));
+	if (!mode_b)
+		return NULL;
+	mode_b->fd = -1;
+	mode_b_forget(mode_b);
+	return mode_b;
+}
+
+void mode_b_free(struct ModeB *mode_b)
+{
+	free(mode_b);
+}
+
+void mode_b_start(struct ModeB *mode_b, int fd)
+{
+	mode_b->fd = fd;
+	mode_b->ended = false;
+	mode_b->last = false;
+	mode_b->remaining = 0;
+	mode_b->marker = -1;
+}
+
+int mode_b_kept(const struct ModeB *mode_b)
+{
+	return mode_b->ended ? mode_b->fd : -1;
+}
+
+void mode_b_forget(struct ModeB *mode_b)
+{
+	mode_b_start(mode_b, -1);
+}
+
+off_t mode_b_marker(const struct ModeB *mode_b)
+{
+	return mode_b->marker;
+}
+
+/// Receive exactly \a n bytes, the connection may not end before.
+static int recv_exact(int fd, void *buf, size_t n)
+{
+	for (size_t got = 0; got < n;) {
+		ssize_t r = try_recv(fd, (char *)buf + got, n - got);
+		if (r < 0)
+			return -1;
+		if (r == 0) {
+			errno = EPROTO;
+			return -1;
+		}
+		got += r;
+	}
+	return 0;
+}
+
+/// Keep the marker in the \a len bytes at the start of `mode_b->buf`.
+static void parse_marker(struct ModeB *mode_b, size_t len)
+{
+	if (len == 0 || len > MODE_B_MARKER_MAX_DIGITS)
+		return;
+	off_t marker = 0;
+	for (size_t i = 0; i < len; i++) {
+		unsigned char c = mode_b->buf[i];
+		if (c < '0' || c > '9')
+			return;
+		marker = marker * 10 + (c - '0');
+	}
+	mode_b->marker = marker;
+}
+
+/// Receive the header of the next block, and the block itself if it holds
+/// a restart marker rather than data.
+static int next_block(struct ModeB *mode_b)
+{
+	unsigned char header[MODE_B_HEADER_LEN];
+	if (recv_exact(mode_b->fd, header, sizeof(header)) < 0)
+		return -1;
+	mode_b->last = header[0] & DESC_EOF;
+	mode_b->remaining = header[1] << 8 | header[2];
+	if (!(header[0] & DESC_RESTART))
+		return 0;
+	size_t len = mode_b->remaining;
+	mode_b->remaining = 0;
+	if (recv_exact(mode_b->fd, mode_b->buf, len) < 0)
+		return -1;
+	parse_marker(mode_b, len);
+	return 0;
+}
+
+ssize_t mode_b_recv(struct ModeB *mode_b, char *buf, size_t size)
+{
+	while (mode_b->remaining == 0) {
+		if (mode_b->ended || mode_b->last) {
+			mode_b->ended = true;
+			return 0;
+		}
+		if (next_block(mode_b) < 0)
+			return -1;
+	}
+	if (size > mode_b->remaining)
+		size = mode_b->remaining;
+	ssize_t n = try_recv(mode_b->fd, buf, size);
+	if (n < 0)
+		return -1;
+	if (n == 0 && size) {
+		errno = EPROTO;
+		return -1;
+	}
+	mode_b->remaining -= n;
+	return n;
+}
+
+ssize_t mode_b_recv_to_fd(struct ModeB *mode_b, int out_fd)
+{
+	char *buf = malloc(MODE_B_BLOCK_MAX);
+	if (!buf)
+		return -1;
+	ssize_t total = 0;
+	for (;;) {
+		ssize_t n = mode_b_recv(mode_b, buf, MODE_B_BLOCK_MAX);
+		if (n <= 0 || writen(out_fd, buf, n) < 0) {
+			free(buf);
+			return n == 0 ? total : -1;
+		}
+		total += n;
+	}
+}
+
+/// Send the block of \a len bytes put after the header in `mode_b->buf`.
+static int send_block(struct ModeB *mode_b, enum Descriptor desc, size_t len)
+{
+	mode_b->buf[0] = desc;
+	mode_b->buf[1] = len >> 8;
+	mode_b->buf[2] = len & 0xff;
+	if (sendn(mode_b->fd, mode_b->buf, MODE_B_HEADER_LEN + len) < 0)
+		return -1;
+	return 0;
+}
+
+ssize_t mode_b_send(struct ModeB *mode_b, const void *buf, size_t n)
+{
+	for (size_t sent = 0; sent < n;) {
+		size_t len = n - sent < MODE_B_BLOCK_MAX ? n - sent :
+		                                           MODE_B_BLOCK_MAX;
+		memcpy(mode_b->buf + MODE_B_HEADER_LEN,
+		       (const char *)buf + sent, len);
+		if (send_block(mode_b, 0, len) < 0)
+			return -1;
+		sent += len;
+	}
+	return n;
+}
+
+ssize_t mode_b_send_from_fd(struct ModeB *mode_b, int in_fd)
+{
+	ssize_t total = 0;
+	for (;;) {
+		ssize_t n = read(in_fd, mode_b->buf + MODE_B_HEADER_LEN,
+		                 MODE_B_BLOCK_MAX);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0 || send_block(mode_b, 0, n) < 0)
+			return n == 0 ? total : -1;
+		total += n;
+	}
+}
+
+int mode_b_send_end(struct ModeB *mode_b)
+{
+	if (send_block(mode_b, DESC_EOF, 0) < 0)
+		return -1;
+	mode_b->ended = true;
+	return 0;
+}
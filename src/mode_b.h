@@ -0,0 +1,61 @@
+#ifndef _MODE_B_H
+#define _MODE_B_H
+
+#include <sys/types.h>
+
+/// The blocks of the transfers of a session in MODE B.
+/**
+ *  Every block starts with a descriptor and a 16-bit length, and a transfer
+ *  ends with a block flagged EOF instead of the end of the connection. The
+ *  data connection is then left open for the next transfer.
+ */
+struct ModeB;
+
+/// \return NULL on error and sets errno.
+struct ModeB *mode_b_new(void);
+
+/// The data connection isn't closed, see mode_b_kept().
+void mode_b_free(struct ModeB *mode_b);
+
+/// Start a transfer on the data connection \a fd.
+void mode_b_start(struct ModeB *mode_b, int fd);
+
+/// The data connection left open by the last transfer, or -1.
+/**
+ *  That's only once the EOF block went through, in either direction.
+ */
+int mode_b_kept(const struct ModeB *mode_b);
+
+/// Stop keeping the data connection, it's been closed.
+void mode_b_forget(struct ModeB *mode_b);
+
+/// The last restart marker received in this transfer, or -1.
+/**
+ *  Only markers giving a byte offset, as decimal digits, are kept. The
+ *  data before them has all been received, so REST can restart there.
+ */
+off_t mode_b_marker(const struct ModeB *mode_b);
+
+/// Receive up to \a size bytes of data, skipping the headers and markers.
+/**
+ *  \return 0 after the EOF block, or -1 on error and sets errno, to EPROTO
+ *  if the connection ends before it.
+ */
+ssize_t mode_b_recv(struct ModeB *mode_b, char *buf, size_t size);
+
+/// Receive the rest of the transfer into \a out_fd.
+ssize_t mode_b_recv_to_fd(struct ModeB *mode_b, int out_fd);
+
+/// Send \a n bytes in as many blocks as needed.
+/**
+ *  \return -1 on error and sets errno.
+ */
+ssize_t mode_b_send(struct ModeB *mode_b, const void *buf, size_t n);
+
+/// Send what's left of \a in_fd.
+ssize_t mode_b_send_from_fd(struct ModeB *mode_b, int in_fd);
+
+/// Send the EOF block.
+int mode_b_send_end(struct ModeB *mode_b);
+
+#endif
@@ -0,0 +1,221 @@
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "config.h"
+
+#include "mode_z.h"
+#include "socket_util.h"
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+
+#define MODE_Z_BUF_LEN (64 * 1024)
+
+struct ModeZ {
+	int level;
+	int fd;
+	z_stream inflate;
+	z_stream deflate;
+	bool ended;
+	/// Compressed data, received or about to be sent.
+	unsigned char buf[MODE_Z_BUF_LEN];
+};
+
+struct ModeZ *mode_z_new(int level)
+{
+	struct ModeZ *mode_z = malloc(sizeof(*mode_z));
+	if (!mode_z)
+		return NULL;
+	*mode_z = (struct ModeZ){ .level = level, .fd = -1 };
+	if (inflateInit(&mode_z->inflate) != Z_OK) {
+		free(mode_z);
+		errno = ENOMEM;
+		return NULL;
+	}
+	if (deflateInit(&mode_z->deflate, level) != Z_OK) {
+		inflateEnd(&mode_z->inflate);
+		free(mode_z);
+		errno = ENOMEM;
+		return NULL;
+	}
+	return mode_z;
+}
+
+void mode_z_free(struct ModeZ *mode_z)
+{
+	if (!mode_z)
+		return;
+	inflateEnd(&mode_z->inflate);
+	deflateEnd(&mode_z->deflate);
+	free(mode_z);
+}
+
+int mode_z_level(const struct ModeZ *mode_z)
+{
+	return mode_z->level;
+}
+
+void mode_z_start(struct ModeZ *mode_z, int fd)
+{
+	mode_z->fd = fd;
+	mode_z->ended = false;
+	inflateReset(&mode_z->inflate);
+	mode_z->inflate.avail_in = 0;
+	deflateReset(&mode_z->deflate);
+}
+
+ssize_t mode_z_recv(struct ModeZ *mode_z, char *buf, size_t size)
+{
+	z_stream *z = &mode_z->inflate;
+	if (mode_z->ended || size == 0)
+		return 0;
+	z->next_out = (unsigned char *)buf;
+	z->avail_out = size;
+	while (z->avail_out == size) {
+		if (z->avail_in == 0) {
+			ssize_t n = try_recv(mode_z->fd, (char *)mode_z->buf,
+			                     MODE_Z_BUF_LEN);
+			if (n < 0)
+				return -1;
+			if (n == 0) {
+				errno = EPROTO;
+				return -1;
+			}
+			z->next_in = mode_z->buf;
+			z->avail_in = n;
+		}
+		int ret = inflate(z, Z_NO_FLUSH);
+		if (ret == Z_STREAM_END) {
+			mode_z->ended = true;
+			break;
+		}
+		if (ret != Z_OK && ret != Z_BUF_ERROR) {
+			errno = ret == Z_MEM_ERROR ? ENOMEM : EPROTO;
+			return -1;
+		}
+	}
+	return size - z->avail_out;
+}
+
+ssize_t mode_z_recv_to_fd(struct ModeZ *mode_z, int out_fd)
+{
+	char *buf = malloc(MODE_Z_BUF_LEN);
+	if (!buf)
+		return -1;
+	ssize_t total = 0;
+	for (;;) {
+		ssize_t n = mode_z_recv(mode_z, buf, MODE_Z_BUF_LEN);
+		if (n <= 0 || writen(out_fd, buf, n) < 0) {
+			free(buf);
+			return n == 0 ? total : -1;
+		}
+		total += n;
+	}
+}
+
+/// Deflate the input of \a mode_z with \a flush and send the output.
+static int deflate_send(struct ModeZ *mode_z, int flush)
+{
+	z_stream *z = &mode_z->deflate;
+	int ret;
+	do {
+		z->next_out = mode_z->buf;
+		z->avail_out = MODE_Z_BUF_LEN;
+		ret = deflate(z, flush);
+		if (ret == Z_STREAM_ERROR) {
+			errno = EINVAL;
+			return -1;
+		}
+		size_t have = MODE_Z_BUF_LEN - z->avail_out;
+		if (have && sendn(mode_z->fd, mode_z->buf, have) < 0)
+			return -1;
+	} while (z->avail_in || z->avail_out == 0 ||
+	         (flush == Z_FINISH && ret != Z_STREAM_END));
+	return 0;
+}
+
+ssize_t mode_z_send(struct ModeZ *mode_z, const void *buf, size_t n)
+{
+	mode_z->deflate.next_in = (unsigned char *)buf;
+	mode_z->deflate.avail_in = n;
+	if (deflate_send(mode_z, Z_NO_FLUSH) < 0)
+		return -1;
+	return n;
+}
+
+ssize_t mode_z_send_from_fd(struct ModeZ *mode_z, int in_fd)
+{
+	char *buf = malloc(MODE_Z_BUF_LEN);
+	if (!buf)
+		return -1;
+	ssize_t total = 0;
+	for (;;) {
+		ssize_t n = read(in_fd, buf, MODE_Z_BUF_LEN);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0 || mode_z_send(mode_z, buf, n) < 0) {
+			free(buf);
+			return n == 0 ? total : -1;
+		}
+		total += n;
+	}
+}
+
+int mode_z_send_end(struct ModeZ *mode_z)
+{
+	mode_z->deflate.avail_in = 0;
+	return deflate_send(mode_z, Z_FINISH);
+}
+#else
+struct ModeZ *mode_z_new(int level)
+{
+	errno = ENOTSUP;
+	return NULL;
+}
+
+void mode_z_free(struct ModeZ *mode_z)
+{
+}
+
+// Without zlib there's no ModeZ to call the others with.
+int mode_z_level(const struct ModeZ *mode_z)
+{
+	return 0;
+}
+
+void mode_z_start(struct ModeZ *mode_z, int fd)
+{
+}
+
+ssize_t mode_z_recv(struct ModeZ *mode_z, char *buf, size_t size)
+{
+	errno = ENOTSUP;
+	return -1;
+}
+
+ssize_t mode_z_recv_to_fd(struct ModeZ *mode_z, int out_fd)
+{
+	errno = ENOTSUP;
+	return -1;
+}
+
+ssize_t mode_z_send(struct ModeZ *mode_z, const void *buf, size_t n)
+{
+	errno = ENOTSUP;
+	return -1;
+}
+
+ssize_t mode_z_send_from_fd(struct ModeZ *mode_z, int in_fd)
+{
+	errno = ENOTSUP;
+	return -1;
+}
+
+int mode_z_send_end(struct ModeZ *mode_z)
+{
+	errno = ENOTSUP;
+	return -1;
+}
+#endif
@@ -0,0 +1,47 @@
+#ifndef _MODE_Z_H
+#define _MODE_Z_H
+
+#include <sys/types.h>
+
+/// The deflate streams of the transfers of a session in MODE Z.
+/**
+ *  Every transfer is a zlib stream of its own. The streams are set up once
+ *  and reset for each transfer, so that a transfer doesn't pay for
+ *  allocating the windows.
+ */
+struct ModeZ;
+
+/// \return NULL on error and sets errno, to ENOTSUP without zlib.
+struct ModeZ *mode_z_new(int level);
+
+void mode_z_free(struct ModeZ *mode_z);
+
+int mode_z_level(const struct ModeZ *mode_z);
+
+/// Start a transfer on the data connection \a fd.
+void mode_z_start(struct ModeZ *mode_z, int fd);
+
+/// Receive and inflate up to \a size bytes.
+/**
+ *  \return 0 at the end of the stream, or -1 on error and sets errno,
+ *  to EPROTO if the data is corrupt or ends too early.
+ */
+ssize_t mode_z_recv(struct ModeZ *mode_z, char *buf, size_t size);
+
+/// Inflate the rest of the transfer into \a out_fd.
+ssize_t mode_z_recv_to_fd(struct ModeZ *mode_z, int out_fd);
+
+/// Deflate and send \a n bytes.
+/**
+ *  Some of them may stay buffered until mode_z_send_end().
+ *  \return -1 on error and sets errno.
+ */
+ssize_t mode_z_send(struct ModeZ *mode_z, const void *buf, size_t n);
+
+/// Deflate and send what's left of \a in_fd.
+ssize_t mode_z_send_from_fd(struct ModeZ *mode_z, int in_fd);
+
+/// Send the end of the stream.
+int mode_z_send_end(struct ModeZ *mode_z);
+
+#endif
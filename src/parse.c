@@ -1,11 +1,13 @@
 #include <assert.h>
 #include <ctype.h>
 #include <limits.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
+#include "arena.h"
 #include "debug.h"
 #include "parse.h"
 
@@ -238,12 +240,38 @@ static int guess_year(int mon, int mday, int hour, int min)
 	return now_tm.tm_year - 1;
 }
 
+/// Copy a name into \a arena, or the heap if there's no arena.
+static char *copy_name(const char *name, size_t len, struct ListArena *arena)
+{
+	if (arena)
+		return list_arena_strndup(arena, name, len);
+	return strndup(name, len);
+}
+
 int parse_line_list_gnu(const char *list, bool *ignore, const char **end,
                         struct Fact *fact)
+{
+	return parse_line_list_gnu_arena(list, ignore, end, fact, NULL);
+}
+
+int parse_line_list_gnu_arena(const char *list, bool *ignore,
+                              const char **end, struct Fact *fact,
+                              struct ListArena *arena)
 {
 	*ignore = false;
 	const char *ptr = list;
 
+	if (!strncmp(ptr, "total ", strlen("total "))) {
+		*ignore = true;
+		skip_at_least_one_neq(ptr, &ptr, '\n');
+		RETURN_IF_0();
+		*end = ptr + 1;
+		return 0;
+	}
+
+	// LIST has no unique ID.
+	fact->unique[0] = '\0';
+
 	// is_dir
 	RETURN_IF_0();
 	fact->is_dir = *ptr == 'd';
@@ -329,10 +357,9 @@ int parse_line_list_gnu(const char *list, bool *ignore, const char **end,
 	if (ptr <= name)
 		return -1;
 	size_t name_len = ptr - name;
-	fact->name = malloc(name_len + 1);
-	for (size_t i = 0; i < name_len; i++)
-		fact->name[i] = name[i];
-	fact->name[name_len] = '\0';
+	fact->name = copy_name(name, name_len, arena);
+	if (!fact->name)
+		return -1;
 
 	// optional -> ... and mandatory CRLF
 	skip_at_least_one_neq(ptr, &ptr, '\n');
@@ -342,8 +369,256 @@ int parse_line_list_gnu(const char *list, bool *ignore, const char **end,
 	return 0;
 }
 
+// The vector scan reads past the end of the string.
+#if defined(__SANITIZE_ADDRESS__)
+#define PARSE_SANITIZED
+#elif defined(__has_feature)
+#if __has_feature(address_sanitizer)
+#define PARSE_SANITIZED
+#endif
+#endif
+
+/// Walks the delimiters ';', '=', ' ', '\r', '\n' and '\0' of a string.
+struct DelimScan {
+	const char *block;
+	uint64_t mask; /// Delimiters in block not returned yet.
+};
+
+#if defined(__SSE2__) && !defined(PARSE_SANITIZED)
+#include <emmintrin.h>
+
+#define DELIM_BLOCK_LEN 64
+
+static uint64_t delim_mask16(const char *block)
+{
+	__m128i v = _mm_load_si128((const __m128i *)block);
+	__m128i m = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(';')),
+	                         _mm_cmpeq_epi8(v, _mm_set1_epi8('=')));
+	m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8(' ')));
+	m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('\r')));
+	m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('\n')));
+	m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_setzero_si128()));
+	return (unsigned int)_mm_movemask_epi8(m);
+}
+
+static uint64_t delim_mask(const char *block)
+{
+	return delim_mask16(block) | delim_mask16(block + 16) << 16 |
+	       delim_mask16(block + 32) << 32 | delim_mask16(block + 48) << 48;
+}
+
+#else
+
+#define DELIM_BLOCK_LEN 8
+
+static uint64_t delim_mask(const char *block)
+{
+	uint64_t mask = 0;
+	for (size_t i = 0; i < DELIM_BLOCK_LEN; i++) {
+		switch (block[i]) {
+		case ';':
+		case '=':
+		case ' ':
+		case '\r':
+		case '\n':
+			mask |= (uint64_t)1 << i;
+			break;
+		case '\0':
+			// Don't read past the end.
+			return mask | (uint64_t)1 << i;
+		}
+	}
+	return mask;
+}
+
+#endif
+
+static void delim_scan_init(struct DelimScan *scan, const char *ptr)
+{
+	// Aligned blocks never cross into the next page, so reading on past
+	// the terminating '\0' is safe.
+	uintptr_t misalign = (uintptr_t)ptr % DELIM_BLOCK_LEN;
+	scan->block = ptr - misalign;
+	scan->mask = delim_mask(scan->block) & (~(uint64_t)0 << misalign);
+}
+
+/// The next delimiter. Don't call it again once it returned '\0'.
+static const char *delim_scan_next(struct DelimScan *scan)
+{
+	while (!scan->mask) {
+		scan->block += DELIM_BLOCK_LEN;
+		scan->mask = delim_mask(scan->block);
+	}
+	const char *delim = scan->block + __builtin_ctzll(scan->mask);
+	scan->mask &= scan->mask - 1;
+	return delim;
+}
+
+/// Parse the digits in [\a begin, \a end), at most 18 of them.
+/**
+ *  \return -1 on error.
+ */
+static int parse_digits(const char *begin, const char *end, long long *n)
+{
+	if (begin == end || end - begin > 18)
+		return -1;
+	long long result = 0;
+	for (const char *ptr = begin; ptr < end; ptr++) {
+		unsigned int digit = *ptr - '0';
+		if (digit > 9)
+			return -1;
+		result = result * 10 + digit;
+	}
+	*n = result;
+	return 0;
+}
+
+/// Days from 1970-01-01 to \a year-\a mon-\a mday, in the proleptic
+/// Gregorian calendar.
+static long long days_from_civil(long long year, unsigned int mon,
+                                 unsigned int mday)
+{
+	year -= mon <= 2;
+	long long era = (year >= 0 ? year : year - 399) / 400;
+	unsigned int yoe = year - era * 400;
+	unsigned int doy = (153 * (mon > 2 ? mon - 3 : mon + 9) + 2) / 5 + mday - 1;
+	unsigned int doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+	return era * 146097 + doe - 719468;
+}
+
+int parse_time_val(const char *begin, const char *end, time_t *t)
+{
+	if (end - begin < 14)
+		return -1;
+	long long ymd;
+	long long hms;
+	if (parse_digits(begin, begin + 8, &ymd) < 0 ||
+	    parse_digits(begin + 8, begin + 14, &hms) < 0)
+		return -1;
+	if (end - begin > 14 && begin[14] != '.')
+		return -1;
+	unsigned int mon = ymd / 100 % 100;
+	unsigned int mday = ymd % 100;
+	unsigned int hour = hms / 10000;
+	unsigned int min = hms / 100 % 100;
+	unsigned int sec = hms % 100;
+	if (mon < 1 || mon > 12 || mday < 1 || mday > 31 || hour > 23 ||
+	    min > 59 || sec > 60)
+		return -1;
+	*t = days_from_civil(ymd / 10000, mon, mday) * 86400 + hour * 3600 +
+	     min * 60 + sec;
+	return 0;
+}
+
+/// Pack up to 8 bytes of a token in lower case, to compare it at once.
+static uint64_t token_pack(const char *begin, size_t len)
+{
+	uint64_t packed = 0;
+	for (size_t i = 0; i < len; i++)
+		packed |= (uint64_t)(begin[i] | 0x20) << (8 * i);
+	return packed;
+}
+
+/// token_pack() of a lower case string literal, as a constant.
+#define TOKEN_CHAR(s, i) (sizeof(s) > (i) + 1 ? (uint64_t)(s)[i] << (8 * (i)) : 0)
+#define TOKEN(s)                                                               \
+	(TOKEN_CHAR(s, 0) | TOKEN_CHAR(s, 1) | TOKEN_CHAR(s, 2) |              \
+	 TOKEN_CHAR(s, 3) | TOKEN_CHAR(s, 4) | TOKEN_CHAR(s, 5))
+
+static void copy_value(const char *begin, const char *end, char *dest,
+                       size_t len)
+{
+	size_t n = end - begin;
+	if (n > len - 1)
+		n = len - 1;
+	memcpy(dest, begin, n);
+	dest[n] = '\0';
+}
+
+static int parse_fact(const char *key, const char *key_end, const char *value,
+                      const char *value_end, bool *ignore, struct Fact *fact)
+{
+	size_t key_len = key_end - key;
+	if (key_len > 6)
+		return 0; // Not of interest.
+	uint64_t packed = token_pack(key, key_len);
+	if (packed == TOKEN("type")) {
+		size_t len = value_end - value;
+		uint64_t type = len <= 4 ? token_pack(value, len) : 0;
+		if (type == TOKEN("dir")) {
+			fact->is_dir = true;
+		} else if (type == TOKEN("cdir") || type == TOKEN("pdir")) {
+			fact->is_dir = true;
+			*ignore = true;
+		}
+	} else if (packed == TOKEN("size") || packed == TOKEN("sizd")) {
+		long long size;
+		if (parse_digits(value, value_end, &size) < 0)
+			return -1;
+		fact->size = size;
+	} else if (packed == TOKEN("modify")) {
+		if (parse_time_val(value, value_end, &fact->modify) < 0)
+			return -1;
+	} else if (packed == TOKEN("perm")) {
+		copy_value(value, value_end, fact->perm, FACT_PERM_MAX_LEN);
+	} else if (packed == TOKEN("unique")) {
+		copy_value(value, value_end, fact->unique, FACT_UNIQUE_MAX_LEN);
+	}
+	return 0;
+}
+
 int parse_line_mlsd(const char *list, bool *ignore, const char **end,
                     struct Fact *fact)
 {
-	return -1;
+	return parse_line_mlsd_arena(list, ignore, end, fact, NULL);
+}
+
+int parse_line_mlsd_arena(const char *list, bool *ignore, const char **end,
+                          struct Fact *fact, struct ListArena *arena)
+{
+	*ignore = false;
+	fact->name = NULL;
+	fact->is_dir = false;
+	fact->size = -1;
+	fact->perm[0] = '\0';
+	fact->modify = -1;
+	fact->unique[0] = '\0';
+
+	// "fact=value;" until the space before the name
+	struct DelimScan scan;
+	delim_scan_init(&scan, list);
+	const char *ptr = list;
+	while (*ptr != ' ') {
+		const char *key = ptr;
+		const char *eq = delim_scan_next(&scan);
+		if (*eq != '=' || eq == key)
+			return -1;
+		// Values may hold '=' and ' ', e.g. "type=OS.unix=slink:/a b".
+		const char *semicolon;
+		do {
+			semicolon = delim_scan_next(&scan);
+		} while (*semicolon == '=' || *semicolon == ' ');
+		if (*semicolon != ';')
+			return -1;
+		if (parse_fact(key, eq, eq + 1, semicolon, ignore, fact) < 0)
+			return -1;
+		ptr = semicolon + 1;
+	}
+
+	// The name may hold anything but CRLF.
+	const char *name = delim_scan_next(&scan) + 1;
+	const char *lf;
+	do {
+		lf = delim_scan_next(&scan);
+	} while (*lf != '\n' && *lf != '\0');
+	if (!*lf)
+		return -1;
+	const char *name_end = lf > name && lf[-1] == '\r' ? lf - 1 : lf;
+	if (name_end == name)
+		return -1;
+	fact->name = copy_name(name, name_end - name, arena);
+	if (!fact->name)
+		return -1;
+	*end = lf + 1;
+	return 0;
 }
@@ -4,6 +4,7 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <sys/types.h>
+#include <time.h>
 
 int parse_pasv_reply(const char *reply, size_t len, char *name, char *service);
 
@@ -12,13 +13,50 @@ int parse_epsv_reply(const char *reply, size_t len, char *port);
 struct Fact {
 	char *name;
 	bool is_dir;
-	ssize_t size;
+	ssize_t size; /// -1 if unknown.
 #define FACT_PERM_MAX_LEN 64
 	char perm[FACT_PERM_MAX_LEN];
-	time_t modify;
+	time_t modify; /// -1 if unknown.
+#define FACT_UNIQUE_MAX_LEN 64
+	char unique[FACT_UNIQUE_MAX_LEN]; /// Empty if unknown.
 };
 
+struct ListArena;
+
+typedef int (*ParseLineListFunc)(const char *list, bool *ignore,
+                                 const char **end, struct Fact *fact);
+
+/// Like ParseLineListFunc, but the name is put in \a arena if it's not NULL.
+typedef int (*ParseLineListArenaFunc)(const char *list, bool *ignore,
+                                      const char **end, struct Fact *fact,
+                                      struct ListArena *arena);
+
+/// Parse a line of `ls -l` style LIST output.
+/**
+ *  \a ignore is set for lines that aren't entries, like "total 42".
+ *  \return -1 on error.
+ */
 int parse_line_list_gnu(const char *list, bool *ignore, const char **end,
                         struct Fact *fact);
 
+int parse_line_list_gnu_arena(const char *list, bool *ignore,
+                              const char **end, struct Fact *fact,
+                              struct ListArena *arena);
+
+/// Parse an entry of MLSD, in the format of RFC 3659.
+/**
+ *  Understands the type, size, sizd, modify, perm and unique facts. The
+ *  entries of MLST carry a leading space, skip it first. \a ignore is set
+ *  for the cdir and pdir entries.
+ *  \return -1 on error.
+ */
+int parse_line_mlsd(const char *list, bool *ignore, const char **end,
+                    struct Fact *fact);
+
+int parse_line_mlsd_arena(const char *list, bool *ignore, const char **end,
+                          struct Fact *fact, struct ListArena *arena);
+
+/// Parse a time-val, "YYYYMMDDHHMMSS[.sss]" in UTC, as in MDTM and MLSD.
+int parse_time_val(const char *begin, const char *end, time_t *t);
+
 #endif
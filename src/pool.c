@@ -0,0 +1,399 @@
+#include <errno.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "debug.h"
+
+#include "cmd.h"
+#include "error.h"
+#include "ftp.h"
+#include "pool.h"
+
+struct PoolEntry {
+	struct UserPI user_pi; // Must be the first member.
+	struct PoolKey *key;
+	uint64_t last_used_ms; // Checked in.
+	uint64_t last_active_ms; // Checked in, or sent a keepalive.
+	struct PoolEntry *next;
+};
+
+/// Sessions sharing a host, service and login.
+struct PoolKey {
+	char *name;
+	char *service;
+	char *username;
+	char *password;
+	char *account_info;
+	struct LoginInfo login;
+
+	/// Owns the address of the server once the first session is up.
+	/**
+	 *  Only the ctrl part and the connect timeout are used, as the source
+	 *  of user_pi_clone().
+	 */
+	struct UserPI origin;
+	bool has_origin;
+
+	struct PoolEntry *idle;
+	unsigned int n_sessions; // Idle, checked out, or being created.
+	struct PoolKey *next;
+};
+
+struct SessionPool {
+	struct PoolOptions options;
+	pthread_mutex_t lock;
+	pthread_cond_t released; // A session was checked in or closed.
+	struct PoolKey *keys;
+
+	bool has_thread;
+	bool stopping;
+	pthread_cond_t stop;
+	pthread_t thread;
+};
+
+static uint64_t now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static bool str_eq(const char *a, const char *b)
+{
+	if (!a || !b)
+		return a == b;
+	return !strcmp(a, b);
+}
+
+static char *str_dup(const char *str, bool *ok)
+{
+	if (!str)
+		return NULL;
+	char *dup = strdup(str);
+	if (!dup)
+		*ok = false;
+	return dup;
+}
+
+static void pool_key_free(struct PoolKey *key)
+{
+	if (key->has_origin)
+		freeaddrinfo(key->origin.ctrl.addr_info);
+	free(key->name);
+	free(key->service);
+	free(key->username);
+	free(key->password);
+	free(key->account_info);
+	free(key);
+}
+
+/// Find or create the key. Called with the lock held.
+static struct PoolKey *pool_key_get(struct SessionPool *pool, const char *name,
+                                    const char *service,
+                                    const struct LoginInfo *login)
+{
+	struct PoolKey *key;
+	for (key = pool->keys; key; key = key->next) {
+		if (str_eq(key->name, name) && str_eq(key->service, service) &&
+		    str_eq(key->username, login->username) &&
+		    str_eq(key->password, login->password) &&
+		    str_eq(key->account_info, login->account_info))
+			return key;
+	}
+	key = calloc(1, sizeof(*key));
+	if (!key)
+		return NULL;
+	bool ok = true;
+	key->name = str_dup(name, &ok);
+	key->service = str_dup(service, &ok);
+	key->username = str_dup(login->username, &ok);
+	key->password = str_dup(login->password, &ok);
+	key->account_info = str_dup(login->account_info, &ok);
+	if (!ok) {
+		pool_key_free(key);
+		return NULL;
+	}
+	key->login = (struct LoginInfo){ .username = key->username,
+		                         .password = key->password,
+		                         .account_info = key->account_info };
+	key->next = pool->keys;
+	pool->keys = key;
+	return key;
+}
+
+static void entry_close(struct PoolEntry *entry)
+{
+	user_pi_quit(&entry->user_pi);
+	free(entry);
+}
+
+/// Whether an idle session is still usable.
+/**
+ *  An idle control connection has nothing to say. If it's readable, the
+ *  server has closed it or is about to, e.g. with 421.
+ */
+static bool entry_is_healthy(struct PoolEntry *entry, bool probe)
+{
+	struct pollfd pfd = { .fd = entry->user_pi.ctrl.fd, .events = POLLIN };
+	if (poll(&pfd, 1, 0) != 0)
+		return false;
+	if (!probe)
+		return true;
+	struct Reply reply;
+	struct ErrMsg err;
+	if (send_command(&entry->user_pi, &reply, &err, "NOOP") < 0)
+		return false;
+	return reply.first == POS_COM;
+}
+
+/// Create a session for \a key. Called without the lock.
+static struct PoolEntry *entry_create(struct SessionPool *pool,
+                                      struct PoolKey *key, struct ErrMsg *err)
+{
+	struct PoolEntry *entry = calloc(1, sizeof(*entry));
+	if (!entry) {
+		strerror_r(errno, err->msg, ERR_MSG_MAX_LEN);
+		ERR_WHERE();
+		return NULL;
+	}
+	entry->key = key;
+
+	pthread_mutex_lock(&pool->lock);
+	bool has_origin = key->has_origin;
+	pthread_mutex_unlock(&pool->lock);
+	if (has_origin) {
+		// key->origin never changes once set.
+		if (user_pi_clone(&key->origin, &entry->user_pi, &key->login,
+		                  err) < 0)
+			goto fail;
+		return entry;
+	}
+
+	if (!user_pi_init(key->name, key->service, &key->login,
+	                  &entry->user_pi, err))
+		goto fail;
+	pthread_mutex_lock(&pool->lock);
+	if (!key->has_origin) {
+		key->origin.ctrl = entry->user_pi.ctrl;
+		key->origin.connect_timeout_ms =
+			entry->user_pi.connect_timeout_ms;
+		key->has_origin = true;
+	} else {
+		// Another thread got there first. Share its address.
+		freeaddrinfo(entry->user_pi.ctrl.addr_info);
+		entry->user_pi.ctrl.addr_info = key->origin.ctrl.addr_info;
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return entry;
+fail:
+	free(entry);
+	return NULL;
+}
+
+struct UserPI *session_pool_checkout(struct SessionPool *pool,
+                                     const char *name, const char *service,
+                                     const struct LoginInfo *login,
+                                     struct ErrMsg *err)
+{
+	pthread_mutex_lock(&pool->lock);
+	struct PoolKey *key = pool_key_get(pool, name, service, login);
+	if (!key) {
+		pthread_mutex_unlock(&pool->lock);
+		ERR_PRINTF("Out of memory.");
+		ERR_WHERE();
+		return NULL;
+	}
+	for (;;) {
+		while (key->idle) {
+			struct PoolEntry *entry = key->idle;
+			key->idle = entry->next;
+			pthread_mutex_unlock(&pool->lock);
+
+			bool probe = pool->options.keepalive_ms &&
+			             now_ms() - entry->last_active_ms >=
+			                     pool->options.keepalive_ms;
+			if (entry_is_healthy(entry, probe)) {
+				debug("[INFO] Reusing a pooled session.\n");
+				return &entry->user_pi;
+			}
+			debug("[WARNING] Dropping a stale pooled session.\n");
+			entry_close(entry);
+			pthread_mutex_lock(&pool->lock);
+			key->n_sessions--;
+		}
+		if (!pool->options.max_sessions ||
+		    key->n_sessions < pool->options.max_sessions)
+			break;
+		pthread_cond_wait(&pool->released, &pool->lock);
+	}
+	key->n_sessions++;
+	pthread_mutex_unlock(&pool->lock);
+
+	struct PoolEntry *entry = entry_create(pool, key, err);
+	if (!entry) {
+		pthread_mutex_lock(&pool->lock);
+		key->n_sessions--;
+		pthread_cond_signal(&pool->released);
+		pthread_mutex_unlock(&pool->lock);
+		return NULL;
+	}
+	return &entry->user_pi;
+}
+
+static void entry_put_idle(struct SessionPool *pool, struct PoolEntry *entry)
+{
+	pthread_mutex_lock(&pool->lock);
+	entry->next = entry->key->idle;
+	entry->key->idle = entry;
+	pthread_cond_signal(&pool->released);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+void session_pool_checkin(struct SessionPool *pool, struct UserPI *user_pi)
+{
+	struct PoolEntry *entry = (struct PoolEntry *)user_pi;
+	entry->last_used_ms = now_ms();
+	entry->last_active_ms = entry->last_used_ms;
+	entry_put_idle(pool, entry);
+}
+
+void session_pool_discard(struct SessionPool *pool, struct UserPI *user_pi)
+{
+	struct PoolEntry *entry = (struct PoolEntry *)user_pi;
+	struct PoolKey *key = entry->key;
+	entry_close(entry);
+	pthread_mutex_lock(&pool->lock);
+	key->n_sessions--;
+	pthread_cond_signal(&pool->released);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+void session_pool_maintain(struct SessionPool *pool)
+{
+	const struct PoolOptions *options = &pool->options;
+	struct PoolEntry *work = NULL;
+	uint64_t now = now_ms();
+
+	// Take out the sessions that need attention, so that the network
+	// round trips happen without the lock.
+	pthread_mutex_lock(&pool->lock);
+	for (struct PoolKey *key = pool->keys; key; key = key->next) {
+		for (struct PoolEntry **p = &key->idle; *p;) {
+			struct PoolEntry *entry = *p;
+			bool expired = options->idle_timeout_ms &&
+			               now - entry->last_used_ms >=
+			                       options->idle_timeout_ms;
+			bool stale = options->keepalive_ms &&
+			             now - entry->last_active_ms >=
+			                     options->keepalive_ms;
+			if (!expired && !stale) {
+				p = &entry->next;
+				continue;
+			}
+			*p = entry->next;
+			entry->next = work;
+			work = entry;
+		}
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	while (work) {
+		struct PoolEntry *entry = work;
+		work = entry->next;
+		bool expired = options->idle_timeout_ms &&
+		               now - entry->last_used_ms >=
+		                       options->idle_timeout_ms;
+		if (!expired && entry_is_healthy(entry, true)) {
+			// A keepalive doesn't count as use, so that the
+			// session still expires.
+			entry->last_active_ms = now_ms();
+			entry_put_idle(pool, entry);
+			continue;
+		}
+		debug("[INFO] Reaping a pooled session.\n");
+		session_pool_discard(pool, &entry->user_pi);
+	}
+}
+
+static void *maintenance_main(void *arg)
+{
+	struct SessionPool *pool = arg;
+	const struct PoolOptions *options = &pool->options;
+	unsigned int interval_ms = options->keepalive_ms;
+	if (!interval_ms || (options->idle_timeout_ms &&
+	                     options->idle_timeout_ms < interval_ms))
+		interval_ms = options->idle_timeout_ms;
+	interval_ms = interval_ms / 2 + 1;
+
+	pthread_mutex_lock(&pool->lock);
+	while (!pool->stopping) {
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += interval_ms / 1000;
+		deadline.tv_nsec += (interval_ms % 1000) * 1000000L;
+		if (deadline.tv_nsec >= 1000000000L) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
+		pthread_cond_timedwait(&pool->stop, &pool->lock, &deadline);
+		if (pool->stopping)
+			break;
+		pthread_mutex_unlock(&pool->lock);
+		session_pool_maintain(pool);
+		pthread_mutex_lock(&pool->lock);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+struct SessionPool *session_pool_create(const struct PoolOptions *options)
+{
+	struct SessionPool *pool = calloc(1, sizeof(*pool));
+	if (!pool)
+		return NULL;
+	pool->options = *options;
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->released, NULL);
+	pthread_cond_init(&pool->stop, NULL);
+	if (options->keepalive_ms || options->idle_timeout_ms) {
+		if (pthread_create(&pool->thread, NULL, maintenance_main,
+		                   pool)) {
+			session_pool_destroy(pool);
+			return NULL;
+		}
+		pool->has_thread = true;
+	}
+	return pool;
+}
+
+void session_pool_destroy(struct SessionPool *pool)
+{
+	if (pool->has_thread) {
+		pthread_mutex_lock(&pool->lock);
+		pool->stopping = true;
+		pthread_cond_signal(&pool->stop);
+		pthread_mutex_unlock(&pool->lock);
+		pthread_join(pool->thread, NULL);
+	}
+	while (pool->keys) {
+		struct PoolKey *key = pool->keys;
+		pool->keys = key->next;
+		while (key->idle) {
+			struct PoolEntry *entry = key->idle;
+			key->idle = entry->next;
+			entry_close(entry);
+		}
+		pool_key_free(key);
+	}
+	pthread_cond_destroy(&pool->stop);
+	pthread_cond_destroy(&pool->released);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool);
+}
@@ -0,0 +1,59 @@
+#ifndef _POOL_H
+#define _POOL_H
+
+#include <stdbool.h>
+
+struct UserPI;
+struct LoginInfo;
+struct ErrMsg;
+
+struct PoolOptions {
+	/// Sessions per (host, service, login), 0 means unbounded.
+	unsigned int max_sessions;
+	/// Send NOOP to sessions idle for this long, 0 disables keepalive.
+	unsigned int keepalive_ms;
+	/// Close sessions idle for this long, 0 keeps them forever.
+	unsigned int idle_timeout_ms;
+};
+
+struct SessionPool;
+
+/// Create a pool of logged-in sessions.
+/**
+ *  A maintenance thread sends the keepalives and reaps idle sessions,
+ *  if either is enabled in \a options.
+ *  \return NULL on failure.
+ */
+struct SessionPool *session_pool_create(const struct PoolOptions *options);
+
+/// Close every idle session and free \a pool.
+/**
+ *  All sessions must have been checked in or discarded.
+ */
+void session_pool_destroy(struct SessionPool *pool);
+
+/// Get a logged-in session to \a name, \a service.
+/**
+ *  Idle sessions are reused after a health check. New ones are cloned from
+ *  an earlier session to the same server, so DNS is resolved once per key.
+ *  When the key is at `max_sessions`, this waits for a check-in.
+ *  \return NULL on failure.
+ */
+struct UserPI *session_pool_checkout(struct SessionPool *pool,
+                                     const char *name, const char *service,
+                                     const struct LoginInfo *login,
+                                     struct ErrMsg *err);
+
+/// Give a healthy session back to \a pool.
+/**
+ *  The session must not be in the middle of a transfer.
+ */
+void session_pool_checkin(struct SessionPool *pool, struct UserPI *user_pi);
+
+/// Close a broken session instead of giving it back.
+void session_pool_discard(struct SessionPool *pool, struct UserPI *user_pi);
+
+/// Send keepalives and reap idle sessions now.
+void session_pool_maintain(struct SessionPool *pool);
+
+#endif
@@ -0,0 +1,354 @@
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "debug.h"
+
+#include "cmd.h"
+#include "error.h"
+#include "ftp.h"
+#include "remote_file.h"
+
+struct Block {
+	int64_t index; /// -1 while unused.
+	size_t len; /// Less than the block length only at the end of the file.
+	char *data;
+	/// In the LRU list.
+	struct Block *newer;
+	struct Block *older;
+	struct Block *next_in_bucket;
+};
+
+struct RemoteFile {
+	struct UserPI *user_pi;
+	char *path;
+	off_t size;
+	struct RemoteFileOptions options;
+
+	/// Cached blocks, found by index in \a buckets.
+	struct Block *blocks;
+	unsigned int n_taken;
+	struct Block **buckets;
+	size_t bucket_mask;
+	struct Block *newest;
+	struct Block *oldest;
+	char *data;
+
+	/// A read from where the last one ended is sequential.
+	off_t last_end;
+	/// Blocks fetched past the ones wanted.
+	unsigned int read_ahead;
+	/// A transfer is left open at block \a stream_index.
+	bool streaming;
+	int64_t stream_index;
+
+	struct RemoteFileStats stats;
+};
+
+static struct Block **bucket_of(struct RemoteFile *file, int64_t index)
+{
+	return &file->buckets[index & file->bucket_mask];
+}
+
+static struct Block *block_find(struct RemoteFile *file, int64_t index)
+{
+	struct Block *block = *bucket_of(file, index);
+	while (block && block->index != index)
+		block = block->next_in_bucket;
+	return block;
+}
+
+static void bucket_remove(struct RemoteFile *file, struct Block *block)
+{
+	struct Block **link = bucket_of(file, block->index);
+	while (*link != block)
+		link = &(*link)->next_in_bucket;
+	*link = block->next_in_bucket;
+}
+
+static void lru_unlink(struct RemoteFile *file, struct Block *block)
+{
+	if (block->newer)
+		block->newer->older = block->older;
+	else
+		file->newest = block->older;
+	if (block->older)
+		block->older->newer = block->newer;
+	else
+		file->oldest = block->newer;
+}
+
+static void lru_push_newest(struct RemoteFile *file, struct Block *block)
+{
+	block->newer = NULL;
+	block->older = file->newest;
+	if (file->newest)
+		file->newest->newer = block;
+	else
+		file->oldest = block;
+	file->newest = block;
+}
+
+static void lru_push_oldest(struct RemoteFile *file, struct Block *block)
+{
+	block->older = NULL;
+	block->newer = file->oldest;
+	if (file->oldest)
+		file->oldest->older = block;
+	else
+		file->newest = block;
+	file->oldest = block;
+}
+
+/// A block for \a index, unused or else the least recently used one.
+static struct Block *block_take(struct RemoteFile *file, int64_t index)
+{
+	struct Block *block;
+	if (file->n_taken < file->options.max_blocks) {
+		block = &file->blocks[file->n_taken++];
+	} else {
+		block = file->oldest;
+		lru_unlink(file, block);
+		if (block->index >= 0)
+			bucket_remove(file, block);
+	}
+	off_t begin = index * file->options.block_len;
+	block->index = index;
+	block->len = file->size - begin < (off_t)file->options.block_len ?
+	                     (size_t)(file->size - begin) :
+	                     file->options.block_len;
+	block->next_in_bucket = *bucket_of(file, index);
+	*bucket_of(file, index) = block;
+	lru_push_newest(file, block);
+	return block;
+}
+
+/// Make \a block the first to be taken again.
+static void block_drop(struct RemoteFile *file, struct Block *block)
+{
+	bucket_remove(file, block);
+	block->index = -1;
+	lru_unlink(file, block);
+	lru_push_oldest(file, block);
+}
+
+static void stream_abort(struct RemoteFile *file)
+{
+	if (!file->streaming)
+		return;
+	file->streaming = false;
+	download_abort(file->user_pi, &(struct ErrMsg){ 0 });
+}
+
+static int receive_block(struct RemoteFile *file, struct Block *block,
+                         struct ErrMsg *err)
+{
+	for (size_t got = 0; got < block->len;) {
+		ssize_t n = data_recv(file->user_pi, block->data + got,
+		                      block->len - got);
+		if (n < 0) {
+			strerror_r(errno, err->msg, ERR_MSG_MAX_LEN);
+			ERR_WHERE();
+			return -1;
+		}
+		if (n == 0) {
+			ERR_PRINTF("%s ended before %lld bytes.", file->path,
+			           (long long)file->size);
+			ERR_WHERE();
+			return -1;
+		}
+		got += n;
+		file->stats.bytes_received += n;
+	}
+	return 0;
+}
+
+/// Fetch block \a index and the ones up to \a last_wanted, plus read-ahead.
+/**
+ *  \return the block for \a index, or NULL on error.
+ */
+static struct Block *fetch(struct RemoteFile *file, int64_t index,
+                           int64_t last_wanted, bool sequential,
+                           struct ErrMsg *err)
+{
+	const struct RemoteFileOptions *o = &file->options;
+	int64_t n_blocks = (file->size + o->block_len - 1) / o->block_len;
+	if (!sequential)
+		file->read_ahead = 0;
+	else if (!file->read_ahead)
+		file->read_ahead = 1;
+	else if (file->read_ahead < o->max_read_ahead / 2)
+		file->read_ahead *= 2;
+	else
+		file->read_ahead = o->max_read_ahead;
+
+	int64_t last = last_wanted + file->read_ahead;
+	if (last >= n_blocks)
+		last = n_blocks - 1;
+	// Keep the first block from being taken back by the last ones.
+	if (last - index >= o->max_blocks)
+		last = index + o->max_blocks - 1;
+	for (int64_t i = index + 1; i <= last; i++) {
+		if (block_find(file, i)) {
+			last = i - 1;
+			break;
+		}
+	}
+
+	if (file->streaming && file->stream_index != index)
+		stream_abort(file);
+	if (!file->streaming) {
+		if (download_init_at(file->user_pi, file->path,
+		                     index * o->block_len, err) < 0)
+			return NULL;
+		file->streaming = true;
+		file->stream_index = index;
+		file->stats.transfers++;
+	}
+	struct Block *first = NULL;
+	for (int64_t i = index; i <= last; i++) {
+		struct Block *block = block_take(file, i);
+		if (receive_block(file, block, err) < 0) {
+			block_drop(file, block);
+			stream_abort(file);
+			return NULL;
+		}
+		file->stream_index++;
+		if (!first)
+			first = block;
+	}
+	if (file->stream_index == n_blocks) {
+		file->streaming = false;
+		if (download_finish(file->user_pi, err) < 0)
+			return NULL;
+	} else if (!file->read_ahead) {
+		// Random reads would only waste the rest of the transfer.
+		stream_abort(file);
+	}
+	return first;
+}
+
+struct RemoteFile *remote_file_open(struct UserPI *user_pi, char *path,
+                                    const struct RemoteFileOptions *options,
+                                    struct ErrMsg *err)
+{
+	// REST would take restart markers of the server, not byte offsets.
+	if (user_pi->mode_b) {
+		ERR_PRINTF("Reads need REST at byte offsets, not in MODE B.");
+		ERR_WHERE();
+		return NULL;
+	}
+	off_t size = get_file_size(user_pi, path, err);
+	if (size < 0)
+		return NULL;
+	struct RemoteFile *file = calloc(1, sizeof(*file));
+	if (!file)
+		goto nomem;
+	*file = (struct RemoteFile){
+		.user_pi = user_pi,
+		.size = size,
+		.options = options ? *options : (struct RemoteFileOptions){ 0 },
+	};
+	struct RemoteFileOptions *o = &file->options;
+	if (!o->block_len)
+		o->block_len = REMOTE_FILE_DEFAULT_BLOCK_LEN;
+	if (!o->max_blocks)
+		o->max_blocks = REMOTE_FILE_DEFAULT_MAX_BLOCKS;
+	if (!o->max_read_ahead)
+		o->max_read_ahead = REMOTE_FILE_DEFAULT_MAX_READ_AHEAD;
+	if (o->block_len > SIZE_MAX / o->max_blocks) {
+		ERR_PRINTF("A cache of %u blocks of %zu bytes is too big.",
+		           o->max_blocks, o->block_len);
+		ERR_WHERE();
+		free(file);
+		return NULL;
+	}
+	size_t n_buckets = 1;
+	while (n_buckets < o->max_blocks)
+		n_buckets *= 2;
+	file->bucket_mask = n_buckets - 1;
+	file->path = strdup(path);
+	file->blocks = calloc(o->max_blocks, sizeof(*file->blocks));
+	file->buckets = calloc(n_buckets, sizeof(*file->buckets));
+	// Pages are only touched once blocks are used.
+	file->data = malloc(o->max_blocks * o->block_len);
+	if (!file->path || !file->blocks || !file->buckets || !file->data)
+		goto nomem;
+	for (unsigned int i = 0; i < o->max_blocks; i++) {
+		file->blocks[i].index = -1;
+		file->blocks[i].data = file->data + i * o->block_len;
+	}
+	return file;
+nomem:
+	strerror_r(errno, err->msg, ERR_MSG_MAX_LEN);
+	ERR_WHERE();
+	remote_file_close(file);
+	return NULL;
+}
+
+void remote_file_close(struct RemoteFile *file)
+{
+	if (!file)
+		return;
+	stream_abort(file);
+	free(file->path);
+	free(file->blocks);
+	free(file->buckets);
+	free(file->data);
+	free(file);
+}
+
+off_t remote_file_size(const struct RemoteFile *file)
+{
+	return file->size;
+}
+
+ssize_t remote_file_pread(struct RemoteFile *file, void *buf, size_t len,
+                          off_t offset, struct ErrMsg *err)
+{
+	if (offset < 0) {
+		ERR_PRINTF("Invalid offset %lld.", (long long)offset);
+		ERR_WHERE();
+		return -1;
+	}
+	if (offset >= file->size || !len)
+		return 0;
+	if ((off_t)len > file->size - offset)
+		len = file->size - offset;
+	size_t block_len = file->options.block_len;
+	bool sequential = offset == file->last_end;
+	int64_t last_wanted = (offset + len - 1) / block_len;
+	for (size_t done = 0; done < len;) {
+		off_t pos = offset + done;
+		int64_t index = pos / block_len;
+		struct Block *block = block_find(file, index);
+		if (block) {
+			file->stats.hits++;
+			lru_unlink(file, block);
+			lru_push_newest(file, block);
+		} else {
+			file->stats.misses++;
+			block = fetch(file, index, last_wanted, sequential, err);
+			if (!block)
+				return -1;
+		}
+		size_t at = pos - index * block_len;
+		size_t n = block->len - at;
+		if (n > len - done)
+			n = len - done;
+		memcpy((char *)buf + done, block->data + at, n);
+		done += n;
+	}
+	file->last_end = offset + len;
+	debug("[INFO] Read %zu at %lld of %s.\n", len, (long long)offset,
+	      file->path);
+	return len;
+}
+
+void remote_file_stats(const struct RemoteFile *file,
+                       struct RemoteFileStats *stats)
+{
+	*stats = file->stats;
+}
@@ -0,0 +1,67 @@
+#ifndef _REMOTE_FILE_H
+#define _REMOTE_FILE_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+struct UserPI;
+struct ErrMsg;
+
+/// How a RemoteFile caches and reads ahead.
+struct RemoteFileOptions {
+	/// Reads are done in blocks of this many bytes.
+	size_t block_len;
+	/// The most blocks kept, the least recently used go first.
+	unsigned int max_blocks;
+	/// Sequential reads fetch up to this many blocks ahead.
+	unsigned int max_read_ahead;
+};
+
+#define REMOTE_FILE_DEFAULT_BLOCK_LEN (64 * 1024)
+#define REMOTE_FILE_DEFAULT_MAX_BLOCKS 256
+#define REMOTE_FILE_DEFAULT_MAX_READ_AHEAD 64
+
+struct RemoteFileStats {
+	uint64_t hits; /// Blocks read from the cache.
+	uint64_t misses; /// Blocks that started a fetch.
+	uint64_t transfers; /// RETR sent.
+	uint64_t bytes_received;
+};
+
+/// A file on the server read at random offsets.
+struct RemoteFile;
+
+/// Open \a path for remote_file_pread().
+/**
+ *  \a user_pi belongs to the file until it's closed, since a transfer may
+ *  be left open between reads. \a options may be NULL for the defaults,
+ *  and so may any of its fields be 0. Not in MODE B, where REST doesn't
+ *  take byte offsets.
+ *  \return NULL on error.
+ */
+struct RemoteFile *remote_file_open(struct UserPI *user_pi, char *path,
+                                    const struct RemoteFileOptions *options,
+                                    struct ErrMsg *err);
+
+/// Abort any transfer left open, and free \a file.
+void remote_file_close(struct RemoteFile *file);
+
+/// The size of the file, as given by SIZE when it was opened.
+off_t remote_file_size(const struct RemoteFile *file);
+
+/// Read up to \a len bytes at \a offset, like pread().
+/**
+ *  Missing blocks are fetched with REST and RETR, and the transfer is
+ *  aborted once they're in, unless the reads look sequential. Then blocks
+ *  are read ahead, twice as many every time up to `max_read_ahead`, and
+ *  the transfer stays open for the next read to carry on with.
+ *  \return the number of bytes read, less than \a len only at the end of
+ *  the file, or -1 on error.
+ */
+ssize_t remote_file_pread(struct RemoteFile *file, void *buf, size_t len,
+                          off_t offset, struct ErrMsg *err);
+
+void remote_file_stats(const struct RemoteFile *file,
+                       struct RemoteFileStats *stats);
+
+#endif
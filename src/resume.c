@@ -0,0 +1,201 @@
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "debug.h"
+
+#include "cmd.h"
+#include "error.h"
+#include "ftp.h"
+#include "mode_b.h"
+#include "resume.h"
+
+#define RESUME_BUF_LEN (256 * 1024)
+
+/// What tells one version of a file from another.
+struct FileVersion {
+	off_t size;
+	bool has_mtime;
+	time_t mtime;
+};
+
+static int file_version(struct UserPI *user_pi, char *path,
+                        struct FileVersion *version, struct ErrMsg *err)
+{
+	version->size = get_file_size(user_pi, path, err);
+	if (version->size < 0)
+		return -1;
+	// Not every server has MDTM, SIZE alone has to do then.
+	version->has_mtime = get_modification_time(user_pi, path,
+	                                           &version->mtime,
+	                                           &(struct ErrMsg){ 0 }) == 0;
+	return 0;
+}
+
+static bool file_version_eq(const struct FileVersion *a,
+                            const struct FileVersion *b)
+{
+	return a->size == b->size && a->has_mtime == b->has_mtime &&
+	       (!a->has_mtime || a->mtime == b->mtime);
+}
+
+/// Get \a user_pi ready to restart the download of \a path.
+/**
+ *  \a retry is cleared if restarting can't help.
+ *  \return -1 on error.
+ */
+static int resume_prepare(struct UserPI *user_pi,
+                          const struct LoginInfo *login, char *path,
+                          const struct FileVersion *version, bool *retry,
+                          struct ErrMsg *err)
+{
+	if (!session_is_alive(user_pi)) {
+		if (!login) {
+			*retry = false;
+			ERR_PRINTF("The control connection is lost.");
+			ERR_WHERE();
+			return -1;
+		}
+		struct UserPI fresh;
+		if (user_pi_clone(user_pi, &fresh, login, err) < 0)
+			return -1;
+		// The new session shares addr_info, which stays with user_pi.
+		user_pi_release(user_pi);
+		*user_pi = fresh;
+		debug("[INFO] Reconnected to resume %s.\n", path);
+	}
+	struct FileVersion now;
+	if (file_version(user_pi, path, &now, err) < 0)
+		return -1;
+	if (!file_version_eq(&now, version)) {
+		*retry = false;
+		ERR_PRINTF("%s has changed on the server.", path);
+		ERR_WHERE();
+		return -1;
+	}
+	return 0;
+}
+
+/// Receive \a path from \a offset on, moving \a offset past what's written.
+/**
+ *  In block mode, \a offset is moved back to the last restart marker on
+ *  failure, or else to where it was.
+ *  \a retry is cleared if restarting can't help.
+ *  \return -1 on error.
+ */
+static int resume_receive(struct UserPI *user_pi, char *path, int out_fd,
+                          off_t *offset, char *buf, bool *retry,
+                          struct ErrMsg *err)
+{
+	off_t begin = *offset;
+	if (download_init_at(user_pi, path, *offset, err) < 0)
+		return -1;
+	for (;;) {
+		ssize_t n = data_recv(user_pi, buf, RESUME_BUF_LEN);
+		if (n < 0) {
+			strerror_r(errno, err->msg, ERR_MSG_MAX_LEN);
+			goto fail;
+		}
+		if (n == 0)
+			break;
+		for (ssize_t written = 0; written < n;) {
+			ssize_t w = pwrite(out_fd, buf + written, n - written,
+			                   *offset + written);
+			if (w < 0 && errno == EINTR)
+				continue;
+			if (w <= 0) {
+				strerror_r(errno, err->msg, ERR_MSG_MAX_LEN);
+				*retry = false;
+				goto fail;
+			}
+			written += w;
+		}
+		*offset += n;
+	}
+	return download_finish(user_pi, err);
+fail:
+	ERR_WHERE();
+	// REST then only takes one of the markers of the server.
+	if (user_pi->mode_b) {
+		off_t marker = mode_b_marker(user_pi->mode_b);
+		*offset = marker >= 0 ? marker : begin;
+	}
+	download_abort(user_pi, &(struct ErrMsg){ 0 });
+	return -1;
+}
+
+static void sleep_ms(unsigned int ms)
+{
+	struct timespec ts = { .tv_sec = ms / 1000,
+		               .tv_nsec = ms % 1000 * 1000000L };
+	while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+		;
+}
+
+off_t download_resumable(struct UserPI *user_pi, const struct LoginInfo *login,
+                         char *path, int out_fd, off_t offset,
+                         const struct RetryOptions *options,
+                         struct ErrMsg *err)
+{
+	const struct RetryOptions defaults = {
+		.max_retries = RETRY_DEFAULT_MAX_RETRIES,
+		.backoff_ms = RETRY_DEFAULT_BACKOFF_MS,
+		.max_backoff_ms = RETRY_DEFAULT_MAX_BACKOFF_MS,
+	};
+	if (!options)
+		options = &defaults;
+	struct FileVersion version;
+	if (file_version(user_pi, path, &version, err) < 0)
+		return -1;
+	if (offset < 0 || offset > version.size) {
+		ERR_PRINTF("Cannot resume at %lld, the file has %lld bytes.",
+		           (long long)offset, (long long)version.size);
+		ERR_WHERE();
+		return -1;
+	}
+	char *buf = malloc(RESUME_BUF_LEN);
+	if (!buf) {
+		strerror_r(errno, err->msg, ERR_MSG_MAX_LEN);
+		ERR_WHERE();
+		return -1;
+	}
+
+	off_t ret = -1;
+	unsigned int n_failures = 0;
+	unsigned int backoff_ms = options->backoff_ms;
+	for (bool restart = false;; restart = true) {
+		off_t begin = offset;
+		bool retry = true;
+		if ((!restart || resume_prepare(user_pi, login, path, &version,
+		                                &retry, err) == 0) &&
+		    resume_receive(user_pi, path, out_fd, &offset, buf, &retry,
+		                   err) == 0) {
+			if (offset == version.size) {
+				ret = offset;
+				break;
+			}
+			ERR_PRINTF("The file ended at %lld, expected %lld.",
+			           (long long)offset, (long long)version.size);
+			ERR_WHERE();
+		}
+		if (!retry)
+			break;
+		if (offset > begin) {
+			n_failures = 0;
+			backoff_ms = options->backoff_ms;
+		}
+		if (n_failures++ == options->max_retries)
+			break;
+		debug("[WARNING] Retrying %s at %lld in %u ms: [%s] %s\n", path,
+		      (long long)offset, backoff_ms, err->where, err->msg);
+		sleep_ms(backoff_ms);
+		backoff_ms = backoff_ms > options->max_backoff_ms / 2 ?
+		                     options->max_backoff_ms :
+		                     backoff_ms * 2;
+	}
+	free(buf);
+	return ret;
+}
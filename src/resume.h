@@ -0,0 +1,42 @@
+#ifndef _RESUME_H
+#define _RESUME_H
+
+#include <sys/types.h>
+
+struct UserPI;
+struct LoginInfo;
+struct ErrMsg;
+
+/// How download_resumable() retries a broken transfer.
+struct RetryOptions {
+	/// Give up after this many failures in a row without any progress.
+	unsigned int max_retries;
+	/// The delay before the first retry, doubled for every next one.
+	unsigned int backoff_ms;
+	unsigned int max_backoff_ms;
+};
+
+#define RETRY_DEFAULT_MAX_RETRIES 5
+#define RETRY_DEFAULT_BACKOFF_MS 500
+#define RETRY_DEFAULT_MAX_BACKOFF_MS 30000
+
+/// Download \a path into \a out_fd from \a offset on, surviving failures.
+/**
+ *  Byte n of the file is written at n in \a out_fd with pwrite(), so a
+ *  partial download is continued by passing its length as \a offset.
+ *  When the data connection breaks, the transfer is restarted with REST
+ *  from the last byte written, after a backoff. If the control connection
+ *  is gone too, \a user_pi is replaced with a new session logged in with
+ *  \a login, unless it's NULL. Before every restart, SIZE and MDTM must
+ *  still give what they gave at the beginning, or the file has changed
+ *  and the download fails. \a options may be NULL for the defaults. In
+ *  block mode, REST takes the last restart marker of the server instead,
+ *  so \a offset has to be 0 or one of them.
+ *  \return the size of the file, or -1 on error.
+ */
+off_t download_resumable(struct UserPI *user_pi, const struct LoginInfo *login,
+                         char *path, int out_fd, off_t offset,
+                         const struct RetryOptions *options,
+                         struct ErrMsg *err);
+
+#endif
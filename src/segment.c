@@ -0,0 +1,183 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "debug.h"
+
+#include "cmd.h"
+#include "error.h"
+#include "ftp.h"
+#include "segment.h"
+
+#define SEGMENT_BUF_LEN (256 * 1024)
+
+struct Segment {
+	struct UserPI *user_pi;
+	char *path;
+	int out_fd;
+	off_t begin;
+	off_t end;
+
+	pthread_t thread;
+	/// Segment 0 runs on the caller's session, the others on clones.
+	bool cloned;
+	struct UserPI clone;
+	int ret;
+	struct ErrMsg err;
+};
+
+/// Receive the range [begin, end) of the file on \a user_pi.
+static int segment_receive(struct Segment *seg, struct UserPI *user_pi,
+                           char *buf)
+{
+	struct ErrMsg *err = &seg->err;
+	if (download_init_at(user_pi, seg->path, seg->begin, err) < 0)
+		return -1;
+	off_t offset = seg->begin;
+	while (offset < seg->end) {
+		size_t want = SEGMENT_BUF_LEN;
+		if (want > seg->end - offset)
+			want = seg->end - offset;
+		ssize_t n = data_recv(user_pi, buf, want);
+		if (n < 0) {
+			strerror_r(errno, err->msg, ERR_MSG_MAX_LEN);
+			goto fail;
+		}
+		if (n == 0) {
+			ERR_PRINTF("The file ended at %lld, expected %lld.",
+			           (long long)offset, (long long)seg->end);
+			goto fail;
+		}
+		for (ssize_t written = 0; written < n;) {
+			ssize_t w = pwrite(seg->out_fd, buf + written,
+			                   n - written, offset + written);
+			if (w < 0 && errno == EINTR)
+				continue;
+			if (w <= 0) {
+				strerror_r(errno, err->msg, ERR_MSG_MAX_LEN);
+				goto fail;
+			}
+			written += w;
+		}
+		offset += n;
+	}
+	// The last segment runs into the end of the file, the others stop in
+	// the middle of it.
+	return download_abort(user_pi, err);
+fail:
+	ERR_WHERE();
+	download_abort(user_pi, &(struct ErrMsg){ 0 });
+	return -1;
+}
+
+static void *segment_main(void *arg)
+{
+	struct Segment *seg = arg;
+	struct ErrMsg *err = &seg->err;
+	seg->ret = -1;
+	char *buf = malloc(SEGMENT_BUF_LEN);
+	if (!buf) {
+		strerror_r(errno, err->msg, ERR_MSG_MAX_LEN);
+		ERR_WHERE();
+		return NULL;
+	}
+	debug("[INFO] Segment [%lld, %lld) started.\n", (long long)seg->begin,
+	      (long long)seg->end);
+	seg->ret = segment_receive(seg, seg->user_pi, buf);
+	free(buf);
+	return NULL;
+}
+
+off_t download_segmented(struct UserPI *user_pi,
+                         const struct LoginInfo *login, char *path,
+                         int out_fd, unsigned int n_segments,
+                         struct ErrMsg *err)
+{
+	// REST would take restart markers of the server, not byte offsets.
+	if (user_pi->mode_b) {
+		ERR_PRINTF("Segments need byte offsets, not in MODE B.");
+		goto fail;
+	}
+	off_t size = get_file_size(user_pi, path, err);
+	if (size < 0)
+		return -1;
+	if (n_segments < 1)
+		n_segments = 1;
+	if (size / n_segments < SEGMENT_MIN_LEN)
+		n_segments = size / SEGMENT_MIN_LEN + 1;
+
+	if (ftruncate(out_fd, size) < 0) {
+		strerror_r(errno, err->msg, ERR_MSG_MAX_LEN);
+		goto fail;
+	}
+	// Reserve the blocks now, so that the ranges don't fragment the file.
+	// Not every file system can, which is fine.
+	int fallocate_ret = posix_fallocate(out_fd, 0, size);
+	if (fallocate_ret && fallocate_ret != EOPNOTSUPP &&
+	    fallocate_ret != EINVAL) {
+		strerror_r(fallocate_ret, err->msg, ERR_MSG_MAX_LEN);
+		goto fail;
+	}
+	if (size == 0)
+		return download_to_fd(user_pi, path, out_fd, err);
+
+	struct Segment *segs = calloc(n_segments, sizeof(*segs));
+	if (!segs) {
+		strerror_r(errno, err->msg, ERR_MSG_MAX_LEN);
+		goto fail;
+	}
+	off_t seg_len = size / n_segments;
+	unsigned int n_started = 0;
+	off_t ret = -1;
+	// The clones are made before any segment starts, since a clone reads
+	// the state of user_pi that segment 0 changes.
+	for (unsigned int i = 0; i < n_segments; i++) {
+		struct Segment *seg = &segs[i];
+		*seg = (struct Segment){
+			.user_pi = user_pi,
+			.path = path,
+			.out_fd = out_fd,
+			.begin = i * seg_len,
+			.end = i == n_segments - 1 ? size : (i + 1) * seg_len,
+		};
+		if (i) {
+			if (user_pi_clone(user_pi, &seg->clone, login, err) < 0)
+				goto join;
+			seg->cloned = true;
+			seg->user_pi = &seg->clone;
+		}
+	}
+	for (; n_started < n_segments; n_started++) {
+		struct Segment *seg = &segs[n_started];
+		int create_ret = pthread_create(&seg->thread, NULL,
+		                                segment_main, seg);
+		if (create_ret) {
+			strerror_r(create_ret, err->msg, ERR_MSG_MAX_LEN);
+			ERR_WHERE();
+			goto join;
+		}
+	}
+	ret = size;
+
+join:
+	for (unsigned int i = 0; i < n_segments; i++) {
+		struct Segment *seg = &segs[i];
+		if (i < n_started)
+			pthread_join(seg->thread, NULL);
+		if (seg->cloned)
+			user_pi_quit(&seg->clone);
+		if (i < n_started && seg->ret < 0 && ret >= 0) {
+			*err = seg->err;
+			ret = -1;
+		}
+	}
+	free(segs);
+	return ret;
+fail:
+	ERR_WHERE();
+	return -1;
+}
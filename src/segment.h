@@ -0,0 +1,27 @@
+#ifndef _SEGMENT_H
+#define _SEGMENT_H
+
+#include <sys/types.h>
+
+struct UserPI;
+struct LoginInfo;
+struct ErrMsg;
+
+/// Segments smaller than this aren't worth another session.
+#define SEGMENT_MIN_LEN (1024 * 1024)
+
+/// Download \a path into \a out_fd over \a n_segments sessions at once.
+/**
+ *  The file is split into ranges using SIZE. \a user_pi fetches the first
+ *  range, and the others are fetched by sessions cloned from it with
+ *  \a login, each starting with REST. Every range is written with pwrite()
+ *  into \a out_fd, which is preallocated to the size of the file. Not in
+ *  MODE B, where REST doesn't take byte offsets.
+ *  \return the size of the file, or -1 on error.
+ */
+off_t download_segmented(struct UserPI *user_pi,
+                         const struct LoginInfo *login, char *path,
+                         int out_fd, unsigned int n_segments,
+                         struct ErrMsg *err);
+
+#endif
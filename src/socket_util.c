@@ -1,10 +1,25 @@
+#define _GNU_SOURCE
+#include <arpa/inet.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <linux/errqueue.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "config.h"
+
 #include "debug.h"
 #include "socket_util.h"
+#include "trace.h"
 
 ssize_t sendn(int fd, const void *buf, size_t n)
 {
@@ -40,69 +55,305 @@ ssize_t try_recv(int fd, char *buf, size_t size)
 
 void recv_buf_init(struct RecvBuf *rb)
 {
-	rb->remain_count = 0;
+	rb->begin = 0;
+	rb->end = 0;
 }
 
-/// Fills the receive buffer \a rb by calling recv().
+size_t recv_buf_next_line(struct RecvBuf *rb, const char **line)
+{
+	char *begin = &rb->buf[rb->begin];
+	size_t remain = rb->end - rb->begin;
+	size_t n = remain < LINE_MAX_LEN ? remain : LINE_MAX_LEN;
+	// memchr() is vectorised, unlike a loop over the bytes.
+	char *lf = memchr(begin, '\n', n);
+	if (lf)
+		n = lf + 1 - begin;
+	else if (n < LINE_MAX_LEN)
+		return 0;
+	*line = begin;
+	rb->begin += n;
+	return n;
+}
+
+size_t recv_buf_space(struct RecvBuf *rb, char **space)
+{
+	if (rb->begin == rb->end) {
+		rb->begin = 0;
+		rb->end = 0;
+	} else if (rb->end == sizeof(rb->buf)) {
+		// Only a partial line, shorter than LINE_MAX_LEN, is left.
+		memmove(rb->buf, &rb->buf[rb->begin], rb->end - rb->begin);
+		rb->end -= rb->begin;
+		rb->begin = 0;
+	}
+	*space = &rb->buf[rb->end];
+	return sizeof(rb->buf) - rb->end;
+}
+
+void recv_buf_commit(struct RecvBuf *rb, size_t n)
+{
+	rb->end += n;
+}
+
+ssize_t recv_buf_get_line(struct RecvBuf *rb, int fd, const char **line)
+{
+	for (;;) {
+		size_t len = recv_buf_next_line(rb, line);
+		if (len)
+			return len;
+		char *space;
+		size_t size = recv_buf_space(rb, &space);
+		ssize_t n = try_recv(fd, space, size);
+		if (n < 0)
+			return -1;
+		if (n == 0) {
+			// The connection has been properly closed.
+			*line = &rb->buf[rb->begin];
+			len = rb->end - rb->begin;
+			rb->begin = rb->end;
+			return len;
+		}
+		recv_buf_commit(rb, n);
+	}
+}
+
+static int64_t now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/// Order \a addr_info the way RFC 8305 tries it.
 /**
- *  Only call this if everything previously stored in the buffer
- *  has been consumed.
- *  \return 1 on success, 0 when the connection is closed, or -1 otherwise.
+ *  The first family keeps going first, and the families take turns.
+ *  \return the number of addresses put in \a order.
  */
-static int recv_buf_fill(struct RecvBuf *rb, int fd)
+static size_t interleave_families(const struct addrinfo *addr_info,
+                                  const struct addrinfo **order, size_t n)
 {
-	for (;;) {
-		if ((rb->remain_count = recv(fd, rb->buf, sizeof(rb->buf),
-		                             MSG_NOSIGNAL)) < 0) {
-			if (errno != EINTR)
-				return -1;
-			continue;
-		} else if (rb->remain_count == 0) {
-			return 0; // The connection has been properly closed.
+	size_t len = 0;
+	const struct addrinfo *first = addr_info;
+	const struct addrinfo *other = addr_info;
+	while (other && other->ai_family == addr_info->ai_family)
+		other = other->ai_next;
+	while ((first || other) && len < n) {
+		if (first) {
+			order[len++] = first;
+			do
+				first = first->ai_next;
+			while (first && first->ai_family != addr_info->ai_family);
+		}
+		if (other && len < n) {
+			order[len++] = other;
+			do
+				other = other->ai_next;
+			while (other && other->ai_family == addr_info->ai_family);
 		}
-		rb->read_ptr = rb->buf;
-		return 1;
 	}
+	return len;
 }
 
-/// Gets one character from \a rb and put it in \a c.
+/// Start connecting to \a ai without blocking.
 /**
- *  Potentially refills the buffer.
- *  \return 1 on success, 0 when the connection is closed, or -1 otherwise.
+ *  \return a socket descriptor, or -1 and sets errno. \a *done is set if
+ *  it connected right away.
  */
-static inline int recv_buf_get_char(struct RecvBuf *rb, int fd, char *c)
+static int connect_start(const struct addrinfo *ai, bool *done)
 {
-	if (rb->remain_count <= 0) {
-		int result = recv_buf_fill(rb, fd);
-		if (result <= 0)
-			return result;
+	int fd = socket(ai->ai_family, SOCK_STREAM | SOCK_NONBLOCK,
+	                ai->ai_protocol);
+	if (fd < 0)
+		return -1;
+	*done = connect(fd, ai->ai_addr, ai->ai_addrlen) == 0;
+	if (!*done && errno != EINPROGRESS) {
+		int saved = errno;
+		close(fd);
+		errno = saved;
+		return -1;
 	}
-	rb->remain_count--;
-	*c = *(rb->read_ptr++);
-	return 1;
+	return fd;
 }
 
-ssize_t recv_buf_get_line(struct RecvBuf *rb, int fd, unsigned char *line)
+/// Clear O_NONBLOCK, or close \a fd.
+/**
+ *  \return \a fd, or -1 and sets errno.
+ */
+static int set_blocking(int fd)
 {
-	int result;
-	ssize_t n;
-	for (n = 0; n < LINE_MAX_LEN; n++) {
-		char c;
-		if ((result = recv_buf_get_char(rb, fd, &c)) == 1) {
-			*line++ = c;
-			if (c == '\n')
+	int flags = fcntl(fd, F_GETFL);
+	if (flags < 0 || fcntl(fd, F_SETFL, flags & ~O_NONBLOCK) < 0) {
+		int saved = errno;
+		close(fd);
+		errno = saved;
+		return -1;
+	}
+	return fd;
+}
+
+#define CONNECT_MAX_ATTEMPTS 16
+
+int connect_happy(const struct addrinfo *addr_info, unsigned int timeout_ms)
+{
+	const struct addrinfo *order[CONNECT_MAX_ATTEMPTS];
+	size_t n = interleave_families(addr_info, order, CONNECT_MAX_ATTEMPTS);
+	struct pollfd fds[CONNECT_MAX_ATTEMPTS];
+	nfds_t n_fds = 0;
+	size_t next = 0;
+	int64_t deadline = timeout_ms ? now_ms() + timeout_ms : INT64_MAX;
+	int64_t next_attempt = 0;
+	int fd = -1;
+	int last_errno = ECONNREFUSED;
+	trace_event(TRACE_CONNECT_BEGIN, -1, n, NULL, 0);
+
+	for (;;) {
+		int64_t now = now_ms();
+		if (next < n && (n_fds == 0 || now >= next_attempt)) {
+			bool done;
+			int s = connect_start(order[next++], &done);
+			if (s >= 0 && done) {
+				fd = s;
 				break;
-			continue;
+			}
+			if (s < 0) {
+				last_errno = errno;
+				continue;
+			}
+			fds[n_fds++] = (struct pollfd){ .fd = s,
+				                        .events = POLLOUT };
+			next_attempt = now + CONNECT_ATTEMPT_DELAY_MS;
+		}
+		if (n_fds == 0 && next >= n)
+			break;
+		if (now >= deadline) {
+			last_errno = ETIMEDOUT;
+			break;
 		}
-		if (result == 0) {
-			*line = 0;
-			return n - 1;
+		int64_t wake = deadline;
+		if (next < n && next_attempt < wake)
+			wake = next_attempt;
+		int wait = wake - now > INT32_MAX ? -1 : (int)(wake - now);
+		if (poll(fds, n_fds, wait) < 0) {
+			if (errno == EINTR)
+				continue;
+			last_errno = errno;
+			break;
 		}
+		for (nfds_t i = 0; i < n_fds && fd < 0;) {
+			if (!fds[i].revents) {
+				i++;
+				continue;
+			}
+			int so_error;
+			socklen_t len = sizeof(so_error);
+			if (getsockopt(fds[i].fd, SOL_SOCKET, SO_ERROR,
+			               &so_error, &len) < 0)
+				so_error = errno;
+			if (!so_error) {
+				fd = fds[i].fd;
+				fds[i] = fds[--n_fds];
+				break;
+			}
+			last_errno = so_error;
+			close(fds[i].fd);
+			fds[i] = fds[--n_fds];
+			// Don't wait out the delay after a failure.
+			next_attempt = 0;
+		}
+		if (fd >= 0)
+			break;
+	}
+	for (nfds_t i = 0; i < n_fds; i++)
+		close(fds[i].fd);
+	trace_event(TRACE_CONNECT_END, fd, fd < 0 ? last_errno : 0, NULL, 0);
+	if (fd < 0) {
+		errno = last_errno;
 		return -1;
 	}
-	*line = 0;
-	n++;
-	return n;
+	return set_blocking(fd);
+}
+
+int connect_nowait(const struct addrinfo *ai)
+{
+	trace_event(TRACE_CONNECT_BEGIN, -1, 1, NULL, 0);
+	bool done;
+	int fd = connect_start(ai, &done);
+	if (fd < 0)
+		trace_event(TRACE_CONNECT_END, -1, errno, NULL, 0);
+	return fd;
+}
+
+int connect_wait(int fd, unsigned int timeout_ms)
+{
+	struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+	int64_t deadline = timeout_ms ? now_ms() + timeout_ms : INT64_MAX;
+	int so_error = 0;
+	for (;;) {
+		int64_t now = now_ms();
+		if (now >= deadline) {
+			so_error = ETIMEDOUT;
+			break;
+		}
+		int wait = deadline - now > INT32_MAX ? -1 :
+		                                        (int)(deadline - now);
+		int n = poll(&pfd, 1, wait);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0) {
+			so_error = errno;
+			break;
+		}
+		if (n == 0)
+			continue;
+		socklen_t len = sizeof(so_error);
+		if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &so_error, &len) < 0)
+			so_error = errno;
+		break;
+	}
+	trace_event(TRACE_CONNECT_END, so_error ? -1 : fd, so_error, NULL, 0);
+	if (so_error) {
+		close(fd);
+		errno = so_error;
+		return -1;
+	}
+	return set_blocking(fd);
+}
+
+static void set_port(struct sockaddr_storage *addr, in_port_t port)
+{
+	if (addr->ss_family == AF_INET6)
+		((struct sockaddr_in6 *)addr)->sin6_port = port;
+	else
+		((struct sockaddr_in *)addr)->sin_port = port;
+}
+
+int data_sockaddr(const char *name, const char *service,
+                  const struct sockaddr_storage *peer, socklen_t peer_len,
+                  struct sockaddr_storage *addr, socklen_t *len)
+{
+	char *end;
+	long port = strtol(service, &end, 10);
+	if (*end || end == service || port <= 0 || port > 65535)
+		return -1;
+	if (!*name) {
+		memcpy(addr, peer, peer_len);
+		*len = peer_len;
+	} else {
+		struct sockaddr_in *in = (struct sockaddr_in *)addr;
+		struct sockaddr_in6 *in6 = (struct sockaddr_in6 *)addr;
+		*addr = (struct sockaddr_storage){ 0 };
+		if (inet_pton(AF_INET, name, &in->sin_addr) == 1) {
+			in->sin_family = AF_INET;
+			*len = sizeof(*in);
+		} else if (inet_pton(AF_INET6, name, &in6->sin6_addr) == 1) {
+			in6->sin6_family = AF_INET6;
+			*len = sizeof(*in6);
+		} else {
+			return -1;
+		}
+	}
+	set_port(addr, htons(port));
+	return 0;
 }
 
 ssize_t recv_all(int fd, char **data)
@@ -134,7 +385,6 @@ ssize_t recv_all(int fd, char **data)
 		}
 		if (n == 0) {
 			*data = buf;
-			close(fd);
 			buf[received] = '\0';
 			return received;
 		}
@@ -142,3 +392,286 @@ ssize_t recv_all(int fd, char **data)
 		received += n;
 	}
 }
+
+ssize_t writen(int fd, const void *buf, size_t n)
+{
+	size_t n_remain = n;
+	const char *p = buf;
+	ssize_t n_written;
+
+	while (n_remain) {
+		if ((n_written = write(fd, p, n_remain)) <= 0) {
+			if (n_written < 0 && errno == EINTR)
+				n_written = 0;
+			else
+				return -1;
+		}
+		n_remain -= n_written;
+		p += n_written;
+	}
+	return n;
+}
+
+/// Copies everything from \a in_fd to \a out_fd through user space.
+static ssize_t copy_to_fd(int in_fd, int out_fd)
+{
+#define COPY_BUF_LEN (64 * 1024)
+	char *buf = malloc(COPY_BUF_LEN);
+	if (!buf)
+		return -1;
+	ssize_t total = 0;
+	for (;;) {
+		ssize_t n = try_recv(in_fd, buf, COPY_BUF_LEN);
+		if (n <= 0) {
+			free(buf);
+			return n < 0 ? -1 : total;
+		}
+		if (writen(out_fd, buf, n) < 0) {
+			free(buf);
+			return -1;
+		}
+		total += n;
+	}
+}
+
+#ifdef HAVE_SPLICE
+/// Moves whatever is left in the pipe \a pipe_in to \a out_fd with write().
+static ssize_t drain_pipe(int pipe_in, int out_fd, size_t n)
+{
+	char buf[4096];
+	size_t remain = n;
+	while (remain) {
+		ssize_t got = read(pipe_in, buf,
+		                   remain < sizeof(buf) ? remain : sizeof(buf));
+		if (got < 0 && errno == EINTR)
+			continue;
+		if (got <= 0 || writen(out_fd, buf, got) < 0)
+			return -1;
+		remain -= got;
+	}
+	return n;
+}
+
+ssize_t recv_to_fd(int in_fd, int out_fd)
+{
+#define SPLICE_PIPE_SIZE (1024 * 1024)
+#define SPLICE_CHUNK_LEN (1024 * 1024)
+	int p[2];
+	if (pipe2(p, O_CLOEXEC) < 0)
+		return copy_to_fd(in_fd, out_fd);
+	// A bigger pipe means fewer round trips through splice().
+	fcntl(p[1], F_SETPIPE_SZ, SPLICE_PIPE_SIZE);
+
+	ssize_t total = 0;
+	ssize_t ret;
+	for (;;) {
+		ssize_t in = splice(in_fd, NULL, p[1], NULL, SPLICE_CHUNK_LEN,
+		                    SPLICE_F_MOVE | SPLICE_F_MORE);
+		if (in < 0) {
+			if (errno == EINTR)
+				continue;
+			if (total == 0 && (errno == EINVAL || errno == ENOSYS)) {
+				debug("[INFO] splice() unsupported, copying.\n");
+				close(p[0]);
+				close(p[1]);
+				return copy_to_fd(in_fd, out_fd);
+			}
+			goto fail;
+		}
+		if (in == 0)
+			break;
+		ssize_t remain = in;
+		while (remain) {
+			ssize_t out = splice(p[0], NULL, out_fd, NULL, remain,
+			                     SPLICE_F_MOVE | SPLICE_F_MORE);
+			if (out < 0 && errno == EINTR)
+				continue;
+			if (out < 0 && (errno == EINVAL || errno == ENOSYS)) {
+				// \a out_fd doesn't take splice(), e.g. O_APPEND.
+				debug("[INFO] splice() unsupported, copying.\n");
+				if (drain_pipe(p[0], out_fd, remain) < 0)
+					goto fail;
+				close(p[0]);
+				close(p[1]);
+				if ((ret = copy_to_fd(in_fd, out_fd)) < 0)
+					return -1;
+				return total + in + ret;
+			}
+			if (out <= 0)
+				goto fail;
+			remain -= out;
+		}
+		total += in;
+	}
+	close(p[0]);
+	close(p[1]);
+	return total;
+fail:
+	ret = errno;
+	close(p[0]);
+	close(p[1]);
+	errno = ret;
+	return -1;
+}
+#else
+ssize_t recv_to_fd(int in_fd, int out_fd)
+{
+	return copy_to_fd(in_fd, out_fd);
+}
+#endif
+
+/// Copy what's left of \a in_fd to the socket \a out_fd.
+static ssize_t copy_from_fd(int out_fd, int in_fd)
+{
+	char *buf = malloc(COPY_BUF_LEN);
+	if (!buf)
+		return -1;
+	ssize_t total = 0;
+	for (;;) {
+		ssize_t n = read(in_fd, buf, COPY_BUF_LEN);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			free(buf);
+			return n < 0 ? -1 : total;
+		}
+		if (sendn(out_fd, buf, n) < 0) {
+			free(buf);
+			return -1;
+		}
+		total += n;
+	}
+}
+
+#ifdef HAVE_SENDFILE
+ssize_t send_from_fd(int out_fd, int in_fd)
+{
+#define SENDFILE_CHUNK_LEN (16 * 1024 * 1024)
+	ssize_t total = 0;
+	for (;;) {
+		ssize_t n = sendfile(out_fd, in_fd, NULL, SENDFILE_CHUNK_LEN);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (total == 0 && (errno == EINVAL || errno == ENOSYS)) {
+				debug("[INFO] sendfile() unsupported, copying.\n");
+				return copy_from_fd(out_fd, in_fd);
+			}
+			return -1;
+		}
+		if (n == 0)
+			return total;
+		total += n;
+	}
+}
+#else
+ssize_t send_from_fd(int out_fd, int in_fd)
+{
+	return copy_from_fd(out_fd, in_fd);
+}
+#endif
+
+#ifdef SO_ZEROCOPY
+void zerocopy_init(struct ZeroCopy *zc, int fd)
+{
+	int one = 1;
+	*zc = (struct ZeroCopy){ .fd = fd };
+	zc->enabled =
+		setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0;
+}
+
+/// Read the completion notifications off the error queue of \a zc.
+/**
+ *  \return -1 on error and sets errno.
+ */
+static int zerocopy_reap(struct ZeroCopy *zc, bool wait)
+{
+	while (zc->n_done != zc->n_sent) {
+		char control[CMSG_SPACE(sizeof(struct sock_extended_err)) + 64];
+		struct msghdr msg = { .msg_control = control,
+			              .msg_controllen = sizeof(control) };
+		if (recvmsg(zc->fd, &msg, MSG_ERRQUEUE) < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				return -1;
+			if (!wait)
+				return 0;
+			// The error queue is signalled by POLLERR.
+			struct pollfd pfd = { .fd = zc->fd };
+			if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+				return -1;
+			if (pfd.revents & POLLHUP && !(pfd.revents & POLLERR)) {
+				errno = EPIPE;
+				return -1;
+			}
+			continue;
+		}
+		for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm;
+		     cm = CMSG_NXTHDR(&msg, cm)) {
+			struct sock_extended_err *ee =
+				(struct sock_extended_err *)CMSG_DATA(cm);
+			if (ee->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+				continue;
+			// Sends ee_info to ee_data are done.
+			zc->n_done += ee->ee_data - ee->ee_info + 1;
+			if (ee->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+				debug("[INFO] MSG_ZEROCOPY copied, stopping it.\n");
+				zc->enabled = false;
+			}
+		}
+	}
+	return 0;
+}
+
+ssize_t zerocopy_sendn(struct ZeroCopy *zc, const void *buf, size_t n)
+{
+	if (!zc->enabled || n < ZEROCOPY_MIN_LEN)
+		return sendn(zc->fd, buf, n);
+	const char *p = buf;
+	size_t remain = n;
+	while (remain) {
+		ssize_t sent = send(zc->fd, p, remain,
+		                    MSG_NOSIGNAL | MSG_ZEROCOPY);
+		if (sent < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == ENOBUFS) {
+				// Out of optmem for the notifications, copy.
+				if (sendn(zc->fd, p, remain) < 0)
+					return -1;
+				break;
+			}
+			return -1;
+		}
+		zc->n_sent++;
+		p += sent;
+		remain -= sent;
+		// Keep the queue of notifications short.
+		if (zerocopy_reap(zc, false) < 0)
+			return -1;
+	}
+	return n;
+}
+
+int zerocopy_flush(struct ZeroCopy *zc)
+{
+	return zerocopy_reap(zc, true);
+}
+#else
+void zerocopy_init(struct ZeroCopy *zc, int fd)
+{
+	*zc = (struct ZeroCopy){ .fd = fd };
+}
+
+ssize_t zerocopy_sendn(struct ZeroCopy *zc, const void *buf, size_t n)
+{
+	return sendn(zc->fd, buf, n);
+}
+
+int zerocopy_flush(struct ZeroCopy *zc)
+{
+	(void)zc;
+	return 0;
+}
+#endif
@@ -1,25 +1,52 @@
 #ifndef _SOCKET_UTIL_H
 #define _SOCKET_UTIL_H
 
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/socket.h>
 #include <sys/types.h>
 
 #define LINE_MAX_LEN 1024
+#define RECV_BUF_LEN (4 * LINE_MAX_LEN)
+/// Buffered input of a control connection.
+/**
+ *  Lines are handed out as views into \a buf. The unconsumed bytes
+ *  [\a begin, \a end) are only moved to the front when a partial line
+ *  reaches the end of the buffer.
+ */
 struct RecvBuf {
-	char buf[LINE_MAX_LEN];
-	char *read_ptr;
-	int remain_count;
+	char buf[RECV_BUF_LEN];
+	size_t begin;
+	size_t end;
 };
 
 void recv_buf_init(struct RecvBuf *rb);
 
-/// Gets one line(ended by LF) from a socket \a fd using \rb.
+/// Take the next buffered line (ended by LF) out of \a rb, if any.
+/**
+ *  \a line points into \a rb and stays valid until \a rb is written to.
+ *  Lines longer than LINE_MAX_LEN are returned in pieces.
+ *  \return the length of \a line, including the LF, or 0 if no complete
+ *  line is buffered.
+ */
+size_t recv_buf_next_line(struct RecvBuf *rb, const char **line);
+
+/// Where to put newly received bytes. Call recv_buf_commit() afterwards.
 /**
- *  The LF is copied if received.
- *  The result \a line is always '\0' terminated.
- *  \return the length of \a line (without trailing '\0') on success
- *  0 when the connection is closed, or -1 otherwise.
+ *  \return the free space at \a *space, never 0.
  */
-ssize_t recv_buf_get_line(struct RecvBuf *rb, int fd, unsigned char *line);
+size_t recv_buf_space(struct RecvBuf *rb, char **space);
+
+void recv_buf_commit(struct RecvBuf *rb, size_t n);
+
+/// Gets one line (ended by LF) from a socket \a fd using \a rb.
+/**
+ *  Like recv_buf_next_line(), but receives from \a fd until a line is
+ *  complete. A partial line is returned if the connection is closed.
+ *  \return the length of \a line on success, 0 when the connection is
+ *  closed, or -1 otherwise.
+ */
+ssize_t recv_buf_get_line(struct RecvBuf *rb, int fd, const char **line);
 
 /// Sends \a n bytes to \a fd with MSG_NOSIGNAL.
 /**
@@ -27,13 +54,108 @@ ssize_t recv_buf_get_line(struct RecvBuf *rb, int fd, unsigned char *line);
  */
 ssize_t sendn(int fd, const void *buf, size_t n);
 
+/// Writes \a n bytes to \a fd, which needn't be a socket.
+/**
+ *  On error, \return -1 and sets errno.
+ */
+ssize_t writen(int fd, const void *buf, size_t n);
+
 /// Receives \a data from \a fd until the connection is closed.
 /**
- *  Caller should remember to free the buffer.
+ *  Caller should remember to free the buffer, and close \a fd.
  *  \return -1 if `recv` or memory allocation fails and sets `errno`.
  */
 ssize_t recv_all(int fd, char **data);
 
 ssize_t try_recv(int fd, char *buf, size_t size);
 
+struct addrinfo;
+
+/// Wait this long for an attempt before starting the next, as in RFC 8305.
+#define CONNECT_ATTEMPT_DELAY_MS 250
+
+/// Connect to whichever address of \a addr_info answers first.
+/**
+ *  Non-blocking attempts are started CONNECT_ATTEMPT_DELAY_MS apart, or
+ *  as soon as the previous one fails, alternating between the address
+ *  families, so a blackholed address doesn't hold up the others. The
+ *  first to connect wins and the rest are closed.
+ *  \a timeout_ms of 0 means no deadline.
+ *  \return a blocking socket descriptor, or -1 and sets errno, to
+ *  ETIMEDOUT when the deadline passes.
+ */
+int connect_happy(const struct addrinfo *addr_info, unsigned int timeout_ms);
+
+/// Start connecting to \a ai, without waiting for it to complete.
+/**
+ *  \return a non-blocking socket descriptor for connect_wait(), or -1 and
+ *  sets errno.
+ */
+int connect_nowait(const struct addrinfo *ai);
+
+/// Wait for the connection started by connect_nowait() on \a fd.
+/**
+ *  \a timeout_ms of 0 means no deadline. \a fd is closed on error.
+ *  \return \a fd, now blocking, or -1 and sets errno.
+ */
+int connect_wait(int fd, unsigned int timeout_ms);
+
+/// The address of a passive data endpoint, from a parsed EPSV/PASV reply.
+/**
+ *  A numeric \a name is used as it is, and an empty one means \a peer,
+ *  the host of the control connection. Nothing is resolved.
+ *  \return -1 if \a name isn't numeric, or \a service isn't a port.
+ */
+int data_sockaddr(const char *name, const char *service,
+                  const struct sockaddr_storage *peer, socklen_t peer_len,
+                  struct sockaddr_storage *addr, socklen_t *len);
+
+/// Moves everything from the socket \a in_fd to \a out_fd until EOF.
+/**
+ *  Data goes through a kernel pipe with splice() and never enters user
+ *  space. Falls back to copying when splice() isn't supported for
+ *  \a out_fd.
+ *  \return the number of bytes moved, or -1 and sets errno.
+ */
+ssize_t recv_to_fd(int in_fd, int out_fd);
+
+/// Moves everything from \a in_fd, from its current offset, to the socket
+/// \a out_fd until EOF.
+/**
+ *  Files are sent with sendfile(), so the data never enters user space.
+ *  Falls back to copying for what sendfile() doesn't take, e.g. pipes.
+ *  \return the number of bytes moved, or -1 and sets errno.
+ */
+ssize_t send_from_fd(int out_fd, int in_fd);
+
+/// Sends below this size are copied, pinning the pages costs more.
+#define ZEROCOPY_MIN_LEN (32 * 1024)
+
+/// Sends on a socket with MSG_ZEROCOPY.
+struct ZeroCopy {
+	int fd;
+	bool enabled;
+	uint32_t n_sent; /// Zero-copy sends so far, the kernel numbers them.
+	uint32_t n_done; /// Zero-copy sends the kernel is done with.
+};
+
+/// Turn on MSG_ZEROCOPY for the socket \a fd, if the kernel has it.
+void zerocopy_init(struct ZeroCopy *zc, int fd);
+
+/// Sends \a n bytes, without copying them if they're big enough.
+/**
+ *  Doesn't wait for the kernel to let go of \a buf, which must stay as it
+ *  is until zerocopy_flush(), or until the socket is closed. Once the
+ *  kernel reports that it copied the data anyway, e.g. on loopback, the
+ *  rest are sent normally.
+ *  \return \a n, or -1 and sets errno.
+ */
+ssize_t zerocopy_sendn(struct ZeroCopy *zc, const void *buf, size_t n);
+
+/// Waits for the kernel to let go of every buffer sent on \a zc.
+/**
+ *  \return -1 on error and sets errno.
+ */
+int zerocopy_flush(struct ZeroCopy *zc);
+
 #endif
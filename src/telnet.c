@@ -1,3 +1,4 @@
+#include <string.h>
 #include <unistd.h>
 
 #include "debug.h"
@@ -5,6 +6,7 @@
 #include "cmd.h"
 #include "socket_util.h"
 #include "telnet.h"
+#include "trace.h"
 
 /**
  *  \return On error, returns -1 and sets errno.
@@ -34,6 +36,7 @@ int copy_from_telnet_line(int fd, const unsigned char *line, size_t len,
 	if (cmd == DONT || cmd == WONT || cmd == DO || cmd == WILL) {          \
 		INC_OR_RETURN(ptr);                                            \
 		unsigned char opt = *ptr;                                      \
+		trace_event(TRACE_TELNET, fd, cmd << 8 | opt, NULL, 0);        \
 		unsigned char reply = 0;                                       \
 		if (cmd == WILL)                                               \
 			reply = DONT;                                          \
@@ -49,9 +52,9 @@ int copy_from_telnet_line(int fd, const unsigned char *line, size_t len,
 	const unsigned char *end = line + len;
 
 	char *dest = &reply->reply[reply->len];
-	char *dest_end = dest + MAX_TELNET_BUF_LEN;
+	char *dest_end = reply->reply + MAX_TELNET_BUF_LEN;
 
-	for (size_t i = 0; i < SHORT_REPLY_MAX_LEN; i++) {
+	for (size_t i = 0; i < SHORT_REPLY_MAX_LEN - 1; i++) {
 		unsigned char c = *ptr;
 		if (c != IAC) {
 			reply->short_reply[i] = c;
@@ -66,15 +69,20 @@ int copy_from_telnet_line(int fd, const unsigned char *line, size_t len,
 			goto end;
 		}
 	}
-	reply->short_reply_len = SHORT_REPLY_MAX_LEN;
+	reply->short_reply_len = SHORT_REPLY_MAX_LEN - 1;
 
 	for (; ptr < end; ptr++) {
-		unsigned char c = *ptr;
-		if (c != IAC) {
-			if (dest < dest_end)
-				*(dest++) = c;
-			continue;
-		}
+		// Copy up to the next command in one go.
+		const unsigned char *iac = memchr(ptr, IAC, end - ptr);
+		const unsigned char *text_end = iac ? iac : end;
+		size_t n = text_end - ptr;
+		if (n > (size_t)(dest_end - dest))
+			n = dest_end - dest;
+		memcpy(dest, ptr, n);
+		dest += n;
+		ptr = text_end;
+		if (!iac)
+			break;
 		TELNET_CMD();
 	}
 end:
@@ -0,0 +1,325 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "socket_util.h"
+#include "telnet.h"
+#include "trace.h"
+
+_Static_assert(sizeof(struct TraceRecord) == 64,
+               "A TraceRecord should fill a cache line.");
+
+#define TRACE_MAGIC "WAFTPTR1"
+
+/// Starts a dump, followed by the records in the byte order of the machine.
+struct TraceHeader {
+	char magic[8];
+	uint32_t record_size;
+	uint32_t ring_len;
+	/// When the dump was taken, to put the records in wall-clock time.
+	uint64_t monotonic_ns;
+	uint64_t realtime_ns;
+};
+
+/// The records of one thread.
+/**
+ *  Only the owner writes, publishing each record by moving \a head. A ring
+ *  is released when its thread exits, and claimed by the next new thread.
+ */
+struct TraceRing {
+	struct TraceRing *next;
+	bool in_use;
+	uint64_t head; /// Records written so far.
+	struct TraceRecord records[TRACE_RING_LEN];
+};
+
+static bool enabled = true;
+/// Every ring so far, they're never freed.
+static struct TraceRing *rings;
+static pthread_key_t ring_key;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+static __thread struct TraceRing *ring;
+static __thread int32_t tid;
+
+static uint64_t clock_ns(clockid_t clock)
+{
+	struct timespec ts;
+	clock_gettime(clock, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void ring_release(void *r)
+{
+	__atomic_store_n(&((struct TraceRing *)r)->in_use, false,
+	                 __ATOMIC_RELEASE);
+}
+
+static void ring_key_create(void)
+{
+	pthread_key_create(&ring_key, ring_release);
+}
+
+static struct TraceRing *ring_claim(void)
+{
+	pthread_once(&ring_key_once, ring_key_create);
+	struct TraceRing *r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE);
+	for (; r; r = r->next) {
+		bool in_use = false;
+		if (__atomic_compare_exchange_n(&r->in_use, &in_use, true,
+		                                false, __ATOMIC_ACQUIRE,
+		                                __ATOMIC_RELAXED))
+			break;
+	}
+	if (!r) {
+		r = calloc(1, sizeof(*r));
+		if (!r)
+			return NULL;
+		r->in_use = true;
+		r->next = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+		while (!__atomic_compare_exchange_n(&rings, &r->next, r, true,
+		                                    __ATOMIC_RELEASE,
+		                                    __ATOMIC_RELAXED))
+			;
+	}
+	pthread_setspecific(ring_key, r);
+	tid = syscall(SYS_gettid);
+	return r;
+}
+
+void trace_set_enabled(bool on)
+{
+	__atomic_store_n(&enabled, on, __ATOMIC_RELAXED);
+}
+
+static const char *telnet_command_name(unsigned int cmd)
+{
+	switch (cmd) {
+	case WILL:
+		return "WILL";
+	case WONT:
+		return "WONT";
+	case DO:
+		return "DO";
+	case DONT:
+		return "DONT";
+	default:
+		return "?";
+	}
+}
+
+/// Print the event, without a newline, \a len bytes of \a data are shown.
+static void print_event(FILE *out, enum TraceType type, int64_t value,
+                        const char *data, size_t len)
+{
+	// Lines are shown without their CR LF.
+	while (len && (data[len - 1] == '\n' || data[len - 1] == '\r'))
+		len--;
+	switch (type) {
+	case TRACE_COMMAND:
+		fprintf(out, "-> %.*s", (int)len, data);
+		break;
+	case TRACE_LINE:
+		fprintf(out, "<- %.*s", (int)len, data);
+		break;
+	case TRACE_REPLY:
+		fprintf(out, "reply %lld", (long long)value);
+		break;
+	case TRACE_TELNET:
+		fprintf(out, "telnet %s %u", telnet_command_name(value >> 8),
+		        (unsigned int)(value & 0xff));
+		break;
+	case TRACE_CONNECT_BEGIN:
+		fprintf(out, "connecting, %lld addresses", (long long)value);
+		break;
+	case TRACE_CONNECT_END:
+		if (value)
+			fprintf(out, "cannot connect: %s", strerror(value));
+		else
+			fprintf(out, "connected");
+		break;
+	case TRACE_DATA_RECV:
+	case TRACE_DATA_SEND:
+		if (value < 0)
+			fprintf(out, "cannot %s: %s",
+			        type == TRACE_DATA_RECV ? "receive" : "send",
+			        strerror(-value));
+		else
+			fprintf(out, "%s %lld",
+			        type == TRACE_DATA_RECV ? "received" : "sent",
+			        (long long)value);
+		break;
+	default:
+		fprintf(out, "event %u, %lld", type, (long long)value);
+	}
+}
+
+void trace_event(enum TraceType type, int fd, int64_t value,
+                 const char *data, size_t len)
+{
+	if (type == TRACE_COMMAND && len > 5 &&
+	    !strncasecmp(data, "PASS ", 5)) {
+		data = "PASS ***";
+		len = strlen(data);
+	}
+#ifdef DEBUG
+	fprintf(stderr, "[T] fd %d ", fd);
+	print_event(stderr, type, value, data, len);
+	fputc('\n', stderr);
+#endif
+	if (!__atomic_load_n(&enabled, __ATOMIC_RELAXED))
+		return;
+	struct TraceRing *r = ring;
+	if (!r && !(r = ring = ring_claim()))
+		return;
+	uint64_t head = r->head;
+	struct TraceRecord *rec = &r->records[head % TRACE_RING_LEN];
+	*rec = (struct TraceRecord){ .ns = clock_ns(CLOCK_MONOTONIC),
+		                     .value = value,
+		                     .tid = tid,
+		                     .fd = fd,
+		                     .type = type,
+		                     .len = len > UINT16_MAX ? UINT16_MAX : len };
+	if (len)
+		memcpy(rec->data, data,
+		       len < TRACE_DATA_LEN ? len : TRACE_DATA_LEN);
+	__atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+}
+
+ssize_t trace_dump(int fd)
+{
+	struct TraceHeader header = {
+		.magic = TRACE_MAGIC,
+		.record_size = sizeof(struct TraceRecord),
+		.ring_len = TRACE_RING_LEN,
+		.monotonic_ns = clock_ns(CLOCK_MONOTONIC),
+		.realtime_ns = clock_ns(CLOCK_REALTIME),
+	};
+	struct TraceRecord *buf = malloc(sizeof(*buf) * TRACE_RING_LEN);
+	if (!buf)
+		return -1;
+	ssize_t total = -1;
+	if (writen(fd, &header, sizeof(header)) < 0)
+		goto clean_up;
+	total = 0;
+	struct TraceRing *r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE);
+	for (; r; r = r->next) {
+		uint64_t end = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+		uint64_t begin =
+			end > TRACE_RING_LEN ? end - TRACE_RING_LEN : 0;
+		for (uint64_t i = begin; i < end; i++)
+			buf[i - begin] = r->records[i % TRACE_RING_LEN];
+		// Drop what the owner may have overwritten while copying,
+		// including the record it's writing now.
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		uint64_t head = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+		uint64_t valid = head + 1 > TRACE_RING_LEN ?
+		                         head + 1 - TRACE_RING_LEN :
+		                         0;
+		if (valid < begin)
+			valid = begin;
+		if (valid >= end)
+			continue;
+		if (writen(fd, buf + (valid - begin),
+		           sizeof(*buf) * (end - valid)) < 0) {
+			total = -1;
+			goto clean_up;
+		}
+		total += end - valid;
+	}
+clean_up:
+	free(buf);
+	return total;
+}
+
+/// Read up to \a n bytes, fewer only at the end of the file.
+static ssize_t read_full(int fd, void *buf, size_t n)
+{
+	size_t got = 0;
+	while (got < n) {
+		ssize_t r = read(fd, (char *)buf + got, n - got);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r < 0)
+			return -1;
+		if (r == 0)
+			break;
+		got += r;
+	}
+	return got;
+}
+
+static int record_cmp(const void *a, const void *b)
+{
+	const struct TraceRecord *x = a;
+	const struct TraceRecord *y = b;
+	if (x->ns != y->ns)
+		return x->ns < y->ns ? -1 : 1;
+	return x->tid - y->tid;
+}
+
+ssize_t trace_decode(int fd, FILE *out)
+{
+	struct TraceHeader header;
+	ssize_t n = read_full(fd, &header, sizeof(header));
+	if (n < 0)
+		return -1;
+	if (n != sizeof(header) ||
+	    memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) ||
+	    header.record_size != sizeof(struct TraceRecord)) {
+		errno = EINVAL;
+		return -1;
+	}
+	struct TraceRecord *records = NULL;
+	size_t n_records = 0;
+	size_t capacity = 0;
+	for (;;) {
+		if (n_records == capacity) {
+			capacity = capacity ? capacity * 2 : TRACE_RING_LEN;
+			void *bigger = realloc(records,
+			                       capacity * sizeof(*records));
+			if (!bigger) {
+				free(records);
+				return -1;
+			}
+			records = bigger;
+		}
+		n = read_full(fd, records + n_records,
+		              (capacity - n_records) * sizeof(*records));
+		if (n < 0) {
+			free(records);
+			return -1;
+		}
+		n_records += n / sizeof(*records);
+		if (n_records < capacity)
+			break;
+	}
+	qsort(records, n_records, sizeof(*records), record_cmp);
+
+	for (size_t i = 0; i < n_records; i++) {
+		const struct TraceRecord *rec = &records[i];
+		// Both clocks were read at the dump.
+		int64_t wall_ns = header.realtime_ns -
+		                  (int64_t)(header.monotonic_ns - rec->ns);
+		time_t wall_s = wall_ns / 1000000000;
+		struct tm tm;
+		char date[32];
+		localtime_r(&wall_s, &tm);
+		strftime(date, sizeof(date), "%F %T", &tm);
+		double since_ms =
+			i ? (rec->ns - records[i - 1].ns) / 1e6 : 0;
+		fprintf(out, "%s.%06lld %+10.3f ms tid %d fd %d ", date,
+		        (long long)(wall_ns % 1000000000 / 1000), since_ms,
+		        rec->tid, rec->fd);
+		size_t len = rec->len < TRACE_DATA_LEN ? rec->len :
+		                                         TRACE_DATA_LEN;
+		print_event(out, rec->type, rec->value, rec->data, len);
+		fputs(rec->len > TRACE_DATA_LEN ? "...\n" : "\n", out);
+	}
+	free(records);
+	return n_records;
+}
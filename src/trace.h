@@ -0,0 +1,69 @@
+#ifndef _TRACE_H
+#define _TRACE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+enum TraceType {
+	/// A command sent, in data.
+	TRACE_COMMAND,
+	/// The last line of a reply, value is its code.
+	TRACE_REPLY,
+	/// A line received on a control connection, in data.
+	TRACE_LINE,
+	/// A telnet negotiation received, value is its command << 8 | option.
+	TRACE_TELNET,
+	/// value is the number of addresses to try.
+	TRACE_CONNECT_BEGIN,
+	/// fd is the connection or -1, value is 0 or errno.
+	TRACE_CONNECT_END,
+	/// value is the size of the chunk, or -errno.
+	TRACE_DATA_RECV,
+	/// value is the size of the chunk, or -errno.
+	TRACE_DATA_SEND,
+	N_TRACE_TYPES
+};
+
+#define TRACE_DATA_LEN 36
+/// One event, as recorded and dumped.
+struct TraceRecord {
+	uint64_t ns; /// CLOCK_MONOTONIC
+	int64_t value;
+	int32_t tid;
+	int32_t fd;
+	uint16_t type; /// enum TraceType
+	uint16_t len; /// Of data, which is truncated to TRACE_DATA_LEN.
+	char data[TRACE_DATA_LEN];
+};
+
+/// Records kept for each thread, the older ones are overwritten.
+#define TRACE_RING_LEN 1024
+
+/// Turn tracing on or off for every thread, it starts on.
+void trace_set_enabled(bool enabled);
+
+/// Record an event in the ring of the calling thread.
+/**
+ *  Lock-free, and never blocks. The password of a PASS command is left out.
+ *  Builds with DEBUG also print the event to stderr.
+ */
+void trace_event(enum TraceType type, int fd, int64_t value,
+                 const char *data, size_t len);
+
+/// Write the rings of every thread, past and present, to \a fd.
+/**
+ *  Events recorded while dumping may be left out.
+ *  \return the number of events written, or -1 and sets errno.
+ */
+ssize_t trace_dump(int fd);
+
+/// Print a dump read from \a fd as a timeline, oldest first.
+/**
+ *  \return the number of events printed, or -1 and sets errno, EINVAL if
+ *  \a fd doesn't hold a dump.
+ */
+ssize_t trace_decode(int fd, FILE *out);
+
+#endif
@@ -0,0 +1,221 @@
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "uring.h"
+
+static int sys_io_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned int to_submit,
+                              unsigned int min_complete, unsigned int flags,
+                              void *arg, size_t arg_len)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+	               arg, arg_len);
+}
+
+static int sys_io_uring_register(int fd, unsigned int opcode, void *arg,
+                                 unsigned int nr_args)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void *ring_ptr(void *ring, unsigned int offset)
+{
+	return (char *)ring + offset;
+}
+
+int uring_init(struct Uring *ring, unsigned int entries)
+{
+	memset(ring, 0, sizeof(*ring));
+	struct io_uring_params p = {
+		// Completions are only reaped in io_uring_enter() anyway.
+		.flags = IORING_SETUP_COOP_TASKRUN | IORING_SETUP_SUBMIT_ALL,
+	};
+	ring->fd = sys_io_uring_setup(entries, &p);
+	if (ring->fd < 0 && errno == EINVAL) {
+		// Before Linux 5.19.
+		p = (struct io_uring_params){ 0 };
+		ring->fd = sys_io_uring_setup(entries, &p);
+	}
+	if (ring->fd < 0)
+		return -1;
+	if (!(p.features & IORING_FEAT_EXT_ARG)) {
+		close(ring->fd);
+		errno = ENOSYS;
+		return -1;
+	}
+
+	ring->sq_ring_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	ring->cq_ring_len =
+		p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sq_ring = mmap(NULL, ring->sq_ring_len, PROT_READ | PROT_WRITE,
+	                     MAP_SHARED | MAP_POPULATE, ring->fd,
+	                     IORING_OFF_SQ_RING);
+	ring->cq_ring = mmap(NULL, ring->cq_ring_len, PROT_READ | PROT_WRITE,
+	                     MAP_SHARED | MAP_POPULATE, ring->fd,
+	                     IORING_OFF_CQ_RING);
+	ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE,
+	                  MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED ||
+	    ring->sqes == MAP_FAILED) {
+		int saved = errno;
+		uring_exit(ring);
+		errno = saved;
+		return -1;
+	}
+
+	ring->sq_entries = p.sq_entries;
+	ring->sq_head = ring_ptr(ring->sq_ring, p.sq_off.head);
+	ring->sq_tail = ring_ptr(ring->sq_ring, p.sq_off.tail);
+	ring->sq_mask = ring_ptr(ring->sq_ring, p.sq_off.ring_mask);
+	ring->sq_array = ring_ptr(ring->sq_ring, p.sq_off.array);
+	ring->sqe_tail = *ring->sq_tail;
+
+	ring->cq_head = ring_ptr(ring->cq_ring, p.cq_off.head);
+	ring->cq_tail = ring_ptr(ring->cq_ring, p.cq_off.tail);
+	ring->cq_mask = ring_ptr(ring->cq_ring, p.cq_off.ring_mask);
+	ring->cqes = ring_ptr(ring->cq_ring, p.cq_off.cqes);
+	return 0;
+}
+
+void uring_exit(struct Uring *ring)
+{
+	if (ring->sqes && ring->sqes != MAP_FAILED)
+		munmap(ring->sqes, ring->sqes_len);
+	if (ring->cq_ring && ring->cq_ring != MAP_FAILED)
+		munmap(ring->cq_ring, ring->cq_ring_len);
+	if (ring->sq_ring && ring->sq_ring != MAP_FAILED)
+		munmap(ring->sq_ring, ring->sq_ring_len);
+	close(ring->fd);
+}
+
+/// Publish the filled SQEs to the kernel.
+/**
+ *  \return the number of SQEs published but not consumed yet.
+ */
+static unsigned int sq_flush(struct Uring *ring)
+{
+	__atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+	return ring->sqe_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+}
+
+struct io_uring_sqe *uring_get_sqe(struct Uring *ring)
+{
+	unsigned int head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	if (ring->sqe_tail - head >= ring->sq_entries) {
+		if (uring_submit(ring, 0, 0) < 0)
+			return NULL;
+		head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+		if (ring->sqe_tail - head >= ring->sq_entries) {
+			errno = EBUSY;
+			return NULL;
+		}
+	}
+	unsigned int index = ring->sqe_tail & *ring->sq_mask;
+	struct io_uring_sqe *sqe = &ring->sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	ring->sq_array[index] = index;
+	ring->sqe_tail++;
+	return sqe;
+}
+
+int uring_submit(struct Uring *ring, unsigned int wait_nr, int timeout_ms)
+{
+	unsigned int to_submit = sq_flush(ring);
+	unsigned int flags = wait_nr ? IORING_ENTER_GETEVENTS : 0;
+	struct __kernel_timespec ts;
+	struct io_uring_getevents_arg arg = { .sigmask_sz = _NSIG / 8 };
+	if (wait_nr && timeout_ms >= 0) {
+		ts.tv_sec = timeout_ms / 1000;
+		ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+		arg.ts = (uintptr_t)&ts;
+	}
+	for (;;) {
+		int ret = sys_io_uring_enter(ring->fd, to_submit, wait_nr,
+		                             flags | IORING_ENTER_EXT_ARG, &arg,
+		                             sizeof(arg));
+		if (ret >= 0)
+			return 0;
+		if (errno != EINTR)
+			return -1;
+		to_submit = sq_flush(ring);
+	}
+}
+
+struct io_uring_cqe *uring_peek_cqe(struct Uring *ring)
+{
+	unsigned int head = *ring->cq_head;
+	if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+		return NULL;
+	return &ring->cqes[head & *ring->cq_mask];
+}
+
+void uring_cqe_seen(struct Uring *ring)
+{
+	__atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+int uring_buf_ring_init(struct Uring *ring, struct UringBufRing *br,
+                        unsigned short bgid, unsigned int n_bufs,
+                        size_t buf_len)
+{
+	memset(br, 0, sizeof(*br));
+	br->bgid = bgid;
+	br->n_bufs = n_bufs;
+	br->buf_len = buf_len;
+	br->br_len = n_bufs * sizeof(struct io_uring_buf);
+	br->bufs_len = n_bufs * buf_len;
+	// The ring must be page aligned.
+	br->br = mmap(NULL, br->br_len, PROT_READ | PROT_WRITE,
+	              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (br->br == MAP_FAILED)
+		return -1;
+	br->bufs = mmap(NULL, br->bufs_len, PROT_READ | PROT_WRITE,
+	                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (br->bufs == MAP_FAILED) {
+		munmap(br->br, br->br_len);
+		return -1;
+	}
+	struct io_uring_buf_reg reg = { .ring_addr = (uintptr_t)br->br,
+		                        .ring_entries = n_bufs,
+		                        .bgid = bgid };
+	if (sys_io_uring_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg,
+	                          1) < 0) {
+		int saved = errno;
+		munmap(br->bufs, br->bufs_len);
+		munmap(br->br, br->br_len);
+		errno = saved;
+		return -1;
+	}
+	for (unsigned int i = 0; i < n_bufs; i++)
+		uring_buf_ring_put(br, i);
+	return 0;
+}
+
+void uring_buf_ring_free(struct Uring *ring, struct UringBufRing *br)
+{
+	struct io_uring_buf_reg reg = { .bgid = br->bgid };
+	sys_io_uring_register(ring->fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+	munmap(br->bufs, br->bufs_len);
+	munmap(br->br, br->br_len);
+}
+
+void uring_buf_ring_put(struct UringBufRing *br, unsigned short bid)
+{
+	struct io_uring_buf *buf = &br->br->bufs[br->tail & (br->n_bufs - 1)];
+	buf->addr = (uintptr_t)uring_buf(br, bid);
+	buf->len = br->buf_len;
+	buf->bid = bid;
+	br->tail++;
+	__atomic_store_n(&br->br->tail, br->tail, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,89 @@
+#ifndef _URING_H
+#define _URING_H
+
+#include <linux/io_uring.h>
+#include <stddef.h>
+
+/// A minimal io_uring instance, driven through the raw system calls.
+struct Uring {
+	int fd;
+	unsigned int sq_entries;
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	unsigned int *sq_array;
+	struct io_uring_sqe *sqes;
+	unsigned int sqe_tail; /// Filled, but not yet published to the kernel.
+
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	void *sq_ring;
+	size_t sq_ring_len;
+	void *cq_ring;
+	size_t cq_ring_len;
+	size_t sqes_len;
+};
+
+/// A ring of provided buffers the kernel picks from, e.g. for multishot
+/// receives.
+struct UringBufRing {
+	struct io_uring_buf_ring *br;
+	size_t br_len;
+	char *bufs;
+	size_t bufs_len;
+	unsigned int n_bufs;
+	size_t buf_len;
+	unsigned short bgid;
+	unsigned short tail;
+};
+
+/**
+ *  \return -1 on error and sets errno.
+ */
+int uring_init(struct Uring *ring, unsigned int entries);
+
+void uring_exit(struct Uring *ring);
+
+/// Get a zeroed SQE, submitting the queued ones if the SQ is full.
+/**
+ *  \return NULL on error and sets errno.
+ */
+struct io_uring_sqe *uring_get_sqe(struct Uring *ring);
+
+/// Submit the queued SQEs and wait for at least \a wait_nr completions.
+/**
+ *  A negative \a timeout_ms waits forever.
+ *  \return -1 on error and sets errno, ETIME if the time ran out.
+ */
+int uring_submit(struct Uring *ring, unsigned int wait_nr, int timeout_ms);
+
+/**
+ *  \return NULL if the CQ is empty.
+ */
+struct io_uring_cqe *uring_peek_cqe(struct Uring *ring);
+
+void uring_cqe_seen(struct Uring *ring);
+
+/// Register \a n_bufs buffers of \a buf_len bytes as group \a bgid.
+/**
+ *  \a n_bufs must be a power of 2.
+ *  \return -1 on error and sets errno.
+ */
+int uring_buf_ring_init(struct Uring *ring, struct UringBufRing *br,
+                        unsigned short bgid, unsigned int n_bufs,
+                        size_t buf_len);
+
+void uring_buf_ring_free(struct Uring *ring, struct UringBufRing *br);
+
+static inline char *uring_buf(struct UringBufRing *br, unsigned short bid)
+{
+	return br->bufs + (size_t)bid * br->buf_len;
+}
+
+/// Hand buffer \a bid back to the kernel.
+void uring_buf_ring_put(struct UringBufRing *br, unsigned short bid);
+
+#endif
@@ -0,0 +1,23 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "trace.h"
+
+/* Print a dump written by trace_dump(), from a file or stdin. */
+
+int main(int argc, char **argv)
+{
+	if (argc > 2) {
+		fprintf(stderr, "usage: %s [dump]\n", argv[0]);
+		return 2;
+	}
+	int fd = argc == 2 ? open(argv[1], O_RDONLY) : 0;
+	if (fd < 0 || trace_decode(fd, stdout) < 0) {
+		fprintf(stderr, "%s: %s\n", argc == 2 ? argv[1] : "stdin",
+		        errno == EINVAL ? "not a trace dump" : strerror(errno));
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,214 @@
+#include "../src/arena.h"
+#include "../src/cmd.h"
+#include "../src/error.h"
+#include "../src/ftp.h"
+#include "../src/parse.h"
+#include "config.h"
+#include "ftp_server.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Numbers to compare between commits, against the in-process server. */
+
+#define N_LOGINS 200
+#define N_SMALL_FILES 1000
+#define LIST_DIR "/synthetic/dir-500000"
+#define BIG_FILE "/synthetic/size-1073741824"
+#define BIG_FILE_LEN (1024.0 * 1024 * 1024)
+#define CHUNK_LEN (256 * 1024)
+#define N_PARSE_LINES 1000000
+
+static const struct LoginInfo anonymous = {
+	.username = "anonymous",
+	.password = "",
+	.account_info = "",
+};
+
+static double now_s(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void die(const struct ErrMsg *err)
+{
+	fprintf(stderr, "[%s] %s\n", err->where, err->msg);
+	exit(1);
+}
+
+static void report(const char *what, double value, const char *unit)
+{
+	printf("%-32s %12.1f %s\n", what, value, unit);
+}
+
+static int count_fact(void *ctx, const struct Fact *fact)
+{
+	(*(size_t *)ctx)++;
+	return 0;
+}
+
+/// MLSD parsing alone, without the network.
+static void bench_parse(void)
+{
+	const char *format = "type=file;size=%d;modify=20221019123456;"
+	                     "perm=adfrw;unique=801g%x; file-%d.csv\r\n";
+	size_t capacity = (size_t)N_PARSE_LINES * 96;
+	char *list = malloc(capacity);
+	size_t len = 0;
+	for (int i = 0; i < N_PARSE_LINES; i++)
+		len += snprintf(list + len, capacity - len, format, i * 13, i,
+		                i);
+	struct ListArena *arena = list_arena_new();
+	double begin = now_s();
+	for (const char *line = list; line < list + len;) {
+		bool ignore;
+		const char *end;
+		struct Fact fact;
+		if (parse_line_mlsd_arena(line, &ignore, &end, &fact, arena) <
+		    0) {
+			fprintf(stderr, "Cannot parse: %.40s\n", line);
+			exit(1);
+		}
+		line = strchr(end, '\n') + 1;
+	}
+	double elapsed = now_s() - begin;
+	report("MLSD parsing", len / elapsed / 1e6, "MB/s");
+	report("MLSD parsing", N_PARSE_LINES / elapsed / 1e6,
+	       "M entries/s");
+	list_arena_free(arena);
+	free(list);
+}
+
+/// Login and per-file latency, in round trips of \a rtt_ms.
+static void bench_latency(unsigned int rtt_ms)
+{
+	struct FtpServerConfig config = { .reply_latency_ms = rtt_ms };
+	struct FtpServer *server = ftp_server_start(&config);
+	if (!server) {
+		perror("ftp_server_start");
+		exit(1);
+	}
+	const char *port = ftp_server_port(server);
+	struct ErrMsg err;
+	struct UserPI user_pi;
+	unsigned int n_logins = rtt_ms ? N_LOGINS / 20 : N_LOGINS;
+	unsigned int n_files = rtt_ms ? N_SMALL_FILES / 50 : N_SMALL_FILES;
+	char what[64];
+
+	double begin = now_s();
+	for (unsigned int i = 0; i < n_logins; i++) {
+		if (!user_pi_init("127.0.0.1", port, &anonymous, &user_pi,
+		                  &err))
+			die(&err);
+		user_pi_drop(&user_pi);
+	}
+	double login_us = (now_s() - begin) / n_logins * 1e6;
+	snprintf(what, sizeof(what), "login, RTT %u ms", rtt_ms);
+	report(what, login_us, "us");
+
+	if (!user_pi_init("127.0.0.1", port, &anonymous, &user_pi, &err))
+		die(&err);
+	int null_fd = open("/dev/null", O_WRONLY);
+	begin = now_s();
+	for (unsigned int i = 0; i < n_files; i++)
+		if (download_to_fd(&user_pi, "/synthetic/size-1", null_fd,
+		                   &err) != 1)
+			die(&err);
+	double file_us = (now_s() - begin) / n_files * 1e6;
+	snprintf(what, sizeof(what), "1-byte download, RTT %u ms", rtt_ms);
+	report(what, file_us, "us");
+
+	set_data_prefetch(&user_pi, true);
+	begin = now_s();
+	for (unsigned int i = 0; i < n_files; i++)
+		if (download_to_fd(&user_pi, "/synthetic/size-1", null_fd,
+		                   &err) != 1)
+			die(&err);
+	double prefetch_us = (now_s() - begin) / n_files * 1e6;
+	snprintf(what, sizeof(what), "  with data prefetch");
+	report(what, prefetch_us, "us");
+
+	set_data_prefetch(&user_pi, false);
+	if (set_mode_b(&user_pi, true, &err) < 0)
+		die(&err);
+	begin = now_s();
+	for (unsigned int i = 0; i < n_files; i++)
+		if (download_to_fd(&user_pi, "/synthetic/size-1", null_fd,
+		                   &err) != 1)
+			die(&err);
+	double mode_b_us = (now_s() - begin) / n_files * 1e6;
+	report("  in MODE B", mode_b_us, "us");
+	if (rtt_ms) {
+		report("  login", login_us / 1e3 / rtt_ms, "round trips");
+		report("  1-byte download", file_us / 1e3 / rtt_ms,
+		       "round trips");
+		report("  with data prefetch", prefetch_us / 1e3 / rtt_ms,
+		       "round trips");
+		report("  in MODE B", mode_b_us / 1e3 / rtt_ms, "round trips");
+	}
+	close(null_fd);
+	user_pi_drop(&user_pi);
+	ftp_server_stop(server);
+}
+
+static void bench_throughput(void)
+{
+	struct FtpServerConfig config = { 0 };
+	struct FtpServer *server = ftp_server_start(&config);
+	if (!server) {
+		perror("ftp_server_start");
+		exit(1);
+	}
+	struct ErrMsg err;
+	struct UserPI user_pi;
+	if (!user_pi_init("127.0.0.1", ftp_server_port(server), &anonymous,
+	                  &user_pi, &err))
+		die(&err);
+
+	size_t n_facts = 0;
+	double begin = now_s();
+	if (list_directory_foreach(&user_pi, LIST_DIR, count_fact, &n_facts,
+	                           &err) < 0)
+		die(&err);
+	report("listing over the network", n_facts / (now_s() - begin) / 1e6,
+	       "M entries/s");
+
+	int null_fd = open("/dev/null", O_WRONLY);
+	begin = now_s();
+	if (download_to_fd(&user_pi, BIG_FILE, null_fd, &err) < 0)
+		die(&err);
+	report("download_to_fd()", BIG_FILE_LEN / (now_s() - begin) / 1e6,
+	       "MB/s");
+	close(null_fd);
+
+	char *buf = malloc(CHUNK_LEN);
+	begin = now_s();
+	if (download_init(&user_pi, BIG_FILE, &err) < 0)
+		die(&err);
+	ssize_t n;
+	while ((n = download_chunk(&user_pi, buf, CHUNK_LEN, &err)) > 0)
+		;
+	if (n < 0)
+		die(&err);
+	report("download_chunk()", BIG_FILE_LEN / (now_s() - begin) / 1e6,
+	       "MB/s");
+	free(buf);
+	user_pi_drop(&user_pi);
+	ftp_server_stop(server);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int rtt_ms = argc > 1 ? atoi(argv[1]) : 10;
+	bench_parse();
+	bench_latency(0);
+	bench_latency(rtt_ms);
+	bench_throughput();
+	return 0;
+}
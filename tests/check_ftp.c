@@ -1,22 +1,39 @@
+#include "../src/arena.h"
+#include "../src/async.h"
 #include "../src/cmd.h"
+#include "../src/crawl.h"
 #include "../src/error.h"
 #include "../src/ftp.h"
+#include "../src/list_cache.h"
+#include "../src/metrics.h"
+#include "../src/parse.h"
+#include "../src/pool.h"
+#include "../src/remote_file.h"
+#include "../src/resume.h"
+#include "../src/segment.h"
+#include "../src/socket_util.h"
+#include "../src/trace.h"
 #include "config.h"
+#include "ftp_server.h"
 
 #include <check.h>
 
-#include <assert.h>
-#include <signal.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <sys/wait.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 const char SERVER_IP_V4[] = "127.0.0.1";
 const char SERVER_IP_V6[] = "::";
-const char SERVER_PORT[] = "12345";
-const char SERVER_PROGRAM[] = "pure-ftpd";
 const char SERVER_ROOT[] = FTP_DIR;
+// An ephemeral port, filled in by start_server().
+char SERVER_PORT[8];
 
 const struct LoginInfo anonymous = {
 	.username = "anonymous",
@@ -24,47 +41,23 @@ const struct LoginInfo anonymous = {
 	.account_info = "",
 };
 
-static pid_t server_pid;
-
-void exec_server(void)
-{
-	const size_t buf_len = 1024;
-	char cwd[buf_len];
-	char program_name[buf_len];
-	char ftp_anon_dir[buf_len];
-	;
-	getcwd(cwd, buf_len);
-
-	snprintf(ftp_anon_dir, buf_len, "FTP_ANON_DIR=%s", SERVER_ROOT);
-	printf("starting: %s\n", program_name);
-	const char *const new_argv[] = { SERVER_PROGRAM, "-S", SERVER_PORT,
-		                         NULL };
-	putenv(ftp_anon_dir);
-	execvp(new_argv[0], (char *const *)new_argv);
-	perror("execvp:");
-	exit(1);
-}
+static struct FtpServer *server;
 
 void start_server(void)
 {
-	pid_t pid = fork();
-	printf("pid %d\n", pid);
-	if (!pid) {
-		exec_server();
-	} else {
-		server_pid = pid;
-		sleep(1);
+	struct FtpServerConfig config = { .root = SERVER_ROOT };
+	server = ftp_server_start(&config);
+	if (!server) {
+		perror("ftp_server_start");
+		exit(1);
 	}
+	snprintf(SERVER_PORT, sizeof(SERVER_PORT), "%s",
+	         ftp_server_port(server));
 }
 
 void stop_server(void)
 {
-	if (server_pid > 0) {
-		kill(server_pid, 9);
-		int wstatus;
-		wait(&wstatus);
-		assert(WIFSIGNALED(wstatus));
-	}
+	ftp_server_stop(server);
 }
 
 struct UserPI user_pi;
@@ -104,6 +97,1258 @@ void check_user_pi_init_valid(const char *name, const char *service)
 	}
 }
 
+void check_pipeline(const char *name, const char *service)
+{
+	struct ErrMsg err;
+	struct UserPI *user_pi_result =
+		user_pi_init(name, service, &anonymous, &user_pi, &err);
+	ck_assert_msg(user_pi_result == &user_pi, "[%s] %s", err.where,
+	              err.msg);
+	const size_t n = 4;
+	for (size_t i = 0; i < n - 1; i++)
+		ck_assert(pipeline_push(&user_pi, &err, "NOOP") == 0);
+	ck_assert(pipeline_push(&user_pi, &err, "PWD") == 0);
+	ck_assert_int_eq(user_pi.pipeline.n_queued, n);
+	ck_assert(pipeline_flush(&user_pi, &err) == 0);
+	ck_assert_int_eq(user_pi.pipeline.n_pending, n);
+	for (size_t i = 0; i < n; i++) {
+		struct Reply reply;
+		int result = pipeline_get_reply(&user_pi, &reply, &err);
+		ck_assert_msg(result == 0, "[%s] %s", err.where, err.msg);
+		ck_assert_int_eq(reply.first, POS_COM);
+		// NOOP gets 200, PWD gets 257.
+		ck_assert_int_eq(reply.third, i < n - 1 ? 0 : 7);
+	}
+	ck_assert_int_eq(user_pi.pipeline.n_pending, 0);
+	user_pi_quit(&user_pi);
+}
+
+void check_download_to_fd(const char *name, const char *service)
+{
+	struct ErrMsg err;
+	struct UserPI *user_pi_result =
+		user_pi_init(name, service, &anonymous, &user_pi, &err);
+	ck_assert_msg(user_pi_result == &user_pi, "[%s] %s", err.where,
+	              err.msg);
+	char path[] = "/tmp/check_ftp_XXXXXX";
+	int fd = mkstemp(path);
+	ck_assert(fd >= 0);
+	unlink(path);
+	ssize_t n = download_to_fd(&user_pi, "file", fd, &err);
+	ck_assert_msg(n == 4096, "[%s] %s", err.where, err.msg);
+	ck_assert_int_eq(lseek(fd, 0, SEEK_END), 4096);
+	close(fd);
+
+	// Pipes take splice() too.
+	int p[2];
+	ck_assert(pipe(p) == 0);
+	n = download_to_fd(&user_pi, "a", p[1], &err);
+	ck_assert_msg(n == 0, "[%s] %s", err.where, err.msg);
+	close(p[0]);
+	close(p[1]);
+	user_pi_quit(&user_pi);
+}
+
+void check_download_resumable(const char *name, const char *service)
+{
+	struct ErrMsg err;
+	struct UserPI *user_pi_result =
+		user_pi_init(name, service, &anonymous, &user_pi, &err);
+	ck_assert_msg(user_pi_result == &user_pi, "[%s] %s", err.where,
+	              err.msg);
+	char expected[4096];
+	int fd = open(FTP_DIR "/file", O_RDONLY);
+	ck_assert(fd >= 0);
+	ck_assert(read(fd, expected, sizeof(expected)) == sizeof(expected));
+	close(fd);
+
+	// Continue a partial download, whose first 1000 bytes are there.
+	char path[] = "/tmp/check_ftp_XXXXXX";
+	fd = mkstemp(path);
+	ck_assert(fd >= 0);
+	unlink(path);
+	ck_assert(write(fd, expected, 1000) == 1000);
+	off_t n = download_resumable(&user_pi, &anonymous, "file", fd, 1000,
+	                             NULL, &err);
+	ck_assert_msg(n == 4096, "[%s] %s", err.where, err.msg);
+	char got[4096];
+	ck_assert(pread(fd, got, sizeof(got), 0) == sizeof(got));
+	ck_assert(memcmp(got, expected, sizeof(got)) == 0);
+
+	ck_assert(download_resumable(&user_pi, &anonymous, "file", fd, 5000,
+	                             NULL, &err) < 0);
+	struct RetryOptions options = { .max_retries = 2,
+		                        .backoff_ms = 1,
+		                        .max_backoff_ms = 10 };
+	ck_assert(download_resumable(&user_pi, &anonymous, "missing", fd, 0,
+	                             &options, &err) < 0);
+	close(fd);
+	user_pi_quit(&user_pi);
+
+	// A server that drops both connections in the middle, twice.
+	struct FtpServerConfig config = { .drop_after = 100000,
+		                          .n_drops = 2,
+		                          .drop_ctrl = true };
+	struct FtpServer *flaky = ftp_server_start(&config);
+	ck_assert(flaky);
+	user_pi_result = user_pi_init(name, ftp_server_port(flaky),
+	                              &anonymous, &user_pi, &err);
+	ck_assert_msg(user_pi_result == &user_pi, "[%s] %s", err.where,
+	              err.msg);
+	char flaky_path[] = "/tmp/check_ftp_XXXXXX";
+	fd = mkstemp(flaky_path);
+	ck_assert(fd >= 0);
+	unlink(flaky_path);
+	const size_t len = 300000;
+	n = download_resumable(&user_pi, &anonymous, "/synthetic/size-300000",
+	                       fd, 0, &options, &err);
+	ck_assert_msg(n == (off_t)len, "[%s] %s", err.where, err.msg);
+	ck_assert_int_eq(ftp_server_sessions(flaky), 3);
+	unsigned char *data = malloc(len);
+	ck_assert(pread(fd, data, len, 0) == (ssize_t)len);
+	for (size_t i = 0; i < len; i++)
+		ck_assert_int_eq(data[i], ftp_server_synthetic_byte(i));
+	free(data);
+	close(fd);
+	user_pi_drop(&user_pi);
+	ftp_server_stop(flaky);
+}
+
+void check_mode_z(const char *name, const char *service)
+{
+	struct ErrMsg err;
+	struct UserPI *user_pi_result =
+		user_pi_init(name, service, &anonymous, &user_pi, &err);
+	ck_assert_msg(user_pi_result == &user_pi, "[%s] %s", err.where,
+	              err.msg);
+	ck_assert(set_mode_z(&user_pi, 10, &err) < 0);
+	int ret = set_mode_z(&user_pi, 6, &err);
+#ifndef HAVE_ZLIB
+	ck_assert(ret < 0);
+	user_pi_quit(&user_pi);
+	return;
+#endif
+	ck_assert_msg(ret == 0, "[%s] %s", err.where, err.msg);
+
+	// Upload text that compresses, and get it back in pieces.
+	const size_t len = 200 * 1000;
+	char *text = malloc(len + 1);
+	for (size_t i = 0; i < len; i += 10)
+		snprintf(text + i, 11, "%09zu\n", i % 1000);
+	ck_assert_msg(upload_init(&user_pi, "upload_z", false, &err) == 0,
+	              "[%s] %s", err.where, err.msg);
+	ck_assert(upload_chunk(&user_pi, text, len, &err) == (ssize_t)len);
+	ck_assert_msg(upload_finish(&user_pi, &err) == 0, "[%s] %s",
+	              err.where, err.msg);
+	ck_assert_msg(download_init(&user_pi, "upload_z", &err) == 0,
+	              "[%s] %s", err.where, err.msg);
+	char *got = malloc(len + 1000);
+	size_t got_len = 0;
+	ssize_t n;
+	while ((n = download_chunk(&user_pi, got + got_len, 1000, &err)) > 0)
+		got_len += n;
+	ck_assert_msg(n == 0, "[%s] %s", err.where, err.msg);
+	ck_assert_int_eq(got_len, len);
+	ck_assert(memcmp(got, text, len) == 0);
+
+	char *list;
+	enum ListFormat format;
+	ssize_t list_len =
+		list_directory(&user_pi, "/", &list, &format, &err);
+	ck_assert_msg(list_len > 0, "[%s] %s", err.where, err.msg);
+	ck_assert(strstr(list, "upload_z"));
+	free(list);
+
+	ck_assert_msg(set_mode_z(&user_pi, 0, &err) == 0, "[%s] %s",
+	              err.where, err.msg);
+	ck_assert_int_eq(get_file_size(&user_pi, "upload_z", &err), len);
+	user_pi_quit(&user_pi);
+	free(text);
+	free(got);
+	unlink(FTP_DIR "/upload_z");
+}
+
+void check_metrics(const char *name, const char *service)
+{
+	struct ErrMsg err;
+	struct UserPI *user_pi_result =
+		user_pi_init(name, service, &anonymous, &user_pi, &err);
+	ck_assert_msg(user_pi_result == &user_pi, "[%s] %s", err.where,
+	              err.msg);
+	int fd = open("/dev/null", O_WRONLY);
+	ck_assert_int_eq(download_to_fd(&user_pi, "file", fd, &err), 4096);
+	ck_assert(download_to_fd(&user_pi, "missing", fd, &err) < 0);
+	close(fd);
+
+	struct Metrics session;
+	metrics_snapshot(&user_pi, &session);
+	ck_assert_int_eq(session.histograms[METRIC_COMMAND + METRIC_CMD_RETR]
+	                         .count,
+	                 2);
+	ck_assert_int_eq(session.histograms[METRIC_COMMAND + METRIC_CMD_USER]
+	                         .count,
+	                 1);
+	ck_assert_int_eq(session.histograms[METRIC_TRANSFER].count, 2);
+	ck_assert_int_eq(session.histograms[METRIC_FIRST_BYTE].count, 1);
+	ck_assert_int_eq(session.histograms[METRIC_DATA_CONNECT].count, 2);
+	ck_assert_int_eq(session.counters[METRIC_BYTES_RECEIVED], 4096);
+	ck_assert_int_ge(session.counters[METRIC_NEGATIVE_REPLIES], 1);
+
+	struct Metrics global;
+	metrics_snapshot(NULL, &global);
+	ck_assert_int_ge(global.counters[METRIC_BYTES_RECEIVED], 4096);
+	ck_assert_int_ge(global.histograms[METRIC_TRANSFER].count, 2);
+
+	size_t len = metrics_export(&session, NULL, 0);
+	char *text = malloc(len + 1);
+	ck_assert_int_eq(metrics_export(&session, text, len + 1), len);
+	ck_assert(strstr(text, "waftp_command_seconds_bucket{command=\"RETR\","
+	                       "le=\"+Inf\"} 2\n"));
+	ck_assert(strstr(text, "waftp_received_bytes_total 4096\n"));
+	ck_assert(!strstr(text, "command=\"STOR\""));
+	free(text);
+	user_pi_quit(&user_pi);
+}
+
+void check_trace(const char *name, const char *service)
+{
+	struct ErrMsg err;
+	const struct LoginInfo secret = { .username = "anonymous",
+		                          .password = "hunter2",
+		                          .account_info = "" };
+	struct UserPI *user_pi_result =
+		user_pi_init(name, service, &secret, &user_pi, &err);
+	ck_assert_msg(user_pi_result == &user_pi, "[%s] %s", err.where,
+	              err.msg);
+	int fd = open("/dev/null", O_WRONLY);
+	ck_assert_int_eq(download_to_fd(&user_pi, "file", fd, &err), 4096);
+	close(fd);
+	user_pi_quit(&user_pi);
+
+	FILE *dump = tmpfile();
+	ck_assert(trace_dump(fileno(dump)) > 0);
+	rewind(dump);
+	char *text;
+	size_t len;
+	FILE *out = open_memstream(&text, &len);
+	ck_assert(trace_decode(fileno(dump), out) > 0);
+	fclose(out);
+	ck_assert(strstr(text, "connected\n"));
+	ck_assert(strstr(text, "-> USER anonymous\n"));
+	ck_assert(strstr(text, "-> PASS ***\n"));
+	ck_assert(!strstr(text, "hunter2"));
+	ck_assert(strstr(text, "-> RETR file\n"));
+	ck_assert(strstr(text, "received 4096\n"));
+	ck_assert(strstr(text, "reply 226\n"));
+	ck_assert(strstr(text, "-> QUIT\n"));
+	free(text);
+
+	rewind(dump);
+	ck_assert(write(fileno(dump), "garbage", 7) == 7);
+	rewind(dump);
+	ck_assert(trace_decode(fileno(dump), stdout) < 0);
+	ck_assert_int_eq(errno, EINVAL);
+	fclose(dump);
+}
+
+static uint64_t command_count(const struct UserPI *user_pi,
+                              enum MetricCommand command)
+{
+	return user_pi->metrics.histograms[METRIC_COMMAND + command].count;
+}
+
+void check_features(const char *name)
+{
+	struct ErrMsg err;
+	struct FtpServerConfig config = { .root = SERVER_ROOT };
+	struct FtpServer *full = ftp_server_start(&config);
+	ck_assert(full);
+	struct UserPI *user_pi_result = user_pi_init(
+		name, ftp_server_port(full), &anonymous, &user_pi, &err);
+	ck_assert_msg(user_pi_result == &user_pi, "[%s] %s", err.where,
+	              err.msg);
+	ck_assert(user_pi.features.known);
+	ck_assert_int_eq(user_pi.features.has & ~FEAT_MODE_Z,
+	                 FEAT_EPSV | FEAT_MLST | FEAT_REST_STREAM | FEAT_SIZE |
+	                         FEAT_MDTM | FEAT_UTF8);
+	ck_assert_str_eq(user_pi.features.mlst_facts,
+	                 "type*;size*;modify*;perm*;unique*;");
+	ck_assert_int_eq(command_count(&user_pi, METRIC_CMD_OTHER), 1);
+	user_pi_quit(&user_pi);
+	// Sessions to the same host don't ask again.
+	user_pi_result = user_pi_init(name, ftp_server_port(full), &anonymous,
+	                              &user_pi, &err);
+	ck_assert_msg(user_pi_result == &user_pi, "[%s] %s", err.where,
+	              err.msg);
+	ck_assert(user_pi.features.known);
+	ck_assert_int_eq(command_count(&user_pi, METRIC_CMD_OTHER), 0);
+	user_pi_quit(&user_pi);
+	ftp_server_stop(full);
+
+	// Without FEAT, EPSV and MLSD are tried once.
+	config = (struct FtpServerConfig){ .root = SERVER_ROOT,
+		                           .disable_feat = true,
+		                           .disable_epsv = true,
+		                           .disable_mlsd = true };
+	struct FtpServer *bare = ftp_server_start(&config);
+	ck_assert(bare);
+	user_pi_result = user_pi_init(name, ftp_server_port(bare), &anonymous,
+	                              &user_pi, &err);
+	ck_assert_msg(user_pi_result == &user_pi, "[%s] %s", err.where,
+	              err.msg);
+	ck_assert(!user_pi.features.known);
+	int fd = open("/dev/null", O_WRONLY);
+	for (int i = 0; i < 2; i++) {
+		ck_assert_int_eq(download_to_fd(&user_pi, "file", fd, &err),
+		                 4096);
+		char *list;
+		enum ListFormat format;
+		ck_assert(list_directory(&user_pi, "/", &list, &format, &err) >
+		          0);
+		ck_assert_int_eq(format, FORMAT_LIST);
+		free(list);
+	}
+	ck_assert_int_eq(command_count(&user_pi, METRIC_CMD_EPSV), 1);
+	ck_assert_int_eq(command_count(&user_pi, METRIC_CMD_PASV), 4);
+	ck_assert_int_eq(command_count(&user_pi, METRIC_CMD_MLSD), 1);
+	ck_assert_int_eq(user_pi.features.lacks, FEAT_EPSV | FEAT_MLST);
+
+	struct UserPI clone;
+	ck_assert_msg(user_pi_clone(&user_pi, &clone, &anonymous, &err) == 0,
+	              "[%s] %s", err.where, err.msg);
+	ck_assert_int_eq(clone.features.lacks, FEAT_EPSV | FEAT_MLST);
+	ck_assert_int_eq(download_to_fd(&clone, "file", fd, &err), 4096);
+	ck_assert_int_eq(command_count(&clone, METRIC_CMD_EPSV), 0);
+	user_pi_quit(&clone);
+	close(fd);
+	user_pi_quit(&user_pi);
+	ftp_server_stop(bare);
+}
+
+static void check_synthetic(const char *buf, size_t len, off_t offset)
+{
+	for (size_t i = 0; i < len; i++)
+		ck_assert_int_eq((unsigned char)buf[i],
+		                 ftp_server_synthetic_byte(offset + i));
+}
+
+void check_remote_file(const char *name, const char *service)
+{
+	struct ErrMsg err;
+	struct UserPI *user_pi_result =
+		user_pi_init(name, service, &anonymous, &user_pi, &err);
+	ck_assert_msg(user_pi_result == &user_pi, "[%s] %s", err.where,
+	              err.msg);
+	const off_t size = 100 * 1000 * 1000;
+	const size_t block_len = REMOTE_FILE_DEFAULT_BLOCK_LEN;
+	struct RemoteFile *file = remote_file_open(
+		&user_pi, "/synthetic/size-100000000", NULL, &err);
+	ck_assert_msg(file, "[%s] %s", err.where, err.msg);
+	ck_assert_int_eq(remote_file_size(file), size);
+	struct RemoteFileStats stats;
+
+	// A footer costs a block or two, not the whole file.
+	const size_t footer_len = 64 * 1024;
+	char *buf = malloc(4 * 1024 * 1024);
+	ck_assert_int_eq(remote_file_pread(file, buf, footer_len,
+	                                   size - footer_len, &err),
+	                 footer_len);
+	check_synthetic(buf, footer_len, size - footer_len);
+	remote_file_stats(file, &stats);
+	ck_assert_int_eq(stats.transfers, 1);
+	ck_assert_uint_le(stats.bytes_received, 2 * block_len);
+	ck_assert_int_eq(remote_file_pread(file, buf, 100, size - 1000, &err),
+	                 100);
+	check_synthetic(buf, 100, size - 1000);
+	remote_file_stats(file, &stats);
+	ck_assert_int_eq(stats.transfers, 1);
+	ck_assert_int_ge(stats.hits, 1);
+
+	// Short at the end, nothing past it.
+	ck_assert_int_eq(remote_file_pread(file, buf, 1000, size - 10, &err),
+	                 10);
+	ck_assert_int_eq(remote_file_pread(file, buf, 1000, size, &err), 0);
+	ck_assert(remote_file_pread(file, buf, 1000, -1, &err) < 0);
+
+	// A random read in the middle.
+	off_t middle = 12345678;
+	ck_assert_int_eq(remote_file_pread(file, buf, 3 * block_len, middle,
+	                                   &err),
+	                 3 * block_len);
+	check_synthetic(buf, 3 * block_len, middle);
+	remote_file_stats(file, &stats);
+	ck_assert_int_eq(stats.transfers, 2);
+
+	// Sequential reads keep one transfer going, reading ahead.
+	const size_t read_len = 100 * 1000;
+	for (off_t offset = 0; offset < 20 * 1000 * 1000; offset += read_len) {
+		ck_assert_int_eq(remote_file_pread(file, buf, read_len, offset,
+		                                   &err),
+		                 read_len);
+		check_synthetic(buf, read_len, offset);
+	}
+	remote_file_stats(file, &stats);
+	ck_assert_uint_le(stats.transfers, 5);
+	ck_assert_uint_le(stats.bytes_received,
+	                  21 * 1000 * 1000 + 70 * block_len);
+	remote_file_close(file);
+	free(buf);
+
+	// The session is usable again once the file is closed.
+	ck_assert_int_eq(get_file_size(&user_pi, "file", &err), 4096);
+
+	// A cache smaller than a read.
+	struct RemoteFileOptions small = { .block_len = 1000, .max_blocks = 4 };
+	file = remote_file_open(&user_pi, "/synthetic/size-100000", &small,
+	                        &err);
+	ck_assert_msg(file, "[%s] %s", err.where, err.msg);
+	buf = malloc(10000);
+	for (int i = 0; i < 3; i++) {
+		ck_assert_int_eq(remote_file_pread(file, buf, 10000,
+		                                   i * 33333, &err),
+		                 10000);
+		check_synthetic(buf, 10000, i * 33333);
+	}
+	remote_file_close(file);
+	free(buf);
+	user_pi_quit(&user_pi);
+}
+
+void check_mode_b(const char *name, const char *service)
+{
+	struct ErrMsg err;
+	struct UserPI *user_pi_result =
+		user_pi_init(name, service, &anonymous, &user_pi, &err);
+	ck_assert_msg(user_pi_result == &user_pi, "[%s] %s", err.where,
+	              err.msg);
+	ck_assert_msg(set_mode_b(&user_pi, true, &err) == 0, "[%s] %s",
+	              err.where, err.msg);
+
+	// Every kind of transfer, over the first data connection.
+	const size_t len = 200 * 1000;
+	char *text = malloc(len);
+	for (size_t i = 0; i < len; i++)
+		text[i] = i * 7;
+	ck_assert_msg(upload_init(&user_pi, "upload_b", false, &err) == 0,
+	              "[%s] %s", err.where, err.msg);
+	ck_assert(upload_chunk(&user_pi, text, len, &err) == (ssize_t)len);
+	ck_assert_msg(upload_finish(&user_pi, &err) == 0, "[%s] %s",
+	              err.where, err.msg);
+	char *got = malloc(len + 1000);
+	for (int i = 0; i < 3; i++) {
+		ck_assert_msg(download_init(&user_pi, "upload_b", &err) == 0,
+		              "[%s] %s", err.where, err.msg);
+		size_t got_len = 0;
+		ssize_t n;
+		while ((n = download_chunk(&user_pi, got + got_len, 1000,
+		                           &err)) > 0)
+			got_len += n;
+		ck_assert_msg(n == 0, "[%s] %s", err.where, err.msg);
+		ck_assert_int_eq(got_len, len);
+		ck_assert(memcmp(got, text, len) == 0);
+	}
+	ck_assert(download_init(&user_pi, "missing", &err) < 0);
+	int fd = open("/dev/null", O_WRONLY);
+	ck_assert_msg(download_to_fd(&user_pi, "file", fd, &err) == 4096,
+	              "[%s] %s", err.where, err.msg);
+	close(fd);
+	char *list;
+	enum ListFormat format;
+	ssize_t list_len =
+		list_directory(&user_pi, "/", &list, &format, &err);
+	ck_assert_msg(list_len > 0, "[%s] %s", err.where, err.msg);
+	ck_assert(strstr(list, "upload_b"));
+	free(list);
+	ck_assert_int_eq(command_count(&user_pi, METRIC_CMD_TYPE), 1);
+	ck_assert_int_eq(command_count(&user_pi, METRIC_CMD_EPSV), 1);
+	// They would send byte offsets with REST.
+	fd = open("/dev/null", O_WRONLY);
+	ck_assert(download_segmented(&user_pi, &anonymous, "file", fd, 2,
+	                             &err) < 0);
+	close(fd);
+	ck_assert(!remote_file_open(&user_pi, "file", NULL, &err));
+	ck_assert(strstr(err.msg, "MODE B"));
+
+	ck_assert_msg(set_mode_b(&user_pi, false, &err) == 0, "[%s] %s",
+	              err.where, err.msg);
+	ck_assert_msg(download_init(&user_pi, "upload_b", &err) == 0,
+	              "[%s] %s", err.where, err.msg);
+	size_t got_len = 0;
+	ssize_t n;
+	while ((n = download_chunk(&user_pi, got + got_len, 1000, &err)) > 0)
+		got_len += n;
+	ck_assert_int_eq(got_len, len);
+	ck_assert_int_eq(command_count(&user_pi, METRIC_CMD_TYPE), 2);
+	user_pi_quit(&user_pi);
+	free(text);
+	free(got);
+	unlink(FTP_DIR "/upload_b");
+
+	// A broken transfer restarts at the last marker before the break. The
+	// bandwidth keeps the reset from taking everything still unread.
+	struct FtpServerConfig config = { .bandwidth = 20 * 1000 * 1000,
+		                          .drop_after = 2500000,
+		                          .n_drops = 1 };
+	struct FtpServer *flaky = ftp_server_start(&config);
+	ck_assert(flaky);
+	user_pi_result = user_pi_init(name, ftp_server_port(flaky),
+	                              &anonymous, &user_pi, &err);
+	ck_assert_msg(user_pi_result == &user_pi, "[%s] %s", err.where,
+	              err.msg);
+	ck_assert_msg(set_mode_b(&user_pi, true, &err) == 0, "[%s] %s",
+	              err.where, err.msg);
+	char path[] = "/tmp/check_ftp_XXXXXX";
+	fd = mkstemp(path);
+	ck_assert(fd >= 0);
+	unlink(path);
+	const size_t size = 5000000;
+	struct RetryOptions options = { .max_retries = 2,
+		                        .backoff_ms = 1,
+		                        .max_backoff_ms = 10 };
+	off_t ret = download_resumable(&user_pi, NULL,
+	                               "/synthetic/size-5000000", fd, 0,
+	                               &options, &err);
+	ck_assert_msg(ret == (off_t)size, "[%s] %s", err.where, err.msg);
+	ck_assert_int_eq(command_count(&user_pi, METRIC_CMD_REST), 1);
+	ck_assert(user_pi.metrics.counters[METRIC_BYTES_RECEIVED] > size);
+	char *data = malloc(size);
+	ck_assert(pread(fd, data, size, 0) == (ssize_t)size);
+	check_synthetic(data, size, 0);
+	free(data);
+	close(fd);
+	user_pi_quit(&user_pi);
+	ftp_server_stop(flaky);
+
+	config = (struct FtpServerConfig){ .disable_mode_b = true };
+	struct FtpServer *stream_only = ftp_server_start(&config);
+	ck_assert(stream_only);
+	user_pi_result = user_pi_init(name, ftp_server_port(stream_only),
+	                              &anonymous, &user_pi, &err);
+	ck_assert_msg(user_pi_result == &user_pi, "[%s] %s", err.where,
+	              err.msg);
+	ck_assert(set_mode_b(&user_pi, true, &err) < 0);
+	ck_assert(!user_pi.mode_b);
+	// Turned down once, it isn't tried again.
+	ck_assert(user_pi.features.lacks & FEAT_MODE_B);
+	ck_assert(set_mode_b(&user_pi, true, &err) < 0);
+	ck_assert_int_eq(command_count(&user_pi, METRIC_CMD_MODE), 1);
+	user_pi_quit(&user_pi);
+	ftp_server_stop(stream_only);
+}
+
+void check_data_prefetch(const char *name, const char *service)
+{
+	struct ErrMsg err;
+	struct UserPI *user_pi_result =
+		user_pi_init(name, service, &anonymous, &user_pi, &err);
+	ck_assert_msg(user_pi_result == &user_pi, "[%s] %s", err.where,
+	              err.msg);
+	set_data_prefetch(&user_pi, true);
+	int fd = open("/dev/null", O_WRONLY);
+	const int n_files = 10;
+	for (int i = 0; i < n_files; i++)
+		ck_assert_msg(download_to_fd(&user_pi, "file", fd, &err) ==
+		                      4096,
+		              "[%s] %s", err.where, err.msg);
+	// Only the first transfer sets them up, the others start right away,
+	// each on the EPSV sent at the end of the previous one.
+	ck_assert_int_eq(command_count(&user_pi, METRIC_CMD_TYPE), 1);
+	ck_assert_int_eq(command_count(&user_pi, METRIC_CMD_EPSV), n_files + 1);
+	ck_assert_int_ge(user_pi.prefetch.fd, 0);
+
+	// Other commands in between, and other kinds of transfers.
+	ck_assert_int_eq(get_file_size(&user_pi, "file", &err), 4096);
+	char *list;
+	enum ListFormat format;
+	ck_assert_msg(list_directory(&user_pi, "/", &list, &format, &err) > 0,
+	              "[%s] %s", err.where, err.msg);
+	free(list);
+	char buf[4096];
+	ck_assert_int_eq(download_init(&user_pi, "file", &err), 0);
+	ssize_t n, total = 0;
+	while ((n = download_chunk(&user_pi, buf, sizeof(buf), &err)) > 0)
+		total += n;
+	ck_assert_int_eq(total, 4096);
+	struct RemoteFile *file = remote_file_open(
+		&user_pi, "/synthetic/size-10000000", NULL, &err);
+	ck_assert_msg(file, "[%s] %s", err.where, err.msg);
+	ck_assert_int_eq(remote_file_pread(file, buf, 100, 5000000, &err), 100);
+	check_synthetic(buf, 100, 5000000);
+	remote_file_close(file);
+	ck_assert_msg(download_to_fd(&user_pi, "file", fd, &err) == 4096,
+	              "[%s] %s", err.where, err.msg);
+	ck_assert_int_eq(command_count(&user_pi, METRIC_CMD_TYPE), 1);
+	ck_assert(download_to_fd(&user_pi, "missing", fd, &err) < 0);
+
+	// A connection the server closed isn't used.
+	shutdown(user_pi.prefetch.fd, SHUT_RD);
+	ck_assert_msg(download_to_fd(&user_pi, "file", fd, &err) == 4096,
+	              "[%s] %s", err.where, err.msg);
+	ck_assert_int_ge(command_count(&user_pi, METRIC_CMD_TYPE), 2);
+
+	set_data_prefetch(&user_pi, false);
+	ck_assert_int_lt(user_pi.prefetch.fd, 0);
+	ck_assert_int_eq(download_to_fd(&user_pi, "file", fd, &err), 4096);
+	ck_assert_int_lt(user_pi.prefetch.fd, 0);
+	user_pi_quit(&user_pi);
+
+	// Falling back to PASV and LIST.
+	struct FtpServerConfig config = { .root = SERVER_ROOT,
+		                          .disable_feat = true,
+		                          .disable_epsv = true,
+		                          .disable_mlsd = true };
+	struct FtpServer *bare = ftp_server_start(&config);
+	ck_assert(bare);
+	user_pi_result = user_pi_init(name, ftp_server_port(bare), &anonymous,
+	                              &user_pi, &err);
+	ck_assert_msg(user_pi_result == &user_pi, "[%s] %s", err.where,
+	              err.msg);
+	set_data_prefetch(&user_pi, true);
+	for (int i = 0; i < 2; i++) {
+		ck_assert_msg(list_directory(&user_pi, "/", &list, &format,
+		                             &err) > 0,
+		              "[%s] %s", err.where, err.msg);
+		free(list);
+		ck_assert_int_eq(download_to_fd(&user_pi, "file", fd, &err),
+		                 4096);
+	}
+	ck_assert_int_eq(command_count(&user_pi, METRIC_CMD_TYPE), 1);
+	user_pi_quit(&user_pi);
+	ftp_server_stop(bare);
+	close(fd);
+}
+
+void check_fxp(const char *name)
+{
+	struct ErrMsg err;
+	struct FtpServerConfig config = { .root = SERVER_ROOT };
+	struct FtpServer *other = ftp_server_start(&config);
+	ck_assert(other);
+	struct UserPI src, dest;
+	ck_assert_msg(user_pi_init(name, SERVER_PORT, &anonymous, &src, &err) ==
+	                      &src,
+	              "[%s] %s", err.where, err.msg);
+	ck_assert_msg(user_pi_init(name, ftp_server_port(other), &anonymous,
+	                           &dest, &err) == &dest,
+	              "[%s] %s", err.where, err.msg);
+
+	const size_t size = 3 * 1000 * 1000;
+	for (int i = 0; i < 2; i++) {
+		ck_assert_msg(fxp_copy(&src, "/synthetic/size-3000000", &dest,
+		                       "fxp_copy", &err) == 0,
+		              "[%s] %s", err.where, err.msg);
+		ck_assert_int_eq(get_file_size(&dest, "fxp_copy", &err), size);
+	}
+	// None of it went through us.
+	ck_assert_int_eq(src.metrics.counters[METRIC_BYTES_RECEIVED], 0);
+	ck_assert_int_eq(dest.metrics.counters[METRIC_BYTES_SENT], 0);
+	char *buf = malloc(size);
+	int fd = open(FTP_DIR "/fxp_copy", O_RDONLY);
+	ck_assert_int_ge(fd, 0);
+	ck_assert_int_eq(read(fd, buf, size), size);
+	check_synthetic(buf, size, 0);
+	close(fd);
+	free(buf);
+	unlink(FTP_DIR "/fxp_copy");
+
+	// A refused destination leaves both sessions usable.
+	ck_assert(fxp_copy(&src, "file", &dest, "/synthetic/x", &err) < 0);
+	ck_assert(strstr(err.msg, "553"));
+	ck_assert(session_is_alive(&src));
+	ck_assert(session_is_alive(&dest));
+	ck_assert(fxp_copy(&src, "file", &src, "fxp_copy", &err) < 0);
+	user_pi_quit(&src);
+
+	// Over IPv6, a source without EPSV can't give its address.
+	config = (struct FtpServerConfig){ .root = SERVER_ROOT,
+		                           .disable_feat = true,
+		                           .disable_epsv = true };
+	struct FtpServer *bare = ftp_server_start(&config);
+	ck_assert(bare);
+	ck_assert_msg(user_pi_init(name, ftp_server_port(bare), &anonymous,
+	                           &src, &err) == &src,
+	              "[%s] %s", err.where, err.msg);
+	int ret = fxp_copy(&src, "file", &dest, "fxp_copy", &err);
+	if (strchr(name, ':')) {
+		ck_assert(ret < 0);
+		ck_assert(strstr(err.where, "EPSV"));
+		ck_assert(session_is_alive(&src));
+		ck_assert(session_is_alive(&dest));
+	} else {
+		ck_assert_msg(ret == 0, "[%s] %s", err.where, err.msg);
+		unlink(FTP_DIR "/fxp_copy");
+	}
+	user_pi_quit(&src);
+	ftp_server_stop(bare);
+
+	user_pi_quit(&dest);
+	ftp_server_stop(other);
+}
+
+/// List \a path, \return whether \a entry is in it.
+static bool listed(struct UserPI *user_pi, char *path, const char *entry)
+{
+	struct ErrMsg err;
+	struct ListArena *arena = list_arena_new();
+	struct Fact *facts;
+	ssize_t n = list_directory_facts(user_pi, path, arena, &facts, &err);
+	ck_assert_msg(n >= 0, "[%s] %s", err.where, err.msg);
+	bool found = false;
+	for (ssize_t i = 0; i < n; i++)
+		found |= !strcmp(facts[i].name, entry);
+	list_arena_free(arena);
+	return found;
+}
+
+static time_t list_cache_now;
+
+static time_t list_cache_clock(void)
+{
+	return list_cache_now;
+}
+
+/// Make the time of the directory \a path move by \a s seconds.
+static void touch_dir(const char *path, time_t s)
+{
+	struct stat st;
+	ck_assert(stat(path, &st) == 0);
+	struct timespec times[2] = { st.st_atim, st.st_mtim };
+	times[1].tv_sec += s;
+	ck_assert(utimensat(AT_FDCWD, path, times, 0) == 0);
+}
+
+void check_list_cache(const char *name, const char *service)
+{
+	struct ErrMsg err;
+	struct UserPI *user_pi_result =
+		user_pi_init(name, service, &anonymous, &user_pi, &err);
+	ck_assert_msg(user_pi_result == &user_pi, "[%s] %s", err.where,
+	              err.msg);
+	ck_assert(mkdir(FTP_DIR "/cache", 0755) == 0);
+	struct ListCache *cache =
+		list_cache_new(&(struct ListCacheOptions){ .ttl_s = 1 });
+	ck_assert(cache);
+	list_cache_set_clock(cache, list_cache_clock);
+	set_list_cache(&user_pi, cache);
+	const uint64_t *counters = user_pi.metrics.counters;
+
+	ck_assert(!listed(&user_pi, "/cache", "a"));
+	ck_assert(!listed(&user_pi, "/cache/", "a"));
+	ck_assert_int_eq(command_count(&user_pi, METRIC_CMD_MLSD), 1);
+	ck_assert_int_eq(counters[METRIC_LIST_CACHE_MISSES], 1);
+	ck_assert_int_eq(counters[METRIC_LIST_CACHE_HITS], 1);
+
+	// Past the TTL, an unchanged directory isn't listed again.
+	list_cache_now += 2;
+	ck_assert(!listed(&user_pi, "/cache", "a"));
+	ck_assert_int_eq(command_count(&user_pi, METRIC_CMD_MLSD), 1);
+	ck_assert_int_eq(counters[METRIC_LIST_CACHE_REVALIDATIONS], 1);
+
+	// A change made by someone else shows once the time moved, which
+	// may take a second.
+	int fd = open(FTP_DIR "/cache/other", O_WRONLY | O_CREAT, 0644);
+	ck_assert(fd >= 0);
+	close(fd);
+	touch_dir(FTP_DIR "/cache", 10);
+	ck_assert(!listed(&user_pi, "/cache", "other"));
+	ck_assert_int_eq(command_count(&user_pi, METRIC_CMD_MLSD), 1);
+	list_cache_now += 2;
+	ck_assert(listed(&user_pi, "/cache", "other"));
+	ck_assert_int_eq(command_count(&user_pi, METRIC_CMD_MLSD), 2);
+	unlink(FTP_DIR "/cache/other");
+
+	// Changes made by the session, or its clones, show at once.
+	struct UserPI clone;
+	ck_assert_msg(user_pi_clone(&user_pi, &clone, &anonymous, &err) == 0,
+	              "[%s] %s", err.where, err.msg);
+	fd = open("/dev/null", O_RDONLY);
+	ck_assert_msg(upload_from_fd(&clone, "/cache/a", fd, false, &err) == 0,
+	              "[%s] %s", err.where, err.msg);
+	close(fd);
+	ck_assert(listed(&user_pi, "/cache", "a"));
+	ck_assert_msg(rename_file(&user_pi, "/cache/a", "/cache/b", &err) == 0,
+	              "[%s] %s", err.where, err.msg);
+	ck_assert(!listed(&user_pi, "/cache", "a"));
+	ck_assert(listed(&user_pi, "/cache", "b"));
+	ck_assert_msg(delete_file(&clone, "/cache/b", &err) == 0, "[%s] %s",
+	              err.where, err.msg);
+	ck_assert(!listed(&user_pi, "/cache", "b"));
+	ck_assert(delete_file(&user_pi, "/cache/b", &err) < 0);
+	ck_assert(strstr(err.msg, "550"));
+	user_pi_quit(&clone);
+
+	// Other users don't see those listings.
+	const struct LoginInfo other = { .username = "other",
+		                         .password = "",
+		                         .account_info = "" };
+	struct UserPI stranger;
+	ck_assert_msg(user_pi_init(name, service, &other, &stranger, &err) ==
+	                      &stranger,
+	              "[%s] %s", err.where, err.msg);
+	set_list_cache(&stranger, cache);
+	ck_assert(!listed(&stranger, "/cache", "b"));
+	ck_assert_int_eq(command_count(&stranger, METRIC_CMD_MLSD), 1);
+	user_pi_quit(&stranger);
+
+	// However the current directory is spelled.
+	ck_assert(!listed(&user_pi, ".", "relative"));
+	fd = open("/dev/null", O_RDONLY);
+	ck_assert_msg(upload_from_fd(&user_pi, "relative", fd, false, &err) ==
+	                      0,
+	              "[%s] %s", err.where, err.msg);
+	close(fd);
+	ck_assert(listed(&user_pi, "./", "relative"));
+	ck_assert_msg(delete_file(&user_pi, "relative", &err) == 0, "[%s] %s",
+	              err.where, err.msg);
+	ck_assert(!listed(&user_pi, "", "relative"));
+
+	size_t len = metrics_export(&user_pi.metrics, NULL, 0);
+	char *text = malloc(len + 1);
+	metrics_export(&user_pi.metrics, text, len + 1);
+	ck_assert(strstr(text, "waftp_list_cache_hits_total 3\n"));
+	free(text);
+	list_cache_free(cache);
+
+	// Every entry is used, then the least recently used one is replaced.
+	cache = list_cache_new(&(struct ListCacheOptions){ .max_entries = 2 });
+	ck_assert(cache);
+	set_list_cache(&user_pi, cache);
+	uint64_t n_mlsd = command_count(&user_pi, METRIC_CMD_MLSD);
+	ck_assert(listed(&user_pi, "/", "file"));
+	ck_assert(!listed(&user_pi, "/cache", "file"));
+	ck_assert(listed(&user_pi, "/", "file"));
+	ck_assert(!listed(&user_pi, "/cache", "file"));
+	ck_assert_int_eq(command_count(&user_pi, METRIC_CMD_MLSD), n_mlsd + 2);
+	// "/" goes, "/cache" was used since.
+	ck_assert(listed(&user_pi, "", "cache"));
+	ck_assert(!listed(&user_pi, "/cache", "file"));
+	ck_assert_int_eq(command_count(&user_pi, METRIC_CMD_MLSD), n_mlsd + 3);
+	ck_assert(listed(&user_pi, "/", "file"));
+	ck_assert_int_eq(command_count(&user_pi, METRIC_CMD_MLSD), n_mlsd + 4);
+	user_pi_quit(&user_pi);
+	list_cache_free(cache);
+	rmdir(FTP_DIR "/cache");
+}
+
+void check_upload(const char *name, const char *service)
+{
+	struct ErrMsg err;
+	struct UserPI *user_pi_result =
+		user_pi_init(name, service, &anonymous, &user_pi, &err);
+	ck_assert_msg(user_pi_result == &user_pi, "[%s] %s", err.where,
+	              err.msg);
+	const size_t chunk_len = 256 * 1024;
+	char *chunk = malloc(chunk_len);
+	for (size_t i = 0; i < chunk_len; i++)
+		chunk[i] = i % 251;
+	ck_assert_msg(upload_init(&user_pi, "upload", false, &err) == 0,
+	              "[%s] %s", err.where, err.msg);
+	for (size_t i = 0; i < 2; i++)
+		ck_assert_msg(upload_chunk(&user_pi, chunk, chunk_len, &err) ==
+		                      (ssize_t)chunk_len,
+		              "[%s] %s", err.where, err.msg);
+	ck_assert(upload_chunk(&user_pi, "tail", 4, &err) == 4);
+	ck_assert_msg(upload_finish(&user_pi, &err) == 0, "[%s] %s",
+	              err.where, err.msg);
+
+	// Append the file with sendfile().
+	char path[] = "/tmp/check_ftp_XXXXXX";
+	int fd = mkstemp(path);
+	ck_assert(fd >= 0);
+	unlink(path);
+	ck_assert(write(fd, chunk, chunk_len) == (ssize_t)chunk_len);
+	ck_assert(lseek(fd, 0, SEEK_SET) == 0);
+	off_t n = upload_from_fd(&user_pi, "upload", fd, true, &err);
+	ck_assert_msg(n == (off_t)chunk_len, "[%s] %s", err.where, err.msg);
+	close(fd);
+
+	ck_assert_int_eq(get_file_size(&user_pi, "upload", &err),
+	                 3 * chunk_len + 4);
+	user_pi_quit(&user_pi);
+	free(chunk);
+	unlink(FTP_DIR "/upload");
+}
+
+void check_download_segmented(const char *name, const char *service)
+{
+	struct ErrMsg err;
+	struct UserPI *user_pi_result =
+		user_pi_init(name, service, &anonymous, &user_pi, &err);
+	ck_assert_msg(user_pi_result == &user_pi, "[%s] %s", err.where,
+	              err.msg);
+	char path[] = "/tmp/check_ftp_XXXXXX";
+	int fd = mkstemp(path);
+	ck_assert(fd >= 0);
+	unlink(path);
+	// Big enough for 3 segments.
+	const size_t len = 2500000;
+	off_t size = download_segmented(&user_pi, &anonymous,
+	                                "/synthetic/size-2500000", fd, 4, &err);
+	ck_assert_msg(size == (off_t)len, "[%s] %s", err.where, err.msg);
+	ck_assert_int_eq(lseek(fd, 0, SEEK_END), len);
+	char *buf = malloc(len);
+	ck_assert_int_eq(pread(fd, buf, len, 0), len);
+	check_synthetic(buf, len, 0);
+	free(buf);
+
+	// Clones that fail to log in are closed.
+	const struct LoginInfo nobody = { 0 };
+	ck_assert(download_segmented(&user_pi, &nobody,
+	                             "/synthetic/size-2500000", fd, 4,
+	                             &err) < 0);
+	struct UserPI clone;
+	ck_assert(user_pi_clone(&user_pi, &clone, &nobody, &err) < 0);
+	ck_assert(fcntl(clone.ctrl.fd, F_GETFD) < 0);
+	close(fd);
+	user_pi_quit(&user_pi);
+}
+
+void check_session_pool(const char *name, const char *service)
+{
+	struct ErrMsg err;
+	struct SessionPool *pool = session_pool_create(&(struct PoolOptions){
+		.max_sessions = 2, .idle_timeout_ms = 0 });
+	ck_assert(pool != NULL);
+	struct UserPI *a =
+		session_pool_checkout(pool, name, service, &anonymous, &err);
+	ck_assert_msg(a != NULL, "[%s] %s", err.where, err.msg);
+	struct UserPI *b =
+		session_pool_checkout(pool, name, service, &anonymous, &err);
+	ck_assert_msg(b != NULL, "[%s] %s", err.where, err.msg);
+	ck_assert(a != b);
+	// b is a clone of a, sharing its address and its connect timeout.
+	ck_assert(a->ctrl.addr_info == b->ctrl.addr_info);
+	ck_assert(b->connect_timeout_ms);
+	ck_assert_int_eq(b->connect_timeout_ms, a->connect_timeout_ms);
+	session_pool_checkin(pool, a);
+	struct UserPI *c =
+		session_pool_checkout(pool, name, service, &anonymous, &err);
+	ck_assert(c == a);
+	char *list = NULL;
+	enum ListFormat format;
+	ck_assert(list_directory(c, "", &list, &format, &err) >= 0);
+	free(list);
+	session_pool_checkin(pool, c);
+	// Another login doesn't get the idle session logged in as anonymous.
+	const struct LoginInfo other = { .username = "anonymous",
+		                         .password = "other",
+		                         .account_info = "" };
+	struct UserPI *d =
+		session_pool_checkout(pool, name, service, &other, &err);
+	ck_assert_msg(d != NULL, "[%s] %s", err.where, err.msg);
+	ck_assert(d != a);
+	session_pool_checkin(pool, d);
+	session_pool_discard(pool, b);
+	session_pool_destroy(pool);
+}
+
+struct ListCount {
+	size_t n;
+	ssize_t file_size;
+};
+
+static int count_fact(void *ctx, const struct Fact *fact)
+{
+	struct ListCount *count = ctx;
+	count->n++;
+	if (!strcmp(fact->name, "file"))
+		count->file_size = fact->size;
+	return 0;
+}
+
+static int stop_at_first_fact(void *ctx, const struct Fact *fact)
+{
+	(void)ctx;
+	(void)fact;
+	return -1;
+}
+
+void check_list_directory_foreach(const char *name, const char *service)
+{
+	struct ErrMsg err;
+	struct UserPI *user_pi_result =
+		user_pi_init(name, service, &anonymous, &user_pi, &err);
+	ck_assert_msg(user_pi_result == &user_pi, "[%s] %s", err.where,
+	              err.msg);
+	struct ListCount count = { .file_size = -1 };
+	ssize_t n = list_directory_foreach(&user_pi, "", count_fact, &count,
+	                                   &err);
+	ck_assert_msg(n == 2, "[%s] %s", err.where, err.msg);
+	ck_assert_int_eq(count.n, 2);
+	ck_assert_int_eq(count.file_size, 4096);
+
+	// Stopping early leaves the session usable.
+	ck_assert(list_directory_foreach(&user_pi, "", stop_at_first_fact,
+	                                 NULL, &err) < 0);
+	n = list_directory_foreach(&user_pi, "", count_fact, &count, &err);
+	ck_assert_msg(n == 2, "[%s] %s", err.where, err.msg);
+
+	struct ListArena *arena = list_arena_new();
+	struct Fact *facts;
+	n = list_directory_facts(&user_pi, "", arena, &facts, &err);
+	ck_assert_msg(n == 2, "[%s] %s", err.where, err.msg);
+	ck_assert(!strcmp(facts[0].name, "file") ||
+	          !strcmp(facts[1].name, "file"));
+	list_arena_free(arena);
+	user_pi_quit(&user_pi);
+}
+
+static int count_crawl_fact(void *ctx, const char *dir, const struct Fact *fact)
+{
+	(void)dir;
+	(void)fact;
+	__atomic_add_fetch((size_t *)ctx, 1, __ATOMIC_SEQ_CST);
+	return 0;
+}
+
+static int stop_crawl(void *ctx, const char *dir, const struct Fact *fact)
+{
+	(void)ctx;
+	(void)dir;
+	(void)fact;
+	return -1;
+}
+
+void check_crawl(const char *name, const char *service)
+{
+	struct ErrMsg err;
+	struct UserPI *user_pi_result =
+		user_pi_init(name, service, &anonymous, &user_pi, &err);
+	ck_assert_msg(user_pi_result == &user_pi, "[%s] %s", err.where,
+	              err.msg);
+	size_t count = 0;
+	ssize_t n = crawl(&user_pi, &anonymous, "", 3, count_crawl_fact, &count,
+	                  &err);
+	ck_assert_msg(n == 2, "[%s] %s", err.where, err.msg);
+	ck_assert_int_eq(count, 2);
+	ck_assert(crawl(&user_pi, &anonymous, "", 2, stop_crawl, NULL, &err) <
+	          0);
+	// The tree would be incomplete.
+	ck_assert(crawl(&user_pi, &anonymous, "missing", 2, count_crawl_fact,
+	                &count, &err) < 0);
+	ck_assert(strstr(err.msg, "Cannot list missing"));
+	ck_assert(session_is_alive(&user_pi));
+	user_pi_quit(&user_pi);
+}
+
+static int count_bytes(void *ctx, const char *data, size_t len)
+{
+	(void)data;
+	*(size_t *)ctx += len;
+	return 0;
+}
+
+/// Run every session until none is pending.
+static void async_run(struct UserPIAsync **sessions, enum AsyncResult *results,
+                      size_t n)
+{
+	struct ErrMsg err;
+	for (;;) {
+		struct pollfd fds[n * ASYNC_MAX_FDS];
+		nfds_t n_fds = 0;
+		for (size_t i = 0; i < n; i++) {
+			results[i] = user_pi_step(sessions[i], &err);
+			ck_assert_msg(results[i] != ASYNC_FAILED, "[%s] %s",
+			              err.where, err.msg);
+			if (results[i] == ASYNC_PENDING)
+				n_fds += user_pi_async_fds(sessions[i],
+				                           &fds[n_fds]);
+		}
+		if (!n_fds)
+			return;
+		ck_assert(poll(fds, n_fds, 5000) > 0);
+	}
+}
+
+void check_user_pi_async(const char *name, const char *service)
+{
+	enum { N = 3 };
+	struct ErrMsg err;
+	struct UserPIAsync *sessions[N];
+	enum AsyncResult results[N];
+	size_t received[N] = { 0 };
+	for (size_t i = 0; i < N; i++) {
+		sessions[i] = user_pi_async_new(name, service, &anonymous, &err);
+		ck_assert_msg(sessions[i] != NULL, "[%s] %s", err.where,
+		              err.msg);
+	}
+	async_run(sessions, results, N);
+	for (size_t i = 0; i < N; i++) {
+		ck_assert_int_eq(results[i], ASYNC_READY);
+		ck_assert(user_pi_async_download(sessions[i], "file",
+		                                 count_bytes, &received[i],
+		                                 &err) == 0);
+	}
+	async_run(sessions, results, N);
+	for (size_t i = 0; i < N; i++) {
+		ck_assert_int_eq(results[i], ASYNC_READY);
+		ck_assert_int_eq(received[i], 4096);
+	}
+
+	// A failed transfer leaves the session usable.
+	ck_assert(user_pi_async_download(sessions[0], "no-such-file",
+	                                 count_bytes, &received[0], &err) == 0);
+	async_run(sessions, results, 1);
+	ck_assert_int_eq(results[0], ASYNC_ERROR);
+	received[0] = 0;
+	ck_assert(user_pi_async_list(sessions[0], "", count_bytes,
+	                             &received[0], &err) == 0);
+	async_run(sessions, results, 1);
+	ck_assert_int_eq(results[0], ASYNC_READY);
+	ck_assert(received[0] > 0);
+
+	for (size_t i = 0; i < N; i++)
+		user_pi_async_free(sessions[i]);
+}
+
+void check_async_loop(const char *name, const char *service)
+{
+	struct ErrMsg err;
+	struct AsyncLoop *loop = async_loop_new(64, &err);
+	if (!loop) {
+		// Not built in, or not allowed here.
+		printf("Skipping AsyncLoop: [%s] %s\n", err.where, err.msg);
+		return;
+	}
+	struct UserPIAsync *a =
+		user_pi_async_new(name, service, &anonymous, &err);
+	ck_assert_msg(a != NULL, "[%s] %s", err.where, err.msg);
+	ck_assert(async_loop_add(loop, a, &err) == 0);
+	struct AsyncEvent event;
+	int n;
+	while ((n = async_loop_wait(loop, &event, 1, 5000, &err)) == 0)
+		;
+	ck_assert_msg(n == 1, "[%s] %s", err.where, err.msg);
+	ck_assert_int_eq(event.result, ASYNC_READY);
+
+	char path[] = "/tmp/check_ftp_XXXXXX";
+	int fd = mkstemp(path);
+	ck_assert(fd >= 0);
+	unlink(path);
+	ck_assert(user_pi_async_download_to_fd(a, "file", fd, 0, &err) == 0);
+	while ((n = async_loop_wait(loop, &event, 1, 5000, &err)) == 0)
+		;
+	ck_assert_msg(n == 1 && event.result == ASYNC_READY, "[%s] %s",
+	              event.err.where, event.err.msg);
+	ck_assert_int_eq(lseek(fd, 0, SEEK_END), 4096);
+	close(fd);
+
+	user_pi_async_free(a);
+	async_loop_free(loop);
+}
+
+void check_recv_buf(void)
+{
+	int fds[2];
+	ck_assert(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+	const size_t long_len = LINE_MAX_LEN + 500;
+	char long_line[long_len];
+	memset(long_line, 'x', long_len - 2);
+	memcpy(&long_line[long_len - 2], "\r\n", 2);
+	ck_assert(sendn(fds[1], "220-a\r\n", 7) == 7);
+	ck_assert(sendn(fds[1], long_line, long_len) == (ssize_t)long_len);
+	ck_assert(sendn(fds[1], "220 b\r\n220 c", 12) == 12);
+	close(fds[1]);
+
+	struct RecvBuf rb;
+	recv_buf_init(&rb);
+	const char *line;
+	ck_assert_int_eq(recv_buf_get_line(&rb, fds[0], &line), 7);
+	ck_assert(memcmp(line, "220-a\r\n", 7) == 0);
+	// Long lines come in pieces.
+	ck_assert_int_eq(recv_buf_get_line(&rb, fds[0], &line), LINE_MAX_LEN);
+	ck_assert_int_eq(recv_buf_get_line(&rb, fds[0], &line),
+	                 long_len - LINE_MAX_LEN);
+	ck_assert(memcmp(&line[long_len - LINE_MAX_LEN - 2], "\r\n", 2) == 0);
+	ck_assert_int_eq(recv_buf_get_line(&rb, fds[0], &line), 7);
+	ck_assert(memcmp(line, "220 b\r\n", 7) == 0);
+	// What's left when the connection is closed.
+	ck_assert_int_eq(recv_buf_get_line(&rb, fds[0], &line), 5);
+	ck_assert_int_eq(recv_buf_get_line(&rb, fds[0], &line), 0);
+	close(fds[0]);
+}
+
+void check_data_sockaddr(void)
+{
+	struct sockaddr_storage addr;
+	socklen_t len;
+	ck_assert(data_sockaddr("127.0.0.1", "2121", NULL, 0, &addr, &len) ==
+	          0);
+	struct sockaddr_in *in = (struct sockaddr_in *)&addr;
+	ck_assert_int_eq(in->sin_family, AF_INET);
+	ck_assert_int_eq(ntohs(in->sin_port), 2121);
+	ck_assert_int_eq(ntohl(in->sin_addr.s_addr), 0x7f000001);
+
+	// EPSV reuses the address of the control connection.
+	struct sockaddr_storage peer;
+	struct sockaddr_in6 *peer6 = (struct sockaddr_in6 *)&peer;
+	*peer6 = (struct sockaddr_in6){ .sin6_family = AF_INET6,
+		                        .sin6_port = htons(21),
+		                        .sin6_addr = in6addr_loopback };
+	ck_assert(data_sockaddr("", "50000", &peer, sizeof(*peer6), &addr,
+	                        &len) == 0);
+	ck_assert_int_eq(len, sizeof(*peer6));
+	ck_assert_int_eq(ntohs(((struct sockaddr_in6 *)&addr)->sin6_port),
+	                 50000);
+
+	ck_assert(data_sockaddr("localhost", "21", NULL, 0, &addr, &len) < 0);
+	ck_assert(data_sockaddr("127.0.0.1", "70000", NULL, 0, &addr, &len) <
+	          0);
+}
+
+static int listen_loopback(struct sockaddr_in *addr, int backlog)
+{
+	int s = socket(AF_INET, SOCK_STREAM, 0);
+	ck_assert(s >= 0);
+	*addr = (struct sockaddr_in){ .sin_family = AF_INET,
+		                      .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+	socklen_t len = sizeof(*addr);
+	ck_assert(bind(s, (struct sockaddr *)addr, len) == 0);
+	ck_assert(listen(s, backlog) == 0);
+	ck_assert(getsockname(s, (struct sockaddr *)addr, &len) == 0);
+	return s;
+}
+
+void check_connect_happy(void)
+{
+	// Once its queue is full, a listener drops SYNs like a blackhole.
+	struct sockaddr_in hole, open;
+	int hole_fd = listen_loopback(&hole, 0);
+	int open_fd = listen_loopback(&open, 8);
+	int fillers[2];
+	for (size_t i = 0; i < 2; i++) {
+		fillers[i] = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+		connect(fillers[i], (struct sockaddr *)&hole, sizeof(hole));
+	}
+	usleep(100 * 1000);
+
+	struct addrinfo open_ai = { .ai_family = AF_INET,
+		                    .ai_socktype = SOCK_STREAM,
+		                    .ai_addrlen = sizeof(open),
+		                    .ai_addr = (struct sockaddr *)&open };
+	struct addrinfo hole_ai = { .ai_family = AF_INET,
+		                    .ai_socktype = SOCK_STREAM,
+		                    .ai_addrlen = sizeof(hole),
+		                    .ai_addr = (struct sockaddr *)&hole,
+		                    .ai_next = &open_ai };
+	int fd = connect_happy(&hole_ai, 5000);
+	ck_assert(fd >= 0);
+	struct sockaddr_in peer;
+	socklen_t len = sizeof(peer);
+	ck_assert(getpeername(fd, (struct sockaddr *)&peer, &len) == 0);
+	ck_assert_int_eq(peer.sin_port, open.sin_port);
+	close(fd);
+
+	hole_ai.ai_next = NULL;
+	ck_assert(connect_happy(&hole_ai, 300) < 0);
+	ck_assert_int_eq(errno, ETIMEDOUT);
+
+	for (size_t i = 0; i < 2; i++)
+		close(fillers[i]);
+	close(hole_fd);
+	close(open_fd);
+}
+
 void setup(void)
 {
 }
@@ -119,6 +1364,139 @@ START_TEST(test_user_pi_init_valid)
 }
 END_TEST
 
+START_TEST(test_pipeline)
+{
+	check_pipeline(SERVER_IP_V4, SERVER_PORT);
+}
+END_TEST
+
+START_TEST(test_download_to_fd)
+{
+	check_download_to_fd(SERVER_IP_V4, SERVER_PORT);
+}
+END_TEST
+
+START_TEST(test_download_resumable)
+{
+	check_download_resumable(SERVER_IP_V4, SERVER_PORT);
+}
+END_TEST
+
+START_TEST(test_mode_z)
+{
+	check_mode_z(SERVER_IP_V4, SERVER_PORT);
+}
+END_TEST
+
+START_TEST(test_mode_b)
+{
+	check_mode_b(SERVER_IP_V4, SERVER_PORT);
+}
+END_TEST
+
+START_TEST(test_metrics)
+{
+	check_metrics(SERVER_IP_V4, SERVER_PORT);
+}
+END_TEST
+
+START_TEST(test_trace)
+{
+	check_trace(SERVER_IP_V4, SERVER_PORT);
+}
+END_TEST
+
+START_TEST(test_features)
+{
+	check_features(SERVER_IP_V4);
+}
+END_TEST
+
+START_TEST(test_remote_file)
+{
+	check_remote_file(SERVER_IP_V4, SERVER_PORT);
+}
+END_TEST
+
+START_TEST(test_data_prefetch)
+{
+	check_data_prefetch(SERVER_IP_V4, SERVER_PORT);
+}
+END_TEST
+
+START_TEST(test_fxp)
+{
+	check_fxp(SERVER_IP_V4);
+	check_fxp("::1");
+}
+END_TEST
+
+START_TEST(test_list_cache)
+{
+	check_list_cache(SERVER_IP_V4, SERVER_PORT);
+}
+END_TEST
+
+START_TEST(test_upload)
+{
+	check_upload(SERVER_IP_V4, SERVER_PORT);
+}
+END_TEST
+
+START_TEST(test_download_segmented)
+{
+	check_download_segmented(SERVER_IP_V4, SERVER_PORT);
+}
+END_TEST
+
+START_TEST(test_session_pool)
+{
+	check_session_pool(SERVER_IP_V4, SERVER_PORT);
+}
+END_TEST
+
+START_TEST(test_user_pi_async)
+{
+	check_user_pi_async(SERVER_IP_V4, SERVER_PORT);
+}
+END_TEST
+
+START_TEST(test_async_loop)
+{
+	check_async_loop(SERVER_IP_V4, SERVER_PORT);
+}
+END_TEST
+
+START_TEST(test_list_directory_foreach)
+{
+	check_list_directory_foreach(SERVER_IP_V4, SERVER_PORT);
+}
+END_TEST
+
+START_TEST(test_crawl)
+{
+	check_crawl(SERVER_IP_V4, SERVER_PORT);
+}
+END_TEST
+
+START_TEST(test_data_sockaddr)
+{
+	check_data_sockaddr();
+}
+END_TEST
+
+START_TEST(test_connect_happy)
+{
+	check_connect_happy();
+}
+END_TEST
+
+START_TEST(test_recv_buf)
+{
+	check_recv_buf();
+}
+END_TEST
+
 START_TEST(test_user_pi_init_invalid)
 {
 	check_user_pi_init_invalid("&&&&", "ftp");
@@ -137,6 +1515,28 @@ Suite *ftp_suite(void)
 
 	tcase_add_test(tc, test_user_pi_init_valid);
 	tcase_add_test(tc, test_user_pi_init_invalid);
+	tcase_add_test(tc, test_pipeline);
+	tcase_add_test(tc, test_download_to_fd);
+	tcase_add_test(tc, test_download_segmented);
+	tcase_add_test(tc, test_download_resumable);
+	tcase_add_test(tc, test_upload);
+	tcase_add_test(tc, test_mode_z);
+	tcase_add_test(tc, test_mode_b);
+	tcase_add_test(tc, test_metrics);
+	tcase_add_test(tc, test_trace);
+	tcase_add_test(tc, test_features);
+	tcase_add_test(tc, test_remote_file);
+	tcase_add_test(tc, test_data_prefetch);
+	tcase_add_test(tc, test_fxp);
+	tcase_add_test(tc, test_list_cache);
+	tcase_add_test(tc, test_session_pool);
+	tcase_add_test(tc, test_user_pi_async);
+	tcase_add_test(tc, test_async_loop);
+	tcase_add_test(tc, test_list_directory_foreach);
+	tcase_add_test(tc, test_crawl);
+	tcase_add_test(tc, test_recv_buf);
+	tcase_add_test(tc, test_data_sockaddr);
+	tcase_add_test(tc, test_connect_happy);
 
 	tcase_set_timeout(tc, 100);
 	suite_add_tcase(s, tc);
@@ -1,7 +1,9 @@
+#include "../src/arena.h"
 #include "../src/parse.h"
 
 #include <check.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 
 void parse_pasv_reply_check_valid(const char *reply, char *name, char *service)
@@ -102,9 +104,12 @@ void parse_line_list_gnu_check_valid(const char *line, struct Fact fact_ref,
 	bool ignore = true;
 	const char *ptr = line;
 	struct Fact fact;
+	// Every field is set, whatever was there.
+	memset(&fact, 'x', sizeof(fact));
 	ck_assert(parse_line_list_gnu(line, &ignore, &ptr, &fact) == 0);
 	ck_assert(!ignore);
 	ck_assert_int_eq(fact.is_dir, fact_ref.is_dir);
+	ck_assert_str_eq(fact.unique, "");
 	ck_assert_str_eq(fact.name, fact_ref.name);
 	ck_assert_int_eq(fact.size, fact_ref.size);
 
@@ -169,6 +174,138 @@ START_TEST(test_parse_list_gnu_reply_valid)
 }
 END_TEST
 
+void parse_line_mlsd_check_valid(const char *line, struct Fact fact_ref,
+                                 struct tm tm_ref)
+{
+	bool ignore = true;
+	const char *end;
+	struct Fact fact;
+	ck_assert(parse_line_mlsd(line, &ignore, &end, &fact) == 0);
+	ck_assert(!ignore);
+	ck_assert(*end == '\0');
+	ck_assert_int_eq(fact.is_dir, fact_ref.is_dir);
+	ck_assert_str_eq(fact.name, fact_ref.name);
+	ck_assert_int_eq(fact.size, fact_ref.size);
+	ck_assert_str_eq(fact.perm, fact_ref.perm);
+	ck_assert_str_eq(fact.unique, fact_ref.unique);
+	ck_assert_int_eq(fact.modify, timegm(&tm_ref));
+	free(fact.name);
+}
+
+START_TEST(test_parse_mlsd_valid)
+{
+	parse_line_mlsd_check_valid(
+		"type=file;size=17864;modify=20031023143015;perm=adfrw;unique=801U1F; MISSING-FILES\r\n",
+		(struct Fact){ .is_dir = false,
+	                       .name = "MISSING-FILES",
+	                       .perm = "adfrw",
+	                       .unique = "801U1F",
+	                       .size = 17864 },
+		(struct tm){ .tm_year = 2003 - 1900,
+	                     .tm_mon = 9,
+	                     .tm_mday = 23,
+	                     .tm_hour = 14,
+	                     .tm_min = 30,
+	                     .tm_sec = 15 });
+	// Fact names are case-insensitive, and the order is free.
+	parse_line_mlsd_check_valid(
+		"Modify=20240229235959.123;Type=dir;Sizd=4096;Perm=flcdmpe; a dir; with=odd name\r\n",
+		(struct Fact){ .is_dir = true,
+	                       .name = "a dir; with=odd name",
+	                       .perm = "flcdmpe",
+	                       .unique = "",
+	                       .size = 4096 },
+		(struct tm){ .tm_year = 2024 - 1900,
+	                     .tm_mon = 1,
+	                     .tm_mday = 29,
+	                     .tm_hour = 23,
+	                     .tm_min = 59,
+	                     .tm_sec = 59 });
+	parse_line_mlsd_check_valid(
+		"type=OS.unix=slink:/etc/x y;modify=19691231235958;UNIX.mode=0777; link\n",
+		(struct Fact){ .is_dir = false,
+	                       .name = "link",
+	                       .perm = "",
+	                       .unique = "",
+	                       .size = -1 },
+		(struct tm){ .tm_year = 1969 - 1900,
+	                     .tm_mon = 11,
+	                     .tm_mday = 31,
+	                     .tm_hour = 23,
+	                     .tm_min = 59,
+	                     .tm_sec = 58 });
+}
+END_TEST
+
+START_TEST(test_parse_mlsd_ignore)
+{
+	bool ignore = false;
+	const char *end;
+	struct Fact fact;
+	ck_assert(parse_line_mlsd("type=cdir;modify=20220801000000; .\r\n",
+	                          &ignore, &end, &fact) == 0);
+	ck_assert(ignore);
+	free(fact.name);
+}
+END_TEST
+
+START_TEST(test_parse_mlsd_invalid)
+{
+	const char *lines[] = {
+		"type=file;size=1 name\r\n",
+		"type=file;size=12a; name\r\n",
+		"type=file;modify=20221301000000; name\r\n",
+		"type=file;modify=2022080100; name\r\n",
+		"=file; name\r\n",
+		"type=file; \r\n",
+		"type=file; name",
+		"",
+	};
+	for (size_t i = 0; i < sizeof(lines) / sizeof(lines[0]); i++) {
+		bool ignore;
+		const char *end;
+		struct Fact fact;
+		ck_assert_msg(parse_line_mlsd(lines[i], &ignore, &end, &fact) <
+		                      0,
+		              "%s", lines[i]);
+	}
+}
+END_TEST
+
+START_TEST(test_parse_arena)
+{
+	struct ListArena *arena = list_arena_new();
+	ck_assert(arena);
+	bool ignore;
+	const char *end;
+	struct Fact fact;
+	const char *line = "-rw-r--r-- 1 ftp ftp 4096 Aug 01  2022 file\r\n";
+	ck_assert(parse_line_list_gnu_arena(line, &ignore, &end, &fact,
+	                                    arena) == 0);
+	ck_assert_str_eq(fact.name, "file");
+	char *names[2000];
+	for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+		ck_assert(parse_line_mlsd_arena("type=file; some name\r\n",
+		                                &ignore, &end, &fact,
+		                                arena) == 0);
+		names[i] = fact.name;
+	}
+	// Still valid after the arena has grown.
+	ck_assert_str_eq(fact.name, "some name");
+	ck_assert_str_eq(names[0], "some name");
+	ck_assert(names[0] != names[1]);
+
+	char *big = list_arena_alloc(arena, 1024 * 1024);
+	ck_assert(big);
+	memset(big, 0, 1024 * 1024);
+	list_arena_reset(arena);
+	ck_assert(parse_line_mlsd_arena("type=dir; d\r\n", &ignore, &end,
+	                                &fact, arena) == 0);
+	ck_assert_str_eq(fact.name, "d");
+	list_arena_free(arena);
+}
+END_TEST
+
 Suite *parse_suite(void)
 {
 	Suite *s;
@@ -184,6 +321,12 @@ Suite *parse_suite(void)
 	TCase *list_gnu_tc = tcase_create("parse_list_gnu_reply");
 	tcase_add_test(list_gnu_tc, test_parse_list_gnu_reply_valid);
 	suite_add_tcase(s, list_gnu_tc);
+	TCase *mlsd_tc = tcase_create("parse_mlsd");
+	tcase_add_test(mlsd_tc, test_parse_mlsd_valid);
+	tcase_add_test(mlsd_tc, test_parse_mlsd_ignore);
+	tcase_add_test(mlsd_tc, test_parse_mlsd_invalid);
+	tcase_add_test(mlsd_tc, test_parse_arena);
+	suite_add_tcase(s, mlsd_tc);
 	return s;
 }
 
@@ -0,0 +1,1280 @@
+#include <arpa/inet.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "config.h"
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#include "ftp_server.h"
+
+#define SERVER_LINE_MAX_LEN 1024
+#define SERVER_CHUNK_LEN (64 * 1024)
+#define SERVER_ACCEPT_TIMEOUT_MS 10000
+#define SERVER_MARKER_INTERVAL (1024 * 1024)
+#define SYNTHETIC_MTIME 1600000000
+// ftp_server_synthetic_byte() repeats itself after 251 * 251 bytes.
+#define SYNTHETIC_PERIOD (251 * 251)
+
+static unsigned char synthetic[SYNTHETIC_PERIOD];
+static pthread_once_t synthetic_once = PTHREAD_ONCE_INIT;
+
+static void synthetic_init(void)
+{
+	for (size_t i = 0; i < SYNTHETIC_PERIOD; i++)
+		synthetic[i] = ftp_server_synthetic_byte(i);
+}
+
+struct SessionList {
+	int fd;
+	struct SessionList *next;
+};
+
+struct FtpServer {
+	struct FtpServerConfig config;
+	int listen_fd;
+	int family;
+	char port[8];
+	pthread_t accept_thread;
+	int stop_pipe[2];
+
+	pthread_mutex_t lock;
+	pthread_cond_t idle;
+	unsigned int n_active;
+	unsigned int n_sessions;
+	struct SessionList *sessions;
+	unsigned int n_dropped;
+};
+
+struct Session {
+	struct FtpServer *server;
+	const struct FtpServerConfig *config;
+	int ctrl;
+	char in[SERVER_LINE_MAX_LEN];
+	size_t in_len;
+	double in_time; // When the last bytes of in arrived.
+	double cmd_time; // When the command being served arrived.
+
+	int pasv_fd;
+	bool active;
+	struct sockaddr_storage port_addr;
+	socklen_t port_len;
+	int data_fd; // Kept open across transfers in block mode.
+
+	char mode;
+	int z_level;
+	long long rest;
+	char rnfr[PATH_MAX];
+	bool has_rnfr;
+};
+
+enum NodeKind {
+	NODE_NONE,
+	NODE_REAL,
+	NODE_SYNTHETIC_ROOT,
+	NODE_SYNTHETIC_FILE,
+	NODE_SYNTHETIC_DIR,
+	NODE_SYNTHETIC_TREE
+};
+
+struct Node {
+	enum NodeKind kind;
+	bool is_dir;
+	long long size;
+	time_t mtime;
+	char real[PATH_MAX];
+	long n; // dir-<n> entries, or tree fanout
+	long depth; // tree depth left
+};
+
+static void msleep(unsigned int ms)
+{
+	struct timespec ts = { .tv_sec = ms / 1000,
+		               .tv_nsec = (ms % 1000) * 1000000L };
+	while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+		;
+}
+
+static double now_s(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int write_all(int fd, const void *buf, size_t n)
+{
+	const char *p = buf;
+	while (n) {
+		ssize_t w = send(fd, p, n, MSG_NOSIGNAL);
+		if (w < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		p += w;
+		n -= w;
+	}
+	return 0;
+}
+
+static int read_full(int fd, void *buf, size_t n)
+{
+	char *p = buf;
+	while (n) {
+		ssize_t r = recv(fd, p, n, 0);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			return -1;
+		p += r;
+		n -= r;
+	}
+	return 0;
+}
+
+static void reply(struct Session *s, const char *fmt, ...)
+{
+	char buf[SERVER_LINE_MAX_LEN * 2];
+	va_list args;
+	va_start(args, fmt);
+	int len = vsnprintf(buf, sizeof(buf) - 2, fmt, args);
+	va_end(args);
+	if (len > (int)sizeof(buf) - 3)
+		len = sizeof(buf) - 3;
+	memcpy(buf + len, "\r\n", 2);
+	// Replies to pipelined commands are delayed together, like on a link
+	// with this much latency.
+	if (s->config->reply_latency_ms) {
+		double due = s->cmd_time + s->config->reply_latency_ms / 1e3;
+		double now = now_s();
+		if (due > now)
+			msleep((due - now) * 1000);
+	}
+	write_all(s->ctrl, buf, len + 2);
+}
+
+/// \return the length of the command line without CRLF, or -1 on EOF.
+static ssize_t read_command(struct Session *s, char *line)
+{
+	for (;;) {
+		char *lf = memchr(s->in, '\n', s->in_len);
+		if (lf) {
+			size_t len = lf - s->in;
+			size_t line_len = len;
+			if (line_len && s->in[line_len - 1] == '\r')
+				line_len--;
+			memcpy(line, s->in, line_len);
+			line[line_len] = '\0';
+			memmove(s->in, lf + 1, s->in_len - len - 1);
+			s->in_len -= len + 1;
+			s->cmd_time = s->in_time;
+			return line_len;
+		}
+		if (s->in_len == sizeof(s->in))
+			s->in_len = 0; // Line too long, drop it.
+		ssize_t n = recv(s->ctrl, s->in + s->in_len,
+		                 sizeof(s->in) - s->in_len, 0);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		s->in_len += n;
+		s->in_time = now_s();
+	}
+}
+
+static bool parse_long_suffix(const char *str, const char *prefix, long *n)
+{
+	size_t len = strlen(prefix);
+	if (strncmp(str, prefix, len))
+		return false;
+	char *end;
+	*n = strtol(str + len, &end, 10);
+	return end != str + len && *n >= 0;
+}
+
+static bool resolve(struct Session *s, const char *path, struct Node *node)
+{
+	*node = (struct Node){ .kind = NODE_NONE };
+	while (*path == '/')
+		path++;
+	if (strstr(path, ".."))
+		return false;
+	if (!strncmp(path, "synthetic", 9) &&
+	    (path[9] == '\0' || path[9] == '/')) {
+		const char *rest = path + 9;
+		while (*rest == '/')
+			rest++;
+		node->mtime = SYNTHETIC_MTIME;
+		if (!*rest) {
+			node->kind = NODE_SYNTHETIC_ROOT;
+			node->is_dir = true;
+			return true;
+		}
+		long n, fanout;
+		if (parse_long_suffix(rest, "size-", &n) && !strchr(rest, '/')) {
+			node->kind = NODE_SYNTHETIC_FILE;
+			node->size = n;
+			return true;
+		}
+		if (parse_long_suffix(rest, "dir-", &n) && !strchr(rest, '/')) {
+			node->kind = NODE_SYNTHETIC_DIR;
+			node->is_dir = true;
+			node->n = n;
+			return true;
+		}
+		long depth;
+		char *end;
+		if (strncmp(rest, "tree-", 5))
+			return false;
+		depth = strtol(rest + 5, &end, 10);
+		if (*end != '-')
+			return false;
+		fanout = strtol(end + 1, &end, 10);
+		for (;;) {
+			while (*end == '/')
+				end++;
+			if (!*end)
+				break;
+			long i;
+			char kind = *end;
+			if (kind != 'd' && kind != 'f')
+				return false;
+			i = strtol(end + 1, &end, 10);
+			if (i < 0 || i >= fanout || (*end && *end != '/'))
+				return false;
+			if (kind == 'f') {
+				if (*end)
+					return false;
+				node->kind = NODE_SYNTHETIC_FILE;
+				node->size = i;
+				return true;
+			}
+			if (depth <= 0)
+				return false;
+			depth--;
+		}
+		node->kind = NODE_SYNTHETIC_TREE;
+		node->is_dir = true;
+		node->n = fanout;
+		node->depth = depth;
+		return true;
+	}
+	if (!s->config->root)
+		return false;
+	snprintf(node->real, sizeof(node->real), "%s/%s", s->config->root,
+	         path);
+	struct stat st;
+	if (stat(node->real, &st) < 0)
+		return true; // NODE_NONE, but the path may be created.
+	node->kind = NODE_REAL;
+	node->is_dir = S_ISDIR(st.st_mode);
+	node->size = st.st_size;
+	node->mtime = st.st_mtime;
+	return true;
+}
+
+typedef int (*EmitFunc)(void *ctx, const char *name, bool is_dir,
+                        long long size, time_t mtime);
+
+static int for_each_entry(struct Session *s, const struct Node *dir,
+                          EmitFunc emit, void *ctx)
+{
+	char name[64];
+	switch (dir->kind) {
+	case NODE_SYNTHETIC_ROOT:
+		return 0;
+	case NODE_SYNTHETIC_DIR:
+		for (long i = 0; i < dir->n; i++) {
+			snprintf(name, sizeof(name), "file-%ld", i);
+			if (emit(ctx, name, false, i, SYNTHETIC_MTIME) < 0)
+				return -1;
+		}
+		return 0;
+	case NODE_SYNTHETIC_TREE:
+		for (long i = 0; i < dir->n; i++) {
+			snprintf(name, sizeof(name), "f%ld", i);
+			if (emit(ctx, name, false, i, SYNTHETIC_MTIME) < 0)
+				return -1;
+			if (dir->depth <= 0)
+				continue;
+			snprintf(name, sizeof(name), "d%ld", i);
+			if (emit(ctx, name, true, 4096, SYNTHETIC_MTIME) < 0)
+				return -1;
+		}
+		return 0;
+	case NODE_REAL: {
+		DIR *d = opendir(dir->real);
+		if (!d)
+			return -1;
+		struct dirent *e;
+		int ret = 0;
+		while ((e = readdir(d))) {
+			if (e->d_name[0] == '.')
+				continue;
+			char path[PATH_MAX + 256];
+			snprintf(path, sizeof(path), "%s/%s", dir->real,
+			         e->d_name);
+			struct stat st;
+			if (stat(path, &st) < 0)
+				continue;
+			if ((ret = emit(ctx, e->d_name, S_ISDIR(st.st_mode),
+			                st.st_size, st.st_mtime)) < 0)
+				break;
+		}
+		closedir(d);
+		return ret;
+	}
+	default:
+		return -1;
+	}
+}
+
+/* Data connection */
+
+struct DataOut {
+	struct Session *s;
+	int fd;
+	size_t sent;
+	double start;
+	size_t next_marker;
+	long long offset;
+#ifdef HAVE_ZLIB
+	z_stream z;
+#endif
+};
+
+static int open_data(struct Session *s)
+{
+	if (s->data_fd >= 0)
+		return s->data_fd;
+	int fd = -1;
+	if (s->pasv_fd >= 0) {
+		struct pollfd pfd = { .fd = s->pasv_fd, .events = POLLIN };
+		if (poll(&pfd, 1, SERVER_ACCEPT_TIMEOUT_MS) == 1)
+			fd = accept(s->pasv_fd, NULL, NULL);
+		close(s->pasv_fd);
+		s->pasv_fd = -1;
+	} else if (s->active) {
+		fd = socket(s->port_addr.ss_family, SOCK_STREAM, 0);
+		if (fd >= 0 && connect(fd, (struct sockaddr *)&s->port_addr,
+		                       s->port_len) < 0) {
+			close(fd);
+			fd = -1;
+		}
+		s->active = false;
+	}
+	s->data_fd = fd;
+	return fd;
+}
+
+static void close_data(struct Session *s)
+{
+	if (s->data_fd >= 0)
+		close(s->data_fd);
+	s->data_fd = -1;
+}
+
+static int shaped_send(struct DataOut *out, const void *buf, size_t n)
+{
+	size_t bandwidth = out->s->config->bandwidth;
+	const char *p = buf;
+	while (n) {
+		size_t chunk = n;
+		if (bandwidth && chunk > bandwidth / 100 + 1)
+			chunk = bandwidth / 100 + 1;
+		if (write_all(out->fd, p, chunk) < 0)
+			return -1;
+		out->sent += chunk;
+		p += chunk;
+		n -= chunk;
+		if (bandwidth) {
+			double due = out->start + (double)out->sent / bandwidth;
+			double now = now_s();
+			if (due > now)
+				msleep((due - now) * 1000);
+		}
+	}
+	return 0;
+}
+
+static int send_block(struct DataOut *out, unsigned char desc,
+                      const void *buf, size_t n)
+{
+	unsigned char header[3] = { desc, n >> 8, n & 0xff };
+	if (shaped_send(out, header, 3) < 0)
+		return -1;
+	return shaped_send(out, buf, n);
+}
+
+static int data_out_init(struct DataOut *out, struct Session *s, int fd,
+                         long long offset)
+{
+	*out = (struct DataOut){ .s = s,
+		                 .fd = fd,
+		                 .start = now_s(),
+		                 .offset = offset };
+	out->next_marker = SERVER_MARKER_INTERVAL;
+#ifdef HAVE_ZLIB
+	if (s->mode == 'Z' &&
+	    deflateInit(&out->z, s->z_level ? s->z_level : 6) != Z_OK)
+		return -1;
+#endif
+	return 0;
+}
+
+static int data_out_write(struct DataOut *out, const void *buf, size_t n)
+{
+	if (out->s->mode == 'B') {
+		const char *p = buf;
+		while (n) {
+			size_t chunk = n > 0xffff ? 0xffff : n;
+			if (send_block(out, 0, p, chunk) < 0)
+				return -1;
+			p += chunk;
+			n -= chunk;
+			out->offset += chunk;
+			if (out->offset >= (long long)out->next_marker) {
+				char marker[32];
+				int len = snprintf(marker, sizeof(marker),
+				                   "%lld", out->offset);
+				if (send_block(out, 16, marker, len) < 0)
+					return -1;
+				out->next_marker += SERVER_MARKER_INTERVAL;
+			}
+		}
+		return 0;
+	}
+#ifdef HAVE_ZLIB
+	if (out->s->mode == 'Z') {
+		unsigned char zbuf[SERVER_CHUNK_LEN];
+		out->z.next_in = (unsigned char *)buf;
+		out->z.avail_in = n;
+		do {
+			out->z.next_out = zbuf;
+			out->z.avail_out = sizeof(zbuf);
+			deflate(&out->z, Z_NO_FLUSH);
+			size_t have = sizeof(zbuf) - out->z.avail_out;
+			if (have && shaped_send(out, zbuf, have) < 0)
+				return -1;
+		} while (out->z.avail_in || !out->z.avail_out);
+		return 0;
+	}
+#endif
+	return shaped_send(out, buf, n);
+}
+
+/// \return -1 if the transfer has failed.
+static int data_out_finish(struct DataOut *out, bool failed)
+{
+	struct Session *s = out->s;
+	int ret = failed ? -1 : 0;
+	if (s->mode == 'B') {
+		if (!failed && send_block(out, 64, NULL, 0) < 0)
+			ret = -1;
+		if (ret < 0)
+			close_data(s);
+		return ret;
+	}
+#ifdef HAVE_ZLIB
+	if (s->mode == 'Z') {
+		unsigned char zbuf[SERVER_CHUNK_LEN];
+		int z_ret;
+		do {
+			out->z.next_in = NULL;
+			out->z.avail_in = 0;
+			out->z.next_out = zbuf;
+			out->z.avail_out = sizeof(zbuf);
+			z_ret = deflate(&out->z, Z_FINISH);
+			size_t have = sizeof(zbuf) - out->z.avail_out;
+			if (!failed && have && shaped_send(out, zbuf, have) < 0)
+				ret = -1;
+		} while (z_ret == Z_OK);
+		deflateEnd(&out->z);
+	}
+#endif
+	close_data(s);
+	return ret;
+}
+
+/// Receives an upload into \a fd, undoing the transfer mode.
+static int data_in(struct Session *s, int data_fd, int fd)
+{
+	char buf[SERVER_CHUNK_LEN];
+	if (s->mode == 'B') {
+		for (;;) {
+			unsigned char header[3];
+			if (read_full(data_fd, header, 3) < 0)
+				return -1;
+			size_t n = (header[1] << 8) | header[2];
+			if (read_full(data_fd, buf, n) < 0)
+				return -1;
+			if (!(header[0] & 16) && write(fd, buf, n) != (ssize_t)n)
+				return -1;
+			if (header[0] & 64)
+				return 0;
+		}
+	}
+#ifdef HAVE_ZLIB
+	z_stream z = { 0 };
+	if (s->mode == 'Z' && inflateInit(&z) != Z_OK)
+		return -1;
+#endif
+	int ret = 0;
+	for (;;) {
+		ssize_t n = recv(data_fd, buf, sizeof(buf), 0);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			ret = -1;
+		if (n <= 0)
+			break;
+#ifdef HAVE_ZLIB
+		if (s->mode == 'Z') {
+			unsigned char out[SERVER_CHUNK_LEN];
+			z.next_in = (unsigned char *)buf;
+			z.avail_in = n;
+			do {
+				z.next_out = out;
+				z.avail_out = sizeof(out);
+				int z_ret = inflate(&z, Z_NO_FLUSH);
+				if (z_ret != Z_OK && z_ret != Z_STREAM_END) {
+					ret = -1;
+					break;
+				}
+				size_t have = sizeof(out) - z.avail_out;
+				if (write(fd, out, have) != (ssize_t)have)
+					ret = -1;
+			} while (z.avail_in && ret == 0);
+			if (ret < 0)
+				break;
+			continue;
+		}
+#endif
+		if (write(fd, buf, n) != n) {
+			ret = -1;
+			break;
+		}
+	}
+#ifdef HAVE_ZLIB
+	if (s->mode == 'Z')
+		inflateEnd(&z);
+#endif
+	return ret;
+}
+
+/* Listing formats */
+
+static void format_time(time_t t, const char *fmt, char *buf, size_t len)
+{
+	struct tm tm;
+	gmtime_r(&t, &tm);
+	strftime(buf, len, fmt, &tm);
+}
+
+static int emit_list(void *ctx, const char *name, bool is_dir, long long size,
+                     time_t mtime)
+{
+	char date[32];
+	char line[SERVER_LINE_MAX_LEN];
+	format_time(mtime, "%b %d  %Y", date, sizeof(date));
+	int len = snprintf(line, sizeof(line),
+	                   "%s    1 0        0        %8lld %s %s\r\n",
+	                   is_dir ? "drwxr-xr-x" : "-rw-r--r--", size, date,
+	                   name);
+	return data_out_write(ctx, line, len);
+}
+
+static int format_mlsx(char *line, size_t len, const char *name, bool is_dir,
+                       long long size, time_t mtime)
+{
+	char date[32];
+	format_time(mtime, "%Y%m%d%H%M%S", date, sizeof(date));
+	unsigned long unique = 5381;
+	for (const char *p = name; *p; p++)
+		unique = unique * 33 + (unsigned char)*p;
+	return snprintf(line, len,
+	                "type=%s;size=%lld;modify=%s;perm=%s;unique=%lx; %s",
+	                is_dir ? "dir" : "file", size, date,
+	                is_dir ? "flcdmpe" : "adfrw", unique, name);
+}
+
+static int emit_mlsd(void *ctx, const char *name, bool is_dir, long long size,
+                     time_t mtime)
+{
+	char line[SERVER_LINE_MAX_LEN];
+	int len = format_mlsx(line, sizeof(line) - 2, name, is_dir, size, mtime);
+	memcpy(line + len, "\r\n", 2);
+	return data_out_write(ctx, line, len + 2);
+}
+
+/* Commands */
+
+static void cmd_feat(struct Session *s)
+{
+	const struct FtpServerConfig *c = s->config;
+	if (c->disable_feat) {
+		reply(s, "500 Unknown command.");
+		return;
+	}
+	char buf[SERVER_LINE_MAX_LEN];
+	int len = snprintf(buf, sizeof(buf), "211-Features:\r\n");
+	if (!c->disable_epsv)
+		len += snprintf(buf + len, sizeof(buf) - len, " EPSV\r\n");
+	len += snprintf(buf + len, sizeof(buf) - len,
+	                " PASV\r\n SIZE\r\n MDTM\r\n REST STREAM\r\n");
+	if (!c->disable_mlsd)
+		len += snprintf(
+			buf + len, sizeof(buf) - len,
+			" MLST type*;size*;modify*;perm*;unique*;\r\n");
+#ifdef HAVE_ZLIB
+	if (!c->disable_mode_z)
+		len += snprintf(buf + len, sizeof(buf) - len, " MODE Z\r\n");
+#endif
+	snprintf(buf + len, sizeof(buf) - len, " UTF8\r\n211 End");
+	reply(s, "%s", buf);
+}
+
+static void cmd_mode(struct Session *s, const char *arg)
+{
+	char mode = toupper((unsigned char)*arg);
+	if (mode == 'S' ||
+	    (mode == 'B' && !s->config->disable_mode_b)
+#ifdef HAVE_ZLIB
+	    || (mode == 'Z' && !s->config->disable_mode_z)
+#endif
+	) {
+		if (mode != 'B')
+			close_data(s);
+		s->mode = mode;
+		reply(s, "200 Mode set to %c.", mode);
+		return;
+	}
+	reply(s, "504 Unsupported transfer mode.");
+}
+
+static void cmd_opts(struct Session *s, const char *arg)
+{
+	if (!strncasecmp(arg, "MODE Z LEVEL ", 13)) {
+		int level = atoi(arg + 13);
+		if (level < 1 || level > 9) {
+			reply(s, "501 Bad level.");
+			return;
+		}
+		s->z_level = level;
+		reply(s, "200 MODE Z LEVEL set to %d.", level);
+		return;
+	}
+	if (!strcasecmp(arg, "UTF8 ON")) {
+		reply(s, "200 Always in UTF8 mode.");
+		return;
+	}
+	reply(s, "501 Unknown option.");
+}
+
+static int passive_listen(struct Session *s)
+{
+	if (s->pasv_fd >= 0)
+		close(s->pasv_fd);
+	close_data(s);
+	struct sockaddr_storage addr;
+	socklen_t len = sizeof(addr);
+	getsockname(s->ctrl, (struct sockaddr *)&addr, &len);
+	if (addr.ss_family == AF_INET6)
+		((struct sockaddr_in6 *)&addr)->sin6_port = 0;
+	else
+		((struct sockaddr_in *)&addr)->sin_port = 0;
+	int fd = socket(addr.ss_family, SOCK_STREAM, 0);
+	if (fd < 0)
+		return -1;
+	if (bind(fd, (struct sockaddr *)&addr, len) < 0 || listen(fd, 1) < 0) {
+		close(fd);
+		return -1;
+	}
+	len = sizeof(addr);
+	getsockname(fd, (struct sockaddr *)&addr, &len);
+	s->pasv_fd = fd;
+	s->active = false;
+	if (addr.ss_family == AF_INET6)
+		return ntohs(((struct sockaddr_in6 *)&addr)->sin6_port);
+	return ntohs(((struct sockaddr_in *)&addr)->sin_port);
+}
+
+static void cmd_epsv(struct Session *s)
+{
+	if (s->config->disable_epsv) {
+		reply(s, "500 Unknown command.");
+		return;
+	}
+	int port = passive_listen(s);
+	if (port < 0) {
+		reply(s, "425 Cannot open passive connection.");
+		return;
+	}
+	reply(s, "229 Entering Extended Passive Mode (|||%d|)", port);
+}
+
+static void cmd_pasv(struct Session *s)
+{
+	struct sockaddr_storage addr;
+	socklen_t len = sizeof(addr);
+	getsockname(s->ctrl, (struct sockaddr *)&addr, &len);
+	unsigned char *ip;
+	if (addr.ss_family == AF_INET) {
+		ip = (unsigned char *)&((struct sockaddr_in *)&addr)->sin_addr;
+	} else {
+		struct in6_addr *a6 = &((struct sockaddr_in6 *)&addr)->sin6_addr;
+		if (!IN6_IS_ADDR_V4MAPPED(a6)) {
+			reply(s, "425 Use EPSV on IPv6.");
+			return;
+		}
+		ip = a6->s6_addr + 12;
+	}
+	int port = passive_listen(s);
+	if (port < 0) {
+		reply(s, "425 Cannot open passive connection.");
+		return;
+	}
+	reply(s, "227 Entering Passive Mode (%d,%d,%d,%d,%d,%d)", ip[0], ip[1],
+	      ip[2], ip[3], port >> 8, port & 0xff);
+}
+
+static void set_active(struct Session *s, int family, const char *ip,
+                       int port)
+{
+	memset(&s->port_addr, 0, sizeof(s->port_addr));
+	int ok;
+	if (family == AF_INET) {
+		struct sockaddr_in *a = (struct sockaddr_in *)&s->port_addr;
+		a->sin_family = AF_INET;
+		a->sin_port = htons(port);
+		ok = inet_pton(AF_INET, ip, &a->sin_addr);
+		s->port_len = sizeof(*a);
+	} else {
+		struct sockaddr_in6 *a = (struct sockaddr_in6 *)&s->port_addr;
+		a->sin6_family = AF_INET6;
+		a->sin6_port = htons(port);
+		ok = inet_pton(AF_INET6, ip, &a->sin6_addr);
+		s->port_len = sizeof(*a);
+	}
+	if (ok != 1 || port <= 0 || port > 65535) {
+		reply(s, "501 Bad address.");
+		return;
+	}
+	if (s->pasv_fd >= 0)
+		close(s->pasv_fd);
+	s->pasv_fd = -1;
+	close_data(s);
+	s->active = true;
+	reply(s, "200 Active mode set.");
+}
+
+static void cmd_port(struct Session *s, const char *arg)
+{
+	int h[4], p[2];
+	if (sscanf(arg, "%d,%d,%d,%d,%d,%d", &h[0], &h[1], &h[2], &h[3], &p[0],
+	           &p[1]) != 6) {
+		reply(s, "501 Bad PORT.");
+		return;
+	}
+	char ip[16];
+	snprintf(ip, sizeof(ip), "%d.%d.%d.%d", h[0], h[1], h[2], h[3]);
+	set_active(s, AF_INET, ip, p[0] * 256 + p[1]);
+}
+
+static void cmd_eprt(struct Session *s, const char *arg)
+{
+	char d = *arg;
+	char buf[128];
+	snprintf(buf, sizeof(buf), "%s", arg + 1);
+	char *proto = buf;
+	char *ip = strchr(proto, d);
+	char *port = ip ? strchr(ip + 1, d) : NULL;
+	if (!port) {
+		reply(s, "501 Bad EPRT.");
+		return;
+	}
+	*ip++ = '\0';
+	*port++ = '\0';
+	set_active(s, atoi(proto) == 2 ? AF_INET6 : AF_INET, ip, atoi(port));
+}
+
+static void cmd_retr(struct Session *s, const char *arg)
+{
+	struct Node node;
+	long long offset = s->rest;
+	s->rest = 0;
+	if (!resolve(s, arg, &node) || node.kind == NODE_NONE || node.is_dir) {
+		reply(s, "550 No such file.");
+		return;
+	}
+	int file_fd = -1;
+	if (node.kind == NODE_REAL &&
+	    (file_fd = open(node.real, O_RDONLY)) < 0) {
+		reply(s, "550 Cannot open file.");
+		return;
+	}
+	reply(s, "150 Opening BINARY mode data connection.");
+	int fd = open_data(s);
+	if (fd < 0) {
+		if (file_fd >= 0)
+			close(file_fd);
+		reply(s, "425 Cannot open data connection.");
+		return;
+	}
+	struct DataOut out;
+	bool failed = data_out_init(&out, s, fd, offset) < 0;
+	char buf[SERVER_CHUNK_LEN];
+	for (long long pos = offset; !failed && pos < node.size;) {
+		size_t n = sizeof(buf);
+		if ((long long)n > node.size - pos)
+			n = node.size - pos;
+		if (file_fd >= 0) {
+			ssize_t r = pread(file_fd, buf, n, pos);
+			if (r <= 0) {
+				failed = true;
+				break;
+			}
+			n = r;
+		} else {
+			for (size_t i = 0; i < n;) {
+				size_t at = (pos + i) % SYNTHETIC_PERIOD;
+				size_t len = SYNTHETIC_PERIOD - at;
+				if (len > n - i)
+					len = n - i;
+				memcpy(buf + i, synthetic + at, len);
+				i += len;
+			}
+		}
+		if (s->config->n_drops &&
+		    (size_t)(pos + n - offset) > s->config->drop_after &&
+		    __atomic_fetch_add(&s->server->n_dropped, 1,
+		                       __ATOMIC_SEQ_CST) < s->config->n_drops) {
+			n = s->config->drop_after - (pos - offset);
+			data_out_write(&out, buf, n);
+			struct linger linger = { .l_onoff = 1, .l_linger = 0 };
+			setsockopt(fd, SOL_SOCKET, SO_LINGER, &linger,
+			           sizeof(linger));
+			if (file_fd >= 0)
+				close(file_fd);
+			data_out_finish(&out, true);
+			if (s->config->drop_ctrl)
+				shutdown(s->ctrl, SHUT_RDWR);
+			else
+				reply(s, "426 Connection reset.");
+			return;
+		}
+		if (data_out_write(&out, buf, n) < 0)
+			failed = true;
+		pos += n;
+	}
+	if (file_fd >= 0)
+		close(file_fd);
+	if (data_out_finish(&out, failed) < 0)
+		reply(s, "426 Transfer aborted.");
+	else
+		reply(s, "226 Transfer complete.");
+}
+
+static void cmd_stor(struct Session *s, const char *arg, bool append)
+{
+	struct Node node;
+	long long offset = s->rest;
+	s->rest = 0;
+	if (!resolve(s, arg, &node) ||
+	    (node.kind != NODE_NONE && node.kind != NODE_REAL) || node.is_dir ||
+	    !*node.real) {
+		reply(s, "553 Cannot store here.");
+		return;
+	}
+	int flags = O_WRONLY | O_CREAT | (append ? O_APPEND : 0);
+	if (!append && !offset)
+		flags |= O_TRUNC;
+	int file_fd = open(node.real, flags, 0644);
+	if (file_fd < 0) {
+		reply(s, "553 Cannot create file.");
+		return;
+	}
+	if (offset)
+		lseek(file_fd, offset, SEEK_SET);
+	reply(s, "150 Ok to send data.");
+	int fd = open_data(s);
+	if (fd < 0) {
+		close(file_fd);
+		reply(s, "425 Cannot open data connection.");
+		return;
+	}
+	int ret = data_in(s, fd, file_fd);
+	close(file_fd);
+	if (s->mode != 'B' || ret < 0)
+		close_data(s);
+	if (ret < 0)
+		reply(s, "426 Transfer aborted.");
+	else
+		reply(s, "226 Transfer complete.");
+}
+
+static void cmd_list(struct Session *s, const char *arg, bool mlsd)
+{
+	struct Node node;
+	if (mlsd && s->config->disable_mlsd) {
+		reply(s, "500 Unknown command.");
+		return;
+	}
+	// Ignore options like "-la".
+	if (!mlsd && *arg == '-') {
+		arg = strchr(arg, ' ');
+		arg = arg ? arg + 1 : "";
+	}
+	if (!resolve(s, arg, &node) || node.kind == NODE_NONE ||
+	    (mlsd && !node.is_dir)) {
+		reply(s, "550 No such directory.");
+		return;
+	}
+	reply(s, "150 Here comes the directory listing.");
+	int fd = open_data(s);
+	if (fd < 0) {
+		reply(s, "425 Cannot open data connection.");
+		return;
+	}
+	struct DataOut out;
+	bool failed = data_out_init(&out, s, fd, 0) < 0;
+	if (!failed && !node.is_dir) {
+		const char *name = strrchr(arg, '/');
+		failed = emit_list(&out, name ? name + 1 : arg, false,
+		                   node.size, node.mtime) < 0;
+	} else if (!failed) {
+		failed = for_each_entry(s, &node, mlsd ? emit_mlsd : emit_list,
+		                        &out) < 0;
+	}
+	if (data_out_finish(&out, failed) < 0)
+		reply(s, "426 Transfer aborted.");
+	else
+		reply(s, "226 Directory send OK.");
+}
+
+static void cmd_mlst(struct Session *s, const char *arg)
+{
+	struct Node node;
+	if (s->config->disable_mlsd) {
+		reply(s, "500 Unknown command.");
+		return;
+	}
+	if (!resolve(s, arg, &node) || node.kind == NODE_NONE) {
+		reply(s, "550 No such file or directory.");
+		return;
+	}
+	char line[SERVER_LINE_MAX_LEN];
+	format_mlsx(line, sizeof(line), *arg ? arg : "/", node.is_dir,
+	            node.size, node.mtime);
+	reply(s, "250-Listing %s\r\n %s\r\n250 End", arg, line);
+}
+
+static void cmd_size(struct Session *s, const char *arg)
+{
+	struct Node node;
+	if (!resolve(s, arg, &node) || node.kind == NODE_NONE || node.is_dir) {
+		reply(s, "550 Could not get file size.");
+		return;
+	}
+	reply(s, "213 %lld", node.size);
+}
+
+static void cmd_mdtm(struct Session *s, const char *arg)
+{
+	struct Node node;
+	if (!resolve(s, arg, &node) || node.kind == NODE_NONE) {
+		reply(s, "550 Could not get modification time.");
+		return;
+	}
+	char date[32];
+	format_time(node.mtime, "%Y%m%d%H%M%S", date, sizeof(date));
+	reply(s, "213 %s", date);
+}
+
+static void cmd_dele(struct Session *s, const char *arg)
+{
+	struct Node node;
+	if (!resolve(s, arg, &node) || node.kind != NODE_REAL ||
+	    unlink(node.real) < 0) {
+		reply(s, "550 Delete operation failed.");
+		return;
+	}
+	reply(s, "250 Delete operation successful.");
+}
+
+static void cmd_rnfr(struct Session *s, const char *arg)
+{
+	struct Node node;
+	if (!resolve(s, arg, &node) || node.kind != NODE_REAL) {
+		reply(s, "550 RNFR command failed.");
+		return;
+	}
+	strcpy(s->rnfr, node.real);
+	s->has_rnfr = true;
+	reply(s, "350 Ready for RNTO.");
+}
+
+static void cmd_rnto(struct Session *s, const char *arg)
+{
+	struct Node node;
+	bool has_rnfr = s->has_rnfr;
+	s->has_rnfr = false;
+	if (!has_rnfr) {
+		reply(s, "503 RNFR required first.");
+		return;
+	}
+	if (!resolve(s, arg, &node) || !*node.real ||
+	    rename(s->rnfr, node.real) < 0) {
+		reply(s, "550 Rename failed.");
+		return;
+	}
+	reply(s, "250 Rename successful.");
+}
+
+static void *session_main(void *arg)
+{
+	struct Session *s = arg;
+	char line[SERVER_LINE_MAX_LEN];
+	int on = 1;
+	setsockopt(s->ctrl, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+	s->cmd_time = now_s();
+	reply(s, "220-Welcome to the test server.\r\n220 Ready.");
+	for (;;) {
+		if (read_command(s, line) < 0)
+			break;
+		char *space = strchr(line, ' ');
+		const char *param = "";
+		if (space) {
+			*space = '\0';
+			param = space + 1;
+		}
+		const char *cmd = line;
+#define IS(name) (!strcasecmp(cmd, name))
+		if (IS("USER"))
+			reply(s, "331 Please specify the password.");
+		else if (IS("PASS"))
+			reply(s, "230 Login successful.");
+		else if (IS("ACCT"))
+			reply(s, "202 ACCT is superfluous.");
+		else if (IS("SYST"))
+			reply(s, "215 UNIX Type: L8");
+		else if (IS("NOOP"))
+			reply(s, "200 NOOP ok.");
+		else if (IS("FEAT"))
+			cmd_feat(s);
+		else if (IS("OPTS"))
+			cmd_opts(s, param);
+		else if (IS("TYPE"))
+			reply(s, "200 Switching to Binary mode.");
+		else if (IS("STRU"))
+			reply(s, "200 Structure set to F.");
+		else if (IS("MODE"))
+			cmd_mode(s, param);
+		else if (IS("PWD"))
+			reply(s, "257 \"/\" is the current directory");
+		else if (IS("CWD"))
+			reply(s, "250 Directory successfully changed.");
+		else if (IS("EPSV"))
+			cmd_epsv(s);
+		else if (IS("PASV"))
+			cmd_pasv(s);
+		else if (IS("PORT"))
+			cmd_port(s, param);
+		else if (IS("EPRT"))
+			cmd_eprt(s, param);
+		else if (IS("REST")) {
+			s->rest = atoll(param);
+			reply(s, "350 Restart position accepted (%lld).",
+			      s->rest);
+		} else if (IS("RETR"))
+			cmd_retr(s, param);
+		else if (IS("STOR"))
+			cmd_stor(s, param, false);
+		else if (IS("APPE"))
+			cmd_stor(s, param, true);
+		else if (IS("LIST") || IS("NLST"))
+			cmd_list(s, param, false);
+		else if (IS("MLSD"))
+			cmd_list(s, param, true);
+		else if (IS("MLST"))
+			cmd_mlst(s, param);
+		else if (IS("SIZE"))
+			cmd_size(s, param);
+		else if (IS("MDTM"))
+			cmd_mdtm(s, param);
+		else if (IS("DELE"))
+			cmd_dele(s, param);
+		else if (IS("RNFR"))
+			cmd_rnfr(s, param);
+		else if (IS("RNTO"))
+			cmd_rnto(s, param);
+		else if (IS("ABOR"))
+			reply(s, "225 No transfer to abort.");
+		else if (IS("QUIT")) {
+			reply(s, "221 Goodbye.");
+			break;
+		} else
+			reply(s, "502 Command not implemented.");
+#undef IS
+	}
+
+	close_data(s);
+	if (s->pasv_fd >= 0)
+		close(s->pasv_fd);
+	struct FtpServer *server = s->server;
+	pthread_mutex_lock(&server->lock);
+	for (struct SessionList **p = &server->sessions; *p; p = &(*p)->next) {
+		if ((*p)->fd == s->ctrl) {
+			struct SessionList *node = *p;
+			*p = node->next;
+			free(node);
+			break;
+		}
+	}
+	close(s->ctrl);
+	if (--server->n_active == 0)
+		pthread_cond_broadcast(&server->idle);
+	pthread_mutex_unlock(&server->lock);
+	free(s);
+	return NULL;
+}
+
+static void *accept_main(void *arg)
+{
+	struct FtpServer *server = arg;
+	for (;;) {
+		struct pollfd fds[2] = {
+			{ .fd = server->listen_fd, .events = POLLIN },
+			{ .fd = server->stop_pipe[0], .events = POLLIN },
+		};
+		if (poll(fds, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		if (fds[1].revents)
+			break;
+		int fd = accept(server->listen_fd, NULL, NULL);
+		if (fd < 0)
+			continue;
+		struct Session *s = calloc(1, sizeof(*s));
+		struct SessionList *node = malloc(sizeof(*node));
+		*s = (struct Session){ .server = server,
+			               .config = &server->config,
+			               .ctrl = fd,
+			               .pasv_fd = -1,
+			               .data_fd = -1,
+			               .mode = 'S' };
+		pthread_mutex_lock(&server->lock);
+		node->fd = fd;
+		node->next = server->sessions;
+		server->sessions = node;
+		server->n_active++;
+		server->n_sessions++;
+		pthread_mutex_unlock(&server->lock);
+		pthread_t thread;
+		pthread_create(&thread, NULL, session_main, s);
+		pthread_detach(thread);
+	}
+	return NULL;
+}
+
+struct FtpServer *ftp_server_start(const struct FtpServerConfig *config)
+{
+	pthread_once(&synthetic_once, synthetic_init);
+	struct FtpServer *server = calloc(1, sizeof(*server));
+	if (!server)
+		return NULL;
+	server->config = *config;
+	pthread_mutex_init(&server->lock, NULL);
+	pthread_cond_init(&server->idle, NULL);
+
+	struct sockaddr_storage addr = { 0 };
+	socklen_t len;
+	int fd = socket(AF_INET6, SOCK_STREAM, 0);
+	if (fd >= 0) {
+		// Dual stack, so that both 127.0.0.1 and ::1 reach us.
+		int off = 0;
+		setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+		struct sockaddr_in6 *a = (struct sockaddr_in6 *)&addr;
+		a->sin6_family = AF_INET6;
+		a->sin6_port = htons(config->port ? atoi(config->port) : 0);
+		a->sin6_addr = in6addr_any;
+		len = sizeof(*a);
+	} else {
+		fd = socket(AF_INET, SOCK_STREAM, 0);
+		struct sockaddr_in *a = (struct sockaddr_in *)&addr;
+		a->sin_family = AF_INET;
+		a->sin_port = htons(config->port ? atoi(config->port) : 0);
+		a->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		len = sizeof(*a);
+	}
+	int on = 1;
+	if (fd >= 0)
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	if (fd < 0 || bind(fd, (struct sockaddr *)&addr, len) < 0 ||
+	    listen(fd, 128) < 0 || pipe(server->stop_pipe) < 0)
+		goto fail;
+	len = sizeof(addr);
+	getsockname(fd, (struct sockaddr *)&addr, &len);
+	server->listen_fd = fd;
+	server->family = addr.ss_family;
+	int port = addr.ss_family == AF_INET6 ?
+	                   ntohs(((struct sockaddr_in6 *)&addr)->sin6_port) :
+	                   ntohs(((struct sockaddr_in *)&addr)->sin_port);
+	snprintf(server->port, sizeof(server->port), "%d", port);
+	if (pthread_create(&server->accept_thread, NULL, accept_main, server))
+		goto fail;
+	return server;
+fail:
+	if (fd >= 0)
+		close(fd);
+	free(server);
+	return NULL;
+}
+
+const char *ftp_server_port(const struct FtpServer *server)
+{
+	return server->port;
+}
+
+unsigned int ftp_server_sessions(const struct FtpServer *server)
+{
+	return server->n_sessions;
+}
+
+void ftp_server_stop(struct FtpServer *server)
+{
+	write(server->stop_pipe[1], "", 1);
+	pthread_join(server->accept_thread, NULL);
+	close(server->listen_fd);
+	pthread_mutex_lock(&server->lock);
+	for (struct SessionList *p = server->sessions; p; p = p->next)
+		shutdown(p->fd, SHUT_RDWR);
+	while (server->n_active)
+		pthread_cond_wait(&server->idle, &server->lock);
+	pthread_mutex_unlock(&server->lock);
+	close(server->stop_pipe[0]);
+	close(server->stop_pipe[1]);
+	free(server);
+}
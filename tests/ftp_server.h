@@ -0,0 +1,57 @@
+/* A small, scriptable FTP server that runs inside the test process. */
+#ifndef _FTP_SERVER_H
+#define _FTP_SERVER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ *  Besides the files under \a root, the server exposes a synthetic tree:
+ *  - "/synthetic/size-<n>" is a file of <n> bytes whose i-th byte is
+ *    `ftp_server_synthetic_byte(i)`.
+ *  - "/synthetic/dir-<n>" is a directory holding <n> empty files.
+ *  - "/synthetic/tree-<depth>-<fanout>" is a directory holding <fanout>
+ *    files and, while depth > 0, <fanout> subdirectories of the same shape.
+ */
+struct FtpServerConfig {
+	const char *root;
+	/// NULL means an ephemeral port.
+	const char *port;
+	/// Sleep this long before every reply on the control connection.
+	unsigned int reply_latency_ms;
+	/// Data connection bandwidth in bytes per second, 0 means unlimited.
+	size_t bandwidth;
+	bool disable_epsv;
+	bool disable_mlsd;
+	bool disable_feat;
+	bool disable_mode_b;
+	bool disable_mode_z;
+	/// Reset the data connection of the first \a n_drops RETR after
+	/// \a drop_after bytes, and the control connection too if \a drop_ctrl.
+	size_t drop_after;
+	unsigned int n_drops;
+	bool drop_ctrl;
+};
+
+struct FtpServer;
+
+/// Start serving on 127.0.0.1 and ::1.
+/**
+ *  \return NULL on failure.
+ */
+struct FtpServer *ftp_server_start(const struct FtpServerConfig *config);
+
+/// The port the server listens on, as a decimal string.
+const char *ftp_server_port(const struct FtpServer *server);
+
+/// Number of control connections accepted so far.
+unsigned int ftp_server_sessions(const struct FtpServer *server);
+
+void ftp_server_stop(struct FtpServer *server);
+
+static inline unsigned char ftp_server_synthetic_byte(size_t i)
+{
+	return (i * 7 + i / 251) % 251;
+}
+
+#endif